@@ -1,5 +1,6 @@
 
 import argparse as ap
+import json
 from random import uniform,seed
 from timeit import default_timer
 from itertools import combinations
@@ -11,6 +12,7 @@ from dynamite.operators import op_sum, op_product, index_sum
 from dynamite.extras import majorana
 from dynamite.subspaces import Full, Parity, SpinConserve, Auto
 from dynamite.tools import track_memory, get_max_memory_usage
+from dynamite.tools import track_profile, get_profile, get_version
 from dynamite.computations import reduced_density_matrix
 
 # TODO: write tests for the benchmarks
@@ -75,6 +77,10 @@ def parse_args(argv=None):
     parser.add_argument('--check-conserves', action='store_true',
                         help='Check whether the given subspace is conserved by the matrix.')
 
+    parser.add_argument('--json', type=str,
+                        help='Write the results, the matvec throughput and the backend\'s '
+                        'profile (see dynamite.tools.get_profile) to this file as JSON.')
+
     return parser.parse_args(argv)
 
 def build_subspace(params, hamiltonian=None):
@@ -170,6 +176,39 @@ def do_rdm(state, keep):
 def do_check_conserves(hamiltonian):
     hamiltonian.conserves(hamiltonian.subspace)
 
+def profile_diff(after, before):
+    return {
+        name: {k: v - before[name][k] for k, v in fields.items()}
+        for name, fields in after.items()
+    }
+
+def matvec_rates(params, hamiltonian, mult_time, mult_profile):
+    '''
+    The throughput of one matrix-vector multiplication, summed over ranks. For shell
+    matrices the flops and bytes are those logged by the backend; for the others they
+    follow from the nonzeros, each read once along with its column index, plus reading x
+    and writing the result.
+    '''
+    from petsc4py import PETSc
+    import numpy as np
+
+    if params.shell:
+        flops = mult_profile['ShellMult']['flops'] / params.mult_count
+        nbytes = mult_profile['ShellMult']['bytes'] / params.mult_count
+    else:
+        info = hamiltonian.get_mat().getInfo(PETSc.Mat.InfoType.GLOBAL_SUM)
+        nnz = info['nz_used']
+        scalar_size = np.dtype(PETSc.ScalarType).itemsize
+        int_size = np.dtype(PETSc.IntType).itemsize
+        flops = 2*nnz
+        nbytes = nnz*(scalar_size + int_size) + 2*hamiltonian.dim[0]*scalar_size
+
+    return {
+        'matvec_time': mult_time,
+        'matvec_gflops': flops / mult_time / 1E9,
+        'matvec_gbytes_per_s': nbytes / mult_time / 1E9,
+    }
+
 # this decorator keeps track of and times function calls
 def log_call(function, stat_dict):
     config._initialize()
@@ -195,8 +234,8 @@ def log_call(function, stat_dict):
 
     return rtn
 
-def main():
-    arg_params = parse_args()
+def main(argv=None):
+    arg_params = parse_args(argv)
     slepc_args = arg_params.slepc_args.split(' ')
     config.initialize(slepc_args, gpu=arg_params.gpu)
     config.L = arg_params.L
@@ -213,7 +252,11 @@ def main():
     if arg_params.track_memory:
         track_memory()
 
+    if arg_params.json is not None:
+        track_profile()
+
     stats = {}
+    rates = {}
 
     # build our Hamiltonian, if we need it
     if arg_params.H is not None:
@@ -248,7 +291,12 @@ def main():
         log_call(do_evolve, stats)(arg_params, H, in_state, out_state)
 
     if arg_params.mult:
+        if arg_params.json is not None:
+            before = get_profile()
         log_call(do_mult, stats)(arg_params, H, in_state, out_state)
+        if arg_params.json is not None:
+            rates = matvec_rates(arg_params, H, stats['do_mult']/arg_params.mult_count,
+                                 profile_diff(get_profile(), before))
 
     if arg_params.rdm:
         keep_idxs = arg_params.keep
@@ -263,11 +311,35 @@ def main():
     out_state.vec.destroy()
 
     if arg_params.track_memory:
-        stats['Gb_memory'] = get_max_memory_usage() / 1E9
+        stats['Gb_memory'] = get_max_memory_usage()
 
     Print('---RESULTS---')
     for k,v in stats.items():
         Print('{0}, {1:0.4f}'.format(k, v))
+    for k,v in rates.items():
+        Print('{0}, {1:0.4f}'.format(k, v))
+
+    if arg_params.json is not None:
+        from petsc4py import PETSc
+
+        result = {
+            'params': vars(arg_params),
+            'ranks': PETSc.COMM_WORLD.size,
+            'dim': int(subspace.get_dimension()),
+            'version': get_version(),
+            'stats': stats,
+            'rates': rates,
+            'profile': get_profile(),
+        }
+        if H is not None:
+            result['nnz_per_row'] = int(H.nnz)
+            result['msc_size'] = int(H.msc_size)
+
+        if PETSc.COMM_WORLD.rank == 0:
+            with open(arg_params.json, 'w') as f:
+                json.dump(result, f, indent=2)
+
+    return stats
 
 if __name__ == '__main__':
     main()
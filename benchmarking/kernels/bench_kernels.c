@@ -0,0 +1,354 @@
+/*
+ * Microbenchmarks for the innermost kernels of the backend: the CPU shell matvec kernel, the
+ * S2I/I2S mappings of each subspace, and sum_term from the fast matvec. The backend is
+ * compiled into this program directly, so that its internal functions can be called on their
+ * own. Build with the makefile in this directory, and run on one process:
+ *
+ *     ./bench_kernels -L 20 -reps 5 -nvecs 1
+ *
+ * Each result is printed as a JSON object on its own line. The time is the best of the
+ * repetitions; the flops and bytes use the same model as the backend's log events.
+ */
+
+#include "bpetsc_impl.c"
+
+typedef struct _bench_opts {
+  PetscInt L;
+  PetscInt reps;
+  PetscInt n_vecs;
+} bench_opts;
+
+/* keeps the compiler from discarding the results of the loops being timed */
+static volatile PetscInt bench_sink;
+
+#define BEST_TIME(best, reps, stmt)                     \
+  do {                                                  \
+    PetscLogDouble t0_, t1_;                            \
+    PetscInt rep_;                                      \
+    (best) = PETSC_MAX_REAL;                            \
+    for (rep_ = 0; rep_ < (reps); ++rep_) {             \
+      PetscCall(PetscTime(&t0_));                       \
+      stmt;                                             \
+      PetscCall(PetscTime(&t1_));                       \
+      (best) = PetscMin((best), t1_-t0_);               \
+    }                                                   \
+  } while (0)
+
+static PetscErrorCode PrintResult(const char* kernel, const char* subspace, const bench_opts* opts,
+                                  PetscInt n, PetscLogDouble seconds,
+                                  PetscLogDouble flops, PetscLogDouble bytes)
+{
+  PetscCall(PetscPrintf(PETSC_COMM_WORLD,
+    "{\"kernel\": \"%s\", \"subspace\": \"%s\", \"L\": %" PetscInt_FMT ", \"n\": %" PetscInt_FMT
+    ", \"n_vecs\": %" PetscInt_FMT ", \"seconds\": %.6e, \"ns_per_elem\": %.4f"
+    ", \"gflops\": %.4f, \"gbytes_per_s\": %.4f}\n",
+    kernel, subspace, opts->L, n, opts->n_vecs, seconds, 1E9*seconds/n,
+    flops/seconds/1E9, bytes/seconds/1E9));
+  return 0;
+}
+
+/*
+ * The nearest-neighbor Heisenberg chain with open boundaries, in the sorted form BuildMat
+ * expects: the ZZ terms under mask 0, then an XX and a YY term under each bond's mask.
+ */
+static PetscErrorCode BuildHeisenberg(PetscInt L, msc_t *msc)
+{
+  PetscInt i, bond, nterms;
+
+  msc->nmasks = L;  /* mask 0 and the L-1 bonds */
+  nterms = (L-1) + 2*(L-1);
+
+  PetscCall(PetscMalloc1(msc->nmasks, &(msc->masks)));
+  PetscCall(PetscMalloc1(msc->nmasks+1, &(msc->mask_offsets)));
+  PetscCall(PetscMalloc1(nterms, &(msc->signs)));
+  PetscCall(PetscMalloc1(nterms, &(msc->coeffs)));
+
+  msc->masks[0] = 0;
+  msc->mask_offsets[0] = 0;
+  for (i = 0; i < L-1; ++i) {
+    msc->signs[i] = ((PetscInt)3) << i;
+    msc->coeffs[i] = 1;
+  }
+  msc->mask_offsets[1] = L-1;
+
+  for (i = 0; i < L-1; ++i) {
+    bond = ((PetscInt)3) << i;
+    msc->masks[i+1] = bond;
+    msc->signs[(L-1) + 2*i] = 0;
+    msc->coeffs[(L-1) + 2*i] = 1;
+    msc->signs[(L-1) + 2*i + 1] = bond;
+    msc->coeffs[(L-1) + 2*i + 1] = -1;
+    msc->mask_offsets[i+2] = (L-1) + 2*(i+1);
+  }
+
+  return 0;
+}
+
+static PetscErrorCode DestroyMSC(msc_t *msc)
+{
+  PetscCall(PetscFree(msc->masks));
+  PetscCall(PetscFree(msc->mask_offsets));
+  PetscCall(PetscFree(msc->signs));
+  PetscCall(PetscFree(msc->coeffs));
+  return 0;
+}
+
+/*
+ * Time MatMult_CPU_kernel alone on all local rows, and the whole shell MatMult (which takes
+ * the fast path for Full and Parity) for comparison.
+ */
+static PetscErrorCode BenchMatMult(const char* name, subspace_type type, void* data,
+                                   const msc_t* msc, const bench_opts* opts)
+{
+  subspaces_t subspaces = {type, type, data, data};
+  shell_context *ctx;
+  Mat A;
+  Vec x, b;
+  PetscInt rows, cols, i;
+  PetscScalar *x_array, *b_array;
+  PetscLogDouble best, flops, bytes;
+
+  PetscCall(BuildMat(msc, &subspaces, CPU_SHELL, PETSC_FALSE, &A));
+  PetscCall(MatShellGetContext(A, &ctx));
+  PetscCall(MatGetLocalSize(A, &rows, &cols));
+
+  PetscCall(PetscMalloc1(cols*opts->n_vecs, &x_array));
+  PetscCall(PetscMalloc1(rows*opts->n_vecs, &b_array));
+  for (i = 0; i < cols*opts->n_vecs; ++i) {
+    x_array[i] = 1.0/(i+1);
+  }
+
+#define KERNEL_CASE(TYPE_ENUM, SUBSPACE)                                              \
+  case TYPE_ENUM:                                                                     \
+    BEST_TIME(best, opts->reps, {                                                     \
+      PetscCall(PetscArrayzero(b_array, rows*opts->n_vecs));                          \
+      C(MatMult_CPU_kernel,C(SUBSPACE,SUBSPACE))(x_array, cols, NULL, b_array, rows,  \
+                                                 opts->n_vecs, ctx, 0, rows, 0, cols); \
+    });                                                                               \
+    break;
+
+  switch (type) {
+    KERNEL_CASE(FULL, Full)
+    KERNEL_CASE(PARITY, Parity)
+    KERNEL_CASE(SPIN_CONSERVE, SpinConserve)
+    KERNEL_CASE(EXPLICIT, Explicit)
+  }
+
+#undef KERNEL_CASE
+
+  bench_sink = (PetscInt)PetscRealPart(b_array[rows/2]);
+
+  flops = 2.0*rows*(ctx->nterms + (PetscLogDouble)ctx->nmasks*opts->n_vecs);
+  bytes = (PetscLogDouble)rows*opts->n_vecs*(ctx->nmasks+2)*sizeof(PetscScalar);
+  PetscCall(PrintResult("MatMult_CPU_kernel", name, opts, rows, best, flops, bytes));
+
+  PetscCall(PetscFree(x_array));
+  PetscCall(PetscFree(b_array));
+
+  PetscCall(MatCreateVecs(A, &x, &b));
+  PetscCall(VecSet(x, 1));
+  BEST_TIME(best, opts->reps, PetscCall(MatMult(A, x, b)));
+
+  flops = 2.0*rows*(ctx->nterms + (PetscLogDouble)ctx->nmasks);
+  bytes = (PetscLogDouble)rows*(ctx->nmasks+2)*sizeof(PetscScalar);
+  PetscCall(PrintResult("MatMult", name, opts, rows, best, flops, bytes));
+
+  PetscCall(VecDestroy(&x));
+  PetscCall(VecDestroy(&b));
+  PetscCall(MatDestroy(&A));
+  return 0;
+}
+
+/*
+ * Time the array versions of S2I and I2S over a scattered sample of the subspace's states,
+ * n of them, so that lookups in large tables are not all served from cache.
+ */
+#define BENCH_MAPS(SUBSPACE, S2I_ARRAY)                                                      \
+static PetscErrorCode C(BenchMaps,SUBSPACE)(const char* name, const C(data,SUBSPACE)* data,  \
+                                            const bench_opts* opts)                          \
+{                                                                                            \
+  PetscInt dim, n, i;                                                                        \
+  PetscInt *idxs, *states, *check;                                                           \
+  PetscLogDouble best;                                                                       \
+                                                                                             \
+  dim = C(Dim,SUBSPACE)(data);                                                               \
+  n = PetscMin(dim, ((PetscInt)1) << 20);                                                    \
+                                                                                             \
+  PetscCall(PetscMalloc1(n, &idxs));                                                         \
+  PetscCall(PetscMalloc1(n, &states));                                                       \
+  PetscCall(PetscMalloc1(n, &check));                                                        \
+                                                                                             \
+  /* spread the sample over the whole subspace */                                           \
+  for (i = 0; i < n; ++i) {                                                                  \
+    idxs[i] = (PetscInt)(((uint64_t)i * UINT64_C(0x9E3779B97F4A7C15)) % (uint64_t)dim);      \
+  }                                                                                          \
+                                                                                             \
+  BEST_TIME(best, opts->reps, C(I2S,C(SUBSPACE,array))(n, data, idxs, states));              \
+  PetscCall(PrintResult("I2S", name, opts, n, best, 0, 2.0*n*sizeof(PetscInt)));             \
+                                                                                             \
+  BEST_TIME(best, opts->reps, S2I_ARRAY(n, data, states, check));                           \
+  PetscCall(PrintResult("S2I", name, opts, n, best, 0, 2.0*n*sizeof(PetscInt)));             \
+                                                                                             \
+  for (i = 0; i < n; ++i) {                                                                  \
+    if (check[i] != idxs[i]) {                                                               \
+      SETERRQ(PETSC_COMM_SELF, PETSC_ERR_PLIB, "S2I did not invert I2S");                    \
+    }                                                                                        \
+  }                                                                                          \
+                                                                                             \
+  PetscCall(PetscFree(idxs));                                                                \
+  PetscCall(PetscFree(states));                                                              \
+  PetscCall(PetscFree(check));                                                               \
+  return 0;                                                                                  \
+}
+
+/* the matvec kernels compute the signs, so time S2I with them */
+static inline void S2I_SpinConserve_signs_array(int n, const data_SpinConserve* data,
+                                                const PetscInt* states, PetscInt* idxs)
+{
+  PetscInt i, sign;
+  for (i = 0; i < n; ++i) {
+    idxs[i] = S2I_SpinConserve(states[i], &sign, data);
+  }
+}
+
+BENCH_MAPS(Full, S2I_Full_array)
+BENCH_MAPS(Parity, S2I_Parity_array)
+BENCH_MAPS(SpinConserve, S2I_SpinConserve_signs_array)
+BENCH_MAPS(Explicit, S2I_Explicit_array)
+
+#undef BENCH_MAPS
+
+/*
+ * Time sum_term accumulating the diagonal terms into every block of the full space, as the
+ * fast matvec does for mask 0.
+ */
+static PetscErrorCode BenchSumTerm(const msc_t* msc, const bench_opts* opts)
+{
+  PetscInt N, n_blocks, block, term_idx, nterms;
+  PetscReal *lookup, *summed_re, *summed_im;
+  PetscLogDouble best;
+
+  N = ((PetscInt)1) << opts->L;
+  if (N < VECSET_CACHE_SIZE) {
+    PetscCall(PetscPrintf(PETSC_COMM_WORLD, "# skipping sum_term: L too small\n"));
+    return 0;
+  }
+  n_blocks = N / VECSET_CACHE_SIZE;
+  nterms = msc->mask_offsets[1];
+
+  PetscCall(PetscMalloc1(LKP_SIZE*LKP_SIZE, &lookup));
+  PetscCall(PetscMalloc1(VECSET_CACHE_SIZE, &summed_re));
+  PetscCall(PetscMalloc1(VECSET_CACHE_SIZE, &summed_im));
+  compute_sign_lookup(lookup);
+
+  BEST_TIME(best, opts->reps, {
+    for (block = 0; block < n_blocks; ++block) {
+      PetscCall(PetscArrayzero(summed_re, VECSET_CACHE_SIZE));
+      for (term_idx = 0; term_idx < nterms; ++term_idx) {
+        sum_term(block*VECSET_CACHE_SIZE, msc->signs[term_idx], 1,
+                 PetscRealPart(msc->coeffs[term_idx]), PETSC_FALSE, lookup,
+                 summed_re, summed_im);
+      }
+      bench_sink = (PetscInt)summed_re[block % VECSET_CACHE_SIZE];
+    }
+  });
+
+  /* one multiply-add per entry and term */
+  PetscCall(PrintResult("sum_term", "Full", opts, N*nterms, best, 2.0*N*nterms, 0));
+
+  PetscCall(PetscFree(lookup));
+  PetscCall(PetscFree(summed_re));
+  PetscCall(PetscFree(summed_im));
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  bench_opts opts = {20, 5, 1};
+  PetscMPIInt size;
+  msc_t msc;
+  data_Full full;
+  data_Parity parity;
+  data_SpinConserve spinconserve;
+  data_Explicit explicit_data;
+  PetscInt kk, LL, i;
+
+  PetscCall(SlepcInitialize(&argc, &argv, NULL, NULL));
+
+  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &size));
+  if (size != 1) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_SUP, "the kernel benchmarks run on one process");
+  }
+
+  PetscCall(PetscOptionsGetInt(NULL, NULL, "-L", &opts.L, NULL));
+  PetscCall(PetscOptionsGetInt(NULL, NULL, "-reps", &opts.reps, NULL));
+  PetscCall(PetscOptionsGetInt(NULL, NULL, "-nvecs", &opts.n_vecs, NULL));
+
+  PetscCall(BuildHeisenberg(opts.L, &msc));
+
+  full.L = opts.L;
+
+  parity.L = opts.L;
+  parity.space = 0;
+
+  spinconserve.L = opts.L;
+  spinconserve.k = opts.L/2;
+  spinconserve.spinflip = 0;
+  spinconserve.ld_nchoosek = opts.L+1;
+  PetscCall(PetscMalloc1((spinconserve.k+1)*spinconserve.ld_nchoosek, &(spinconserve.nchoosek)));
+  for (kk = 0; kk <= spinconserve.k; ++kk) {
+    for (LL = 0; LL <= opts.L; ++LL) {
+      /* Pascal's rule, row by row */
+      if (kk == 0) spinconserve.nchoosek[LL] = 1;
+      else if (LL == 0) spinconserve.nchoosek[kk*spinconserve.ld_nchoosek] = 0;
+      else spinconserve.nchoosek[kk*spinconserve.ld_nchoosek + LL] =
+             spinconserve.nchoosek[(kk-1)*spinconserve.ld_nchoosek + LL-1] +
+             spinconserve.nchoosek[kk*spinconserve.ld_nchoosek + LL-1];
+    }
+  }
+
+  /* the same states as spinconserve, which I2S lists in increasing order */
+  explicit_data.L = opts.L;
+  explicit_data.dim = Dim_SpinConserve(&spinconserve);
+  explicit_data.shared = NULL;
+  PetscCall(PetscMalloc1(explicit_data.dim, &(explicit_data.state_map)));
+  PetscCall(PetscMalloc1(explicit_data.dim, &(explicit_data.rmap_indices)));
+  for (i = 0; i < explicit_data.dim; ++i) {
+    explicit_data.state_map[i] = I2S_SpinConserve(i, &spinconserve);
+    explicit_data.rmap_indices[i] = i;
+  }
+  explicit_data.rmap_states = explicit_data.state_map;
+  explicit_data.hash_bits = HashBits_Explicit(explicit_data.dim);
+  PetscCall(PetscMalloc1(((PetscInt)2) << explicit_data.hash_bits, &(explicit_data.hash_table)));
+  BuildHashTable_Explicit(explicit_data.dim, explicit_data.state_map,
+                          explicit_data.hash_bits, explicit_data.hash_table);
+
+  PetscCall(BenchMatMult("Full", FULL, &full, &msc, &opts));
+  PetscCall(BenchMatMult("Parity", PARITY, &parity, &msc, &opts));
+  PetscCall(BenchMatMult("SpinConserve", SPIN_CONSERVE, &spinconserve, &msc, &opts));
+  PetscCall(BenchMatMult("Explicit", EXPLICIT, &explicit_data, &msc, &opts));
+
+  PetscCall(BenchMaps_Full("Full", &full, &opts));
+  PetscCall(BenchMaps_Parity("Parity", &parity, &opts));
+  PetscCall(BenchMaps_SpinConserve("SpinConserve", &spinconserve, &opts));
+  PetscCall(BenchMaps_Explicit("Explicit", &explicit_data, &opts));
+
+  {
+    /* the same lookups by binary search instead of the hash table */
+    PetscInt *hash_table = explicit_data.hash_table;
+    explicit_data.hash_table = NULL;
+    PetscCall(BenchMaps_Explicit("Explicit_bsearch", &explicit_data, &opts));
+    explicit_data.hash_table = hash_table;
+  }
+
+  PetscCall(BenchSumTerm(&msc, &opts));
+
+  PetscCall(PetscFree(explicit_data.hash_table));
+  PetscCall(PetscFree(explicit_data.state_map));
+  PetscCall(PetscFree(explicit_data.rmap_indices));
+  PetscCall(PetscFree(spinconserve.nchoosek));
+  PetscCall(DestroyMSC(&msc));
+
+  PetscCall(SlepcFinalize());
+  return 0;
+}
@@ -0,0 +1,416 @@
+'''
+Run benchmark.py over a matrix of configurations and collect the results as JSON, report
+strong and weak scaling from them, and compare two sets of results to catch performance
+regressions. For example:
+
+    python suite.py run -L 16 18 20 --ranks 1 2 4 --H MBL heisenberg --out results.json
+    python suite.py report results.json
+    python suite.py compare baseline.json results.json
+
+The C-level kernel microbenchmarks in kernels/ are included with ``--kernels``, given the
+path of the built bench_kernels program.
+'''
+
+import argparse as ap
+import json
+import os
+import platform
+import shlex
+import subprocess
+import sys
+import tempfile
+from datetime import datetime, timezone
+from itertools import product
+
+BENCHMARK = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'benchmark.py')
+
+FORMAT_VERSION = 1
+
+# the flags passed to benchmark.py for each matrix type
+BACKENDS = {
+    'aij': [],
+    'shell': ['--shell'],
+    'gpu': ['--gpu'],
+    'gpu_shell': ['--gpu', '--shell'],
+}
+
+# the metrics compared between runs, as paths into a run's results; lower is better for all
+RUN_METRICS = [
+    ('stats', 'build_subspace'),
+    ('stats', 'build_mat'),
+    ('rates', 'matvec_time'),
+    ('stats', 'Gb_memory'),
+]
+
+CONFIG_KEYS = ['H', 'subspace', 'backend', 'L', 'ranks']
+
+
+def parse_args(argv=None):
+
+    parser = ap.ArgumentParser(description='Benchmark suite for dynamite.')
+    subparsers = parser.add_subparsers(dest='command', required=True)
+
+    run = subparsers.add_parser('run', help='Run a matrix of benchmarks.')
+    run.add_argument('-L', type=int, nargs='+', required=True,
+                     help='Spin chain lengths.')
+    run.add_argument('--H', nargs='+', default=['MBL'],
+                     help='Hamiltonians, as accepted by benchmark.py.')
+    run.add_argument('--subspace', nargs='+', default=['full'],
+                     help='Subspaces, as accepted by benchmark.py.')
+    run.add_argument('--backend', nargs='+', default=['aij', 'shell'],
+                     choices=sorted(BACKENDS),
+                     help='Matrix types: PETSc AIJ or shell matrices, on the CPU or the GPU.')
+    run.add_argument('--ranks', type=int, nargs='+', default=[1],
+                     help='Numbers of MPI ranks.')
+    run.add_argument('--mpirun', default='mpirun -n {ranks}',
+                     help='Command to launch a run on {ranks} ranks.')
+    run.add_argument('--mult_count', type=int, default=10,
+                     help='Number of matrix-vector multiplications to time in each run.')
+    run.add_argument('--slepc_args', type=str, default='',
+                     help='Arguments to pass to SLEPc in each run.')
+    run.add_argument('--timeout', type=float, default=3600,
+                     help='Seconds after which a run is abandoned.')
+    run.add_argument('--kernels', type=str,
+                     help='Path of the bench_kernels program, to also run the kernel '
+                     'microbenchmarks for each L.')
+    run.add_argument('--kernel_reps', type=int, default=5,
+                     help='Repetitions of each kernel microbenchmark.')
+    run.add_argument('--out', type=str, default='results.json',
+                     help='File to write the results to.')
+
+    report = subparsers.add_parser('report', help='Print strong and weak scaling reports.')
+    report.add_argument('results', help='Results from the run command.')
+    report.add_argument('--json', type=str,
+                        help='Also write the scaling reports to this file as JSON.')
+
+    compare = subparsers.add_parser('compare', help='Compare results against a baseline, '
+                                    'exiting with status 1 if anything got slower.')
+    compare.add_argument('baseline', help='Results from the run command to compare against.')
+    compare.add_argument('results', help='New results from the run command.')
+    compare.add_argument('--tolerance', type=float, default=0.1,
+                         help='Relative slowdown above which a metric is a regression.')
+    compare.add_argument('--min_time', type=float, default=1E-3,
+                         help='Times below this many seconds are too noisy to compare.')
+
+    return parser.parse_args(argv)
+
+
+def run_benchmark(args, config):
+    '''
+    Run benchmark.py for one configuration, and return its record for the results.
+    '''
+    record = {'config': config}
+
+    with tempfile.TemporaryDirectory() as tmp:
+        out = os.path.join(tmp, 'result.json')
+
+        cmd = shlex.split(args.mpirun.format(ranks=config['ranks']))
+        # -O turns off benchmark.py's progress messages
+        cmd += [sys.executable, '-O', BENCHMARK,
+                '-L', str(config['L']),
+                '-H', config['H'],
+                '--subspace', config['subspace'],
+                '--mult', '--mult_count', str(args.mult_count),
+                '--track_memory',
+                '--json', out]
+        cmd += BACKENDS[config['backend']]
+        if args.slepc_args:
+            cmd += ['--slepc_args', args.slepc_args]
+
+        try:
+            proc = subprocess.run(cmd, capture_output=True, text=True, timeout=args.timeout)
+        except subprocess.TimeoutExpired:
+            record['error'] = 'timed out after %g s' % args.timeout
+            return record
+
+        if proc.returncode != 0 or not os.path.exists(out):
+            record['error'] = proc.stderr[-2000:]
+            return record
+
+        with open(out) as f:
+            record.update(json.load(f))
+
+    return record
+
+
+def run_kernels(args, L):
+    '''
+    Run the kernel microbenchmarks for one L, returning the list of their results.
+    '''
+    cmd = [args.kernels, '-L', str(L), '-reps', str(args.kernel_reps)]
+    proc = subprocess.run(cmd, capture_output=True, text=True, timeout=args.timeout)
+    if proc.returncode != 0:
+        return [{'L': L, 'error': proc.stderr[-2000:]}]
+
+    return [json.loads(line) for line in proc.stdout.splitlines()
+            if line.startswith('{')]
+
+
+def do_run(args):
+    results = {
+        'format_version': FORMAT_VERSION,
+        'date': datetime.now(timezone.utc).isoformat(),
+        'host': platform.node(),
+        'machine': platform.machine(),
+        'runs': [],
+        'kernels': [],
+    }
+
+    configs = product(args.H, args.subspace, args.backend, args.L, args.ranks)
+    for H, subspace, backend, L, ranks in configs:
+        config = dict(zip(CONFIG_KEYS, (H, subspace, backend, L, ranks)))
+        print('running', ' '.join('%s=%s' % kv for kv in config.items()), flush=True)
+
+        record = run_benchmark(args, config)
+        if 'error' in record:
+            lines = record['error'].strip().splitlines()
+            print('  failed:', lines[-1] if lines else 'no output', flush=True)
+        else:
+            rates = record['rates']
+            print('  matvec %.3e s, %.2f GFLOP/s, %.2f GB/s' % (
+                rates['matvec_time'], rates['matvec_gflops'], rates['matvec_gbytes_per_s']),
+                  flush=True)
+        results['runs'].append(record)
+
+    if args.kernels is not None:
+        for L in args.L:
+            print('running kernel microbenchmarks for L=%d' % L, flush=True)
+            results['kernels'] += run_kernels(args, L)
+
+    with open(args.out, 'w') as f:
+        json.dump(results, f, indent=2)
+
+
+def get_metric(record, path):
+    '''
+    The value at path in a run's results, or None if it is missing.
+    '''
+    value = record
+    for key in path:
+        if not isinstance(value, dict) or key not in value:
+            return None
+        value = value[key]
+    return value
+
+
+def successful_runs(results):
+    return [r for r in results['runs'] if 'error' not in r and 'rates' in r and r['rates']]
+
+
+def group_runs(runs, keys):
+    groups = {}
+    for run in runs:
+        key = tuple(run['config'][k] for k in keys)
+        groups.setdefault(key, []).append(run)
+    return groups
+
+
+def scaling_row(run, base, weak):
+    '''
+    One line of a scaling table, for run relative to the one with the fewest ranks.
+    '''
+    t = run['rates']['matvec_time']
+    t0 = base['rates']['matvec_time']
+    r = run['config']['ranks']
+    r0 = base['config']['ranks']
+
+    row = {
+        'ranks': r,
+        'L': run['config']['L'],
+        'build_mat': get_metric(run, ('stats', 'build_mat')),
+        'matvec_time': t,
+        'matvec_gflops': run['rates']['matvec_gflops'],
+        'matvec_gbytes_per_s': run['rates']['matvec_gbytes_per_s'],
+        'Gb_memory': get_metric(run, ('stats', 'Gb_memory')),
+    }
+
+    if weak:
+        # the work per rank is fixed, so the time should be too
+        row['efficiency'] = t0/t
+    else:
+        row['speedup'] = t0/t
+        row['efficiency'] = (t0/t) * r0 / r
+
+    return row
+
+
+def strong_scaling(runs):
+    '''
+    For each problem run on more than one number of ranks, its speedup with more ranks.
+    '''
+    reports = []
+    for key, group in sorted(group_runs(runs, ['H', 'subspace', 'backend', 'L']).items()):
+        group.sort(key=lambda run: run['config']['ranks'])
+        if len(group) < 2:
+            continue
+        reports.append({
+            'problem': dict(zip(['H', 'subspace', 'backend', 'L'], key)),
+            'rows': [scaling_row(run, group[0], weak=False) for run in group],
+        })
+    return reports
+
+
+def weak_scaling(runs):
+    '''
+    For each series of runs that double the dimension along with the number of ranks, how
+    well the time per matvec holds constant. Only includes numbers of ranks that are powers
+    of two.
+    '''
+    for run in runs:
+        ranks = run['config']['ranks']
+        if ranks & (ranks-1) == 0:
+            run['_local_L'] = run['config']['L'] - (ranks.bit_length() - 1)
+
+    weak_runs = [run for run in runs if '_local_L' in run]
+    groups = {}
+    for run in weak_runs:
+        key = tuple(run['config'][k] for k in ['H', 'subspace', 'backend']) + (run['_local_L'],)
+        groups.setdefault(key, []).append(run)
+
+    reports = []
+    for key, group in sorted(groups.items()):
+        group.sort(key=lambda run: run['config']['ranks'])
+        if len(group) < 2:
+            continue
+        reports.append({
+            'problem': dict(zip(['H', 'subspace', 'backend', 'L_per_rank'], key)),
+            'rows': [scaling_row(run, group[0], weak=True) for run in group],
+        })
+
+    for run in weak_runs:
+        del run['_local_L']
+
+    return reports
+
+
+def format_value(value):
+    if value is None:
+        return '-'
+    if isinstance(value, int):
+        return str(value)
+    return '%.4g' % value
+
+
+def print_table(title, report):
+    print(title, ' '.join('%s=%s' % kv for kv in report['problem'].items()))
+    columns = list(report['rows'][0])
+    widths = [max(len(c), 10) + 2 for c in columns]
+    print('  ' + ''.join(c.rjust(w) for c, w in zip(columns, widths)))
+    for row in report['rows']:
+        print('  ' + ''.join(format_value(row[c]).rjust(w) for c, w in zip(columns, widths)))
+    print()
+
+
+def do_report(args):
+    with open(args.results) as f:
+        results = json.load(f)
+
+    runs = successful_runs(results)
+    failed = len(results['runs']) - len(runs)
+    if failed:
+        print('(%d failed runs are not included)\n' % failed)
+
+    reports = {
+        'strong_scaling': strong_scaling(runs),
+        'weak_scaling': weak_scaling(runs),
+    }
+
+    for report in reports['strong_scaling']:
+        print_table('strong scaling:', report)
+    for report in reports['weak_scaling']:
+        print_table('weak scaling:', report)
+
+    if results.get('kernels'):
+        print('kernel microbenchmarks:')
+        print('  %-20s%-18s%6s%14s%12s%12s' % ('kernel', 'subspace', 'L', 'ns/elem',
+                                              'GFLOP/s', 'GB/s'))
+        for k in results['kernels']:
+            if 'error' in k:
+                continue
+            print('  %-20s%-18s%6d%14.4g%12.4g%12.4g' % (k['kernel'], k['subspace'], k['L'],
+                                                       k['ns_per_elem'], k['gflops'],
+                                                       k['gbytes_per_s']))
+
+    if args.json is not None:
+        with open(args.json, 'w') as f:
+            json.dump(reports, f, indent=2)
+
+
+def kernel_key(k):
+    return (k['kernel'], k['subspace'], k['L'], k.get('n_vecs', 1))
+
+
+def compare_value(name, base, new, args, regressions):
+    if base is None or new is None:
+        return
+
+    # times this short are dominated by noise
+    if name.endswith('time') or name.startswith('build') or name == 'seconds':
+        if base < args.min_time and new < args.min_time:
+            return
+
+    ratio = new/base if base > 0 else float('inf')
+    flag = ''
+    if ratio > 1 + args.tolerance:
+        flag = '  REGRESSION'
+        regressions.append(name)
+
+    return '%-14s %12.4g -> %12.4g  (%+.1f%%)%s' % (name, base, new, 100*(ratio-1), flag)
+
+
+def do_compare(args):
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    with open(args.results) as f:
+        results = json.load(f)
+
+    regressions = []
+
+    base_runs = {tuple(r['config'][k] for k in CONFIG_KEYS): r
+                 for r in successful_runs(baseline)}
+    for run in successful_runs(results):
+        key = tuple(run['config'][k] for k in CONFIG_KEYS)
+        if key not in base_runs:
+            continue
+
+        lines = [compare_value(path[-1], get_metric(base_runs[key], path),
+                               get_metric(run, path), args, regressions)
+                 for path in RUN_METRICS]
+        print(' '.join('%s=%s' % kv for kv in run['config'].items()))
+        for line in lines:
+            if line is not None:
+                print('  ' + line)
+
+    base_kernels = {kernel_key(k): k for k in baseline.get('kernels', []) if 'error' not in k}
+    for k in results.get('kernels', []):
+        if 'error' in k or kernel_key(k) not in base_kernels:
+            continue
+        line = compare_value('seconds', base_kernels[kernel_key(k)]['seconds'], k['seconds'],
+                             args, regressions)
+        if line is not None:
+            print('%s %s L=%d:' % (k['kernel'], k['subspace'], k['L']))
+            print('  ' + line)
+
+    if regressions:
+        print('\n%d regressions beyond %g%%' % (len(regressions), 100*args.tolerance))
+        return 1
+
+    print('\nno regressions')
+    return 0
+
+
+def main(argv=None):
+    args = parse_args(argv)
+
+    if args.command == 'run':
+        do_run(args)
+    elif args.command == 'report':
+        do_report(args)
+    elif args.command == 'compare':
+        return do_compare(args)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
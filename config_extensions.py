@@ -17,6 +17,7 @@ if any(e not in environ for e in ['PETSC_DIR', 'PETSC_ARCH', 'SLEPC_DIR']):
 extension_names = [
     'bsubspace',
     'bbuild',
+    'bmsc',
     'bpetsc'
 ]
 
@@ -26,6 +27,7 @@ header_only = {
 
 cython_only = {
     'bbuild',
+    'bmsc',
 }
 
 
@@ -40,6 +40,7 @@ MOCK_MODULES = ['slepc4py',
                 'scipy.sparse',
                 'threadpoolctl',
                 'dynamite._backend.bbuild',
+                'dynamite._backend.bmsc',
                 'dynamite._backend.bpetsc',
                 'dynamite._backend.bsubspace']
 sys.modules.update((mod_name, Mock()) for mod_name in MOCK_MODULES)
@@ -25,6 +25,9 @@ configure_options = [
     # uncomment if you don't have an MPI implementation already installed
     #'--download-mpich',
 
+    # uncomment to enable thread parallelism for shell matrices within each MPI rank
+    #'--with-openmp',
+
 ]
 
 if __name__ == '__main__':
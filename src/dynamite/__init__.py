@@ -19,6 +19,7 @@ class _Config:
     _info_level = 0
     _subspace = None
     _gpu = False
+    _cache_dir = environ.get('DNM_CACHE_DIR') or None
 
     def initialize(self, slepc_args=None, version_check=True, gpu=None):
         """
@@ -82,9 +83,12 @@ class _Config:
             '-options_left', '0'
         ]
 
-        # prevent PETSc from being sad if we don't use gpu aware mpi
-        if not self.initialized and bbuild.have_gpu_shell():
-            slepc_args += ['-use_gpu_aware_mpi', '0'] # we only use one process anyway
+        # prevent PETSc from being sad if we don't use gpu aware mpi. multi-GPU runs
+        # with a CUDA-aware MPI should pass '-use_gpu_aware_mpi 1' to avoid staging
+        # the shell matvec's ghost exchange through the host
+        if (not self.initialized and bbuild.have_gpu_shell()
+                and '-use_gpu_aware_mpi' not in slepc_args):
+            slepc_args += ['-use_gpu_aware_mpi', '0']
 
         if bbuild.petsc_initialized():
             raise RuntimeError('PETSc has been initialized but dynamite has not. '
@@ -165,6 +169,24 @@ class _Config:
         else:
             self._subspace = validate.subspace(value)
 
+    @property
+    def cache_dir(self):
+        """
+        A directory in which to cache assembled (non-shell) matrices and the mappings of
+        :class:`dynamite.subspaces.Auto` subspaces between runs, or ``None`` (default) to
+        disable the cache. Entries are keyed by the operator, the subspaces, and the number
+        of MPI ranks, so jobs that build the same matrices, as in a parameter sweep, load
+        them from disk instead of rebuilding them. The directory should be on a filesystem
+        shared by all ranks. Defaults to the ``DNM_CACHE_DIR`` environment variable if set.
+
+        The cache is never cleaned up automatically; delete the directory to empty it.
+        """
+        return self._cache_dir
+
+    @cache_dir.setter
+    def cache_dir(self, value):
+        self._cache_dir = None if value is None else str(value)
+
     @property
     def gpu(self):
         """
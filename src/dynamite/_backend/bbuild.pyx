@@ -21,6 +21,7 @@ cdef extern from "petsc.h":
 cdef extern from "bpetsc_impl.h":
     int DNM_PETSC_COMPLEX
     int DNM_PETSC_CUDA
+    int DNM_PETSC_SINGLE
 
 def have_gpu_shell():
     return bool(DNM_PETSC_CUDA)
@@ -35,6 +36,9 @@ else:
 def complex_enabled():
     return bool(DNM_PETSC_COMPLEX)
 
+def single_precision_enabled():
+    return bool(DNM_PETSC_SINGLE)
+
 def petsc_initialized():
     cdef PetscBool rtn
     cdef int ierr
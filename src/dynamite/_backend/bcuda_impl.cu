@@ -1,5 +1,6 @@
 
 #include "bcuda_impl.h"
+#include <thrust/complex.h>
 
 #ifdef PETSC_USE_64BIT_INDICES
   #define CUDA_POPCOUNT(x) (__popcll(x))
@@ -151,6 +152,12 @@ PetscErrorCode CopySubspaceData_CUDA_Explicit(data_Explicit** out_p, const data_
   err = cudaMemcpy(cpu_data.rmap_states, in->rmap_states,
     sizeof(PetscInt)*in->dim, cudaMemcpyHostToDevice);CHKERRCUDA(err);
 
+  if (in->hash_table) {
+    err = cudaMalloc(&(cpu_data.hash_table), sizeof(PetscInt)*(((PetscInt)2) << in->hash_bits));CHKERRCUDA(err);
+    err = cudaMemcpy(cpu_data.hash_table, in->hash_table,
+      sizeof(PetscInt)*(((PetscInt)2) << in->hash_bits), cudaMemcpyHostToDevice);CHKERRCUDA(err);
+  }
+
   err = cudaMalloc((void **) out_p, sizeof(data_Explicit));CHKERRCUDA(err);
   err = cudaMemcpy(*out_p, &cpu_data, sizeof(data_Explicit), cudaMemcpyHostToDevice);CHKERRCUDA(err);
 
@@ -167,16 +174,33 @@ PetscErrorCode DestroySubspaceData_CUDA_Explicit(data_Explicit* data) {
   err = cudaFree(cpu_data.state_map);CHKERRCUDA(err);
   err = cudaFree(cpu_data.rmap_indices);CHKERRCUDA(err);
   err = cudaFree(cpu_data.rmap_states);CHKERRCUDA(err);
+  if (cpu_data.hash_table) {
+    err = cudaFree(cpu_data.hash_table);CHKERRCUDA(err);
+  }
   err = cudaFree(data);CHKERRCUDA(err);
   return 0;
 }
 
-/* TODO: this is really not well suited for GPUs */
-/* but I bet we can do something clever! */
 __device__ PetscInt S2I_CUDA_Explicit(PetscInt state, const data_Explicit* data) {
   PetscInt left, right, mid;
+  PetscInt slot, slot_mask;
+
+  /* with the hash table, a lookup is usually a single memory transaction */
+  if (data->hash_table) {
+    slot_mask = (((PetscInt)1) << data->hash_bits) - 1;
+    slot = EXPLICIT_HASH(state, data->hash_bits);
+    while (data->hash_table[2*slot] != -1) {
+      if (data->hash_table[2*slot] == state) {
+        return data->hash_table[2*slot+1];
+      }
+      slot = (slot+1) & slot_mask;
+    }
+    return -1;
+  }
+
+  /* otherwise, binary search (which is not well suited for GPUs) */
   left = 0;
-  right = data->dim;
+  right = data->dim-1;
   while (left <= right) {
     mid = left + (right-left)/2;
     if (data->rmap_states[mid] == state) {
@@ -198,43 +222,349 @@ __device__ PetscInt I2S_CUDA_Explicit(PetscInt idx, const data_Explicit* data) {
   return data->state_map[idx];
 }
 
+/* the lookup tables are part of the struct, so only the arrays need to be copied separately */
+PetscErrorCode CopySubspaceData_CUDA_Momentum(data_Momentum** out_p, const data_Momentum* in) {
+  cudaError_t err;
+
+  data_Momentum cpu_data;
+
+  PetscCall(PetscMemcpy(&cpu_data, in, sizeof(data_Momentum)));
+
+  err = cudaMalloc(&(cpu_data.state_map), sizeof(PetscInt)*in->dim);CHKERRCUDA(err);
+  err = cudaMemcpy(cpu_data.state_map, in->state_map,
+    sizeof(PetscInt)*in->dim, cudaMemcpyHostToDevice);CHKERRCUDA(err);
+
+  err = cudaMalloc(&(cpu_data.periods), sizeof(PetscInt)*in->dim);CHKERRCUDA(err);
+  err = cudaMemcpy(cpu_data.periods, in->periods,
+    sizeof(PetscInt)*in->dim, cudaMemcpyHostToDevice);CHKERRCUDA(err);
+
+  if (in->hash_table) {
+    err = cudaMalloc(&(cpu_data.hash_table), sizeof(PetscInt)*(((PetscInt)2) << in->hash_bits));CHKERRCUDA(err);
+    err = cudaMemcpy(cpu_data.hash_table, in->hash_table,
+      sizeof(PetscInt)*(((PetscInt)2) << in->hash_bits), cudaMemcpyHostToDevice);CHKERRCUDA(err);
+  }
+
+  err = cudaMalloc((void **) out_p, sizeof(data_Momentum));CHKERRCUDA(err);
+  err = cudaMemcpy(*out_p, &cpu_data, sizeof(data_Momentum), cudaMemcpyHostToDevice);CHKERRCUDA(err);
+
+  return 0;
+}
+
+PetscErrorCode DestroySubspaceData_CUDA_Momentum(data_Momentum* data) {
+  cudaError_t err;
+
+  data_Momentum cpu_data;
+
+  err = cudaMemcpy(&cpu_data, data, sizeof(data_Momentum), cudaMemcpyDeviceToHost);CHKERRCUDA(err);
+
+  err = cudaFree(cpu_data.state_map);CHKERRCUDA(err);
+  err = cudaFree(cpu_data.periods);CHKERRCUDA(err);
+  if (cpu_data.hash_table) {
+    err = cudaFree(cpu_data.hash_table);CHKERRCUDA(err);
+  }
+  err = cudaFree(data);CHKERRCUDA(err);
+  return 0;
+}
+
+/* as S2I_Momentum; shift must not be NULL */
+__device__ PetscInt S2I_CUDA_Momentum(PetscInt state, PetscInt* shift, const data_Momentum* data) {
+  PetscInt rep, rotated, l, left, right, mid;
+  PetscInt slot, slot_mask;
+  uint64_t all = (UINT64_C(1) << data->L) - 1;
+
+  if (state >> data->L) return (PetscInt)(-1);
+  if (data->k >= 0 && CUDA_POPCOUNT(state) != data->k) return (PetscInt)(-1);
+
+  rep = state;
+  rotated = state;
+  *shift = 0;
+  for (l = 1; l < data->L; ++l) {
+    rotated = (PetscInt)(((((uint64_t)rotated) << 1) | (((uint64_t)rotated) >> (data->L-1))) & all);
+    if (rotated == state) break;
+    if (rotated < rep) {
+      rep = rotated;
+      *shift = l;
+    }
+  }
+
+  if (data->hash_table) {
+    slot_mask = (((PetscInt)1) << data->hash_bits) - 1;
+    slot = EXPLICIT_HASH(rep, data->hash_bits);
+    while (data->hash_table[2*slot] != -1) {
+      if (data->hash_table[2*slot] == rep) {
+        return data->hash_table[2*slot+1];
+      }
+      slot = (slot+1) & slot_mask;
+    }
+    return -1;
+  }
+
+  left = 0;
+  right = data->dim-1;
+  while (left <= right) {
+    mid = left + (right-left)/2;
+    if (data->state_map[mid] == rep) return mid;
+    if (data->state_map[mid] < rep) left = mid + 1;
+    else right = mid - 1;
+  }
+  return -1;
+}
+
+__device__ PetscInt I2S_CUDA_Momentum(PetscInt idx, const data_Momentum* data) {
+  return data->state_map[idx];
+}
+
 PetscErrorCode MatCreateVecs_GPU(Mat mat, Vec *right, Vec *left)
 {
-  PetscInt M, N;
+  PetscInt M, N, m, n;
 
   PetscCall(MatGetSize(mat, &M, &N));
+  PetscCall(MatGetLocalSize(mat, &m, &n));
 
   if (right) {
     PetscCall(VecCreate(PetscObjectComm((PetscObject)mat),right));
-    PetscCall(VecSetSizes(*right, PETSC_DECIDE, N));
+    PetscCall(VecSetSizes(*right, n, N));
     PetscCall(VecSetFromOptions(*right));
   }
   if (left) {
     PetscCall(VecCreate(PetscObjectComm((PetscObject)mat),left));
-    PetscCall(VecSetSizes(*left, PETSC_DECIDE, M));
+    PetscCall(VecSetSizes(*left, m, M));
     PetscCall(VecSetFromOptions(*left));
   }
 
   return 0;
 }
 
-__device__ static __inline__ void add_real(PetscScalar *x, PetscReal r) {
-  PetscReal *real_part;
-  real_part = (PetscReal*) x;
+/* at most this many scalars of zero-padded amplitudes are laid out at once in RDMAccumulate_GPU */
+#define RDM_GPU_CHUNK_ENTRIES (((PetscInt)1) << 22)
+
+/* C += A A^H, in column-major storage, on PETSc's cuBLAS handle */
+static PetscErrorCode RDMGemm_CUDA(cublasHandle_t handle, PetscInt m, PetscInt k,
+                                   const PetscScalar* A, PetscScalar* C_array)
+{
+  cublasStatus_t cberr;
+  int m_int = (int) m, k_int = (int) k;
+
+#if defined(PETSC_USE_COMPLEX) && defined(PETSC_USE_REAL_SINGLE)
+  const cuComplex one = make_cuComplex(1, 0);
+  cberr = cublasCgemm(handle, CUBLAS_OP_N, CUBLAS_OP_C, m_int, m_int, k_int,
+    &one, (const cuComplex*) A, m_int, (const cuComplex*) A, m_int,
+    &one, (cuComplex*) C_array, m_int);CHKERRCUBLAS(cberr);
+#elif defined(PETSC_USE_COMPLEX)
+  const cuDoubleComplex one = make_cuDoubleComplex(1, 0);
+  cberr = cublasZgemm(handle, CUBLAS_OP_N, CUBLAS_OP_C, m_int, m_int, k_int,
+    &one, (const cuDoubleComplex*) A, m_int, (const cuDoubleComplex*) A, m_int,
+    &one, (cuDoubleComplex*) C_array, m_int);CHKERRCUBLAS(cberr);
+#elif defined(PETSC_USE_REAL_SINGLE)
+  const float one = 1;
+  cberr = cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_T, m_int, m_int, k_int,
+    &one, A, m_int, A, m_int, &one, C_array, m_int);CHKERRCUBLAS(cberr);
+#else
+  const double one = 1;
+  cberr = cublasDgemm(handle, CUBLAS_OP_N, CUBLAS_OP_T, m_int, m_int, k_int,
+    &one, A, m_int, A, m_int, &one, C_array, m_int);CHKERRCUBLAS(cberr);
+#endif
+
+  return 0;
+}
+
+/* lay amplitudes out in the zero-padded keep_dim x tr matrix */
+__global__ void device_RDMScatter(PetscInt n, const PetscInt* positions,
+                                  const PetscScalar* xarray, PetscScalar* dense)
+{
+  PetscInt i;
+  for (i = blockIdx.x*blockDim.x + threadIdx.x; i < n; i += gridDim.x*blockDim.x) {
+    dense[positions[i]] = xarray[i];
+  }
+}
+
+/*
+ * The reduced density matrix is a sum over traced states t of x_t x_t^H, where x_t holds
+ * the amplitudes of the keep states for t. Laying the x_t out as the columns of a matrix X
+ * makes this X X^H, a single GEMM. For the Full subspace x_local already is X; otherwise
+ * the columns are zero-padded into X a chunk at a time. Only the result leaves the device.
+ */
+PetscErrorCode RDMAccumulate_GPU(Vec x_local, PetscInt tr_local, PetscInt keep_dim,
+                                 const PetscInt* keep_states, const PetscInt* offsets,
+                                 PetscBool dense, PetscScalar* partial)
+{
+  cudaError_t err;
+  cublasStatus_t cberr;
+  cublasHandle_t handle;
+  const PetscScalar *xarray;
+  PetscScalar *d_rtn, *d_dense;
+  PetscInt *positions, *d_positions;
+  PetscInt chunk_cols, chunk_start, cols, t, i, first, n;
+  int block_num;
+
+  if (tr_local == 0) return 0;
+
+  PetscCall(PetscCUBLASGetHandle(&handle));
+  cberr = cublasSetStream(handle, PetscDefaultCudaStream);CHKERRCUBLAS(cberr);
+
+  err = cudaMalloc((void **) &d_rtn, sizeof(PetscScalar)*keep_dim*keep_dim);CHKERRCUDA(err);
+  err = cudaMemsetAsync(d_rtn, 0, sizeof(PetscScalar)*keep_dim*keep_dim, PetscDefaultCudaStream);CHKERRCUDA(err);
+
+  PetscCall(VecCUDAGetArrayRead(x_local, &xarray));
+
+  if (dense) {
+    PetscCall(RDMGemm_CUDA(handle, keep_dim, tr_local, xarray, d_rtn));
+  }
+  else {
+    chunk_cols = PetscMax(1, PetscMin(tr_local, RDM_GPU_CHUNK_ENTRIES/keep_dim));
+
+    /* where each amplitude goes in its chunk's padded matrix */
+    n = offsets[tr_local];
+    PetscCall(PetscMalloc1(PetscMax(n, 1), &positions));
+    for (t = 0; t < tr_local; ++t) {
+      for (i = offsets[t]; i < offsets[t+1]; ++i) {
+        positions[i] = (t % chunk_cols)*keep_dim + keep_states[i];
+      }
+    }
+    err = cudaMalloc((void **) &d_positions, sizeof(PetscInt)*PetscMax(n, 1));CHKERRCUDA(err);
+    err = cudaMemcpy(d_positions, positions, sizeof(PetscInt)*n, cudaMemcpyHostToDevice);CHKERRCUDA(err);
+    PetscCall(PetscFree(positions));
+
+    err = cudaMalloc((void **) &d_dense, sizeof(PetscScalar)*chunk_cols*keep_dim);CHKERRCUDA(err);
+
+    for (chunk_start = 0; chunk_start < tr_local; chunk_start += chunk_cols) {
+      cols = PetscMin(chunk_cols, tr_local - chunk_start);
+      first = offsets[chunk_start];
+      n = offsets[chunk_start+cols] - first;
+      if (n == 0) continue;
+
+      err = cudaMemsetAsync(d_dense, 0, sizeof(PetscScalar)*cols*keep_dim, PetscDefaultCudaStream);CHKERRCUDA(err);
+      block_num = (int) PetscMin((n + 255)/256, 1024);
+      device_RDMScatter<<<block_num, 256, 0, PetscDefaultCudaStream>>>(
+        n, d_positions + first, xarray + first, d_dense);
+      err = cudaGetLastError();CHKERRCUDA(err);
+
+      PetscCall(RDMGemm_CUDA(handle, keep_dim, cols, d_dense, d_rtn));
+    }
+
+    err = cudaFree(d_dense);CHKERRCUDA(err);
+    err = cudaFree(d_positions);CHKERRCUDA(err);
+  }
+
+  PetscCall(VecCUDARestoreArrayRead(x_local, &xarray));
+
+  err = cudaMemcpyAsync(partial, d_rtn, sizeof(PetscScalar)*keep_dim*keep_dim,
+    cudaMemcpyDeviceToHost, PetscDefaultCudaStream);CHKERRCUDA(err);
+  err = cudaStreamSynchronize(PetscDefaultCudaStream);CHKERRCUDA(err);
+  err = cudaFree(d_rtn);CHKERRCUDA(err);
+
+  /* the column-major result is the transpose, i.e. the conjugate, of the row-major one */
+#if defined(PETSC_USE_COMPLEX)
+  for (i=0; i<keep_dim*keep_dim; ++i) {
+    partial[i] = PetscConj(partial[i]);
+  }
+#endif
+
+  return 0;
+}
+
+/* as in bpetsc_impl.h: with single precision PETSc, the matvecs accumulate in double */
+#if defined(PETSC_USE_REAL_SINGLE)
+  typedef double accum_real;
+  #if defined(PETSC_USE_COMPLEX)
+    typedef thrust::complex<double> accum_t;
+  #else
+    typedef double accum_t;
+  #endif
+#else
+  typedef PetscReal accum_real;
+  typedef PetscScalar accum_t;
+#endif
+
+__device__ static __inline__ void add_real(accum_t *x, accum_real r) {
+  accum_real *real_part;
+  real_part = (accum_real*) x;
   (*real_part) += r;
 }
 
-__device__ static __inline__ void add_imag(PetscScalar *x, PetscReal c) {
-  PetscReal *imag_part;
-  imag_part = ((PetscReal*)x) + 1;
+__device__ static __inline__ void add_imag(accum_t *x, accum_real c) {
+  accum_real *imag_part;
+  imag_part = ((accum_real*)x) + 1;
   (*imag_part) += c;
 }
 
+/* as ElementFactor_Momentum */
+__device__ static __inline__ accum_t ElementFactor_CUDA_Momentum(PetscInt row_idx, PetscInt col_idx,
+                                                                 PetscInt shift, const data_Momentum* data) {
+  accum_t factor = 0;
+  accum_real nrm = (accum_real)data->sqrt_periods[data->periods[row_idx]]/data->sqrt_periods[data->periods[col_idx]];
+
+  add_real(&factor, nrm*data->phases[2*shift]);
+#if defined(PETSC_USE_COMPLEX)
+  add_imag(&factor, nrm*data->phases[2*shift+1]);
+#endif
+  return factor;
+}
+
+/* binary search for a global column index in the sorted (device) ghost list; -1 if absent */
+__device__ static __inline__ PetscInt FindGhost_CUDA(PetscInt col_idx, PetscInt n_ghosts, const PetscInt* ghost_cols)
+{
+  PetscInt lo = 0, hi = n_ghosts, mid;
+  while (lo < hi) {
+    mid = lo + (hi-lo)/2;
+    if (ghost_cols[mid] < col_idx) lo = mid+1;
+    else hi = mid;
+  }
+  return (lo < n_ghosts && ghost_cols[lo] == col_idx) ? lo : -1;
+}
+
+/* bytes of shared memory needed to stage the MSC arrays in StageMSC_CUDA */
+#define MSC_SHARED_SIZE(nmasks, nterms) \
+  ((nterms)*(sizeof(PetscReal)+sizeof(PetscInt)) + (2*(nmasks)+1)*sizeof(PetscInt))
+
+/*
+ * Copy the MSC arrays into shared memory, since every thread of the block reads all of
+ * them, and point the arguments at the copies. The PetscReals go first to keep them aligned.
+ * Must be called by every thread of the block.
+ */
+__device__ static __inline__ void StageMSC_CUDA(
+  PetscInt nmasks,
+  const PetscInt** masks,
+  const PetscInt** mask_offsets,
+  const PetscInt** signs,
+  const PetscReal** real_coeffs,
+  char* shared)
+{
+  PetscInt i, nterms;
+  PetscReal *s_real_coeffs;
+  PetscInt *s_signs, *s_masks, *s_mask_offsets;
+
+  nterms = (*mask_offsets)[nmasks];
+
+  s_real_coeffs = (PetscReal*) shared;
+  s_signs = (PetscInt*) (s_real_coeffs + nterms);
+  s_masks = s_signs + nterms;
+  s_mask_offsets = s_masks + nmasks;
+
+  for (i = threadIdx.x; i < nterms; i += blockDim.x) {
+    s_real_coeffs[i] = (*real_coeffs)[i];
+    s_signs[i] = (*signs)[i];
+  }
+  for (i = threadIdx.x; i < nmasks; i += blockDim.x) {
+    s_masks[i] = (*masks)[i];
+  }
+  for (i = threadIdx.x; i < nmasks+1; i += blockDim.x) {
+    s_mask_offsets[i] = (*mask_offsets)[i];
+  }
+  __syncthreads();
+
+  *real_coeffs = s_real_coeffs;
+  *signs = s_signs;
+  *masks = s_masks;
+  *mask_offsets = s_mask_offsets;
+}
+
 // defines used in the various templates
 #define Full_SP 0
 #define Parity_SP 1
 #define SpinConserve_SP 2
 #define Explicit_SP 3
+#define Momentum_SP 4
 
 #define LEFT_SUBSPACE Full
   #define RIGHT_SUBSPACE Full
@@ -307,3 +637,10 @@ __device__ static __inline__ void add_imag(PetscScalar *x, PetscReal c) {
     #include "bcuda_template.cu"
   #undef RIGHT_SUBSPACE
 #undef LEFT_SUBSPACE
+
+/* the momentum basis states are not product states, so Momentum only pairs with itself */
+#define LEFT_SUBSPACE Momentum
+  #define RIGHT_SUBSPACE Momentum
+    #include "bcuda_template.cu"
+  #undef RIGHT_SUBSPACE
+#undef LEFT_SUBSPACE
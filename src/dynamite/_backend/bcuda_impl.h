@@ -1,5 +1,24 @@
 
 #include <petscdevice.h>
+#include <petscvec.h>
+#include <cublas_v2.h>
 
 #include "shell_context.h"
+#include "log_events.h"
 #include "bsubspace_impl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* defined in bpetsc_impl.c, so that the GPU shell splits rows the same way as everything else */
+PetscErrorCode SplitOwnership(PetscInt N, PetscInt *n);
+
+/* called from the reduced density matrix code in bpetsc_template_1.c */
+PetscErrorCode RDMAccumulate_GPU(Vec x_local, PetscInt tr_local, PetscInt keep_dim,
+                                 const PetscInt* keep_states, const PetscInt* offsets,
+                                 PetscBool dense, PetscScalar* partial);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,23 +7,25 @@ PetscErrorCode C(BuildGPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const C(data,RIGHT_SUBSPACE)* right_subspace_data,
   Mat *A)
 {
-  PetscInt M, N, mpi_size;
+  PetscInt M, N, m, n;
+  PetscInt *host_ghost_cols;
+  cudaError_t err;
   shell_context *ctx;
 
-  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
-  if (mpi_size > 1) {
-    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_SUP,
-      "Shell GPU matrices currently only implemented for 1 MPI process.");
-  }
-
   /* N is dimension of right subspace, M of left */
   M = C(Dim,LEFT_SUBSPACE)(left_subspace_data);
   N = C(Dim,RIGHT_SUBSPACE)(right_subspace_data);
 
+  PetscCall(SplitOwnership(M, &m));
+  PetscCall(SplitOwnership(N, &n));
+
   PetscCall(C(BuildContext_CUDA,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
     msc, left_subspace_data, right_subspace_data, &ctx));
 
-  PetscCall(MatCreateShell(PETSC_COMM_WORLD, M, N, M, N, ctx, A));
+  PetscCall(C(SetupLaunch_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+    m, msc->mask_offsets[msc->nmasks], ctx));
+
+  PetscCall(MatCreateShell(PETSC_COMM_WORLD, m, n, M, N, ctx, A));
 
   PetscCall(MatShellSetOperation(*A, MATOP_MULT,
     (void(*)(void))C(MatMult_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))));
@@ -33,6 +35,25 @@ PetscErrorCode C(BuildGPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
     (void(*)(void))MatCreateVecs_GPU));
   PetscCall(MatShellSetOperation(*A, MATOP_DESTROY,
     (void(*)(void))C(MatDestroyCtx_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))));
+  PetscCall(MatShellSetMatProductOperation(*A, MATPRODUCT_AB, NULL,
+    C(MatMatMult_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE)),
+    NULL, MATDENSECUDA, MATDENSECUDA));
+
+  /*
+   * With more than one rank, the off-process entries of x that our rows need are gathered
+   * into a device buffer before each matvec. The ghost indices are found on the host, from
+   * the host copies of the operator and subspaces, and then moved to the device for lookup.
+   */
+  PetscCall(C(SetupGhosts,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+    *A, msc, left_subspace_data, right_subspace_data, PETSC_TRUE, ctx));
+  if (ctx->ghost_cols) {
+    host_ghost_cols = ctx->ghost_cols;
+    err = cudaMalloc((void **) &(ctx->ghost_cols),
+      sizeof(PetscInt)*PetscMax(ctx->n_ghosts, 1));CHKERRCUDA(err);
+    err = cudaMemcpy(ctx->ghost_cols, host_ghost_cols, sizeof(PetscInt)*ctx->n_ghosts,
+      cudaMemcpyHostToDevice);CHKERRCUDA(err);
+    PetscCall(PetscFree(host_ghost_cols));
+  }
 
   return 0;
 }
@@ -54,6 +75,18 @@ PetscErrorCode C(BuildContext_CUDA,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   ctx->nmasks = msc->nmasks;
   ctx->nrm = -1;
   nterms = msc->mask_offsets[msc->nmasks];
+  ctx->nterms = nterms;
+
+  /* filled in by SetupGhosts once the matrix layout exists */
+  ctx->n_ghosts = 0;
+  ctx->ghost_cols = NULL;
+  ctx->ghost_vec = NULL;
+  ctx->ghost_scatter = NULL;
+
+  /* mask-diagonal storage is only implemented for the CPU */
+  ctx->dia_values = NULL;
+  ctx->dia_re_offsets = NULL;
+  ctx->dia_im_offsets = NULL;
 
   err = cudaMalloc((void **) &(ctx->masks),
     sizeof(PetscInt)*msc->nmasks);CHKERRCUDA(err);
@@ -93,6 +126,41 @@ PetscErrorCode C(BuildContext_CUDA,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   return 0;
 }
 
+PetscErrorCode C(UpdateGPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  Mat A)
+{
+  PetscReal *cpu_real_coeffs, real_part;
+  PetscInt nterms, ctx_nterms, i;
+  cudaError_t err;
+  shell_context *ctx;
+
+  PetscCall(MatShellGetContext(A, &ctx));
+
+  /* the context's mask offsets live on the device, so fetch just the term count */
+  nterms = msc->mask_offsets[msc->nmasks];
+  err = cudaMemcpy(&ctx_nterms, ctx->mask_offsets + ctx->nmasks, sizeof(PetscInt),
+    cudaMemcpyDeviceToHost);CHKERRCUDA(err);
+  if (msc->nmasks != ctx->nmasks || nterms != ctx_nterms) {
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_INCOMP,
+            "Terms of the new coefficients do not match those of the matrix.");
+  }
+
+  PetscCall(PetscMalloc1(nterms, &cpu_real_coeffs));
+  for (i=0; i < nterms; ++i) {
+    real_part = PetscRealPart(msc->coeffs[i]);
+    cpu_real_coeffs[i] = (real_part != 0) ? real_part : PetscImaginaryPart(msc->coeffs[i]);
+  }
+  err = cudaMemcpy(ctx->real_coeffs, cpu_real_coeffs, sizeof(PetscReal)*nterms,
+    cudaMemcpyHostToDevice);CHKERRCUDA(err);
+  PetscCall(PetscFree(cpu_real_coeffs));
+
+  ctx->nrm = -1;
+  PetscCall(PetscObjectStateIncrease((PetscObject)A));
+
+  return 0;
+}
+
 PetscErrorCode C(MatDestroyCtx_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A)
 {
   cudaError_t err;
@@ -105,6 +173,12 @@ PetscErrorCode C(MatDestroyCtx_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A)
   err = cudaFree(ctx->signs);CHKERRCUDA(err);
   err = cudaFree(ctx->real_coeffs);CHKERRCUDA(err);
 
+  if (ctx->ghost_cols) {
+    err = cudaFree(ctx->ghost_cols);CHKERRCUDA(err);
+  }
+  PetscCall(VecDestroy(&(ctx->ghost_vec)));
+  PetscCall(VecScatterDestroy(&(ctx->ghost_scatter)));
+
   PetscCall(C(DestroySubspaceData_CUDA,LEFT_SUBSPACE)(
     (C(data,LEFT_SUBSPACE)*) ctx->left_subspace_data));
   PetscCall(C(DestroySubspaceData_CUDA,RIGHT_SUBSPACE)(
@@ -115,77 +189,163 @@ PetscErrorCode C(MatDestroyCtx_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A)
   return 0;
 }
 
+/*
+ * Choose the launch geometry for the matvec kernels, once per operator. The MSC arrays are
+ * staged in shared memory if they are small enough; then the block size and the number of
+ * blocks that fill the device are taken from the CUDA occupancy calculator, which accounts
+ * for the kernel's register and shared memory use on this device.
+ */
+PetscErrorCode C(SetupLaunch_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  PetscInt size, PetscInt nterms, shell_context *ctx)
+{
+  cudaError_t err;
+  int device, max_shared, min_grid_size, block_size;
+  size_t shared_size;
+  PetscInt needed_blocks;
+
+  err = cudaGetDevice(&device);CHKERRCUDA(err);
+  err = cudaDeviceGetAttribute(&max_shared, cudaDevAttrMaxSharedMemoryPerBlock, device);CHKERRCUDA(err);
+
+  shared_size = MSC_SHARED_SIZE(ctx->nmasks, nterms);
+  if (shared_size > (size_t)(max_shared/GPU_MAX_SHARED_FRACTION)) {
+    /* too big to stage; the kernels read the arrays from global memory through the cache */
+    shared_size = 0;
+  }
+  ctx->gpu_shared_size = shared_size;
+
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+  err = cudaOccupancyMaxPotentialBlockSize(&min_grid_size, &block_size,
+    C(device_MatMult_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE)), shared_size, 0);CHKERRCUDA(err);
+#else
+  err = cudaOccupancyMaxPotentialBlockSize(&min_grid_size, &block_size,
+    C(device_MatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE)), shared_size, 0);CHKERRCUDA(err);
+#endif
+
+  /* no point in launching blocks that would have no rows */
+  needed_blocks = (size + block_size - 1) / block_size;
+  ctx->gpu_block_size = block_size;
+  ctx->gpu_block_num = (int) PetscMax(1, PetscMin((PetscInt)min_grid_size, needed_blocks));
+
+  return 0;
+}
+
 PetscErrorCode C(MatMult_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b)
 {
   cudaError_t err;
   shell_context *ctx;
 
-  const PetscScalar* xarray;
+  const PetscScalar *xarray, *ghost_array;
   PetscScalar* barray;
-  PetscInt size;
+  PetscInt size, row_start, row_end, col_start, col_end;
 
-  PetscCall(VecSet(b, 0));
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_MULT], A, x, b, 0));
 
   PetscCall(MatShellGetContext(A, &ctx));
 
-  PetscCall(VecCUDAGetArrayRead(x, &xarray));
-  PetscCall(VecCUDAGetArray(b, &barray));
-
-  PetscCall(VecGetSize(b, &size));
+  PetscCall(MatGetOwnershipRange(A, &row_start, &row_end));
+  PetscCall(MatGetOwnershipRangeColumn(A, &col_start, &col_end));
+  size = row_end - row_start;
+
+  /* fetch the off-process entries of x; with CUDA-aware MPI this stays on the device */
+  ghost_array = NULL;
+  if (ctx->ghost_scatter) {
+    PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
+    PetscCall(VecScatterBegin(ctx->ghost_scatter, x, ctx->ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+    PetscCall(VecScatterEnd(ctx->ghost_scatter, x, ctx->ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+    PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
+    PetscCall(VecCUDAGetArrayRead(ctx->ghost_vec, &ghost_array));
+  }
 
-  err = cudaDeviceSynchronize();CHKERRCUDA(err);
+  /*
+   * Everything is queued on PETSc's stream, so it is ordered with respect to PETSc's own
+   * operations on x and b, and nothing here waits for the device. The kernel writes every
+   * element of b, so its old values need not be zeroed or copied.
+   */
+  PetscCall(VecCUDAGetArrayRead(x, &xarray));
+  PetscCall(VecCUDAGetArrayWrite(b, &barray));
 
-  C(device_MatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))<<<GPU_BLOCK_NUM,GPU_BLOCK_SIZE>>>(
+  PetscCall(PetscLogGpuTimeBegin());
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+  C(device_MatMult_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
+#else
+  C(device_MatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
+#endif
+    <<<ctx->gpu_block_num, ctx->gpu_block_size, ctx->gpu_shared_size, PetscDefaultCudaStream>>>(
     size,
     ctx->masks,
     ctx->mask_offsets,
     ctx->signs,
     ctx->real_coeffs,
     ctx->nmasks,
+    (PetscBool)(ctx->gpu_shared_size > 0),
     (C(data,LEFT_SUBSPACE)*) ctx->left_subspace_data,
     (C(data,RIGHT_SUBSPACE)*) ctx->right_subspace_data,
+    row_start,
+    col_start,
+    col_end,
+    ctx->n_ghosts,
+    ctx->ghost_cols,
+    ghost_array,
     xarray,
     barray);
 
-  err = cudaDeviceSynchronize();CHKERRCUDA(err);
+  /* only checks that the launch succeeded; does not wait for the kernel */
+  err = cudaGetLastError();CHKERRCUDA(err);
+  PetscCall(PetscLogGpuTimeEnd());
 
+  if (ctx->ghost_scatter) {
+    PetscCall(VecCUDARestoreArrayRead(ctx->ghost_vec, &ghost_array));
+  }
   PetscCall(VecCUDARestoreArrayRead(x, &xarray));
-  PetscCall(VecCUDARestoreArray(b, &barray));
+  PetscCall(VecCUDARestoreArrayWrite(b, &barray));
+
+  PetscCall(LogShellProduct(EVENT_SHELL_MULT, ctx->nmasks, ctx->nterms,
+                            size, 1, PETSC_TRUE));
 
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_MULT], A, x, b, 0));
   return 0;
 }
 
 __global__ void C(device_MatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscInt size,
-  PetscInt* masks,
-  PetscInt* mask_offsets,
-  PetscInt* signs,
-  PetscReal* real_coeffs,
+  const PetscInt* masks,
+  const PetscInt* mask_offsets,
+  const PetscInt* signs,
+  const PetscReal* real_coeffs,
   PetscInt nmasks,
+  PetscBool stage_msc,
   C(data,LEFT_SUBSPACE) *left_subspace_data,
   C(data,RIGHT_SUBSPACE) *right_subspace_data,
+  PetscInt row_start,
+  PetscInt col_start,
+  PetscInt col_end,
+  PetscInt n_ghosts,
+  const PetscInt* ghost_cols,
+  const PetscScalar* ghost_array,
   const PetscScalar* xarray,
   PetscScalar* barray)
 {
 
-  /* the following four lines come from the PETSc cuda source */
-  PetscInt entries_per_group = (size - 1) / gridDim.x + 1;
-  entries_per_group = (entries_per_group == 0) ? 1 : entries_per_group;  // for very small vectors, a group should still do some work
-  PetscInt vec_start_index = blockIdx.x * entries_per_group;
-  PetscInt vec_stop_index  = PetscMin((blockIdx.x + 1) * entries_per_group, size); // don't go beyond vec size
+  extern __shared__ __align__(sizeof(PetscReal)) char msc_shared[];
 
-  PetscScalar tmp, val;
+  accum_t tmp, val;
   PetscReal sign;
-  PetscInt bra, ket, row_idx, col_idx, mask_idx, term_idx, this_start;
+  PetscInt bra, ket, row_idx, col_idx, mask_idx, term_idx;
 
 #if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
   PetscInt s2i_sign;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+  PetscInt shift;
 #endif
 
-  this_start = vec_start_index + threadIdx.x;
+  if (stage_msc) {
+    StageMSC_CUDA(nmasks, &masks, &mask_offsets, &signs, &real_coeffs, msc_shared);
+  }
 
-  for (row_idx = this_start; row_idx < vec_stop_index; row_idx += blockDim.x) {
-    ket = C(I2S_CUDA,LEFT_SUBSPACE)(row_idx,left_subspace_data);
+  /* consecutive threads take consecutive rows, so that the reads of xarray coalesce
+   * whenever the column index varies smoothly with the row (e.g. col = row ^ mask) */
+  for (row_idx = blockIdx.x*blockDim.x + threadIdx.x; row_idx < size; row_idx += gridDim.x*blockDim.x) {
+    ket = C(I2S_CUDA,LEFT_SUBSPACE)(row_start+row_idx,left_subspace_data);
     val = 0;
     for (mask_idx = 0; mask_idx < nmasks; ++mask_idx) {
       tmp = 0;
@@ -209,29 +369,276 @@ __global__ void C(device_MatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
 #if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
       col_idx = C(S2I_CUDA,RIGHT_SUBSPACE)(bra, &s2i_sign, right_subspace_data);
       tmp *= s2i_sign;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      col_idx = C(S2I_CUDA,RIGHT_SUBSPACE)(bra, &shift, right_subspace_data);
 #else
       col_idx = C(S2I_CUDA,RIGHT_SUBSPACE)(bra, right_subspace_data);
 #endif
 
-      if (col_idx != -1) {
-	val += tmp * xarray[col_idx];
+      if (col_idx == -1) continue;
+
+#if C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      tmp *= ElementFactor_CUDA_Momentum(row_start+row_idx, col_idx, shift, right_subspace_data);
+#endif
+
+      /* every off-process column was recorded by SetupGhosts */
+      if (col_idx >= col_start && col_idx < col_end) {
+        val += tmp * (accum_t)xarray[col_idx-col_start];
+      }
+      else {
+        val += tmp * (accum_t)ghost_array[FindGhost_CUDA(col_idx, n_ghosts, ghost_cols)];
       }
     }
 
-#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
-    // need to use atomics
-    if (right_subspace_data->spinflip) {
-      PetscReal* r = (PetscReal *)(&(barray[row_idx]));
-      PetscReal* c = r+1;
-      atomicAdd(r, val.real());
-      atomicAdd(c, val.imag());
-    } else {
-      barray[row_idx] = val;
+    /* each row belongs to exactly one thread, which computes it from the row's representative
+     * state alone (S2I_CUDA folds spin-flip partners onto it with the right sign), so no atomics
+     * are needed and the result does not depend on scheduling */
+    barray[row_idx] = (PetscScalar)val;
+  }
+}
+
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+/*
+ * Matvec for Full and Parity subspaces. In these the column index follows from the row
+ * index by a XOR, so the subspace lookups and their validity checks are skipped: with Full,
+ * col = row ^ mask, and with Parity (where the index is the state without its last bit)
+ * col = row ^ (mask >> 1), for exactly those masks that connect the two parity sectors.
+ * Consecutive threads take consecutive rows, so the reads of xarray coalesce.
+ */
+__global__ void C(device_MatMult_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  PetscInt size,
+  const PetscInt* masks,
+  const PetscInt* mask_offsets,
+  const PetscInt* signs,
+  const PetscReal* real_coeffs,
+  PetscInt nmasks,
+  PetscBool stage_msc,
+  C(data,LEFT_SUBSPACE) *left_subspace_data,
+  C(data,RIGHT_SUBSPACE) *right_subspace_data,
+  PetscInt row_start,
+  PetscInt col_start,
+  PetscInt col_end,
+  PetscInt n_ghosts,
+  const PetscInt* ghost_cols,
+  const PetscScalar* ghost_array,
+  const PetscScalar* xarray,
+  PetscScalar* barray)
+{
+
+  extern __shared__ __align__(sizeof(PetscReal)) char msc_shared[];
+
+  accum_t tmp, val;
+  PetscReal sign;
+  PetscInt bra, ket, mask, row_idx, col_idx, mask_idx, term_idx;
+
+#if C(LEFT_SUBSPACE,SP) == Parity_SP
+  PetscInt left_space, mask_parity;
+  left_space = left_subspace_data->space;
+  mask_parity = left_space ^ right_subspace_data->space;
+#endif
+
+  if (stage_msc) {
+    StageMSC_CUDA(nmasks, &masks, &mask_offsets, &signs, &real_coeffs, msc_shared);
+  }
+
+  for (row_idx = blockIdx.x*blockDim.x + threadIdx.x; row_idx < size; row_idx += gridDim.x*blockDim.x) {
+#if C(LEFT_SUBSPACE,SP) == Parity_SP
+    ket = ((row_start+row_idx) << 1) | (CUDA_PARITY(row_start+row_idx) ^ left_space);
+#else
+    ket = row_start+row_idx;
+#endif
+    val = 0;
+    for (mask_idx = 0; mask_idx < nmasks; ++mask_idx) {
+      mask = masks[mask_idx];
+
+#if C(LEFT_SUBSPACE,SP) == Parity_SP
+      /* this is the same for every row, so it does not cause divergence */
+      if (CUDA_PARITY(mask) != mask_parity) continue;
+#endif
+
+      tmp = 0;
+      bra = ket ^ mask;
+      for (term_idx = mask_offsets[mask_idx]; term_idx < mask_offsets[mask_idx+1]; ++term_idx) {
+        sign = 1 - 2*CUDA_PARITY(bra & signs[term_idx]);
+        if TERM_REAL_CUDA(mask, signs[term_idx]) {
+          add_real(&tmp, sign * real_coeffs[term_idx]);
+        }
+        else {
+          add_imag(&tmp, sign * real_coeffs[term_idx]);
+        }
+      }
+
+#if C(LEFT_SUBSPACE,SP) == Parity_SP
+      col_idx = bra >> 1;
+#else
+      col_idx = bra;
+#endif
+
+      if (col_idx >= col_start && col_idx < col_end) {
+        val += tmp * (accum_t)xarray[col_idx-col_start];
+      }
+      else {
+        val += tmp * (accum_t)ghost_array[FindGhost_CUDA(col_idx, n_ghosts, ghost_cols)];
+      }
+    }
+
+    barray[row_idx] = (PetscScalar)val;
+  }
+}
+#endif
+
+PetscErrorCode C(MatMatMult_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Mat X, Mat B, void *data)
+{
+  cudaError_t err;
+  shell_context *ctx;
+
+  const PetscScalar* xarray;
+  PetscScalar* barray;
+  PetscInt size, n_vecs, x_ld, b_ld;
+  struct cudaFuncAttributes attr;
+  int block_size;
+  Vec x, b;
+
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_MATMAT], A, X, B, 0));
+
+  PetscCall(MatShellGetContext(A, &ctx));
+
+  /* the fused kernel works on a single rank only; otherwise apply the matvec column by column
+   * (which logs its own work) */
+  if (ctx->ghost_scatter) {
+    PetscCall(MatGetSize(B, NULL, &n_vecs));
+    for (PetscInt vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+      PetscCall(MatDenseGetColumnVecRead(X, vec_idx, &x));
+      PetscCall(MatDenseGetColumnVecWrite(B, vec_idx, &b));
+      PetscCall(C(MatMult_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, x, b));
+      PetscCall(MatDenseRestoreColumnVecWrite(B, vec_idx, &b));
+      PetscCall(MatDenseRestoreColumnVecRead(X, vec_idx, &x));
     }
+    PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_MATMAT], A, X, B, 0));
+    return 0;
+  }
+
+  PetscCall(MatZeroEntries(B));
+
+  PetscCall(MatGetSize(B, &size, &n_vecs));
+  PetscCall(MatDenseGetLDA(X, &x_ld));
+  PetscCall(MatDenseGetLDA(B, &b_ld));
+
+  /* the geometry was tuned for device_MatMult; make sure this kernel can use it too */
+  err = cudaFuncGetAttributes(&attr, C(device_MatMatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE)));CHKERRCUDA(err);
+  block_size = PetscMin(ctx->gpu_block_size, attr.maxThreadsPerBlock);
+
+  PetscCall(MatDenseCUDAGetArrayRead(X, &xarray));
+  PetscCall(MatDenseCUDAGetArray(B, &barray));
+
+  PetscCall(PetscLogGpuTimeBegin());
+  C(device_MatMatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
+    <<<ctx->gpu_block_num, block_size, ctx->gpu_shared_size, PetscDefaultCudaStream>>>(
+    size,
+    ctx->masks,
+    ctx->mask_offsets,
+    ctx->signs,
+    ctx->real_coeffs,
+    ctx->nmasks,
+    (PetscBool)(ctx->gpu_shared_size > 0),
+    (C(data,LEFT_SUBSPACE)*) ctx->left_subspace_data,
+    (C(data,RIGHT_SUBSPACE)*) ctx->right_subspace_data,
+    n_vecs,
+    xarray,
+    x_ld,
+    barray,
+    b_ld);
+
+  err = cudaGetLastError();CHKERRCUDA(err);
+  PetscCall(PetscLogGpuTimeEnd());
+
+  PetscCall(MatDenseCUDARestoreArrayRead(X, &xarray));
+  PetscCall(MatDenseCUDARestoreArray(B, &barray));
+
+  PetscCall(LogShellProduct(EVENT_SHELL_MATMAT, ctx->nmasks, ctx->nterms, size, n_vecs, PETSC_TRUE));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_MATMAT], A, X, B, 0));
+  return 0;
+}
+
+/*
+ * Like device_MatMult, but for n_vecs vectors stored as the columns of dense matrices.
+ * Each matrix element is computed once and applied to all of the vectors.
+ */
+__global__ void C(device_MatMatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  PetscInt size,
+  const PetscInt* masks,
+  const PetscInt* mask_offsets,
+  const PetscInt* signs,
+  const PetscReal* real_coeffs,
+  PetscInt nmasks,
+  PetscBool stage_msc,
+  C(data,LEFT_SUBSPACE) *left_subspace_data,
+  C(data,RIGHT_SUBSPACE) *right_subspace_data,
+  PetscInt n_vecs,
+  const PetscScalar* xarray,
+  PetscInt x_ld,
+  PetscScalar* barray,
+  PetscInt b_ld)
+{
+
+  extern __shared__ __align__(sizeof(PetscReal)) char msc_shared[];
+
+  accum_t tmp;
+  PetscReal sign;
+  PetscInt bra, ket, row_idx, col_idx, mask_idx, term_idx, vec_idx;
+
+#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+  PetscInt s2i_sign;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+  PetscInt shift;
+#endif
+
+  if (stage_msc) {
+    StageMSC_CUDA(nmasks, &masks, &mask_offsets, &signs, &real_coeffs, msc_shared);
+  }
+
+  for (row_idx = blockIdx.x*blockDim.x + threadIdx.x; row_idx < size; row_idx += gridDim.x*blockDim.x) {
+    ket = C(I2S_CUDA,LEFT_SUBSPACE)(row_idx,left_subspace_data);
+    for (mask_idx = 0; mask_idx < nmasks; ++mask_idx) {
+      tmp = 0;
+      bra = ket ^ masks[mask_idx];
+      /* sum all terms for this matrix element */
+      for (term_idx = mask_offsets[mask_idx]; term_idx < mask_offsets[mask_idx+1]; ++term_idx) {
+#if defined(PETSC_USE_64BIT_INDICES)
+        sign = __popcll(bra & signs[term_idx])&1;
+#else
+        sign = __popc(bra & signs[term_idx])&1;
+#endif
+        sign = 1 - 2*sign;
+        if TERM_REAL_CUDA(masks[mask_idx], signs[term_idx]) {
+	  add_real(&tmp, sign * real_coeffs[term_idx]);
+        }
+        else {
+          add_imag(&tmp, sign * real_coeffs[term_idx]);
+        }
+      }
+
+#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+      col_idx = C(S2I_CUDA,RIGHT_SUBSPACE)(bra, &s2i_sign, right_subspace_data);
+      tmp *= s2i_sign;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      col_idx = C(S2I_CUDA,RIGHT_SUBSPACE)(bra, &shift, right_subspace_data);
 #else
-    barray[row_idx] = val;
+      col_idx = C(S2I_CUDA,RIGHT_SUBSPACE)(bra, right_subspace_data);
 #endif
 
+      if (col_idx == -1) continue;
+
+#if C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      tmp *= ElementFactor_CUDA_Momentum(row_idx, col_idx, shift, right_subspace_data);
+#endif
+
+      /* as in device_MatMult, only this thread writes this row */
+      for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+        barray[vec_idx*b_ld + row_idx] += (PetscScalar)(tmp * (accum_t)xarray[vec_idx*x_ld + col_idx]);
+      }
+    }
   }
 }
 
@@ -241,7 +648,7 @@ PetscErrorCode C(MatNorm_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, NormType ty
   shell_context *ctx;
 
   PetscReal *d_maxs,*h_maxs;
-  PetscInt i, M;
+  PetscInt i, row_start, row_end;
 
   if (type != NORM_INFINITY) {
     SETERRQ(PETSC_COMM_WORLD,PETSC_ERR_ARG_OUTOFRANGE,"Only NORM_INFINITY is implemented for shell matrices.");
@@ -258,13 +665,16 @@ PetscErrorCode C(MatNorm_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, NormType ty
     return 0;
   }
 
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_NORM], A, 0, 0, 0));
+
   err = cudaMalloc((void **) &d_maxs, sizeof(PetscReal)*GPU_BLOCK_NUM);CHKERRCUDA(err);
   PetscCall(PetscMalloc1(GPU_BLOCK_NUM, &h_maxs));
 
-  PetscCall(MatGetSize(A, &M, NULL));
+  PetscCall(MatGetOwnershipRange(A, &row_start, &row_end));
 
   C(device_MatNorm,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))<<<GPU_BLOCK_NUM, GPU_BLOCK_SIZE, sizeof(PetscReal)*GPU_BLOCK_SIZE>>>(
-    M,
+    row_end-row_start,
+    row_start,
     ctx->masks,
     ctx->mask_offsets,
     ctx->signs,
@@ -283,17 +693,22 @@ PetscErrorCode C(MatNorm_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, NormType ty
   for (i = 0; i < GPU_BLOCK_NUM; ++i) {
     if (h_maxs[i] > (*nrm)) (*nrm) = h_maxs[i];
   }
+  PetscCallMPI(MPI_Allreduce(MPI_IN_PLACE, nrm, 1, MPIU_REAL, MPI_MAX, PETSC_COMM_WORLD));
 
   ctx->nrm = (*nrm);
 
   err = cudaFree(d_maxs);CHKERRCUDA(err);
   PetscCall(PetscFree(h_maxs));
 
+  PetscCall(LogShellProduct(EVENT_SHELL_NORM, 0, ctx->nterms, row_end-row_start, 0, PETSC_TRUE));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_NORM], A, 0, 0, 0));
   return 0;
 }
 
 __global__ void C(device_MatNorm,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscInt size,
+  PetscInt row_start,
   PetscInt* masks,
   PetscInt* mask_offsets,
   PetscInt* signs,
@@ -312,14 +727,18 @@ __global__ void C(device_MatNorm,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscInt vec_stop_index  = PetscMin((blockIdx.x + 1) * entries_per_group, size); // don't go beyond vec size
 
   PetscReal sum,v1,v2,sign;
-  PetscScalar csum;
+  accum_t csum;
   PetscInt ket, bra, row_idx, mask_idx, term_idx, i;
 
+#if C(RIGHT_SUBSPACE,SP) == Momentum_SP
+  PetscInt col_idx, shift;
+#endif
+
   /* first find this thread's max and put it in threadmax */
 
   threadmax[threadIdx.x] = 0;
   for (row_idx = vec_start_index+threadIdx.x; row_idx < vec_stop_index; row_idx += blockDim.x) {
-    ket = C(I2S_CUDA,LEFT_SUBSPACE)(row_idx,left_subspace_data);
+    ket = C(I2S_CUDA,LEFT_SUBSPACE)(row_start+row_idx,left_subspace_data);
     sum = 0;
     for (mask_idx = 0; mask_idx < nmasks; ++mask_idx) {
       csum = 0;
@@ -339,7 +758,13 @@ __global__ void C(device_MatNorm,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
           add_imag(&csum, sign * real_coeffs[term_idx]);
         }
       }
-      sum += abs(csum);
+#if C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      /* only the ratio of the normalizations changes the magnitude */
+      col_idx = C(S2I_CUDA,RIGHT_SUBSPACE)(bra, &shift, right_subspace_data);
+      if (col_idx == -1) continue;
+      csum *= ElementFactor_CUDA_Momentum(row_start+row_idx, col_idx, shift, right_subspace_data);
+#endif
+      sum += (PetscReal)abs(csum);
     }
     if (sum > threadmax[threadIdx.x]) {
       threadmax[threadIdx.x] = sum;
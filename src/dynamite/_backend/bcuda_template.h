@@ -12,6 +12,19 @@ PetscErrorCode C(BuildGPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const C(data,RIGHT_SUBSPACE)* right_subspace_data,
   Mat *A);
 
+PetscErrorCode C(UpdateGPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  Mat A);
+
+/* defined in the CPU template; builds the ghost scatter for either shell type */
+PetscErrorCode C(SetupGhosts,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  Mat A,
+  const msc_t *msc,
+  const C(data,LEFT_SUBSPACE)* left_subspace_data,
+  const C(data,RIGHT_SUBSPACE)* right_subspace_data,
+  PetscBool gpu,
+  shell_context *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,9 +4,14 @@
 #include <petscmat.h>
 #include "bcuda_template.h"
 
+/* fixed launch geometry, used for the norm computation */
 #define GPU_BLOCK_SIZE 128
 #define GPU_BLOCK_NUM 128
 
+/* at most this fraction of a block's shared memory is used to stage the MSC arrays,
+ * so that several blocks can still fit on each SM */
+#define GPU_MAX_SHARED_FRACTION 4
+
 PetscErrorCode C(BuildContext_CUDA,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const msc_t *msc,
   const C(data,LEFT_SUBSPACE)* left_subspace_data,
@@ -15,24 +20,75 @@ PetscErrorCode C(BuildContext_CUDA,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
 
 PetscErrorCode C(MatDestroyCtx_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A);
 
+PetscErrorCode C(SetupLaunch_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  PetscInt size, PetscInt nterms, shell_context *ctx);
+
 PetscErrorCode C(MatMult_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b);
 
 __global__ void C(device_MatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscInt size,
-  PetscInt* masks,
-  PetscInt* mask_offsets,
-  PetscInt* signs,
-  PetscReal* real_coeffs,
+  const PetscInt* masks,
+  const PetscInt* mask_offsets,
+  const PetscInt* signs,
+  const PetscReal* real_coeffs,
+  PetscInt nmasks,
+  PetscBool stage_msc,
+  C(data,LEFT_SUBSPACE) *left_subspace_data,
+  C(data,RIGHT_SUBSPACE) *right_subspace_data,
+  PetscInt row_start,
+  PetscInt col_start,
+  PetscInt col_end,
+  PetscInt n_ghosts,
+  const PetscInt* ghost_cols,
+  const PetscScalar* ghost_array,
+  const PetscScalar* xarray,
+  PetscScalar* barray);
+
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+/* Full and Parity subspaces of the same type on both sides have a dedicated matvec kernel */
+__global__ void C(device_MatMult_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  PetscInt size,
+  const PetscInt* masks,
+  const PetscInt* mask_offsets,
+  const PetscInt* signs,
+  const PetscReal* real_coeffs,
   PetscInt nmasks,
+  PetscBool stage_msc,
   C(data,LEFT_SUBSPACE) *left_subspace_data,
   C(data,RIGHT_SUBSPACE) *right_subspace_data,
+  PetscInt row_start,
+  PetscInt col_start,
+  PetscInt col_end,
+  PetscInt n_ghosts,
+  const PetscInt* ghost_cols,
+  const PetscScalar* ghost_array,
   const PetscScalar* xarray,
   PetscScalar* barray);
+#endif
+
+PetscErrorCode C(MatMatMult_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Mat X, Mat B, void *data);
+
+__global__ void C(device_MatMatMult,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  PetscInt size,
+  const PetscInt* masks,
+  const PetscInt* mask_offsets,
+  const PetscInt* signs,
+  const PetscReal* real_coeffs,
+  PetscInt nmasks,
+  PetscBool stage_msc,
+  C(data,LEFT_SUBSPACE) *left_subspace_data,
+  C(data,RIGHT_SUBSPACE) *right_subspace_data,
+  PetscInt n_vecs,
+  const PetscScalar* xarray,
+  PetscInt x_ld,
+  PetscScalar* barray,
+  PetscInt b_ld);
 
 PetscErrorCode C(MatNorm_GPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, NormType type, PetscReal *nrm);
 
 __global__ void C(device_MatNorm,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscInt size,
+  PetscInt row_start,
   PetscInt* masks,
   PetscInt* mask_offsets,
   PetscInt* signs,
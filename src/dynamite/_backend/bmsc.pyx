@@ -0,0 +1,181 @@
+# cython: language_level=3
+'''
+Compiled kernels for the MSC algebra in msc_tools. Terms are combined in a hash table keyed
+on (mask, sign) as they are produced, so that memory use is proportional to the number of
+distinct terms in the result rather than the number generated along the way.
+'''
+
+import numpy as np
+cimport numpy as np
+
+from libc.stdlib cimport malloc, calloc, free
+from libc.stdint cimport int64_t, uint64_t
+
+import cython
+
+cdef inline uint64_t term_hash(int64_t mask, int64_t sign):
+    # splitmix64 finalizer, applied to a cheap combination of the two keys
+    cdef uint64_t x = (<uint64_t>mask)*0x9E3779B97F4A7C15ULL ^ (<uint64_t>sign)
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ULL
+    x = (x ^ (x >> 27))*0x94D049BB133111EBULL
+    return x ^ (x >> 31)
+
+cdef inline int parity(uint64_t x):
+    x ^= x >> 32
+    x ^= x >> 16
+    x ^= x >> 8
+    x ^= x >> 4
+    x ^= x >> 2
+    x ^= x >> 1
+    return x & 1
+
+cdef class TermTable:
+    '''
+    An open-addressing hash table accumulating the coefficient of each (mask, sign) term.
+    '''
+
+    cdef int64_t* masks
+    cdef int64_t* signs
+    cdef double complex* coeffs
+    cdef char* used
+    cdef Py_ssize_t capacity
+    cdef Py_ssize_t size
+
+    def __cinit__(self, Py_ssize_t size_hint=0):
+        cdef Py_ssize_t capacity = 16
+        while capacity < 2*size_hint:
+            capacity *= 2
+
+        self.masks = NULL
+        self.signs = NULL
+        self.coeffs = NULL
+        self.used = NULL
+        self.size = 0
+        self.allocate(capacity)
+
+    def __dealloc__(self):
+        free(self.masks)
+        free(self.signs)
+        free(self.coeffs)
+        free(self.used)
+
+    cdef int allocate(self, Py_ssize_t capacity) except -1:
+        self.masks = <int64_t*>malloc(capacity*sizeof(int64_t))
+        self.signs = <int64_t*>malloc(capacity*sizeof(int64_t))
+        self.coeffs = <double complex*>malloc(capacity*sizeof(double complex))
+        self.used = <char*>calloc(capacity, sizeof(char))
+        if not (self.masks and self.signs and self.coeffs and self.used):
+            raise MemoryError('could not allocate MSC term table')
+        self.capacity = capacity
+        return 0
+
+    cdef int grow(self) except -1:
+        cdef int64_t* old_masks = self.masks
+        cdef int64_t* old_signs = self.signs
+        cdef double complex* old_coeffs = self.coeffs
+        cdef char* old_used = self.used
+        cdef Py_ssize_t old_capacity = self.capacity
+        cdef Py_ssize_t i
+
+        try:
+            self.allocate(2*old_capacity)
+            self.size = 0
+            for i in range(old_capacity):
+                if old_used[i]:
+                    self.add(old_masks[i], old_signs[i], old_coeffs[i])
+        finally:
+            free(old_masks)
+            free(old_signs)
+            free(old_coeffs)
+            free(old_used)
+        return 0
+
+    @cython.boundscheck(False)
+    @cython.wraparound(False)
+    cdef int add(self, int64_t mask, int64_t sign, double complex coeff) except -1:
+        cdef Py_ssize_t idx
+
+        # keep the load factor at most 1/2
+        if 2*(self.size+1) > self.capacity:
+            self.grow()
+
+        idx = term_hash(mask, sign) & (self.capacity-1)
+        while self.used[idx]:
+            if self.masks[idx] == mask and self.signs[idx] == sign:
+                self.coeffs[idx] += coeff
+                return 0
+            idx = (idx + 1) & (self.capacity-1)
+
+        self.used[idx] = 1
+        self.masks[idx] = mask
+        self.signs[idx] = sign
+        self.coeffs[idx] = coeff
+        self.size += 1
+        return 0
+
+    @cython.boundscheck(False)
+    @cython.wraparound(False)
+    def to_arrays(self):
+        '''
+        The accumulated terms with nonzero coefficient, in no particular order.
+        '''
+        cdef Py_ssize_t i, n = 0
+        cdef int64_t [:] masks
+        cdef int64_t [:] signs
+        cdef double complex [:] coeffs
+
+        masks_np = np.ndarray(self.size, dtype=np.int64)
+        signs_np = np.ndarray(self.size, dtype=np.int64)
+        coeffs_np = np.ndarray(self.size, dtype=np.complex128)
+
+        masks = masks_np
+        signs = signs_np
+        coeffs = coeffs_np
+
+        for i in range(self.capacity):
+            if self.used[i] and self.coeffs[i] != 0:
+                masks[n] = self.masks[i]
+                signs[n] = self.signs[i]
+                coeffs[n] = self.coeffs[i]
+                n += 1
+
+        return masks_np[:n], signs_np[:n], coeffs_np[:n]
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def combine(int64_t [:] masks, int64_t [:] signs, double complex [:] coeffs):
+    '''
+    Combine like terms, returning the distinct terms with nonzero coefficient as arrays
+    (masks, signs, coeffs), unsorted.
+    '''
+    cdef Py_ssize_t i
+    cdef TermTable table = TermTable(masks.shape[0])
+
+    for i in range(masks.shape[0]):
+        table.add(masks[i], signs[i], coeffs[i])
+
+    return table.to_arrays()
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def product(int64_t [:] left_masks, int64_t [:] left_signs, double complex [:] left_coeffs,
+            int64_t [:] right_masks, int64_t [:] right_signs, double complex [:] right_coeffs):
+    '''
+    The product of two MSC operators (left times right), with like terms combined as they are
+    generated. Returns arrays (masks, signs, coeffs), unsorted.
+    '''
+    cdef Py_ssize_t i, j
+    cdef double complex coeff
+    cdef TermTable table = TermTable(max(left_masks.shape[0], right_masks.shape[0]))
+
+    for i in range(left_masks.shape[0]):
+        for j in range(right_masks.shape[0]):
+            coeff = left_coeffs[i]*right_coeffs[j]
+            # moving the right mask's flips through the left signs
+            if parity(<uint64_t>(right_masks[j] & left_signs[i])):
+                coeff = -coeff
+            table.add(left_masks[i] ^ right_masks[j],
+                      left_signs[i] ^ right_signs[j],
+                      coeff)
+
+    return table.to_arrays()
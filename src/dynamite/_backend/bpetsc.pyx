@@ -11,6 +11,10 @@ from petsc4py.PETSc import Error, COMM_WORLD
 import numpy as np
 cimport numpy as np
 
+np.import_array()
+
+from .bbuild import dnm_int_t
+
 import cython
 
 cdef extern from "bsubspace_impl.h":
@@ -28,14 +32,17 @@ cdef extern from "bsubspace_impl.h":
 cdef extern from "bpetsc_impl.h":
 
     ctypedef int PetscInt
+    ctypedef double PetscReal
     ctypedef float PetscLogDouble
 
     int DNM_PETSC_COMPLEX
+    int DNM_PETSC_SINGLE
 
     ctypedef enum shell_impl:
         NO_SHELL
         CPU_SHELL
         GPU_SHELL
+        CPU_SHELL_MASK_DIAG
 
     ctypedef struct msc_t:
       int nmasks
@@ -47,12 +54,25 @@ cdef extern from "bpetsc_impl.h":
     int BuildMat(msc_t *msc,
                  subspaces_t *subspaces,
                  shell_impl shell,
+                 bint half_storage,
                  PetscMat *A)
 
+    int UpdateMat(msc_t *msc,
+                  subspaces_t *subspaces,
+                  shell_impl shell,
+                  PetscMat A)
+
     int CheckConserves(msc_t *msc,
                        subspaces_t *subspaces,
                        bint *result)
 
+    int AnalyzeOperator(msc_t *msc,
+                        subspaces_t *subspaces,
+                        bint *result,
+                        PetscReal *nrm)
+
+    int SetShellNorm(PetscMat A, PetscReal nrm)
+
     int ReducedDensityMatrix(
         PetscVec vec,
         int sub_type,
@@ -63,14 +83,80 @@ cdef extern from "bpetsc_impl.h":
         PetscInt rtn_dim,
         void* rtn_array)
 
+    int ExpectationValues(msc_t *msc,
+                          PetscInt n_ops,
+                          PetscInt* op_offsets,
+                          int sub_type,
+                          void* sub_data_p,
+                          PetscVec vec,
+                          void* values)
+
+    int SplitOwnership(PetscInt N, PetscInt* n)
+
+    int ComputeAuto(msc_t *msc,
+                    PetscInt start,
+                    PetscInt *dim,
+                    PetscInt **state_map)
+
+    int PetscFree(PetscInt* ptr)
+
     int PetscMemoryGetCurrentUsage(PetscLogDouble* mem)
     int PetscMallocGetCurrentUsage(PetscLogDouble* mem)
     int PetscMemorySetGetMaximumUsage()
     int PetscMemoryGetMaximumUsage(PetscLogDouble* mem)
     int PetscMallocGetMaximumUsage(PetscLogDouble* mem)
 
+cdef extern from "log_events.h":
+
+    ctypedef int PetscLogEvent
+
+    ctypedef enum dnm_event:
+        DNM_N_EVENTS
+
+    ctypedef struct event_profile:
+        PetscLogDouble count
+        PetscLogDouble time
+        PetscLogDouble flops
+        PetscLogDouble bytes
+        PetscLogDouble messages
+        PetscLogDouble message_bytes
+        PetscLogDouble reductions
+
+    const char* dnm_event_names[]
+    PetscLogEvent dnm_events[]
+
+    int RegisterEvents()
+    int GetEventProfile(dnm_event event, event_profile *profile)
+
+    int PetscLogDefaultBegin()
+    int PetscLogEventBegin(PetscLogEvent e, void* o1, void* o2, void* o3, void* o4)
+    int PetscLogEventEnd(PetscLogEvent e, void* o1, void* o2, void* o3, void* o4)
+
 include "config.pxi"
 
+def scalar_dtype():
+    '''
+    The numpy dtype of PETSc's scalars, which depends on how PETSc was configured.
+    '''
+    if DNM_PETSC_COMPLEX:
+        return np.complex64 if DNM_PETSC_SINGLE else np.complex128
+    else:
+        return np.float32 if DNM_PETSC_SINGLE else np.float64
+
+def petsc_coeffs(coeffs):
+    '''
+    The coefficients as a contiguous array of PETSc scalars, for the coeffs of an msc_t.
+    Raises ValueError if any are complex but PETSc was configured for real numbers.
+    '''
+    if not DNM_PETSC_COMPLEX:
+        # check that all the coefficients were actually real
+        if not np.all(np.isreal(coeffs)):
+            raise ValueError('operator has complex entries but PETSc was '
+                             'configured for real numbers')
+        coeffs = np.real(coeffs)
+
+    return np.ascontiguousarray(coeffs, dtype=scalar_dtype())
+
 def build_mat(PetscInt [:] masks,
               PetscInt [:] mask_offsets,
               PetscInt [:] signs,
@@ -80,32 +166,22 @@ def build_mat(PetscInt [:] masks,
               subspace_type right_type,
               right_data,
               bint shell,
-              bint gpu):
+              bint gpu,
+              bint half_storage = False,
+              bint mask_diagonal = False):
 
     cdef int ierr, nterms, nmasks
     cdef subspaces_t subspaces
     cdef msc_t msc
     cdef shell_impl which_shell
 
-    cdef np.float64_t [:] real_coeffs
-
     msc.nmasks      = masks.size
     msc.masks       = &masks[0]
     msc.mask_offsets = &mask_offsets[0]
     msc.signs       = &signs[0]
 
-    if DNM_PETSC_COMPLEX:
-        msc.coeffs = <void*>&coeffs[0]
-    else:
-        # check that all the coefficients were actually real
-        if not np.all(np.isreal(coeffs)):
-            raise ValueError('matrix has complex entries but PETSc was '
-                             'configured for real numbers')
-
-        real_coeffs_np = np.ascontiguousarray(np.real(coeffs), dtype=np.float64)
-        real_coeffs = real_coeffs_np
-
-        msc.coeffs = <void*>&real_coeffs[0]
+    coeffs_np = petsc_coeffs(coeffs)
+    msc.coeffs = np.PyArray_DATA(coeffs_np)
 
     M = Mat()
 
@@ -124,10 +200,12 @@ def build_mat(PetscInt [:] masks,
     else:
         if gpu:
             which_shell = GPU_SHELL
+        elif mask_diagonal:
+            which_shell = CPU_SHELL_MASK_DIAG
         else:
             which_shell = CPU_SHELL
 
-    ierr = BuildMat(&msc, &subspaces, which_shell, &M.mat)
+    ierr = BuildMat(&msc, &subspaces, which_shell, half_storage, &M.mat)
 
     if ierr != 0:
         raise Error(ierr)
@@ -135,6 +213,56 @@ def build_mat(PetscInt [:] masks,
     return M
 
 
+def update_mat(Mat A,
+               PetscInt [:] masks,
+               PetscInt [:] mask_offsets,
+               PetscInt [:] signs,
+               np.complex128_t [:] coeffs,
+               subspace_type left_type,
+               left_data,
+               subspace_type right_type,
+               right_data,
+               bint shell,
+               bint gpu,
+               bint mask_diagonal = False):
+    '''
+    Rewrite the values of a matrix from build_mat with new coefficients, in place. The masks
+    and signs must be exactly those the matrix was built with.
+    '''
+
+    cdef int ierr
+    cdef subspaces_t subspaces
+    cdef msc_t msc
+    cdef shell_impl which_shell
+
+    msc.nmasks      = masks.size
+    msc.masks       = &masks[0]
+    msc.mask_offsets = &mask_offsets[0]
+    msc.signs       = &signs[0]
+
+    coeffs_np = petsc_coeffs(coeffs)
+    msc.coeffs = np.PyArray_DATA(coeffs_np)
+
+    subspaces.left_type = left_type
+    bsubspace.set_data_pointer(left_type, left_data, &(subspaces.left_data))
+    subspaces.right_type = right_type
+    bsubspace.set_data_pointer(right_type, right_data, &(subspaces.right_data))
+
+    if not shell:
+        which_shell = NO_SHELL
+    elif gpu:
+        which_shell = GPU_SHELL
+    elif mask_diagonal:
+        which_shell = CPU_SHELL_MASK_DIAG
+    else:
+        which_shell = CPU_SHELL
+
+    ierr = UpdateMat(&msc, &subspaces, which_shell, A.mat)
+
+    if ierr != 0:
+        raise Error(ierr)
+
+
 def check_conserves(PetscInt [:] masks,
                     PetscInt [:] mask_offsets,
                     PetscInt [:] signs,
@@ -149,25 +277,13 @@ def check_conserves(PetscInt [:] masks,
     cdef msc_t msc
     cdef bint result
 
-    cdef np.float64_t [:] real_coeffs
-
     msc.nmasks      = masks.size
     msc.masks       = &masks[0]
     msc.mask_offsets = &mask_offsets[0]
     msc.signs       = &signs[0]
 
-    if DNM_PETSC_COMPLEX:
-        msc.coeffs = <void*>&coeffs[0]
-    else:
-        # check that all the coefficients were actually real
-        if not np.all(np.isreal(coeffs)):
-            raise ValueError('matrix has complex entries but PETSc was '
-                             'configured for real numbers')
-
-        real_coeffs_np = np.ascontiguousarray(np.real(coeffs), dtype=np.float64)
-        real_coeffs = real_coeffs_np
-
-        msc.coeffs = <void*>&real_coeffs[0]
+    coeffs_np = petsc_coeffs(coeffs)
+    msc.coeffs = np.PyArray_DATA(coeffs_np)
 
     subspaces.left_type = left_type
     bsubspace.set_data_pointer(left_type, left_data, &(subspaces.left_data))
@@ -182,6 +298,112 @@ def check_conserves(PetscInt [:] masks,
     return result
 
 
+def analyze_operator(PetscInt [:] masks,
+                     PetscInt [:] mask_offsets,
+                     PetscInt [:] signs,
+                     np.complex128_t [:] coeffs,
+                     subspace_type left_type,
+                     left_data,
+                     subspace_type right_type,
+                     right_data):
+    '''
+    Check whether the operator conserves the subspaces, and compute the shell matrices'
+    bound on its infinity norm, in a single sweep. Returns the two as a tuple.
+    '''
+
+    cdef int ierr
+    cdef subspaces_t subspaces
+    cdef msc_t msc
+    cdef bint result
+    cdef PetscReal nrm
+
+    msc.nmasks      = masks.size
+    msc.masks       = &masks[0]
+    msc.mask_offsets = &mask_offsets[0]
+    msc.signs       = &signs[0]
+
+    coeffs_np = petsc_coeffs(coeffs)
+    msc.coeffs = np.PyArray_DATA(coeffs_np)
+
+    subspaces.left_type = left_type
+    bsubspace.set_data_pointer(left_type, left_data, &(subspaces.left_data))
+    subspaces.right_type = right_type
+    bsubspace.set_data_pointer(right_type, right_data, &(subspaces.right_data))
+
+    ierr = AnalyzeOperator(&msc, &subspaces, &result, &nrm)
+
+    if ierr != 0:
+        raise Error(ierr)
+
+    return result, nrm
+
+
+def set_shell_norm(Mat A, PetscReal nrm):
+    '''
+    Give a shell matrix the infinity norm it should report, so that it isn't computed again.
+    '''
+    cdef int ierr
+
+    ierr = SetShellNorm(A.mat, nrm)
+
+    if ierr != 0:
+        raise Error(ierr)
+
+
+def split_ownership(PetscInt N):
+    '''
+    The number of elements of a vector of global dimension N that are stored on
+    this process. Vectors must use this layout to be compatible with dynamite's
+    matrices.
+    '''
+    cdef int ierr
+    cdef PetscInt n
+
+    ierr = SplitOwnership(N, &n)
+    if ierr != 0:
+        raise Error(ierr)
+
+    return n
+
+def compute_auto(PetscInt [:] masks,
+                 PetscInt [:] mask_offsets,
+                 PetscInt [:] signs,
+                 np.complex128_t [:] coeffs,
+                 PetscInt start):
+    '''
+    Find the states connected to ``start`` by the operator, using a breadth-first
+    search distributed across all processes. Returns the same array on every
+    process, ordered by distance from ``start`` and then by value.
+    '''
+    cdef int ierr
+    cdef msc_t msc
+    cdef PetscInt dim, i
+    cdef PetscInt* state_map
+    cdef PetscInt [:] state_map_view
+
+    msc.nmasks      = masks.size
+    msc.masks       = &masks[0]
+    msc.mask_offsets = &mask_offsets[0]
+    msc.signs       = &signs[0]
+
+    coeffs_np = petsc_coeffs(coeffs)
+    msc.coeffs = np.PyArray_DATA(coeffs_np)
+
+    ierr = ComputeAuto(&msc, start, &dim, &state_map)
+    if ierr != 0:
+        raise Error(ierr)
+
+    state_map_np = np.ndarray(dim, dtype = dnm_int_t)
+    state_map_view = state_map_np
+    for i in range(dim):
+        state_map_view[i] = state_map[i]
+
+    ierr = PetscFree(state_map)
+    if ierr != 0:
+        raise Error(ierr)
+
+    return state_map_np
+
 def track_memory():
     '''
     Begin tracking memory usage for a later call to :meth:`get_max_memory_usage`.
@@ -257,10 +479,7 @@ def get_cur_memory_usage(which='all'):
 
 def reduced_density_matrix(Vec v, subspace_type sub_type, sub_data, PetscInt [:] keep, bint triang=True):
 
-    if DNM_PETSC_COMPLEX:
-        matrix_dtype = np.complex128
-    else:
-        matrix_dtype = np.float64
+    matrix_dtype = scalar_dtype()
 
     if COMM_WORLD.rank == 0:
         rtn_np = np.zeros((2**keep.size, 2**keep.size), dtype=matrix_dtype, order='C')
@@ -273,17 +492,123 @@ def reduced_density_matrix(Vec v, subspace_type sub_type, sub_data, PetscInt [:]
 
     bsubspace.set_data_pointer(sub_type, sub_data, &sub_data_p)
 
-    cdef np.complex128_t [:,:] rtn_c
-    cdef np.float64_t [:,:] rtn_f
+    # every process computes a full-size part of the result, so all of them need its size,
+    # even though only rank 0 receives it
+    ierr = ReducedDensityMatrix(v.vec, sub_type, sub_data_p, keep.size, &keep[0], triang,
+                                2**keep.size, np.PyArray_DATA(rtn_np))
 
-    if DNM_PETSC_COMPLEX:
-        rtn_c = rtn_np
-        ierr = ReducedDensityMatrix(v.vec, sub_type, sub_data_p, keep.size, &keep[0], triang, rtn_c.shape[0], <void*>&rtn_c[0,0])
-    else:
-        rtn_f = rtn_np
-        ierr = ReducedDensityMatrix(v.vec, sub_type, sub_data_p, keep.size, &keep[0], triang, rtn_f.shape[0], <void*>&rtn_f[0,0])
+    if ierr != 0:
+        raise Error(ierr)
+
+    return rtn_np
+
+def expectation_values(PetscInt [:] masks,
+                       PetscInt [:] mask_offsets,
+                       PetscInt [:] signs,
+                       np.complex128_t [:] coeffs,
+                       PetscInt [:] op_offsets,
+                       Vec v,
+                       subspace_type sub_type,
+                       sub_data):
+    '''
+    Compute the expectation values in v of several operators, whose MSC arrays are
+    concatenated; the masks of operator k are op_offsets[k] to op_offsets[k+1]. Returns
+    the same array on every process.
+    '''
+    cdef int ierr
+    cdef msc_t msc
+    cdef void* sub_data_p
+    cdef PetscInt n_ops = op_offsets.size - 1
+
+    rtn_np = np.zeros(n_ops, dtype=scalar_dtype())
+
+    # an empty operator has expectation value zero
+    if masks.size == 0:
+        return rtn_np
+
+    msc.nmasks      = masks.size
+    msc.masks       = &masks[0]
+    msc.mask_offsets = &mask_offsets[0]
+    msc.signs       = &signs[0]
+
+    coeffs_np = petsc_coeffs(coeffs)
+    msc.coeffs = np.PyArray_DATA(coeffs_np)
+
+    bsubspace.set_data_pointer(sub_type, sub_data, &sub_data_p)
+
+    ierr = ExpectationValues(&msc, n_ops, &op_offsets[0], sub_type, sub_data_p,
+                             v.vec, np.PyArray_DATA(rtn_np))
 
     if ierr != 0:
         raise Error(ierr)
 
     return rtn_np
+
+def track_profile():
+    '''
+    Start PETSc's default logging, which get_profile reads. Not needed if PETSc was started
+    with -log_view.
+    '''
+    cdef int ierr
+    ierr = RegisterEvents()
+    if ierr == 0:
+        ierr = PetscLogDefaultBegin()
+    if ierr != 0:
+        raise Error(ierr)
+
+def get_profile():
+    '''
+    The profile of each of the backend's log events, reduced over all ranks. Must be called
+    on all ranks.
+    '''
+    cdef int ierr, i
+    cdef event_profile profile
+
+    rtn = {}
+    for i in range(DNM_N_EVENTS):
+        ierr = GetEventProfile(<dnm_event>i, &profile)
+        if ierr != 0:
+            raise Error(ierr)
+
+        # strip the "DNM" prefix shared by all of the events
+        name = dnm_event_names[i].decode('utf-8')[3:]
+        rtn[name] = {
+            'count': int(profile.count),
+            'time': profile.time,
+            'flops': profile.flops,
+            'bytes': profile.bytes,
+            'messages': int(profile.messages),
+            'message_bytes': profile.message_bytes,
+            'reductions': int(profile.reductions),
+        }
+
+    return rtn
+
+cdef class LogEvent:
+    '''
+    Context manager logging the code inside it as one of the backend's events, for the work
+    that is done on the Python side or in the other backend modules.
+    '''
+
+    cdef int event
+
+    def __init__(self, name):
+        cdef int i
+        names = [dnm_event_names[i].decode('utf-8')[3:] for i in range(DNM_N_EVENTS)]
+        self.event = names.index(name)
+
+    def __enter__(self):
+        cdef int ierr
+        ierr = RegisterEvents()
+        if ierr == 0:
+            ierr = PetscLogEventBegin(dnm_events[self.event], NULL, NULL, NULL, NULL)
+        if ierr != 0:
+            raise Error(ierr)
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        cdef int ierr
+        ierr = PetscLogEventEnd(dnm_events[self.event], NULL, NULL, NULL, NULL)
+        if ierr != 0:
+            raise Error(ierr)
+        return False
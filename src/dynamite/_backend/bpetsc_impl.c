@@ -13,6 +13,88 @@
 #define Parity_SP 1
 #define SpinConserve_SP 2
 #define Explicit_SP 3
+#define Momentum_SP 4
+
+const char* const dnm_event_names[DNM_N_EVENTS] = {
+  "DNMBuildMat",
+  "DNMComputeRows",
+  "DNMUpdateMat",
+  "DNMShellMult",
+  "DNMShellMatMat",
+  "DNMShellComm",
+  "DNMShellNorm",
+  "DNMCheckConsrv",
+  "DNMRDM",
+  "DNMExpectVals",
+  "DNMComputeAuto",
+  "DNMComputeRCM"
+};
+
+PetscLogEvent dnm_events[DNM_N_EVENTS];
+PetscLogDouble dnm_event_bytes[DNM_N_EVENTS];
+
+#undef  __FUNCT__
+#define __FUNCT__ "RegisterEvents"
+PetscErrorCode RegisterEvents(void)
+{
+  static PetscBool registered = PETSC_FALSE;
+  PetscClassId classid;
+  PetscInt i;
+
+  if (registered) return 0;
+
+  PetscCall(PetscClassIdRegister("dynamite", &classid));
+  for (i = 0; i < DNM_N_EVENTS; ++i) {
+    PetscCall(PetscLogEventRegister(dnm_event_names[i], classid, &(dnm_events[i])));
+  }
+
+  registered = PETSC_TRUE;
+  return 0;
+}
+
+#undef  __FUNCT__
+#define __FUNCT__ "GetEventProfile"
+/*
+ * The profile of an event in the current logging stage. All zeros if logging is not active
+ * (it is started by -log_view, or by PetscLogDefaultBegin).
+ */
+PetscErrorCode GetEventProfile(dnm_event event, event_profile *profile)
+{
+  PetscEventPerfInfo info;
+  PetscBool active;
+  PetscLogDouble local_max[2] = {0, 0}, global_max[2];
+  PetscLogDouble local_sum[5] = {0, 0, 0, 0, 0}, global_sum[5];
+
+  PetscCall(RegisterEvents());
+  PetscCall(PetscLogIsActive(&active));
+
+  if (active) {
+    PetscCall(PetscLogEventGetPerfInfo(PETSC_DETERMINE, dnm_events[event], &info));
+    local_max[0] = info.count;
+    local_max[1] = info.time;
+    local_sum[0] = info.flops;
+#if defined(PETSC_HAVE_DEVICE)
+    local_sum[0] += info.GpuFlops;
+#endif
+    local_sum[1] = dnm_event_bytes[event];
+    local_sum[2] = info.numMessages;
+    local_sum[3] = info.messageLength;
+    local_sum[4] = info.numReductions;
+  }
+
+  PetscCallMPI(MPI_Allreduce(local_max, global_max, 2, MPI_DOUBLE, MPI_MAX, PETSC_COMM_WORLD));
+  PetscCallMPI(MPI_Allreduce(local_sum, global_sum, 5, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD));
+
+  profile->count = global_max[0];
+  profile->time = global_max[1];
+  profile->flops = global_sum[0];
+  profile->bytes = global_sum[1];
+  profile->messages = global_sum[2];
+  profile->message_bytes = global_sum[3];
+  profile->reductions = global_sum[4];
+
+  return 0;
+}
 
 
 #define SUBSPACE Full
@@ -31,6 +113,10 @@
   #include "bpetsc_template_1.c"
 #undef SUBSPACE
 
+#define SUBSPACE Momentum
+  #include "bpetsc_template_1.c"
+#undef SUBSPACE
+
 #undef  __FUNCT__
 #define __FUNCT__ "ReducedDensityMatrix"
 PetscErrorCode ReducedDensityMatrix(
@@ -43,6 +129,17 @@ PetscErrorCode ReducedDensityMatrix(
   PetscInt rtn_dim,
   PetscScalar* rtn
 ){
+  PetscInt local_size;
+
+  /* reject before the event begins, so the log stack stays balanced */
+  if (sub_type == MOMENTUM) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_SUP,
+            "Reduced density matrices require a product state basis.");
+  }
+
+  PetscCall(RegisterEvents());
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_RDM], vec, 0, 0, 0));
+
   switch (sub_type) {
     case FULL:
       PetscCall(rdm_Full(vec, sub_data_p, keep_size, keep, triang, rtn_dim, rtn));
@@ -59,6 +156,57 @@ PetscErrorCode ReducedDensityMatrix(
     default: // shouldn't happen, but give ierr some (nonzero) value for consistency
       return 1;
   }
+
+  /* each amplitude is multiplied by (at most) the rtn_dim others in its group */
+  PetscCall(VecGetLocalSize(vec, &local_size));
+  PetscCall(PetscLogFlops(2.0*local_size*rtn_dim));
+  DNM_LOG_BYTES(EVENT_RDM, local_size*sizeof(PetscScalar));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_RDM], vec, 0, 0, 0));
+  return 0;
+}
+
+#undef  __FUNCT__
+#define __FUNCT__ "ExpectationValues"
+PetscErrorCode ExpectationValues(
+  const msc_t *msc,
+  PetscInt n_ops,
+  const PetscInt* op_offsets,
+  PetscInt sub_type,
+  void* sub_data_p,
+  Vec vec,
+  PetscScalar* values
+){
+  PetscInt local_size;
+
+  PetscCall(RegisterEvents());
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_EXPECTATION], vec, 0, 0, 0));
+
+  switch (sub_type) {
+    case FULL:
+      PetscCall(expectation_values_Full(msc, n_ops, op_offsets, sub_data_p, vec, values));
+      break;
+    case PARITY:
+      PetscCall(expectation_values_Parity(msc, n_ops, op_offsets, sub_data_p, vec, values));
+      break;
+    case SPIN_CONSERVE:
+      PetscCall(expectation_values_SpinConserve(msc, n_ops, op_offsets, sub_data_p, vec, values));
+      break;
+    case EXPLICIT:
+      PetscCall(expectation_values_Explicit(msc, n_ops, op_offsets, sub_data_p, vec, values));
+      break;
+    case MOMENTUM:
+      PetscCall(expectation_values_Momentum(msc, n_ops, op_offsets, sub_data_p, vec, values));
+      break;
+    default:
+      return 1;
+  }
+
+  PetscCall(VecGetLocalSize(vec, &local_size));
+  PetscCall(LogShellProduct(EVENT_EXPECTATION, msc->nmasks, msc->mask_offsets[msc->nmasks],
+                            local_size, 1, PETSC_FALSE));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_EXPECTATION], vec, 0, 0, 0));
   return 0;
 }
 
@@ -134,28 +282,52 @@ PetscErrorCode ReducedDensityMatrix(
   #undef RIGHT_SUBSPACE
 #undef LEFT_SUBSPACE
 
+/* the momentum basis states are not product states, so Momentum only pairs with itself */
+#define LEFT_SUBSPACE Momentum
+  #define RIGHT_SUBSPACE Momentum
+    #include "bpetsc_template_2.c"
+  #undef RIGHT_SUBSPACE
+#undef LEFT_SUBSPACE
+
+static PetscErrorCode CheckMomentumPair(const subspaces_t *subspaces)
+{
+  if ((subspaces->left_type == MOMENTUM) != (subspaces->right_type == MOMENTUM)) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_SUP,
+            "A Momentum subspace can only be paired with another Momentum subspace.");
+  }
+  return 0;
+}
+
 /*
  * Build the matrix using the appropriate BuildMat function for the subspaces.
  */
-PetscErrorCode BuildMat(const msc_t *msc, subspaces_t *subspaces, shell_impl shell, Mat *A)
+PetscErrorCode BuildMat(const msc_t *msc, subspaces_t *subspaces, shell_impl shell,
+                        PetscBool half_storage, Mat *A)
 {
+  PetscCall(RegisterEvents());
+  PetscCall(CheckMomentumPair(subspaces));
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_BUILD_MAT], 0, 0, 0, 0));
+
   switch (subspaces->left_type) {
     case FULL:
       switch (subspaces->right_type) {
         case FULL:
-          PetscCall(BuildMat_Full_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Full_Full(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case PARITY:
-          PetscCall(BuildMat_Full_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Full_Parity(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case SPIN_CONSERVE:
-          PetscCall(BuildMat_Full_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Full_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case EXPLICIT:
-          PetscCall(BuildMat_Full_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Full_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
@@ -163,19 +335,22 @@ PetscErrorCode BuildMat(const msc_t *msc, subspaces_t *subspaces, shell_impl she
     case PARITY:
       switch (subspaces->right_type) {
         case FULL:
-          PetscCall(BuildMat_Parity_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Parity_Full(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case PARITY:
-          PetscCall(BuildMat_Parity_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Parity_Parity(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case SPIN_CONSERVE:
-          PetscCall(BuildMat_Parity_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Parity_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case EXPLICIT:
-          PetscCall(BuildMat_Parity_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Parity_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
@@ -183,19 +358,22 @@ PetscErrorCode BuildMat(const msc_t *msc, subspaces_t *subspaces, shell_impl she
     case SPIN_CONSERVE:
       switch (subspaces->right_type) {
         case FULL:
-          PetscCall(BuildMat_SpinConserve_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_SpinConserve_Full(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case PARITY:
-          PetscCall(BuildMat_SpinConserve_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_SpinConserve_Parity(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
       case SPIN_CONSERVE:
-          PetscCall(BuildMat_SpinConserve_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_SpinConserve_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case EXPLICIT:
-          PetscCall(BuildMat_SpinConserve_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_SpinConserve_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
@@ -203,50 +381,194 @@ PetscErrorCode BuildMat(const msc_t *msc, subspaces_t *subspaces, shell_impl she
     case EXPLICIT:
       switch (subspaces->right_type) {
         case FULL:
-          PetscCall(BuildMat_Explicit_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Explicit_Full(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case PARITY:
-          PetscCall(BuildMat_Explicit_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Explicit_Parity(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
       case SPIN_CONSERVE:
-          PetscCall(BuildMat_Explicit_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          PetscCall(BuildMat_Explicit_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
           break;
 
         case EXPLICIT:
-	  PetscCall(BuildMat_Explicit_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+	  PetscCall(BuildMat_Explicit_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
+
+    case MOMENTUM:
+      PetscCall(BuildMat_Momentum_Momentum(msc, subspaces->left_data, subspaces->right_data, shell, half_storage, A));
+      break;
   }
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_BUILD_MAT], 0, 0, 0, 0));
   return 0;
 }
 
 /*
- * we short-circuit some of these because they always return a particular value
+ * Rewrite the coefficients of a matrix built by BuildMat, keeping its structure.
  */
-PetscErrorCode CheckConserves(const msc_t *msc, subspaces_t *subspaces, PetscInt *result)
+PetscErrorCode UpdateMat(const msc_t *msc, subspaces_t *subspaces, shell_impl shell, Mat A)
+{
+  PetscCall(RegisterEvents());
+  PetscCall(CheckMomentumPair(subspaces));
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_UPDATE_MAT], A, 0, 0, 0));
+
+  switch (subspaces->left_type) {
+    case FULL:
+      switch (subspaces->right_type) {
+        case FULL:
+          PetscCall(UpdateMat_Full_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case PARITY:
+          PetscCall(UpdateMat_Full_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case SPIN_CONSERVE:
+          PetscCall(UpdateMat_Full_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case EXPLICIT:
+          PetscCall(UpdateMat_Full_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
+          break;
+      }
+      break;
+
+    case PARITY:
+      switch (subspaces->right_type) {
+        case FULL:
+          PetscCall(UpdateMat_Parity_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case PARITY:
+          PetscCall(UpdateMat_Parity_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case SPIN_CONSERVE:
+          PetscCall(UpdateMat_Parity_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case EXPLICIT:
+          PetscCall(UpdateMat_Parity_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
+          break;
+      }
+      break;
+
+    case SPIN_CONSERVE:
+      switch (subspaces->right_type) {
+        case FULL:
+          PetscCall(UpdateMat_SpinConserve_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case PARITY:
+          PetscCall(UpdateMat_SpinConserve_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+      case SPIN_CONSERVE:
+          PetscCall(UpdateMat_SpinConserve_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case EXPLICIT:
+          PetscCall(UpdateMat_SpinConserve_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
+          break;
+      }
+      break;
+
+    case EXPLICIT:
+      switch (subspaces->right_type) {
+        case FULL:
+          PetscCall(UpdateMat_Explicit_Full(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case PARITY:
+          PetscCall(UpdateMat_Explicit_Parity(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+      case SPIN_CONSERVE:
+          PetscCall(UpdateMat_Explicit_SpinConserve(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        case EXPLICIT:
+	  PetscCall(UpdateMat_Explicit_Explicit(msc, subspaces->left_data, subspaces->right_data, shell, A));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
+          break;
+      }
+      break;
+
+    case MOMENTUM:
+      PetscCall(UpdateMat_Momentum_Momentum(msc, subspaces->left_data, subspaces->right_data, shell, A));
+      break;
+  }
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_UPDATE_MAT], A, 0, 0, 0));
+  return 0;
+}
+
+/*
+ * Without a norm to compute, we short-circuit some of these because they always return a
+ * particular value
+ */
+PetscErrorCode AnalyzeOperator(const msc_t *msc, subspaces_t *subspaces, PetscInt *result, PetscReal *nrm)
 {
+  PetscCall(RegisterEvents());
+
+  if (subspaces->left_type == MOMENTUM || subspaces->right_type == MOMENTUM) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_SUP,
+            "Conservation of Momentum subspaces is checked by translating the operator.");
+  }
+
+  /* when the outgoing subspace is FULL, it is always conserved */
+  if (!nrm && subspaces->left_type == FULL) {
+    *result = 1;
+    return 0;
+  }
+
+  /* always fails to go from full to anything else (but Explicit might hold every state) */
+  if (!nrm && subspaces->right_type == FULL && subspaces->left_type != EXPLICIT) {
+    *result = 0;
+    return 0;
+  }
+
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_CHECK_CONSERVES], 0, 0, 0, 0));
+
   switch (subspaces->left_type) {
 
-    /* when the outgoing subspace is FULL, it is always conserved */
     case FULL:
       switch (subspaces->right_type) {
         case FULL:
-          *result = 1;
+          PetscCall(AnalyzeOperator_Full_Full(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case PARITY:
-          *result = 1;
+          PetscCall(AnalyzeOperator_Full_Parity(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case SPIN_CONSERVE:
-          *result = 1;
+          PetscCall(AnalyzeOperator_Full_SpinConserve(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case EXPLICIT:
-          *result = 1;
+          PetscCall(AnalyzeOperator_Full_Explicit(msc, subspaces->left_data, subspaces->right_data, result, nrm));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
@@ -254,19 +576,22 @@ PetscErrorCode CheckConserves(const msc_t *msc, subspaces_t *subspaces, PetscInt
     case PARITY:
       switch (subspaces->right_type) {
         case FULL:
-	  *result = 0; /* always fails to go from full to anything else */
+          PetscCall(AnalyzeOperator_Parity_Full(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case PARITY:
-          PetscCall(CheckConserves_Parity_Parity(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_Parity_Parity(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case SPIN_CONSERVE:
-          PetscCall(CheckConserves_Parity_SpinConserve(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_Parity_SpinConserve(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case EXPLICIT:
-          PetscCall(CheckConserves_Parity_Explicit(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_Parity_Explicit(msc, subspaces->left_data, subspaces->right_data, result, nrm));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
@@ -274,19 +599,22 @@ PetscErrorCode CheckConserves(const msc_t *msc, subspaces_t *subspaces, PetscInt
     case SPIN_CONSERVE:
       switch (subspaces->right_type) {
         case FULL:
-	  *result = 0; /* always fails to go from full to anything else */
+          PetscCall(AnalyzeOperator_SpinConserve_Full(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case PARITY:
-          PetscCall(CheckConserves_SpinConserve_Parity(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_SpinConserve_Parity(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case SPIN_CONSERVE:
-          PetscCall(CheckConserves_SpinConserve_SpinConserve(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_SpinConserve_SpinConserve(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case EXPLICIT:
-          PetscCall(CheckConserves_SpinConserve_Explicit(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_SpinConserve_Explicit(msc, subspaces->left_data, subspaces->right_data, result, nrm));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
@@ -294,23 +622,421 @@ PetscErrorCode CheckConserves(const msc_t *msc, subspaces_t *subspaces, PetscInt
     case EXPLICIT:
       switch (subspaces->right_type) {
         case FULL:
-          PetscCall(CheckConserves_Explicit_Full(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_Explicit_Full(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case PARITY:
-          PetscCall(CheckConserves_Explicit_Parity(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_Explicit_Parity(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case SPIN_CONSERVE:
-          PetscCall(CheckConserves_Explicit_SpinConserve(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_Explicit_SpinConserve(msc, subspaces->left_data, subspaces->right_data, result, nrm));
           break;
 
         case EXPLICIT:
-	  PetscCall(CheckConserves_Explicit_Explicit(msc, subspaces->left_data, subspaces->right_data, result));
+          PetscCall(AnalyzeOperator_Explicit_Explicit(msc, subspaces->left_data, subspaces->right_data, result, nrm));
+          break;
+
+        default:  /* MOMENTUM, which is ruled out above */
           break;
       }
       break;
+
+    default:
+      break;
   }
 
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_CHECK_CONSERVES], 0, 0, 0, 0));
+  return 0;
+}
+
+PetscErrorCode CheckConserves(const msc_t *msc, subspaces_t *subspaces, PetscInt *result)
+{
+  PetscCall(AnalyzeOperator(msc, subspaces, result, NULL));
+  return 0;
+}
+
+PetscErrorCode SetShellNorm(Mat A, PetscReal nrm)
+{
+  PetscBool is_shell;
+  shell_context *ctx;
+
+  PetscCall(PetscObjectTypeCompare((PetscObject)A, MATSHELL, &is_shell));
+  if (!is_shell) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_WRONG, "Only shell matrices keep a norm.");
+  }
+
+  PetscCall(MatShellGetContext(A, &ctx));
+  ctx->nrm = nrm;
+  return 0;
+}
+
+/*
+ * Get the number of OpenMP threads to use for CPU shell matrix multiplication.
+ * Can be set at runtime with the option -dnm_shell_threads; otherwise the OpenMP
+ * default is used (e.g. from OMP_NUM_THREADS). The value is made consistent across
+ * ranks, since the fast matvec relies on all ranks making the same number of
+ * collective calls.
+ */
+PetscErrorCode GetShellThreads(PetscInt *nthreads)
+{
+  PetscInt local_nthreads;
+
+#if defined(PETSC_HAVE_OPENMP)
+  local_nthreads = omp_get_max_threads();
+#else
+  local_nthreads = 1;
+#endif
+
+  PetscCall(PetscOptionsGetInt(NULL, NULL, "-dnm_shell_threads", &local_nthreads, NULL));
+
+  if (local_nthreads < 1) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE, "-dnm_shell_threads must be at least 1");
+  }
+
+#if !defined(PETSC_HAVE_OPENMP)
+  /* can't do anything about it if we weren't built with OpenMP */
+  local_nthreads = 1;
+#endif
+
+  PetscCallMPI(MPI_Allreduce(&local_nthreads, nthreads, 1, MPIU_INT, MPI_MIN, PETSC_COMM_WORLD));
+
+  return 0;
+}
+
+/*
+ * The number of entries of a vector of global size N that are owned by this rank. This is
+ * the same as PetscSplitOwnership, except when N is a power of two but the number of ranks
+ * is not. In that case the vector is cut into aligned power-of-two blocks, which are dealt
+ * out as evenly as possible, so that each rank's range is still a union of aligned blocks
+ * and the fast Full/Parity matvec can be used.
+ */
+PetscErrorCode SplitOwnership(PetscInt N, PetscInt *n)
+{
+  int mpi_size, mpi_rank;
+  PetscInt n_blocks, block_size;
+
+  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
+  PetscCallMPI(MPI_Comm_rank(PETSC_COMM_WORLD, &mpi_rank));
+
+  if (N > 0 && (N & (N-1)) == 0 && (mpi_size & (mpi_size-1)) != 0 &&
+      N >= OWNERSHIP_BLOCKS_PER_RANK*mpi_size) {
+    /* the smallest power of two that gives every rank at least OWNERSHIP_BLOCKS_PER_RANK blocks */
+    n_blocks = 1;
+    while (n_blocks < OWNERSHIP_BLOCKS_PER_RANK*mpi_size) n_blocks <<= 1;
+    block_size = N / n_blocks;
+
+    *n = block_size * (n_blocks/mpi_size + (mpi_rank < n_blocks%mpi_size));
+  }
+  else {
+    *n = PETSC_DECIDE;
+    PetscCall(PetscSplitOwnership(PETSC_COMM_WORLD, n, &N));
+  }
+
+  return 0;
+}
+
+/* a growable open-addressing set of states, used to deduplicate states in ComputeAuto */
+typedef struct _state_set {
+  PetscInt hash_bits;
+  PetscInt size;
+  PetscInt *slots;  // empty slots hold -1
+} state_set;
+
+static PetscErrorCode StateSetCreate(state_set *set)
+{
+  PetscInt i;
+
+  set->hash_bits = 10;
+  set->size = 0;
+  PetscCall(PetscMalloc1(((PetscInt)1) << set->hash_bits, &(set->slots)));
+  for (i = 0; i < (((PetscInt)1) << set->hash_bits); ++i) {
+    set->slots[i] = -1;
+  }
+  return 0;
+}
+
+static PetscErrorCode StateSetDestroy(state_set *set)
+{
+  PetscCall(PetscFree(set->slots));
+  return 0;
+}
+
+/* insert state into the set, and report whether it was not there already */
+static PetscErrorCode StateSetInsert(state_set *set, PetscInt state, PetscBool *added)
+{
+  PetscInt i, slot, slot_mask, old_n_slots;
+  PetscInt *old_slots;
+  PetscBool dummy;
+
+  /* keep the load factor at most 1/2 */
+  if (2*(set->size+1) > (((PetscInt)1) << set->hash_bits)) {
+    old_slots = set->slots;
+    old_n_slots = ((PetscInt)1) << set->hash_bits;
+
+    set->hash_bits++;
+    set->size = 0;
+    PetscCall(PetscMalloc1(((PetscInt)1) << set->hash_bits, &(set->slots)));
+    for (i = 0; i < (((PetscInt)1) << set->hash_bits); ++i) {
+      set->slots[i] = -1;
+    }
+
+    for (i = 0; i < old_n_slots; ++i) {
+      if (old_slots[i] != -1) {
+        PetscCall(StateSetInsert(set, old_slots[i], &dummy));
+      }
+    }
+    PetscCall(PetscFree(old_slots));
+  }
+
+  slot_mask = (((PetscInt)1) << set->hash_bits) - 1;
+  slot = EXPLICIT_HASH(state, set->hash_bits);
+  while (set->slots[slot] != -1) {
+    if (set->slots[slot] == state) {
+      *added = PETSC_FALSE;
+      return 0;
+    }
+    slot = (slot+1) & slot_mask;
+  }
+
+  set->slots[slot] = state;
+  set->size++;
+  *added = PETSC_TRUE;
+  return 0;
+}
+
+/* the rank responsible for deduplicating a state. uses a different multiplier than
+ * EXPLICIT_HASH, so that the states owned by one rank don't all collide in its set */
+#define AUTO_OWNER(state, mpi_size) \
+  ((PetscMPIInt)(((((uint64_t)(state)) * UINT64_C(0xD6E8FEB86659FD93)) >> 32) % (uint64_t)(mpi_size)))
+
+/*
+ * Find all states connected to start by the operator described by msc, with a breadth-first
+ * search distributed across ranks. Each state is owned by one rank (chosen by hashing it),
+ * which is the only one that keeps track of whether it has been seen. At each level of the
+ * search, the ranks expand the frontier states that they own (in parallel over threads),
+ * and send the resulting states to their owners, which keep the ones that are new as the
+ * next frontier. So the memory needed for the search scales as dim/nranks, and each level
+ * costs one reduction plus the exchange of the new states.
+ *
+ * The result is by design gathered onto every rank, once the search is done, since the
+ * Explicit subspace built from it holds the full map on each rank anyway: the O(dim) memory
+ * per rank is that of the subspace itself (plus a transient copy during the gather). On
+ * return *state_map, which the caller must free with PetscFree, holds the states ordered by
+ * BFS level and then by value.
+ */
+PetscErrorCode ComputeAuto(const msc_t *msc, PetscInt start, PetscInt *dim, PetscInt **state_map)
+{
+  PetscMPIInt mpi_size, mpi_rank, proc_idx;
+  PetscMPIInt n_owned_mpi, *owned_counts, *owned_displs;
+  PetscMPIInt *send_counts, *send_displs, *recv_counts, *recv_displs;
+  PetscInt n_frontier, n_level, n_neighbors, n_recv, i, mask_idx, term_idx;
+  PetscInt n_levels, levels_capacity, n_owned, owned_capacity, level_idx, offset, start_idx;
+  PetscInt nthreads, state, sign;
+  PetscInt *frontier, *neighbors, *send_buf, *recv_buf;
+  PetscInt *owned, *local_level_counts, *all_level_counts, *level_ends, *gathered;
+  PetscScalar tot_coeff;
+  PetscBool added;
+  state_set seen;
+
+  PetscCall(RegisterEvents());
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_COMPUTE_AUTO], 0, 0, 0, 0));
+
+  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
+  PetscCallMPI(MPI_Comm_rank(PETSC_COMM_WORLD, &mpi_rank));
+
+  /* threads within each rank are controlled by the same option as in the shell matvec */
+  PetscCall(GetShellThreads(&nthreads));
+
+  PetscCall(PetscMalloc1(mpi_size, &owned_counts));
+  PetscCall(PetscMalloc1(mpi_size, &owned_displs));
+  PetscCall(PetscMalloc1(mpi_size, &send_counts));
+  PetscCall(PetscMalloc1(mpi_size, &send_displs));
+  PetscCall(PetscMalloc1(mpi_size, &recv_counts));
+  PetscCall(PetscMalloc1(mpi_size, &recv_displs));
+
+  PetscCall(StateSetCreate(&seen));
+
+  /* the first frontier is just the start state, on its owner */
+  n_frontier = 0;
+  PetscCall(PetscMalloc1(1, &frontier));
+  if (AUTO_OWNER(start, mpi_size) == mpi_rank) {
+    PetscCall(StateSetInsert(&seen, start, &added));
+    frontier[n_frontier++] = start;
+  }
+
+  /* the states we own, level by level, and how many of them are in each level */
+  n_owned = 0;
+  owned_capacity = 1024;
+  PetscCall(PetscMalloc1(owned_capacity, &owned));
+
+  n_levels = 0;
+  levels_capacity = 64;
+  PetscCall(PetscMalloc1(levels_capacity, &local_level_counts));
+
+  while (PETSC_TRUE) {
+
+    /* every rank gets the same n_level, so every rank leaves the loop together */
+    PetscCallMPI(MPI_Allreduce(&n_frontier, &n_level, 1, MPIU_INT, MPI_SUM, PETSC_COMM_WORLD));
+    if (n_level == 0) break;
+
+    if (n_owned + n_frontier > owned_capacity) {
+      while (n_owned + n_frontier > owned_capacity) owned_capacity *= 2;
+      PetscCall(PetscRealloc(owned_capacity*sizeof(PetscInt), &owned));
+    }
+    PetscCall(PetscArraycpy(owned + n_owned, frontier, n_frontier));
+    n_owned += n_frontier;
+
+    if (n_levels == levels_capacity) {
+      levels_capacity *= 2;
+      PetscCall(PetscRealloc(levels_capacity*sizeof(PetscInt), &local_level_counts));
+    }
+    local_level_counts[n_levels++] = n_frontier;
+
+    /* expand the frontier; -1 marks a matrix element that is zero */
+    PetscCall(PetscMalloc1(PetscMax(n_frontier*msc->nmasks, 1), &neighbors));
+
+#if defined(PETSC_HAVE_OPENMP)
+    #pragma omp parallel for schedule(static) num_threads(nthreads) \
+      private(state, mask_idx, term_idx, sign, tot_coeff)
+#endif
+    for (i = 0; i < n_frontier; ++i) {
+      state = frontier[i];
+      for (mask_idx = 0; mask_idx < msc->nmasks; ++mask_idx) {
+        tot_coeff = 0;
+        for (term_idx = msc->mask_offsets[mask_idx]; term_idx < msc->mask_offsets[mask_idx+1]; ++term_idx) {
+          sign = 1 - 2*(builtin_parity(state & msc->signs[term_idx]));
+          tot_coeff += sign * msc->coeffs[term_idx];
+        }
+        neighbors[i*msc->nmasks + mask_idx] = (tot_coeff != 0) ? (state ^ msc->masks[mask_idx]) : -1;
+      }
+    }
+
+    /* drop the zero elements and any duplicates, so each state is sent at most once */
+    n_neighbors = 0;
+    for (i = 0; i < n_frontier*msc->nmasks; ++i) {
+      if (neighbors[i] != -1) {
+        neighbors[n_neighbors++] = neighbors[i];
+      }
+    }
+    PetscCall(PetscSortRemoveDupsInt(&n_neighbors, neighbors));
+
+    /* bucket the states by owner, and exchange them */
+    for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+      send_counts[proc_idx] = 0;
+    }
+    for (i = 0; i < n_neighbors; ++i) {
+      send_counts[AUTO_OWNER(neighbors[i], mpi_size)]++;
+    }
+
+    send_displs[0] = 0;
+    for (proc_idx = 1; proc_idx < mpi_size; ++proc_idx) {
+      send_displs[proc_idx] = send_displs[proc_idx-1] + send_counts[proc_idx-1];
+    }
+
+    PetscCall(PetscMalloc1(PetscMax(n_neighbors, 1), &send_buf));
+    for (i = 0; i < n_neighbors; ++i) {
+      proc_idx = AUTO_OWNER(neighbors[i], mpi_size);
+      send_buf[send_displs[proc_idx]++] = neighbors[i];
+    }
+    for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+      send_displs[proc_idx] -= send_counts[proc_idx];
+    }
+    PetscCall(PetscFree(neighbors));
+
+    PetscCallMPI(MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, PETSC_COMM_WORLD));
+
+    n_recv = 0;
+    for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+      recv_displs[proc_idx] = (PetscMPIInt)n_recv;
+      n_recv += recv_counts[proc_idx];
+    }
+
+    PetscCall(PetscMalloc1(PetscMax(n_recv, 1), &recv_buf));
+    PetscCallMPI(MPI_Alltoallv(send_buf, send_counts, send_displs, MPIU_INT,
+                               recv_buf, recv_counts, recv_displs, MPIU_INT,
+                               PETSC_COMM_WORLD));
+    PetscCall(PetscFree(send_buf));
+
+    /* the states we haven't seen before are the next frontier */
+    PetscCall(PetscFree(frontier));
+    PetscCall(PetscMalloc1(PetscMax(n_recv, 1), &frontier));
+    n_frontier = 0;
+    for (i = 0; i < n_recv; ++i) {
+      PetscCall(StateSetInsert(&seen, recv_buf[i], &added));
+      if (added) {
+        frontier[n_frontier++] = recv_buf[i];
+      }
+    }
+    PetscCall(PetscFree(recv_buf));
+  }
+
+  PetscCall(PetscFree(frontier));
+  PetscCall(StateSetDestroy(&seen));
+
+  /* gather the owned states of every rank, each rank's in order of level */
+  n_owned_mpi = (PetscMPIInt)n_owned;
+  PetscCallMPI(MPI_Allgather(&n_owned_mpi, 1, MPI_INT, owned_counts, 1, MPI_INT, PETSC_COMM_WORLD));
+
+  *dim = 0;
+  for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+    owned_displs[proc_idx] = (PetscMPIInt)(*dim);
+    *dim += owned_counts[proc_idx];
+  }
+
+  PetscCall(PetscMalloc1(*dim, &gathered));
+  PetscCallMPI(MPI_Allgatherv(owned, n_owned_mpi, MPIU_INT,
+                              gathered, owned_counts, owned_displs, MPIU_INT,
+                              PETSC_COMM_WORLD));
+  PetscCall(PetscFree(owned));
+
+  /* every rank went through the same number of levels */
+  PetscCall(PetscMalloc1(n_levels*mpi_size, &all_level_counts));
+  PetscCallMPI(MPI_Allgather(local_level_counts, n_levels, MPIU_INT,
+                             all_level_counts, n_levels, MPIU_INT, PETSC_COMM_WORLD));
+  PetscCall(PetscFree(local_level_counts));
+
+  /* where each level starts in the map; advanced to where it ends as the levels are filled */
+  PetscCall(PetscCalloc1(n_levels, &level_ends));
+  for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+    for (level_idx = 0; level_idx+1 < n_levels; ++level_idx) {
+      level_ends[level_idx+1] += all_level_counts[proc_idx*n_levels + level_idx];
+    }
+  }
+  for (level_idx = 1; level_idx < n_levels; ++level_idx) {
+    level_ends[level_idx] += level_ends[level_idx-1];
+  }
+
+  PetscCall(PetscMalloc1(*dim, state_map));
+  offset = 0;
+  for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+    for (level_idx = 0; level_idx < n_levels; ++level_idx) {
+      n_level = all_level_counts[proc_idx*n_levels + level_idx];
+      PetscCall(PetscArraycpy((*state_map) + level_ends[level_idx], gathered + offset, n_level));
+      level_ends[level_idx] += n_level;
+      offset += n_level;
+    }
+  }
+  PetscCall(PetscFree(gathered));
+  PetscCall(PetscFree(all_level_counts));
+
+  start_idx = 0;
+  for (level_idx = 0; level_idx < n_levels; ++level_idx) {
+    PetscCall(PetscSortInt(level_ends[level_idx] - start_idx, (*state_map) + start_idx));
+    start_idx = level_ends[level_idx];
+  }
+  PetscCall(PetscFree(level_ends));
+
+  PetscCall(PetscFree(owned_counts));
+  PetscCall(PetscFree(owned_displs));
+  PetscCall(PetscFree(send_counts));
+  PetscCall(PetscFree(send_displs));
+  PetscCall(PetscFree(recv_counts));
+  PetscCall(PetscFree(recv_displs));
+
+  /* the gathered map, on every rank */
+  DNM_LOG_BYTES(EVENT_COMPUTE_AUTO, (*dim)*sizeof(PetscInt));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_COMPUTE_AUTO], 0, 0, 0, 0));
   return 0;
 }
@@ -1,12 +1,24 @@
 #pragma once
 
 #include <slepcmfn.h>
+#include <petscblaslapack.h>
 #include "bsubspace_impl.h"
 #include "shell_context.h"
+#include "log_events.h"
+
+#if defined(PETSC_HAVE_OPENMP)
+  #include <omp.h>
+#endif
 
 /* allow us to set many values at once */
 #define BLOCK_SIZE 2048
 
+/* minimum number of aligned blocks per rank in SplitOwnership; bounds the load imbalance */
+#define OWNERSHIP_BLOCKS_PER_RANK 16
+
+/* bytes per cache line, for keeping per-thread data on separate lines */
+#define CACHE_LINE_SIZE 64
+
 #define intmin(a,b) ((a)^(((a)^(b))&(((a)<(b))-1)))
 
 #ifdef PETSC_USE_64BIT_INDICES
@@ -29,18 +41,81 @@
   #define DNM_PETSC_CUDA 0
 #endif
 
+#ifdef PETSC_USE_REAL_SINGLE
+  #define DNM_PETSC_SINGLE 1
+#else
+  #define DNM_PETSC_SINGLE 0
+#endif
+
+/*
+ * The shell matvecs accumulate matrix elements and row sums in accum_t (with real part type
+ * accum_real). With single precision PETSc these are double precision, so that only the
+ * vectors are stored, and streamed through memory, at reduced precision.
+ */
+#if defined(PETSC_USE_REAL_SINGLE)
+  typedef double accum_real;
+  #if defined(PETSC_USE_COMPLEX)
+    typedef double _Complex accum_t;
+  #else
+    typedef double accum_t;
+  #endif
+#else
+  typedef PetscReal accum_real;
+  typedef PetscScalar accum_t;
+#endif
+
 #define TERM_REAL(mask, sign) (!(builtin_parity((mask) & (sign))))
 
+/* binary search for a global column index in the sorted ghost list; -1 if absent */
+static inline PetscInt FindGhost(PetscInt col_idx, PetscInt n_ghosts, const PetscInt* ghost_cols)
+{
+  PetscInt lo = 0, hi = n_ghosts, mid;
+  while (lo < hi) {
+    mid = lo + (hi-lo)/2;
+    if (ghost_cols[mid] < col_idx) lo = mid+1;
+    else hi = mid;
+  }
+  return (lo < n_ghosts && ghost_cols[lo] == col_idx) ? lo : -1;
+}
+
 typedef enum _shell_impl {
   NO_SHELL,
   CPU_SHELL,
-  GPU_SHELL
+  GPU_SHELL,
+  CPU_SHELL_MASK_DIAG   /* CPU shell that also stores the summed coefficients along each mask */
 } shell_impl;
 
-PetscErrorCode BuildMat(const msc_t *msc, subspaces_t *subspaces, shell_impl shell, Mat *A);
+/* half_storage: store only the upper triangle of a Hermitian matrix (non-shell only; the
+ * subspaces must be identical) */
+PetscErrorCode BuildMat(const msc_t *msc, subspaces_t *subspaces, shell_impl shell,
+                        PetscBool half_storage, Mat *A);
+
+/* rewrite the values of a matrix from BuildMat in place; the masks and signs of msc must be
+ * the ones it was built with, only the coefficients may differ */
+PetscErrorCode UpdateMat(const msc_t *msc, subspaces_t *subspaces, shell_impl shell, Mat A);
 
 PetscErrorCode CheckConserves(const msc_t *msc, subspaces_t *subspaces, PetscInt *result);
 
+/*
+ * CheckConserves, also computing in the same sweep (if nrm is not NULL) the bound on the
+ * infinity norm that shell matrices report from MatNorm. The bound is only that of the
+ * matrix when the subspaces are identical.
+ */
+PetscErrorCode AnalyzeOperator(const msc_t *msc, subspaces_t *subspaces, PetscInt *result,
+                               PetscReal *nrm);
+
+/* give a shell matrix the norm it should report, e.g. from AnalyzeOperator */
+PetscErrorCode SetShellNorm(Mat A, PetscReal nrm);
+
+/* the number of threads each rank should use in the CPU shell matvec */
+PetscErrorCode GetShellThreads(PetscInt *nthreads);
+
+/* the local size of a vector of global size N, which all vectors and matrices must agree on */
+PetscErrorCode SplitOwnership(PetscInt N, PetscInt *n);
+
+/* find the states connected to start by the operator, with a BFS distributed across ranks */
+PetscErrorCode ComputeAuto(const msc_t *msc, PetscInt start, PetscInt *dim, PetscInt **state_map);
+
 /* define a type for context destroying functions, and we keep that in the context */
 // TODO
 
@@ -50,6 +125,32 @@ PetscErrorCode BuildContext(const msc_t *msc,
                             shell_context **ctx_p);
 PetscErrorCode DestroyContext(Mat A);
 
+/*
+ * Compute the expectation values in vec of n_ops operators stored back to back in msc, with
+ * the masks of operator k at indices op_offsets[k] to op_offsets[k+1].
+ */
+PetscErrorCode ExpectationValues(
+  const msc_t *msc,
+  PetscInt n_ops,
+  const PetscInt* op_offsets,
+  PetscInt sub_type,
+  void* sub_data_p,
+  Vec vec,
+  PetscScalar* values
+);
+
+#if defined(PETSC_HAVE_CUDA)
+/*
+ * Add to partial (on the host) the reduced density matrix contribution of amplitudes gathered
+ * into the device vector x_local, as listed by rdm_gather_indices. If dense is true, every
+ * group has all keep_dim keep states in order, as for the Full subspace. partial is
+ * keep_dim x keep_dim. Defined in bcuda_impl.cu.
+ */
+PetscErrorCode RDMAccumulate_GPU(Vec x_local, PetscInt tr_local, PetscInt keep_dim,
+                                 const PetscInt* keep_states, const PetscInt* offsets,
+                                 PetscBool dense, PetscScalar* partial);
+#endif
+
 PetscErrorCode ReducedDensityMatrix(
   Vec vec,
   PetscInt sub_type,
@@ -5,6 +5,9 @@
 
 #include "bpetsc_template_1.h"
 
+/* the basis states of Momentum are not product states, so it has no reduced density matrices */
+#if C(SUBSPACE,SP) != Momentum_SP
+
 /*
  * this function is actually the same for all subspaces but
  * I keep it here for organizational purposes
@@ -51,40 +54,155 @@ static inline PetscInt C(combine_states,SUBSPACE)(
   return rtn;
 }
 
-void C(fill_combine_array,SUBSPACE)(
-  PetscInt tr_state,
+/*
+ * List the basis indices whose amplitudes the trace over tr_start <= tr_state < tr_end needs,
+ * grouped by tr_state (the group for tr_start+t is offsets[t] to offsets[t+1]), along with
+ * the keep state of each. Full states that are not in the subspace are skipped.
+ */
+PetscErrorCode C(rdm_gather_indices,SUBSPACE)(
+  PetscInt tr_start,
+  PetscInt tr_end,
   PetscInt keep_size,
   const C(data,SUBSPACE)* sub_data_p,
   const PetscInt* keep,
-  const PetscScalar *x_array,
-  PetscInt *state_array,
-  PetscScalar *combine_array,
-  PetscInt* n_filled_p)
+  PetscInt* n_p,
+  PetscInt** indices_p,
+  PetscInt** keep_states_p,
+  PetscInt** offsets_p)
 {
-  PetscInt keep_dim, keep_state, full_state;
-  PetscInt idx;
+  PetscInt keep_dim, keep_state, tr_state, full_state;
+  PetscInt idx, n, capacity;
+
+  keep_dim = ((PetscInt)1)<<keep_size;
+
+  capacity = PetscMax((tr_end-tr_start)*keep_dim, 1);
+#if C(SUBSPACE,SP) != Full_SP
+  /* most full states are not in the subspace; start smaller and grow as needed */
+  capacity = PetscMax(PetscMin(capacity, C(Dim,SUBSPACE)(sub_data_p)), 1);
+#endif
+  PetscCall(PetscMalloc1(capacity, indices_p));
+  PetscCall(PetscMalloc1(capacity, keep_states_p));
+  PetscCall(PetscMalloc1(tr_end-tr_start+1, offsets_p));
 
-  keep_dim = 1<<keep_size;
-  *n_filled_p = 0;
-  for (keep_state=0; keep_state<keep_dim; ++keep_state) {
-    full_state = C(combine_states,SUBSPACE)(keep_state, tr_state, keep, keep_size, sub_data_p->L);
+  n = 0;
+  for (tr_state = tr_start; tr_state < tr_end; ++tr_state) {
+    (*offsets_p)[tr_state-tr_start] = n;
+    for (keep_state = 0; keep_state < keep_dim; ++keep_state) {
+      full_state = C(combine_states,SUBSPACE)(keep_state, tr_state, keep, keep_size, sub_data_p->L);
 
 #if C(SUBSPACE,SP) == SpinConserve_SP
-    idx = C(S2I,SUBSPACE)(full_state, NULL, sub_data_p);
+      idx = C(S2I,SUBSPACE)(full_state, NULL, sub_data_p);
+#else
+      idx = C(S2I,SUBSPACE)(full_state, sub_data_p);
+#endif
+
+      if (idx == -1) continue;
+
+      if (n == capacity) {
+        capacity *= 2;
+        PetscCall(PetscRealloc(capacity*sizeof(PetscInt), indices_p));
+        PetscCall(PetscRealloc(capacity*sizeof(PetscInt), keep_states_p));
+      }
+      (*indices_p)[n] = idx;
+      (*keep_states_p)[n] = keep_state;
+      ++n;
+    }
+  }
+  (*offsets_p)[tr_end-tr_start] = n;
+  *n_p = n;
+
+  return 0;
+}
+
+#undef  __FUNCT__
+#define __FUNCT__ "rdm_accumulate"
+/*
+ * Add the contribution of the gathered amplitudes (grouped as in rdm_gather_indices) to
+ * the row-major rtn_dim x rtn_dim matrix partial.
+ */
+PetscErrorCode C(rdm_accumulate,SUBSPACE)(
+  const PetscScalar* x_array,
+  PetscInt tr_local,
+  const PetscInt* keep_states,
+  const PetscInt* offsets,
+  PetscInt rtn_dim,
+  PetscScalar* partial
+){
+  PetscInt i;
+
+#if C(SUBSPACE,SP) == Full_SP
+  PetscBLASInt blas_dim, blas_k;
+  PetscScalar one = 1, zero = 0;
+
+  /*
+   * every keep state is present for every traced state, so x_array is the keep_dim x tr
+   * matrix X in column-major order, and the result is X X^H. that is computed by BLAS into
+   * column-major storage, i.e. transposed, which for a Hermitian matrix is the conjugate
+   */
+  if (tr_local == 0) return 0;
+
+  PetscCall(PetscBLASIntCast(rtn_dim, &blas_dim));
+  PetscCall(PetscBLASIntCast(tr_local, &blas_k));
+  PetscStackCallBLAS("BLASgemm", BLASgemm_("N", "C", &blas_dim, &blas_dim, &blas_k,
+    &one, x_array, &blas_dim, x_array, &blas_dim, &zero, partial, &blas_dim));
+#if defined(PETSC_USE_COMPLEX)
+  for (i=0; i<rtn_dim*rtn_dim; ++i) {
+    partial[i] = PetscConj(partial[i]);
+  }
+#endif
+
+#else
+  PetscInt j, t, offset, nthreads, thread_idx;
+  PetscScalar a, *thread_rtn, *thread_partial;
+
+  /* each thread past the first accumulates into its own copy, and those are summed at the end */
+  PetscCall(GetShellThreads(&nthreads));
+  PetscCall(PetscCalloc1(PetscMax((nthreads-1)*rtn_dim*rtn_dim, 1), &thread_rtn));
+
+#if defined(PETSC_HAVE_OPENMP)
+  #pragma omp parallel num_threads(nthreads) private(thread_idx, thread_partial, t, i, j, offset, a)
+#endif
+  {
+#if defined(PETSC_HAVE_OPENMP)
+    thread_idx = omp_get_thread_num();
 #else
-    idx = C(S2I,SUBSPACE)(full_state, sub_data_p);
+    thread_idx = 0;
 #endif
+    thread_partial = (thread_idx == 0) ? partial : thread_rtn + (thread_idx-1)*rtn_dim*rtn_dim;
 
-    if (idx != -1) {
-      state_array[*n_filled_p] = keep_state;
-      combine_array[*n_filled_p] = x_array[idx];
-      ++(*n_filled_p);
+#if defined(PETSC_HAVE_OPENMP)
+    #pragma omp for schedule(dynamic, 256)
+#endif
+    for (t = 0; t < tr_local; ++t) {
+      for (i = offsets[t]; i < offsets[t+1]; ++i) {
+        offset = keep_states[i]*rtn_dim;
+        a = x_array[i];
+        for (j = offsets[t]; j < offsets[t+1]; ++j) {
+          thread_partial[offset + keep_states[j]] += a*PetscConj(x_array[j]);
+        }
+      }
     }
   }
+
+  for (thread_idx = 1; thread_idx < nthreads; ++thread_idx) {
+    for (i=0; i<rtn_dim*rtn_dim; ++i) {
+      partial[i] += thread_rtn[(thread_idx-1)*rtn_dim*rtn_dim + i];
+    }
+  }
+  PetscCall(PetscFree(thread_rtn));
+#endif
+
+  return 0;
 }
 
 #undef  __FUNCT__
 #define __FUNCT__ "rdm"
+/*
+ * The traced-out states are split evenly among the ranks. Each rank fetches the amplitudes
+ * its share needs (about 1/mpi_size of the vector in total) with a single scatter, computes
+ * its part of the sum with its threads (or on the GPU, if the vector is there), and the
+ * parts are summed onto rank 0.
+ */
 PetscErrorCode C(rdm,SUBSPACE)(
   Vec vec,
   const C(data,SUBSPACE)* sub_data_p,
@@ -95,17 +213,17 @@ PetscErrorCode C(rdm,SUBSPACE)(
   PetscScalar* rtn
 ){
 
-  const PetscScalar *v0_array;
-  PetscInt i, j, n_filled, offset;
-  PetscInt tr_state, tr_dim;
+  const PetscScalar *x_array;
+  PetscInt i, n_local;
+  PetscInt tr_dim, tr_start, tr_end, tr_per_rank, tr_extra;
+  PetscInt *indices, *keep_states, *offsets;
   int mpi_size, mpi_rank;
-  PetscScalar a;
-  Vec v0;
+  PetscScalar *partial;
+  PetscBool on_gpu;
+  Vec x_local;
+  IS is;
   VecScatter scat;
 
-  PetscInt *state_array;
-  PetscScalar *combine_array;
-
   for (i=1; i<keep_size; ++i) {
     if (keep[i] <= keep[i-1]) {
       SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_WRONG, "keep array must be strictly increasing");
@@ -115,52 +233,249 @@ PetscErrorCode C(rdm,SUBSPACE)(
   PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
   PetscCallMPI(MPI_Comm_rank(PETSC_COMM_WORLD, &mpi_rank));
 
-  /* scatter to process 0 */
-  /* in the future, perhaps will do this in parallel */
-  /* could be achieved with a round-robin type deal, like we do with MatMult */
-  if (mpi_size > 1) {
-    PetscCall(VecScatterCreateToZero(vec, &scat, &v0));
-    PetscCall(VecScatterBegin(scat, vec, v0, INSERT_VALUES, SCATTER_FORWARD));
-    PetscCall(VecScatterEnd(scat, vec, v0, INSERT_VALUES, SCATTER_FORWARD));
-    PetscCall(VecScatterDestroy(&scat));
+  tr_dim = ((PetscInt)1) << (sub_data_p->L - keep_size);
+  tr_per_rank = tr_dim / mpi_size;
+  tr_extra = tr_dim % mpi_size;
+  tr_start = mpi_rank*tr_per_rank + PetscMin(mpi_rank, tr_extra);
+  tr_end = tr_start + tr_per_rank + (mpi_rank < tr_extra);
+
+  PetscCall(C(rdm_gather_indices,SUBSPACE)(tr_start, tr_end, keep_size, sub_data_p, keep,
+    &n_local, &indices, &keep_states, &offsets));
+
+  /* for GPU vectors, the amplitudes stay on the device and only the result is copied back */
+  PetscCall(PetscObjectTypeCompareAny((PetscObject)vec, &on_gpu, VECSEQCUDA, VECMPICUDA, ""));
+
+  PetscCall(VecCreate(PETSC_COMM_SELF, &x_local));
+  PetscCall(VecSetSizes(x_local, n_local, n_local));
+  PetscCall(VecSetType(x_local, on_gpu ? VECSEQCUDA : VECSEQ));
+  PetscCall(ISCreateGeneral(PETSC_COMM_SELF, n_local, indices, PETSC_USE_POINTER, &is));
+  PetscCall(VecScatterCreate(vec, is, x_local, NULL, &scat));
+  PetscCall(VecScatterBegin(scat, vec, x_local, INSERT_VALUES, SCATTER_FORWARD));
+  PetscCall(VecScatterEnd(scat, vec, x_local, INSERT_VALUES, SCATTER_FORWARD));
+  PetscCall(VecScatterDestroy(&scat));
+  PetscCall(ISDestroy(&is));
+  PetscCall(PetscFree(indices));
+
+  PetscCall(PetscCalloc1(rtn_dim*rtn_dim, &partial));
+
+#if defined(PETSC_HAVE_CUDA)
+  if (on_gpu) {
+    PetscCall(RDMAccumulate_GPU(x_local, tr_end-tr_start, ((PetscInt)1)<<keep_size,
+      keep_states, offsets, (PetscBool)(C(SUBSPACE,SP) == Full_SP), partial));
   }
-  else {
-    v0 = vec;
+  else
+#endif
+  {
+    PetscCall(VecGetArrayRead(x_local, &x_array));
+    PetscCall(C(rdm_accumulate,SUBSPACE)(x_array, tr_end-tr_start, keep_states, offsets,
+      rtn_dim, partial));
+    PetscCall(VecRestoreArrayRead(x_local, &x_array));
   }
 
-  /* we're done if we're rank > 0 */
-  if (mpi_rank > 0) {
-    VecDestroy(&v0);
-    return 0;
+  PetscCall(VecDestroy(&x_local));
+  PetscCall(PetscFree(keep_states));
+  PetscCall(PetscFree(offsets));
+
+  /* rtn is only a placeholder on the other ranks, and is only written on rank 0 */
+  PetscCallMPI(MPI_Reduce(partial, rtn, (PetscMPIInt)(rtn_dim*rtn_dim), MPIU_SCALAR, MPIU_SUM, 0, PETSC_COMM_WORLD));
+
+  PetscCall(PetscFree(partial));
+
+  return 0;
+}
+
+#endif
+
+#undef  __FUNCT__
+#define __FUNCT__ "expectation_values"
+/*
+ * Compute <vec|O_k|vec> for the n_ops operators in msc, where operator k has the masks
+ * op_offsets[k] to op_offsets[k+1]. The operators need not conserve the subspace: since vec
+ * lies in it, dropping the elements that leave it does not change the result. (Except for
+ * Momentum and spin flip subspaces, whose matrix elements assume that the operators commute
+ * with translation or the global flip.)
+ *
+ * The mask == 0 terms only need the local amplitude and a popcount per term. For the others,
+ * the off-process amplitudes any of the operators need are fetched with a single scatter,
+ * and then all of the operators are evaluated in one pass over the local rows.
+ */
+PetscErrorCode C(expectation_values,SUBSPACE)(
+  const msc_t* msc,
+  PetscInt n_ops,
+  const PetscInt* op_offsets,
+  const C(data,SUBSPACE)* sub_data_p,
+  Vec vec,
+  PetscScalar* values
+){
+  PetscInt row_start, row_end, row_idx, col_idx, ket, bra;
+  PetscInt op_idx, mask_idx, term_idx, ghost_idx;
+  PetscInt n_ghosts, capacity, nthreads, thread_idx, stride, line, i;
+  PetscInt *ghost_cols;
+  PetscScalar element, x_row, x_col, *thread_values, *my_values;
+  PetscReal sign;
+  const PetscScalar *x_array, *ghost_array;
+  int mpi_size;
+  IS ghost_is;
+  Vec ghost_vec;
+  VecScatter ghost_scatter;
+
+#if C(SUBSPACE,SP) == SpinConserve_SP
+  PetscInt s2i_sign;
+#elif C(SUBSPACE,SP) == Momentum_SP
+  PetscInt shift;
+#endif
+
+  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
+  PetscCall(VecGetOwnershipRange(vec, &row_start, &row_end));
+
+  /* find the off-process columns, as SetupGhosts does for the shell matrices */
+  n_ghosts = 0;
+  ghost_cols = NULL;
+  ghost_vec = NULL;
+  ghost_scatter = NULL;
+  if (mpi_size > 1) {
+    capacity = PetscMax(row_end-row_start, 1024);
+    PetscCall(PetscMalloc1(capacity, &ghost_cols));
+
+    for (row_idx = row_start; row_idx < row_end; ++row_idx) {
+      ket = C(I2S,SUBSPACE)(row_idx, sub_data_p);
+      for (mask_idx = 0; mask_idx < msc->nmasks; ++mask_idx) {
+        if (msc->masks[mask_idx] == 0) continue;
+
+#if C(SUBSPACE,SP) == SpinConserve_SP || C(SUBSPACE,SP) == Momentum_SP
+        col_idx = C(S2I,SUBSPACE)(ket^msc->masks[mask_idx], NULL, sub_data_p);
+#else
+        col_idx = C(S2I,SUBSPACE)(ket^msc->masks[mask_idx], sub_data_p);
+#endif
+
+        if (col_idx == -1 || (col_idx >= row_start && col_idx < row_end)) continue;
+
+        if (n_ghosts == capacity) {
+          PetscCall(PetscSortRemoveDupsInt(&n_ghosts, ghost_cols));
+          if (2*n_ghosts > capacity) {
+            capacity *= 2;
+            PetscCall(PetscRealloc(capacity*sizeof(PetscInt), &ghost_cols));
+          }
+        }
+        ghost_cols[n_ghosts++] = col_idx;
+      }
+    }
+    PetscCall(PetscSortRemoveDupsInt(&n_ghosts, ghost_cols));
+
+    PetscCall(VecCreateSeq(PETSC_COMM_SELF, n_ghosts, &ghost_vec));
+    PetscCall(ISCreateGeneral(PETSC_COMM_SELF, n_ghosts, ghost_cols, PETSC_USE_POINTER, &ghost_is));
+    PetscCall(VecScatterCreate(vec, ghost_is, ghost_vec, NULL, &ghost_scatter));
+    PetscCall(ISDestroy(&ghost_is));
+    PetscCall(VecScatterBegin(ghost_scatter, vec, ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+    PetscCall(VecScatterEnd(ghost_scatter, vec, ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+    PetscCall(VecScatterDestroy(&ghost_scatter));
+  }
+
+  PetscCall(VecGetArrayRead(vec, &x_array));
+  ghost_array = NULL;
+  if (ghost_vec) {
+    PetscCall(VecGetArrayRead(ghost_vec, &ghost_array));
   }
 
-  PetscCall(VecGetArrayRead(v0, &v0_array));
+  /* each thread's sums take whole cache lines, plus one since the allocation may not be
+   * aligned to a line, so that threads aren't all writing to the same line */
+  line = PetscMax(CACHE_LINE_SIZE/(PetscInt)sizeof(PetscScalar), 1);
+  stride = ((n_ops + line - 1)/line + 1)*line;
+
+  PetscCall(GetShellThreads(&nthreads));
+  PetscCall(PetscCalloc1(nthreads*stride, &thread_values));
+
+#if defined(PETSC_HAVE_OPENMP)
+#if C(SUBSPACE,SP) == SpinConserve_SP
+  #pragma omp parallel num_threads(nthreads) \
+    private(thread_idx, my_values, row_idx, ket, bra, x_row, x_col, op_idx, mask_idx, \
+            term_idx, sign, element, col_idx, ghost_idx, s2i_sign)
+#elif C(SUBSPACE,SP) == Momentum_SP
+  #pragma omp parallel num_threads(nthreads) \
+    private(thread_idx, my_values, row_idx, ket, bra, x_row, x_col, op_idx, mask_idx, \
+            term_idx, sign, element, col_idx, ghost_idx, shift)
+#else
+  #pragma omp parallel num_threads(nthreads) \
+    private(thread_idx, my_values, row_idx, ket, bra, x_row, x_col, op_idx, mask_idx, \
+            term_idx, sign, element, col_idx, ghost_idx)
+#endif
+#endif
+  {
+#if defined(PETSC_HAVE_OPENMP)
+    thread_idx = omp_get_thread_num();
+#else
+    thread_idx = 0;
+#endif
+    my_values = thread_values + thread_idx*stride;
+
+#if defined(PETSC_HAVE_OPENMP)
+    #pragma omp for schedule(static)
+#endif
+    for (row_idx = row_start; row_idx < row_end; ++row_idx) {
+      ket = C(I2S,SUBSPACE)(row_idx, sub_data_p);
+      x_row = x_array[row_idx-row_start];
+
+      for (op_idx = 0; op_idx < n_ops; ++op_idx) {
+        for (mask_idx = op_offsets[op_idx]; mask_idx < op_offsets[op_idx+1]; ++mask_idx) {
+          bra = ket ^ msc->masks[mask_idx];
 
-  PetscCall(PetscMalloc1(1<<keep_size, &state_array));
-  PetscCall(PetscMalloc1(1<<keep_size, &combine_array));
+          element = 0;
+          for (term_idx = msc->mask_offsets[mask_idx]; term_idx < msc->mask_offsets[mask_idx+1]; ++term_idx) {
+            sign = 1 - 2*(builtin_parity(bra & msc->signs[term_idx]));
+            element += sign * msc->coeffs[term_idx];
+          }
 
-  PetscMemzero(rtn, sizeof(PetscScalar)*rtn_dim*rtn_dim);
+          /* diagonal: nothing to look up */
+          if (msc->masks[mask_idx] == 0) {
+            my_values[op_idx] += element * PetscConj(x_row) * x_row;
+            continue;
+          }
 
-  tr_dim = 1 << (sub_data_p->L - keep_size);
-  for (tr_state = 0; tr_state < tr_dim; ++tr_state) {
-    C(fill_combine_array,SUBSPACE)(tr_state, keep_size, sub_data_p, keep,
-      v0_array, state_array, combine_array, &n_filled);
-    for (i=0; i<n_filled; ++i) {
-      offset = state_array[i]*rtn_dim;
-      a = combine_array[i];
-      for (j=0; j<n_filled; ++j) {
-        rtn[offset + state_array[j]] += a*PetscConj(combine_array[j]);
+#if C(SUBSPACE,SP) == SpinConserve_SP
+          col_idx = C(S2I,SUBSPACE)(bra, &s2i_sign, sub_data_p);
+          element *= s2i_sign;
+#elif C(SUBSPACE,SP) == Momentum_SP
+          col_idx = C(S2I,SUBSPACE)(bra, &shift, sub_data_p);
+#else
+          col_idx = C(S2I,SUBSPACE)(bra, sub_data_p);
+#endif
+
+          if (col_idx == -1) continue;
+
+#if C(SUBSPACE,SP) == Momentum_SP
+          element *= ElementFactor_Momentum(row_idx, col_idx, shift, sub_data_p);
+#endif
+
+          if (col_idx >= row_start && col_idx < row_end) {
+            x_col = x_array[col_idx-row_start];
+          }
+          else {
+            ghost_idx = FindGhost(col_idx, n_ghosts, ghost_cols);
+            x_col = ghost_array[ghost_idx];
+          }
+
+          my_values[op_idx] += element * PetscConj(x_row) * x_col;
+        }
       }
     }
   }
 
-  PetscCall(PetscFree(state_array));
-  PetscCall(PetscFree(combine_array));
+  for (op_idx = 0; op_idx < n_ops; ++op_idx) {
+    values[op_idx] = 0;
+    for (i = 0; i < nthreads; ++i) {
+      values[op_idx] += thread_values[i*stride + op_idx];
+    }
+  }
+  PetscCall(PetscFree(thread_values));
 
-  PetscCall(VecRestoreArrayRead(v0, &v0_array));
-  if (mpi_size > 1) {
-    VecDestroy(&v0);
+  PetscCall(VecRestoreArrayRead(vec, &x_array));
+  if (ghost_vec) {
+    PetscCall(VecRestoreArrayRead(ghost_vec, &ghost_array));
+    PetscCall(VecDestroy(&ghost_vec));
   }
+  PetscCall(PetscFree(ghost_cols));
+
+  PetscCallMPI(MPI_Allreduce(MPI_IN_PLACE, values, (PetscMPIInt)n_ops, MPIU_SCALAR, MPIU_SUM, PETSC_COMM_WORLD));
 
   return 0;
 }
@@ -2,6 +2,7 @@
 #define CONCAT_U(a, b) a ## _ ## b
 #define C(a, b) CONCAT_U(a, b)
 
+#if C(SUBSPACE,SP) != Momentum_SP
 /*
  * This function is called to build any matrix.
  */
@@ -14,3 +15,16 @@ PetscErrorCode C(rdm,SUBSPACE)(
   PetscInt rtn_dim,
   PetscScalar* rtn
 );
+#endif
+
+/*
+ * Compute the expectation values of several operators in the state vec at once.
+ */
+PetscErrorCode C(expectation_values,SUBSPACE)(
+  const msc_t* msc,
+  PetscInt n_ops,
+  const PetscInt* op_offsets,
+  const C(data,SUBSPACE)* sub_data_p,
+  Vec vec,
+  PetscScalar* values
+);
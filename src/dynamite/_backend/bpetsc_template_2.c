@@ -16,16 +16,17 @@ PetscErrorCode C(BuildMat,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const void* left_subspace_data,
   const void* right_subspace_data,
   shell_impl shell,
+  PetscBool half_storage,
   Mat *A)
 {
   PetscErrorCode ierr;
   if (shell == NO_SHELL) {
     ierr = C(BuildPetsc,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
-      msc, left_subspace_data, right_subspace_data, A);
+      msc, left_subspace_data, right_subspace_data, half_storage, A);
   }
-  else if (shell == CPU_SHELL) {
+  else if (shell == CPU_SHELL || shell == CPU_SHELL_MASK_DIAG) {
     ierr = C(BuildCPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
-      msc, left_subspace_data, right_subspace_data, A);
+      msc, left_subspace_data, right_subspace_data, shell == CPU_SHELL_MASK_DIAG, A);
   }
 #if PETSC_HAVE_CUDA
   else if (shell == GPU_SHELL) {
@@ -39,44 +40,90 @@ PetscErrorCode C(BuildMat,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   return ierr;
 }
 
+#undef  __FUNCT__
+#define __FUNCT__ "UpdateMat"
+PetscErrorCode C(UpdateMat,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  const void* left_subspace_data,
+  const void* right_subspace_data,
+  shell_impl shell,
+  Mat A)
+{
+  PetscErrorCode ierr;
+  if (shell == NO_SHELL) {
+    ierr = C(UpdatePetsc,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+      msc, left_subspace_data, right_subspace_data, A);
+  }
+  else if (shell == CPU_SHELL || shell == CPU_SHELL_MASK_DIAG) {
+    ierr = C(UpdateCPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(msc, A);
+  }
+#if PETSC_HAVE_CUDA
+  else if (shell == GPU_SHELL) {
+    ierr = C(UpdateGPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(msc, A);
+  }
+#endif
+  else {
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_UNKNOWN_TYPE, "Invalid shell implementation type.");
+  }
+  return ierr;
+}
+
 #undef  __FUNCT__
 #define __FUNCT__ "BuildPetsc"
 PetscErrorCode C(BuildPetsc,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const msc_t *msc,
   const void* left_subspace_data,
   const void* right_subspace_data,
+  PetscBool half_storage,
   Mat *A)
 {
-  PetscInt M, N, row_start, row_end, col_start;
-  PetscInt mask_idx, term_idx, row_count;
+  PetscInt M, N, m, n;
   int mpi_size;
   PetscInt *diag_nonzeros, *offdiag_nonzeros;
 
-  PetscInt row_idx, ket, col_idx, bra, sign;
-  PetscScalar value;
-
-#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
-  PetscInt s2i_sign;
-#endif
-
   PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
 
   /* N is dimension of right subspace, M of left */
   M = C(Dim,LEFT_SUBSPACE)(left_subspace_data);
   N = C(Dim,RIGHT_SUBSPACE)(right_subspace_data);
 
+  if (half_storage && M != N) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_WRONG,
+            "Half storage requires the left and right subspaces to be the same.");
+  }
+
+  PetscCall(SplitOwnership(M, &m));
+  PetscCall(SplitOwnership(N, &n));
+
+  /* a first pass over the rows finds just their columns, for exact preallocation */
+  PetscCall(PetscCalloc1(m, &diag_nonzeros));
+  PetscCall(PetscCalloc1(m, &offdiag_nonzeros));
+  PetscCall(C(ComputeRows,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
+	    (m, n, msc, half_storage, NULL, diag_nonzeros, offdiag_nonzeros,
+	     left_subspace_data, right_subspace_data));
+
   /* create matrix */
   PetscCall(MatCreate(PETSC_COMM_WORLD, A));
-  PetscCall(MatSetSizes(*A, PETSC_DECIDE, PETSC_DECIDE, M, N));
+  PetscCall(MatSetSizes(*A, m, n, M, N));
   PetscCall(MatSetFromOptions(*A));
 
+  /* the elements we set below only make sense in SBAIJ format, so don't let options override it */
+  if (half_storage) {
+    PetscCall(MatSetType(*A, MATSBAIJ));
+  }
+
   /* TODO: we only should call these preallocation routines if matrix type is aij */
   /* preallocate memory */
-  PetscCall(C(ComputeNonzeros,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
-	    (M, N, msc, &diag_nonzeros, &offdiag_nonzeros,
-	     left_subspace_data, right_subspace_data));
-
-  if (mpi_size == 1) {
+  if (half_storage) {
+    if (mpi_size == 1) {
+      PetscCall(MatSeqSBAIJSetPreallocation(*A, 1, 0, diag_nonzeros));
+    }
+    else {
+      PetscCall(MatMPISBAIJSetPreallocation(*A, 1, 0, diag_nonzeros,
+                                            0, offdiag_nonzeros));
+    }
+  }
+  else if (mpi_size == 1) {
     PetscCall(MatSeqAIJSetPreallocation(*A, 0, diag_nonzeros));
   }
   else {
@@ -84,77 +131,93 @@ PetscErrorCode C(BuildPetsc,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
                                      0, offdiag_nonzeros));
   }
 
-  /* this memory is allocated in ComputeNonzeros */
   PetscCall(PetscFree(diag_nonzeros));
   PetscCall(PetscFree(offdiag_nonzeros));
 
-  /* compute matrix elements */
+  /* the second pass computes the elements, inserting each row straight into the matrix */
   PetscCall(MatSetOption(*A, MAT_NO_OFF_PROC_ENTRIES, PETSC_TRUE));
-  PetscCall(MatGetOwnershipRange(*A, &row_start, &row_end));
-  PetscCall(MatGetOwnershipRangeColumn(*A, &col_start, NULL));
-
-  for (row_idx = row_start; row_idx < row_end; ++row_idx) {
-
-    /* each term looks like value*|ket><bra| */
-    ket = C(I2S,LEFT_SUBSPACE)(row_idx, left_subspace_data);
+  PetscCall(C(ComputeRows,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
+	    (m, n, msc, half_storage, *A, NULL, NULL,
+	     left_subspace_data, right_subspace_data));
 
-    row_count = 0;
-    for (mask_idx = 0; mask_idx < msc->nmasks; mask_idx++) {
-      bra = ket ^ msc->masks[mask_idx];
+  PetscCall(MatAssemblyBegin(*A,MAT_FINAL_ASSEMBLY));
+  PetscCall(MatAssemblyEnd(*A,MAT_FINAL_ASSEMBLY));
 
-#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
-      col_idx = C(S2I,RIGHT_SUBSPACE)(bra, &s2i_sign, right_subspace_data);
+  /* SBAIJ assumes the matrix is symmetric unless told otherwise */
+  if (half_storage) {
+#if defined(PETSC_USE_COMPLEX)
+    PetscCall(MatSetOption(*A, MAT_HERMITIAN, PETSC_TRUE));
 #else
-      col_idx = C(S2I,RIGHT_SUBSPACE)(bra, right_subspace_data);
+    PetscCall(MatSetOption(*A, MAT_SYMMETRIC, PETSC_TRUE));
 #endif
-      if (col_idx == -1) {
-        continue;
-      }
+    PetscCall(MatSetOption(*A, MAT_SYMMETRY_ETERNAL, PETSC_TRUE));
+  }
 
-      /* sum all terms for this matrix element */
-      value = 0;
-      for (term_idx = msc->mask_offsets[mask_idx]; term_idx < msc->mask_offsets[mask_idx+1]; ++term_idx) {
-        sign = 1 - 2*(builtin_parity(bra & msc->signs[term_idx]));
-        value += sign * msc->coeffs[term_idx];
-      }
+  return 0;
 
-#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
-      value *= s2i_sign;
-#endif
+}
 
-      row_count++;
-      PetscCall(MatSetValue(*A, row_idx, col_idx, value, ADD_VALUES));
-    }
+#undef  __FUNCT__
+#define __FUNCT__ "UpdatePetsc"
+PetscErrorCode C(UpdatePetsc,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  const void* left_subspace_data,
+  const void* right_subspace_data,
+  Mat A)
+{
+  PetscInt m, n;
+  PetscBool half_storage;
 
-    /* workaround for a bug in PETSc that triggers if there are empty rows */
-    if (row_count == 0) {
-      PetscCall(MatSetValue(*A, row_idx, col_start, 0, ADD_VALUES));
-    }
-  }
+  PetscCall(MatGetLocalSize(A, &m, &n));
+  PetscCall(PetscObjectTypeCompareAny((PetscObject)A, &half_storage, MATSEQSBAIJ, MATMPISBAIJ, ""));
 
-  PetscCall(MatAssemblyBegin(*A,MAT_FINAL_ASSEMBLY));
-  PetscCall(MatAssemblyEnd(*A,MAT_FINAL_ASSEMBLY));
+  /*
+   * the matrix is already preallocated, so there is no counting pass.
+   * zero everything first, so that elements which cancel for the new coefficients don't
+   * keep their old values. conversely, elements that cancelled at build time were never
+   * stored, so let the pattern grow if one of them shows up now
+   */
+  PetscCall(MatZeroEntries(A));
+  PetscCall(MatSetOption(A, MAT_NEW_NONZERO_ALLOCATION_ERR, PETSC_FALSE));
+  PetscCall(C(ComputeRows,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
+	    (m, n, msc, half_storage, A, NULL, NULL,
+	     left_subspace_data, right_subspace_data));
 
-  return 0;
+  PetscCall(MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY));
+  PetscCall(MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY));
 
+  return 0;
 }
 
 #undef  __FUNCT__
-#define __FUNCT__ "ComputeNonzeros"
+#define __FUNCT__ "ComputeRows"
 /*
- * Compute the number of diagonal and off-diagonal nonzeros in each row of our matrix.
- * This is used for preallocating memory in which to store the matrix.
+ * Compute the matrix elements of our local rows one row at a time, so that no more than a
+ * single row is ever held outside of the matrix. Each row's columns are sorted, with
+ * duplicates summed. If A is NULL, only the columns are found, and the number of
+ * diagonal-block and off-diagonal-block nonzeros in each row are counted into
+ * diag_nonzeros and offdiag_nonzeros (zeroed arrays of length local_rows, allocated by the
+ * caller) for preallocation. Otherwise each row is inserted into A with a single
+ * MatSetValues call, and the counts are not touched.
  */
-PetscErrorCode C(ComputeNonzeros,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
-  (PetscInt M, PetscInt N, const msc_t* msc,
-   PetscInt** diag_nonzeros, PetscInt** offdiag_nonzeros,
+PetscErrorCode C(ComputeRows,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
+  (PetscInt local_rows, PetscInt local_cols, const msc_t* msc, PetscBool upper_only, Mat A,
+   PetscInt* diag_nonzeros, PetscInt* offdiag_nonzeros,
    const void *left_subspace_data, const void *right_subspace_data)
 {
-  PetscInt mask_idx, row_idx, row_start, col_idx, col_start, state;
-  PetscInt local_rows = PETSC_DECIDE;
-  PetscInt local_cols = PETSC_DECIDE;
-  PetscCall(PetscSplitOwnership(PETSC_COMM_WORLD, &local_rows, &M));
-  PetscCall(PetscSplitOwnership(PETSC_COMM_WORLD, &local_cols, &N));
+  PetscInt mask_idx, term_idx, row_idx, row_start, col_idx, col_start, ket, bra, sign;
+  PetscInt row_count, i, nnz, total_nnz, global_row;
+  PetscInt *row_cols;
+  PetscScalar *row_values;
+  PetscScalar value;
+
+#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+  PetscInt s2i_sign;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+  PetscInt shift;
+#endif
+
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_COMPUTE_ROWS], 0, 0, 0, 0));
 
   /* prefix sum to get the start indices on each process */
   PetscCallMPI(MPI_Scan(&local_rows, &row_start, 1, MPIU_INT, MPI_SUM, PETSC_COMM_WORLD));
@@ -164,36 +227,115 @@ PetscErrorCode C(ComputeNonzeros,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))
   row_start -= local_rows;
   col_start -= local_cols;
 
-  /* allocate storage for our diagonal and offdiagonal arrays */
-  PetscCall(PetscCalloc1(local_rows, diag_nonzeros));
-  PetscCall(PetscCalloc1(local_rows, offdiag_nonzeros));
+  /* a row has at most one element per mask, plus possibly the diagonal we add below */
+  PetscCall(PetscMalloc1(msc->nmasks+1, &row_cols));
+  PetscCall(PetscMalloc1(msc->nmasks+1, &row_values));
 
+  total_nnz = 0;
   for (row_idx = 0; row_idx < local_rows; row_idx++) {
-    state = C(I2S,LEFT_SUBSPACE)(row_idx+row_start, left_subspace_data);
+    global_row = row_idx+row_start;
+
+    /* each term looks like value*|ket><bra| */
+    ket = C(I2S,LEFT_SUBSPACE)(global_row, left_subspace_data);
+
+    row_count = 0;
     for (mask_idx = 0; mask_idx < msc->nmasks; ++mask_idx) {
+      bra = ket ^ msc->masks[mask_idx];
 
 #if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
-      col_idx = C(S2I,RIGHT_SUBSPACE)(state^msc->masks[mask_idx], NULL, right_subspace_data);
+      col_idx = C(S2I,RIGHT_SUBSPACE)(bra, &s2i_sign, right_subspace_data);
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      col_idx = C(S2I,RIGHT_SUBSPACE)(bra, &shift, right_subspace_data);
 #else
-      col_idx = C(S2I,RIGHT_SUBSPACE)(state^msc->masks[mask_idx], right_subspace_data);
+      col_idx = C(S2I,RIGHT_SUBSPACE)(bra, right_subspace_data);
 #endif
 
-      if (col_idx == -1) {
-        /* this term is outside the subspace */
+      /* outside the subspace, or (in half storage) implied by Hermiticity */
+      if (col_idx == -1 || (upper_only && col_idx < global_row)) {
         continue;
       }
-      else if (col_idx >= col_start && col_idx < col_start+local_cols) {
-        (*diag_nonzeros)[row_idx] += 1;
+
+      row_cols[row_count] = col_idx;
+
+      /* the counting pass only needs the columns */
+      if (A) {
+        /* sum all terms for this matrix element */
+        value = 0;
+        for (term_idx = msc->mask_offsets[mask_idx]; term_idx < msc->mask_offsets[mask_idx+1]; ++term_idx) {
+          sign = 1 - 2*(builtin_parity(bra & msc->signs[term_idx]));
+          value += sign * msc->coeffs[term_idx];
+        }
+
+#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+        value *= s2i_sign;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+        value *= ElementFactor_Momentum(global_row, col_idx, shift, right_subspace_data);
+#endif
+
+        row_values[row_count] = value;
       }
-      else {
-        (*offdiag_nonzeros)[row_idx] += 1;
+      row_count++;
+    }
+
+    /* workaround for a bug in PETSc that triggers if there are empty rows. SBAIJ matrices
+     * also need every diagonal element to be present, so in that case always add it */
+    if (upper_only) {
+      row_cols[row_count] = global_row;
+      row_values[row_count] = 0;
+      row_count++;
+    }
+    else if (row_count == 0) {
+      row_cols[row_count] = col_start;
+      row_values[row_count] = 0;
+      row_count++;
+    }
+
+    /* different masks can give the same column (e.g. with spin flip symmetry) */
+    if (A) {
+      PetscCall(PetscSortIntWithScalarArray(row_count, row_cols, row_values));
+    }
+    else {
+      PetscCall(PetscSortInt(row_count, row_cols));
+    }
+
+    /* sum the duplicates in place */
+    nnz = 0;
+    for (i = 0; i < row_count; ++i) {
+      if (nnz > 0 && row_cols[nnz-1] == row_cols[i]) {
+        if (A) row_values[nnz-1] += row_values[i];
+        continue;
       }
+      row_cols[nnz] = row_cols[i];
+      if (A) row_values[nnz] = row_values[i];
+      nnz++;
     }
-    /* as part of workaround for PETSc bug (see BuildPetsc), need at least one element in each row */
-    if ((*diag_nonzeros)[row_idx] == 0) {
-      (*diag_nonzeros)[row_idx] = 1;
+    total_nnz += nnz;
+
+    if (A) {
+      PetscCall(MatSetValues(A, 1, &global_row, nnz, row_cols, row_values, INSERT_VALUES));
+      continue;
     }
+
+    for (i = 0; i < nnz; ++i) {
+      if (row_cols[i] >= col_start && row_cols[i] < col_start+local_cols) {
+        diag_nonzeros[row_idx] += 1;
+      }
+      else {
+        offdiag_nonzeros[row_idx] += 1;
+      }
+    }
+  }
+
+  PetscCall(PetscFree(row_cols));
+  PetscCall(PetscFree(row_values));
+
+  /* each term is evaluated once per row, and each element written with its column index */
+  if (A) {
+    PetscCall(PetscLogFlops(2.0*local_rows*msc->mask_offsets[msc->nmasks]));
+    DNM_LOG_BYTES(EVENT_COMPUTE_ROWS, total_nnz*(sizeof(PetscInt) + sizeof(PetscScalar)));
   }
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_COMPUTE_ROWS], 0, 0, 0, 0));
   return 0;
 }
 
@@ -203,6 +345,7 @@ PetscErrorCode C(BuildCPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const msc_t *msc,
   const C(data,LEFT_SUBSPACE)* left_subspace_data,
   const C(data,RIGHT_SUBSPACE)* right_subspace_data,
+  PetscBool mask_diagonal,
   Mat *A)
 {
   PetscInt M, N, m, n;
@@ -212,21 +355,40 @@ PetscErrorCode C(BuildCPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   M = C(Dim,LEFT_SUBSPACE)(left_subspace_data);
   N = C(Dim,RIGHT_SUBSPACE)(right_subspace_data);
 
-  m = PETSC_DECIDE;
-  n = PETSC_DECIDE;
-  PetscSplitOwnership(PETSC_COMM_WORLD,&m,&M);
-  PetscSplitOwnership(PETSC_COMM_WORLD,&n,&N);
+  PetscCall(SplitOwnership(M, &m));
+  PetscCall(SplitOwnership(N, &n));
 
   PetscCall(C(BuildContext_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
     msc, left_subspace_data, right_subspace_data, &ctx));
 
   PetscCall(MatCreateShell(PETSC_COMM_WORLD, m, n, M, N, ctx, A));
+
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+  /* the fast matvec communicates on its own, so only the general one needs ghosts */
+  PetscCall(C(SetupFast_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(*A, ctx));
+  if (ctx->fast_block_spins <= 0)
+#endif
+  {
+    PetscCall(C(SetupGhosts,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+      *A, msc, left_subspace_data, right_subspace_data, PETSC_FALSE, ctx));
+  }
+
   PetscCall(MatShellSetOperation(*A, MATOP_MULT,
 				 (void(*)(void))C(MatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))));
   PetscCall(MatShellSetOperation(*A, MATOP_NORM,
 				 (void(*)(void))C(MatNorm_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))));
   PetscCall(MatShellSetOperation(*A, MATOP_DESTROY,
 				 (void(*)(void))C(MatDestroyCtx_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))));
+  PetscCall(MatShellSetMatProductOperation(*A, MATPRODUCT_AB, NULL,
+				 C(MatMatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE)),
+				 NULL, MATDENSE, MATDENSE));
+
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+  /* the stored diagonals are only read by the fast matvec, so don't bother if it can't run */
+  if (mask_diagonal && ctx->fast_block_spins > 0) {
+    PetscCall(C(SetupMaskDiagonals,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(*A, ctx));
+  }
+#endif
 
   return 0;
 }
@@ -252,6 +414,23 @@ PetscErrorCode C(BuildContext_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   ctx->nmasks = msc->nmasks;
   ctx->nrm = -1;
   nterms = msc->mask_offsets[msc->nmasks];
+  ctx->nterms = nterms;
+
+  PetscCall(GetShellThreads(&(ctx->nthreads)));
+
+  /* filled in by SetupGhosts once the matrix layout exists */
+  ctx->n_ghosts = 0;
+  ctx->ghost_cols = NULL;
+  ctx->ghost_vec = NULL;
+  ctx->ghost_scatter = NULL;
+
+  /* determined on the first call to the fast matvec */
+  ctx->fast_block_spins = -1;
+
+  /* set up by SetupMaskDiagonals, if requested */
+  ctx->dia_values = NULL;
+  ctx->dia_re_offsets = NULL;
+  ctx->dia_im_offsets = NULL;
 
   /* we need to keep track of this stuff on our own. the numpy array might get garbage collected */
   PetscCall(PetscMalloc1(msc->nmasks, &(ctx->masks)));
@@ -280,6 +459,42 @@ PetscErrorCode C(BuildContext_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   return 0;
 }
 
+#undef  __FUNCT__
+#define __FUNCT__ "UpdateCPUShell"
+PetscErrorCode C(UpdateCPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  Mat A)
+{
+  shell_context *ctx;
+  PetscInt nterms, i;
+  PetscReal real_part;
+
+  PetscCall(MatShellGetContext(A, &ctx));
+
+  nterms = msc->mask_offsets[msc->nmasks];
+  if (msc->nmasks != ctx->nmasks || nterms != ctx->nterms) {
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_INCOMP,
+            "Terms of the new coefficients do not match those of the matrix.");
+  }
+
+  for (i=0; i < nterms; ++i) {
+    real_part = PetscRealPart(msc->coeffs[i]);
+    ctx->real_coeffs[i] = (real_part != 0) ? real_part : PetscImaginaryPart(msc->coeffs[i]);
+  }
+
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+  if (ctx->dia_values) {
+    PetscCall(C(SetupMaskDiagonals,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, ctx));
+  }
+#endif
+
+  /* the cached norm is stale now, and solvers holding the matrix need to notice the change */
+  ctx->nrm = -1;
+  PetscCall(PetscObjectStateIncrease((PetscObject)A));
+
+  return 0;
+}
+
 #undef  __FUNCT__
 #define __FUNCT__ "MatDestroyCtx_CPU"
 PetscErrorCode C(MatDestroyCtx_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A)
@@ -293,6 +508,14 @@ PetscErrorCode C(MatDestroyCtx_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A)
   PetscCall(PetscFree(ctx->signs));
   PetscCall(PetscFree(ctx->real_coeffs));
 
+  PetscCall(PetscFree(ctx->dia_values));
+  PetscCall(PetscFree(ctx->dia_re_offsets));
+  PetscCall(PetscFree(ctx->dia_im_offsets));
+
+  PetscCall(PetscFree(ctx->ghost_cols));
+  PetscCall(VecDestroy(&(ctx->ghost_vec)));
+  PetscCall(VecScatterDestroy(&(ctx->ghost_scatter)));
+
   PetscCall(C(DestroySubspaceData,LEFT_SUBSPACE)(ctx->left_subspace_data));
   PetscCall(C(DestroySubspaceData,RIGHT_SUBSPACE)(ctx->right_subspace_data));
 
@@ -302,177 +525,298 @@ PetscErrorCode C(MatDestroyCtx_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A)
 }
 
 #undef  __FUNCT__
-#define __FUNCT__ "MatMult_CPU_General"
-
-#undef VECSET_CACHE_SIZE
-#ifdef PETSC_USE_DEBUG
-  #define VECSET_CACHE_SIZE (1<<7)
-#else
-  #define VECSET_CACHE_SIZE (1<<15)
-#endif
-
+#define __FUNCT__ "SetupGhosts"
 /*
- * MatMult for CPU shell matrices.
+ * Find every off-process column that our rows couple to, and build a scatter that
+ * gathers the corresponding entries of x into ctx->ghost_vec. This is done once
+ * at build time, so each matvec needs only a single neighbor exchange.
+ *
+ * The host copies of the MSC and subspace data are used, so that the GPU shell can
+ * share this; with gpu set the ghost buffer lives on the device, and the scatter
+ * communicates device to device.
  */
-PetscErrorCode C(MatMult_CPU_General,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b)
+PetscErrorCode C(SetupGhosts,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  Mat A,
+  const msc_t *msc,
+  const C(data,LEFT_SUBSPACE)* left_subspace_data,
+  const C(data,RIGHT_SUBSPACE)* right_subspace_data,
+  PetscBool gpu,
+  shell_context *ctx)
 {
-  int mpi_size, mpi_rank;
-  PetscBool assembling;
+  int mpi_size;
+  PetscInt row_start, row_end, col_start, col_end;
+  PetscInt row_idx, col_idx, mask_idx, ket;
+  PetscInt n_ghosts, capacity;
+  PetscInt *ghost_cols;
+  IS ghost_is;
+  Vec x_template;
 
-  PetscInt row_start, row_end, col_start, col_end, col_idx;
-  PetscInt ket, bra, sign, row_idx, cache_idx, mask_idx, term_idx;
+  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
 
-#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP
-  PetscInt s2i_sign;
-#endif
+  /* with one process there is nothing to communicate */
+  if (mpi_size == 1) return 0;
 
-  PetscInt *row_idxs;
-  PetscScalar value;
-  const PetscScalar *local_x_array;
-  PetscScalar *b_array, *to_send;
+  PetscCall(MatGetOwnershipRange(A, &row_start, &row_end));
+  PetscCall(MatGetOwnershipRangeColumn(A, &col_start, &col_end));
 
-  int im_done, done_communicating;
+  capacity = PetscMax(row_end-row_start, 1024);
+  PetscCall(PetscMalloc1(capacity, &ghost_cols));
+  n_ghosts = 0;
 
-  shell_context *ctx;
+  for (row_idx = row_start; row_idx < row_end; ++row_idx) {
+    ket = C(I2S,LEFT_SUBSPACE)(row_idx, left_subspace_data);
+    for (mask_idx = 0; mask_idx < msc->nmasks; ++mask_idx) {
 
-  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD, &mpi_size));
-  PetscCallMPI(MPI_Comm_rank(PETSC_COMM_WORLD, &mpi_rank));
+#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP || C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      col_idx = C(S2I,RIGHT_SUBSPACE)(ket^msc->masks[mask_idx], NULL, right_subspace_data);
+#else
+      col_idx = C(S2I,RIGHT_SUBSPACE)(ket^msc->masks[mask_idx], right_subspace_data);
+#endif
 
-  /* TODO: check that vectors are of correct type */
+      if (col_idx == -1 || (col_idx >= col_start && col_idx < col_end)) continue;
 
-  PetscCall(MatShellGetContext(A, &ctx));
+      /* compact the list when it fills up, and only grow it if that didn't help much */
+      if (n_ghosts == capacity) {
+        PetscCall(PetscSortRemoveDupsInt(&n_ghosts, ghost_cols));
+        if (2*n_ghosts > capacity) {
+          capacity *= 2;
+          PetscCall(PetscRealloc(capacity*sizeof(PetscInt), &ghost_cols));
+        }
+      }
+      ghost_cols[n_ghosts++] = col_idx;
+    }
+  }
+  PetscCall(PetscSortRemoveDupsInt(&n_ghosts, ghost_cols));
 
-  PetscCall(VecSet(b, 0));
+  ctx->n_ghosts = n_ghosts;
+  ctx->ghost_cols = ghost_cols;
 
-  PetscCall(VecGetArrayRead(x, &(local_x_array)));
+  /* the scatter only depends on the layout of x, so any vector with that layout will do */
+  PetscCall(MatCreateVecs(A, &x_template, NULL));
+  PetscCall(VecCreate(PETSC_COMM_SELF, &(ctx->ghost_vec)));
+  PetscCall(VecSetSizes(ctx->ghost_vec, n_ghosts, n_ghosts));
+#if defined(PETSC_HAVE_CUDA)
+  PetscCall(VecSetType(ctx->ghost_vec, gpu ? VECSEQCUDA : VECSEQ));
+#else
+  PetscCall(VecSetType(ctx->ghost_vec, VECSEQ));
+#endif
+  PetscCall(ISCreateGeneral(PETSC_COMM_SELF, n_ghosts, ghost_cols, PETSC_USE_POINTER, &ghost_is));
+  PetscCall(VecScatterCreate(x_template, ghost_is, ctx->ghost_vec, NULL, &(ctx->ghost_scatter)));
+  PetscCall(ISDestroy(&ghost_is));
+  PetscCall(VecDestroy(&x_template));
 
-  PetscCall(VecGetOwnershipRange(x, &col_start, &col_end));
-  PetscCall(VecGetOwnershipRange(b, &row_start, &row_end));
+  return 0;
+}
 
-  /* if there is only one process, just do one call to the kernel */
-  if (mpi_size == 1) {
-    PetscCall(VecGetArray(b, &(b_array)));
+#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
 
-    C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
-      local_x_array, b_array, ctx, row_start, row_end, col_start, col_end);
+/* number of consecutive rows each thread handles at a time */
+#undef SPIN_CONSERVE_BLOCK_SIZE
+#define SPIN_CONSERVE_BLOCK_SIZE 1024
 
-    PetscCall(VecRestoreArray(b, &b_array));
-  }
-  else {
+#undef  __FUNCT__
+#define __FUNCT__ "MatMult_CPU_SpinConserve_kernel"
+/*
+ * MatMult kernel for CPU shell matrices whose left and right subspaces are the same
+ * SpinConserve subspace. Rather than computing each column index from scratch, we walk the
+ * rows in order with NextState_SpinConserve, and find the index of each ket^mask from the
+ * row index by recomputing only the bits spanned by the mask (see PartialS2I_SpinConserve).
+ * Rows are handled in blocks, one mask at a time, so that each mask is a single streaming
+ * pass over the block.
+ */
+void C(MatMult_CPU_SpinConserve_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const PetscScalar* x_array, const PetscScalar* ghost_array, PetscScalar* b_array,
+  shell_context *ctx,
+  PetscInt row_start, PetscInt row_end, PetscInt col_start, PetscInt col_end)
+{
+  const data_SpinConserve *data = (const data_SpinConserve*)(ctx->left_subspace_data);
+  PetscInt block_start, block_size, i, dim;
+  PetscInt mask, mask_idx, term_idx, n_flip, lo, hi, low_bits, window;
+  PetscInt ket, bra, rank, col_idx, ghost_idx, sign, s2i_sign;
+  PetscInt kets[SPIN_CONSERVE_BLOCK_SIZE];
+  accum_t value;
+  PetscScalar x_val;
+
+  dim = Dim_SpinConserve(data);
+
+  /* each row is written by exactly one thread, so no synchronization is needed */
+#if defined(PETSC_HAVE_OPENMP)
+  #pragma omp parallel for schedule(static) num_threads(ctx->nthreads) \
+    private(block_size, i, mask, mask_idx, term_idx, n_flip, lo, hi, low_bits, window, \
+            ket, bra, rank, col_idx, ghost_idx, sign, s2i_sign, kets, value, x_val)
+#endif
+  for (block_start = row_start; block_start < row_end; block_start += SPIN_CONSERVE_BLOCK_SIZE) {
 
-    /* allocate for cache */
-    PetscCall(PetscMalloc1(VECSET_CACHE_SIZE, &row_idxs));
-    PetscCall(PetscMalloc1(VECSET_CACHE_SIZE, &to_send));
+    block_size = PetscMin(SPIN_CONSERVE_BLOCK_SIZE, row_end - block_start);
 
-    /* we are not already sending values to another processor */
-    assembling = PETSC_FALSE;
+    kets[0] = I2S_SpinConserve(block_start, data);
+    for (i = 1; i < block_size; ++i) {
+      kets[i] = NextState_SpinConserve(kets[i-1], block_start+i, data);
+    }
 
-    cache_idx = 0;
+    for (mask_idx = 0; mask_idx < ctx->nmasks; ++mask_idx) {
+      mask = ctx->masks[mask_idx];
+
+      /* the mask must flip as many up spins as down spins, within the first L */
+      if ((mask >> data->L) || (builtin_popcount(mask) & 1)) continue;
+      n_flip = builtin_popcount(mask)/2;
+
+      /* the bits from the lowest to the highest bit of the mask */
+      lo = builtin_ctz(mask);
+      for (hi = lo; mask >> (hi+1); ++hi);
+      low_bits = (((PetscInt)1) << lo) - 1;
+      window = ((((PetscInt)1) << (hi+1)) - 1) & ~low_bits;
+
+      for (i = 0; i < block_size; ++i) {
+        ket = kets[i];
+        if (builtin_popcount(ket & mask) != n_flip) continue;
+        bra = ket ^ mask;
+
+        /* bits outside the window keep their rank, so only the window's contribution changes */
+        rank = builtin_popcount(ket & low_bits);
+        col_idx = block_start + i
+                  + PartialS2I_SpinConserve(bra & window, rank, data)
+                  - PartialS2I_SpinConserve(ket & window, rank, data);
+
+        s2i_sign = 1;
+        if (data->spinflip && col_idx >= dim) {
+          col_idx = 2*dim - col_idx - 1;
+          s2i_sign = data->spinflip;
+        }
 
-    ket = 0;
-    for (col_idx=col_start; col_idx<col_end; ++col_idx) {
+        /* off-process columns were gathered into ghost_array before the kernel was called */
+        if (col_idx >= col_start && col_idx < col_end) {
+          x_val = x_array[col_idx - col_start];
+        }
+        else {
+          ghost_idx = FindGhost(col_idx, ctx->n_ghosts, ctx->ghost_cols);
+          if (ghost_idx == -1) continue;
+          x_val = ghost_array[ghost_idx];
+        }
 
-      if (col_idx==col_start) {
-	ket = C(I2S,RIGHT_SUBSPACE)(col_idx, ctx->right_subspace_data);
-      } else {
-	ket = C(NextState,RIGHT_SUBSPACE)(ket, col_idx, ctx->right_subspace_data);
+        /* sum all terms for this matrix element */
+        value = 0;
+        for (term_idx = ctx->mask_offsets[mask_idx]; term_idx < ctx->mask_offsets[mask_idx+1]; ++term_idx) {
+          sign = 1 - 2*(builtin_parity(bra & ctx->signs[term_idx]));
+          if (TERM_REAL(mask, ctx->signs[term_idx])) {
+            value += sign * ctx->real_coeffs[term_idx];
+          } else {
+            value += I * sign * ctx->real_coeffs[term_idx];
+          }
+        }
+        b_array[block_start + i - row_start] += (PetscScalar)(s2i_sign * value * x_val);
       }
+    }
+  }
+}
 
-      for (mask_idx=0; mask_idx<ctx->nmasks; mask_idx++) {
-	bra = ket ^ ctx->masks[mask_idx];
-
-#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP
-	row_idx = C(S2I,LEFT_SUBSPACE)(bra, &s2i_sign, ctx->left_subspace_data);
-#else
-  	row_idx = C(S2I,LEFT_SUBSPACE)(bra, ctx->left_subspace_data);
 #endif
 
-	if (row_idx == -1) continue;
-
-	/* sum all terms for this matrix element */
-	value = 0;
-	for (term_idx=ctx->mask_offsets[mask_idx]; term_idx<ctx->mask_offsets[mask_idx+1]; ++term_idx) {
-	  sign = 1 - 2*(builtin_parity(ket&ctx->signs[term_idx]));
-	  if (TERM_REAL(ctx->masks[mask_idx], ctx->signs[term_idx])) {
-	    value += sign * ctx->real_coeffs[term_idx];
-	  } else {
-	    value += I * sign * ctx->real_coeffs[term_idx];
-	  }
-	}
-	if (cache_idx >= VECSET_CACHE_SIZE) {
-	  SETERRQ(MPI_COMM_SELF, PETSC_ERR_MEMC, "cache out of bounds, value %d", cache_idx);
-	}
+#undef  __FUNCT__
+#define __FUNCT__ "MatMult_CPU_General"
+/*
+ * MatMult for CPU shell matrices.
+ */
+PetscErrorCode C(MatMult_CPU_General,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b)
+{
+  PetscInt row_start, row_end, col_start, col_end;
+  const PetscScalar *local_x_array, *ghost_array;
+  PetscScalar *b_array;
+  shell_context *ctx;
 
-#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP
-	value *= s2i_sign;
+#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+  const data_SpinConserve *left_data, *right_data;
 #endif
 
-	row_idxs[cache_idx] = row_idx;
-	to_send[cache_idx] = value * local_x_array[col_idx-col_start];
-	++cache_idx;
-
-	if (cache_idx == VECSET_CACHE_SIZE) {
-	  if (assembling) {
-	    PetscCall(VecAssemblyEnd(b));
-	    im_done = 0;
-	    PetscCallMPI(MPI_Allreduce(&im_done, &done_communicating, 1, MPI_INT, MPI_BAND, MPI_COMM_WORLD));
-	    assembling = PETSC_FALSE;
-	  }
-
-	  PetscCall(VecSetValues(b, VECSET_CACHE_SIZE, row_idxs, to_send, ADD_VALUES));
+  /* TODO: check that vectors are of correct type */
 
-	  PetscCall(VecAssemblyBegin(b));
-	  assembling = PETSC_TRUE;
+  PetscCall(MatShellGetContext(A, &ctx));
 
-	  cache_idx = 0;
-	}
-      }
-    }
+  PetscCall(VecGetOwnershipRange(x, &col_start, &col_end));
+  PetscCall(VecGetOwnershipRange(b, &row_start, &row_end));
 
-    im_done = cache_idx==0;
-    done_communicating = PETSC_FALSE;
-    if (assembling) {
-      PetscCall(VecAssemblyEnd(b));
-      PetscCallMPI(MPI_Allreduce(&im_done, &done_communicating, 1, MPI_INT, MPI_BAND, MPI_COMM_WORLD));
-    }
+  /* fetch the off-process entries of x that our rows need */
+  ghost_array = NULL;
+  if (ctx->ghost_scatter) {
+    PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
+    PetscCall(VecScatterBegin(ctx->ghost_scatter, x, ctx->ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+    PetscCall(VecScatterEnd(ctx->ghost_scatter, x, ctx->ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+    PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
+    PetscCall(VecGetArrayRead(ctx->ghost_vec, &ghost_array));
+  }
 
-    if (!im_done) {
-      PetscCall(VecSetValues(b, cache_idx, row_idxs, to_send, ADD_VALUES));
-    }
+  PetscCall(VecSet(b, 0));
 
-    while (!done_communicating) {
-      PetscCall(VecAssemblyBegin(b));
-      PetscCall(VecAssemblyEnd(b));
-      im_done = 1;
-      PetscCallMPI(MPI_Allreduce(&im_done, &done_communicating, 1, MPI_INT, MPI_BAND, MPI_COMM_WORLD));
-    }
+  PetscCall(VecGetArrayRead(x, &(local_x_array)));
+  PetscCall(VecGetArray(b, &(b_array)));
 
-    PetscCall(PetscFree(row_idxs));
-    PetscCall(PetscFree(to_send));
+#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+  left_data = (const data_SpinConserve*)(ctx->left_subspace_data);
+  right_data = (const data_SpinConserve*)(ctx->right_subspace_data);
+  if (left_data->L == right_data->L &&
+      left_data->k == right_data->k &&
+      left_data->spinflip == right_data->spinflip) {
+    C(MatMult_CPU_SpinConserve_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+      local_x_array, ghost_array, b_array, ctx, row_start, row_end, col_start, col_end);
+  }
+  else
+#endif
+  {
+    C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+      local_x_array, 0, ghost_array, b_array, 0, 1,
+      ctx, row_start, row_end, col_start, col_end);
   }
 
+  PetscCall(VecRestoreArray(b, &b_array));
   PetscCall(VecRestoreArrayRead(x, &local_x_array));
 
+  if (ctx->ghost_scatter) {
+    PetscCall(VecRestoreArrayRead(ctx->ghost_vec, &ghost_array));
+  }
+
   return 0;
 }
 
 #undef  __FUNCT__
 #define __FUNCT__ "MatMult_CPU_kernel"
 /*
- * MatMult kernel for CPU shell matrices.
+ * MatMult kernel for CPU shell matrices. Applies the matrix to n_vecs vectors at once,
+ * stored as the columns of x_array and b_array with leading dimensions x_ld and b_ld. The
+ * ghost values of the vectors are interleaved: ghost_array[ghost_idx*n_vecs + vec_idx].
  */
 void C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
-  const PetscScalar* x_array, PetscScalar* b_array, shell_context *ctx,
+  const PetscScalar* x_array, PetscInt x_ld, const PetscScalar* ghost_array,
+  PetscScalar* b_array, PetscInt b_ld, PetscInt n_vecs,
+  shell_context *ctx,
   PetscInt row_start, PetscInt row_end, PetscInt col_start, PetscInt col_end)
 {
-  PetscInt row_idx, ket, col_idx, bra;
+  PetscInt row_idx, ket, col_idx, ghost_idx, bra;
+  const PetscScalar *x_vals;
+  PetscInt x_stride, vec_idx;
   PetscInt mask_idx, term_idx;
   PetscInt sign;
 #if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
   PetscInt s2i_sign=0;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+  PetscInt shift=0;
 #endif
-  PetscScalar value;
+  accum_t value;
 
+  /* each row is written by exactly one thread, so no synchronization is needed */
+#if defined(PETSC_HAVE_OPENMP)
+#if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+  #pragma omp parallel for schedule(static) num_threads(ctx->nthreads) \
+    private(ket, col_idx, ghost_idx, bra, mask_idx, term_idx, sign, value, x_vals, x_stride, vec_idx) \
+    firstprivate(s2i_sign)
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+  #pragma omp parallel for schedule(static) num_threads(ctx->nthreads) \
+    private(ket, col_idx, ghost_idx, bra, mask_idx, term_idx, sign, value, x_vals, x_stride, vec_idx) \
+    firstprivate(shift)
+#else
+  #pragma omp parallel for schedule(static) num_threads(ctx->nthreads) \
+    private(ket, col_idx, ghost_idx, bra, mask_idx, term_idx, sign, value, x_vals, x_stride, vec_idx)
+#endif
+#endif
   for (row_idx = row_start; row_idx < row_end; ++row_idx) {
     ket = C(I2S,LEFT_SUBSPACE)(row_idx, ctx->left_subspace_data);
 
@@ -481,12 +825,25 @@ void C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
 
 #if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
       col_idx = C(S2I,RIGHT_SUBSPACE)(bra, &s2i_sign, ctx->right_subspace_data);
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      col_idx = C(S2I,RIGHT_SUBSPACE)(bra, &shift, ctx->right_subspace_data);
 #else
       col_idx = C(S2I,RIGHT_SUBSPACE)(bra, ctx->right_subspace_data);
 #endif
 
-      /* yikes */
-      if (col_idx < col_start || col_idx >= col_end) continue;
+      if (col_idx == -1) continue;
+
+      /* off-process columns were gathered into ghost_array before the kernel was called */
+      if (col_idx >= col_start && col_idx < col_end) {
+        x_vals = x_array + (col_idx - col_start);
+        x_stride = x_ld;
+      }
+      else {
+        ghost_idx = FindGhost(col_idx, ctx->n_ghosts, ctx->ghost_cols);
+        if (ghost_idx == -1) continue;
+        x_vals = ghost_array + ghost_idx*n_vecs;
+        x_stride = 1;
+      }
 
       /* sum all terms for this matrix element */
       value = 0;
@@ -500,10 +857,81 @@ void C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
       }
 #if C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
       value *= s2i_sign;
+#elif C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      value *= ElementFactor_Momentum(row_idx, col_idx, shift,
+                                      (const data_Momentum*)ctx->right_subspace_data);
 #endif
-      b_array[row_idx - row_start] += value * x_array[col_idx - col_start];
+
+      /* the matrix element is reused for every vector */
+      for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+        b_array[vec_idx*b_ld + row_idx - row_start] += (PetscScalar)(value * x_vals[vec_idx*x_stride]);
+      }
+    }
+  }
+}
+
+#undef  __FUNCT__
+#define __FUNCT__ "MatMatMult_CPU_General"
+/*
+ * Multiply the CPU shell matrix by each column of the dense matrix X, decoding each
+ * matrix element only once for all of the columns.
+ */
+PetscErrorCode C(MatMatMult_CPU_General,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Mat X, Mat B)
+{
+  PetscInt row_start, row_end, col_start, col_end, n_vecs, vec_idx, ghost_idx, x_ld, b_ld;
+  const PetscScalar *x_array, *ghost_col;
+  PetscScalar *b_array, *ghost_array;
+  Vec x_col;
+  shell_context *ctx;
+
+  PetscCall(MatShellGetContext(A, &ctx));
+
+  PetscCall(MatGetOwnershipRange(A, &row_start, &row_end));
+  PetscCall(MatGetOwnershipRangeColumn(A, &col_start, &col_end));
+  PetscCall(MatGetSize(X, NULL, &n_vecs));
+
+  /* gather the off-process entries of every column, interleaved by column */
+  ghost_array = NULL;
+  if (ctx->ghost_scatter) {
+    PetscCall(PetscMalloc1(ctx->n_ghosts*n_vecs, &ghost_array));
+    for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+      PetscCall(MatDenseGetColumnVecRead(X, vec_idx, &x_col));
+      PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
+      PetscCall(VecScatterBegin(ctx->ghost_scatter, x_col, ctx->ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+      PetscCall(VecScatterEnd(ctx->ghost_scatter, x_col, ctx->ghost_vec, INSERT_VALUES, SCATTER_FORWARD));
+      PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
+      PetscCall(MatDenseRestoreColumnVecRead(X, vec_idx, &x_col));
+
+      PetscCall(VecGetArrayRead(ctx->ghost_vec, &ghost_col));
+      for (ghost_idx = 0; ghost_idx < ctx->n_ghosts; ++ghost_idx) {
+        ghost_array[ghost_idx*n_vecs + vec_idx] = ghost_col[ghost_idx];
+      }
+      PetscCall(VecRestoreArrayRead(ctx->ghost_vec, &ghost_col));
     }
   }
+
+  PetscCall(MatDenseGetLDA(X, &x_ld));
+  PetscCall(MatDenseGetLDA(B, &b_ld));
+
+  PetscCall(MatDenseGetArrayRead(X, &x_array));
+  PetscCall(MatDenseGetArrayWrite(B, &b_array));
+
+  for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+    PetscCall(PetscArrayzero(b_array + vec_idx*b_ld, row_end-row_start));
+  }
+
+  C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+    x_array, x_ld, ghost_array, b_array, b_ld, n_vecs,
+    ctx, row_start, row_end, col_start, col_end);
+
+  PetscCall(MatDenseRestoreArrayWrite(B, &b_array));
+  PetscCall(MatDenseRestoreArrayRead(X, &x_array));
+
+  if (ghost_array) {
+    PetscCall(PetscFree(ghost_array));
+  }
+
+  return 0;
 }
 
 /* use the hand-tuned kernel for parity and full subspaces, if we can */
@@ -523,54 +951,178 @@ void C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   #define LKP_SIZE (1<<6)
 #endif
 
-PetscErrorCode C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b);
+PetscErrorCode C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  Mat A, PetscInt n_vecs, const PetscScalar* x_array, PetscInt x_ld, Vec* b);
 
-PetscErrorCode C(MatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b)
+#undef  __FUNCT__
+#define __FUNCT__ "SetupFast_CPU"
+/*
+ * Decide whether the fast matvec can be used, and with what block size. It requires every
+ * rank's range to be a union of aligned power-of-two blocks (see SplitOwnership) that are
+ * larger than the cache, so that XORing with a mask maps each block onto a single block.
+ */
+PetscErrorCode C(SetupFast_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, shell_context *ctx)
 {
-  PetscBool use_fast_matmult;
-  PetscInt local_size;
-  shell_context *ctx;
-  int mpi_size;
-  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD,&mpi_size));
+  PetscInt x_start, x_end, local_size, block_spins;
 
-  PetscCall(VecGetLocalSize(b, &local_size));
-
-  PetscCall(MatShellGetContext(A,&ctx));
+  PetscCall(MatGetOwnershipRangeColumn(A, &x_start, &x_end));
+  local_size = x_end - x_start;
 
-  /* mpi size is a power of 2 */
-  use_fast_matmult = __builtin_popcount(mpi_size) == 1;
+  block_spins = 0;
 
   /* problem size is big enough */
-  use_fast_matmult = use_fast_matmult && (local_size > VECSET_CACHE_SIZE);
+  if (local_size > VECSET_CACHE_SIZE) {
+    /* the largest power of two dividing both the start and the length of our range */
+    block_spins = builtin_ctz(x_start | local_size);
+    if ((((PetscInt)1) << block_spins) < VECSET_CACHE_SIZE) {
+      block_spins = 0;
+    }
+  }
 
   #if (C(LEFT_SUBSPACE,SP) == Parity_SP)
-    use_fast_matmult = use_fast_matmult && (\
-      ((data_Parity*)(ctx->left_subspace_data))->space == \
-      ((data_Parity*)(ctx->right_subspace_data))->space);
+    if (((data_Parity*)(ctx->left_subspace_data))->space !=
+        ((data_Parity*)(ctx->right_subspace_data))->space) {
+      block_spins = 0;
+    }
   #endif
 
-  if (use_fast_matmult) {
-    PetscCall(C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, x, b));
+  /* every rank must take the same path, and use the same block size */
+  PetscCallMPI(MPI_Allreduce(&block_spins, &(ctx->fast_block_spins), 1, MPIU_INT, MPI_MIN, PETSC_COMM_WORLD));
+
+  return 0;
+}
+
+#undef  __FUNCT__
+#define __FUNCT__ "SetupMaskDiagonals"
+PetscErrorCode C(SetupMaskDiagonals,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, shell_context *ctx)
+{
+  PetscInt x_start, x_end, local_size, n_arrays;
+  PetscInt mask_idx, term_idx, col_idx, bra;
+  PetscBool has_re, has_im;
+  PetscReal *d_re, *d_im, sign;
+
+  PetscCall(MatGetOwnershipRangeColumn(A, &x_start, &x_end));
+  local_size = x_end - x_start;
+
+  /* which parts each mask needs depends only on its terms, so the layout is computed once */
+  if (!ctx->dia_values) {
+    PetscCall(PetscMalloc1(ctx->nmasks, &(ctx->dia_re_offsets)));
+    PetscCall(PetscMalloc1(ctx->nmasks, &(ctx->dia_im_offsets)));
+
+    n_arrays = 0;
+    for (mask_idx = 0; mask_idx < ctx->nmasks; ++mask_idx) {
+      has_re = PETSC_FALSE;
+      has_im = PETSC_FALSE;
+      for (term_idx = ctx->mask_offsets[mask_idx]; term_idx < ctx->mask_offsets[mask_idx+1]; ++term_idx) {
+        if (TERM_REAL(ctx->masks[mask_idx], ctx->signs[term_idx])) {
+          has_re = PETSC_TRUE;
+        }
+        else {
+          has_im = PETSC_TRUE;
+        }
+      }
+
+#if !defined(PETSC_USE_COMPLEX)
+      /* like the fast matvec, real builds have no use for the imaginary parts */
+      has_im = PETSC_FALSE;
+#endif
+
+      #if (C(LEFT_SUBSPACE,SP) == Parity_SP)
+        /* a mask that flips the parity takes every state out of the subspace */
+        if (builtin_parity(ctx->masks[mask_idx])) {
+          has_re = PETSC_FALSE;
+          has_im = PETSC_FALSE;
+        }
+      #endif
+
+      ctx->dia_re_offsets[mask_idx] = has_re ? (n_arrays++)*local_size : -1;
+      ctx->dia_im_offsets[mask_idx] = has_im ? (n_arrays++)*local_size : -1;
+    }
+
+    PetscCall(PetscMalloc1(PetscMax(n_arrays*local_size, 1), &(ctx->dia_values)));
+  }
+
+  for (mask_idx = 0; mask_idx < ctx->nmasks; ++mask_idx) {
+    d_re = (ctx->dia_re_offsets[mask_idx] >= 0) ? ctx->dia_values + ctx->dia_re_offsets[mask_idx] : NULL;
+    d_im = (ctx->dia_im_offsets[mask_idx] >= 0) ? ctx->dia_values + ctx->dia_im_offsets[mask_idx] : NULL;
+    if (!d_re && !d_im) continue;
+
+    /* the sign of each term is determined by the column's state, as in the general matvec */
+#if defined(PETSC_HAVE_OPENMP)
+    #pragma omp parallel for schedule(static) num_threads(ctx->nthreads) \
+      private(bra, term_idx, sign)
+#endif
+    for (col_idx = 0; col_idx < local_size; ++col_idx) {
+      bra = C(I2S,RIGHT_SUBSPACE)(x_start + col_idx, ctx->right_subspace_data);
+      if (d_re) d_re[col_idx] = 0;
+      if (d_im) d_im[col_idx] = 0;
+
+      for (term_idx = ctx->mask_offsets[mask_idx]; term_idx < ctx->mask_offsets[mask_idx+1]; ++term_idx) {
+        sign = 1 - 2*(builtin_parity(bra & ctx->signs[term_idx]));
+        if (TERM_REAL(ctx->masks[mask_idx], ctx->signs[term_idx])) {
+          d_re[col_idx] += sign * ctx->real_coeffs[term_idx];
+        }
+        else if (d_im) {
+          d_im[col_idx] += sign * ctx->real_coeffs[term_idx];
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+PetscErrorCode C(MatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b)
+{
+  PetscInt local_rows;
+  shell_context *ctx;
+
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_MULT], A, x, b, 0));
+
+  PetscCall(MatShellGetContext(A,&ctx));
+
+  if (ctx->fast_block_spins == -1) {
+    PetscCall(C(SetupFast_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, ctx));
+  }
+
+  if (ctx->fast_block_spins > 0) {
+    const PetscScalar *x_array;
+    PetscCall(VecGetArrayRead(x, &x_array));
+    PetscCall(C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, 1, x_array, 0, &b));
+    PetscCall(VecRestoreArrayRead(x, &x_array));
   }
   else {
     PetscCall(C(MatMult_CPU_General,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, x, b));
   }
+
+  /* with mask-diagonal storage the fast matvec doesn't evaluate terms */
+  PetscCall(VecGetLocalSize(b, &local_rows));
+  PetscCall(LogShellProduct(EVENT_SHELL_MULT, ctx->nmasks,
+                            (ctx->dia_values && ctx->fast_block_spins > 0) ? 0 : ctx->nterms,
+                            local_rows, 1, PETSC_FALSE));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_MULT], A, x, b, 0));
   return 0;
 }
 
 #ifndef HELPER_FNS
 #define HELPER_FNS 1
-static inline void _radd(PetscScalar *x,PetscReal c)
-{
-  (*x) += c;
-}
 
-static inline void _cadd(PetscScalar *x,PetscReal c)
-{
-  (*x) += I*c;
-}
+/*
+ * The loops below are compiled for several instruction sets, and the best one supported by
+ * the running CPU is picked when the library is loaded. On ARM, NEON is part of the baseline
+ * instruction set, so the default version is already vectorized there.
+ */
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+  #if __has_attribute(target_clones)
+    #define DNM_SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+  #endif
+#endif
+#ifndef DNM_SIMD_CLONES
+  #define DNM_SIMD_CLONES
+#endif
 
-void compute_sign_lookup(PetscInt* lookup)
+void compute_sign_lookup(PetscReal* lookup)
 {
   PetscInt i, j, tmp;
   for (i=0;i<LKP_SIZE;++i) {
@@ -581,7 +1133,7 @@ void compute_sign_lookup(PetscInt* lookup)
   }
 }
 
-void compute_parity_sign_lookup(PetscInt parity, PetscInt* lookup)
+void compute_parity_sign_lookup(PetscInt parity, PetscReal* lookup)
 {
   PetscInt i, j, tmp;
   for (i=0;i<LKP_SIZE;++i) {
@@ -593,40 +1145,64 @@ void compute_parity_sign_lookup(PetscInt parity, PetscInt* lookup)
   }
 }
 
+/*
+ * values[c] += summed_c[c]*x[xi], with the complex product written out by hand (and the
+ * coefficients stored as separate real and imaginary arrays) so that the compiler can
+ * vectorize it
+ */
+#if defined(PETSC_USE_COMPLEX)
+  #define CACHE_PRODUCT(c, xi)                                              \
+    do {                                                                    \
+      v[2*(c)]   += summed_re[c]*xr[2*(xi)]   - summed_im[c]*xr[2*(xi)+1];  \
+      v[2*(c)+1] += summed_re[c]*xr[2*(xi)+1] + summed_im[c]*xr[2*(xi)];    \
+    } while (0)
+#else
+  #define CACHE_PRODUCT(c, xi) (v[c] += summed_re[c]*xr[xi])
+#endif
+
+DNM_SIMD_CLONES
 PetscErrorCode do_cache_product(
   PetscInt mask,
   PetscInt block_start,
   PetscInt x_start,
   PetscInt x_end,
-  const PetscScalar* summed_c,
-  const PetscScalar* x_array,
-  PetscScalar* values
+  const PetscReal* PETSC_RESTRICT summed_re,
+  const PetscReal* PETSC_RESTRICT summed_im,
+  const PetscScalar* PETSC_RESTRICT x_array,
+  accum_t* PETSC_RESTRICT values
 )
 {
-  PetscInt iterate_max, cache_idx, inner_idx, row_idx, stop;
+  PetscInt iterate_max, cache_idx, inner_idx, row_idx, x_idx, stop;
 
-  /* TODO: this is not compatible with 64 bit ints */
-  iterate_max = 1 << __builtin_ctz(mask);
+  /* view the (possibly complex) arrays as arrays of reals */
+  accum_real* PETSC_RESTRICT v = (accum_real*)values;
+  const PetscReal* PETSC_RESTRICT xr = (const PetscReal*)x_array;
+
+  iterate_max = ((PetscInt)1) << builtin_ctz(mask);
   if (iterate_max < ITER_CUTOFF) {
     for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE; ++cache_idx) {
       row_idx = (block_start+cache_idx) ^ mask;
-      values[cache_idx] += summed_c[cache_idx]*x_array[row_idx-x_start];
+      CACHE_PRODUCT(cache_idx, row_idx-x_start);
     }
   }
   else {
     for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE;) {
       row_idx = (block_start+cache_idx) ^ mask;
       stop = intmin(iterate_max-(row_idx%iterate_max), VECSET_CACHE_SIZE-cache_idx);
+
+      /* the run of x we read is contiguous, so it's enough to check its ends */
+      x_idx = row_idx-x_start;
+      if (x_idx < 0) {
+        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_MEMC, "negative index on x array");
+      }
+      if (x_idx+stop > x_end-x_start) {
+        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_MEMC, "index past end of x array");
+      }
+
       for (inner_idx=0; inner_idx < stop; ++inner_idx) {
-        if (row_idx+inner_idx-x_start < 0) {
-          SETERRQ(PETSC_COMM_SELF, PETSC_ERR_MEMC, "negative index on x array");
-        }
-        if (row_idx+inner_idx-x_start >= x_end-x_start) {
-          SETERRQ(PETSC_COMM_SELF, PETSC_ERR_MEMC, "index past end of x array");
-        }
-        values[cache_idx+inner_idx] += summed_c[cache_idx+inner_idx] * x_array[row_idx+inner_idx-x_start];
+        CACHE_PRODUCT(cache_idx+inner_idx, x_idx+inner_idx);
       }
-      cache_idx += inner_idx;
+      cache_idx += stop;
     }
   }
 
@@ -634,129 +1210,229 @@ PetscErrorCode do_cache_product(
 
 }
 
+/*
+ * values[c] += d[xi]*x[xi] along one mask's diagonal, for the mask-diagonal storage. Here d
+ * is indexed by local column like x, with its real and imaginary parts in separate arrays
+ * (either of which may be NULL). The access pattern is the same as do_cache_product's.
+ */
+#if defined(PETSC_USE_COMPLEX)
+  #define DIA_PRODUCT_RE(c, xi)                                         \
+    do {                                                                \
+      v[2*(c)]   += d_re[xi]*xr[2*(xi)];                                \
+      v[2*(c)+1] += d_re[xi]*xr[2*(xi)+1];                              \
+    } while (0)
+  #define DIA_PRODUCT_IM(c, xi)                                         \
+    do {                                                                \
+      v[2*(c)]   -= d_im[xi]*xr[2*(xi)+1];                              \
+      v[2*(c)+1] += d_im[xi]*xr[2*(xi)];                                \
+    } while (0)
+  #define DIA_PRODUCT_BOTH(c, xi)                                       \
+    do {                                                                \
+      v[2*(c)]   += d_re[xi]*xr[2*(xi)]   - d_im[xi]*xr[2*(xi)+1];      \
+      v[2*(c)+1] += d_re[xi]*xr[2*(xi)+1] + d_im[xi]*xr[2*(xi)];        \
+    } while (0)
+#else
+  #define DIA_PRODUCT_RE(c, xi) (v[c] += d_re[xi]*xr[xi])
+#endif
+
+/* unswitched by hand, like INNER_LOOP below */
+#define DIA_LOOP(PRODUCT)                                                         \
+  if (iterate_max < ITER_CUTOFF) {                                                \
+    for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE; ++cache_idx) {               \
+      PRODUCT(cache_idx, ((block_start+cache_idx) ^ mask) - x_start);             \
+    }                                                                             \
+  }                                                                               \
+  else {                                                                          \
+    for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE; cache_idx += stop) {         \
+      x_idx = ((block_start+cache_idx) ^ mask) - x_start;                         \
+      stop = intmin(iterate_max-((x_idx+x_start)%iterate_max), VECSET_CACHE_SIZE-cache_idx); \
+      for (inner_idx=0; inner_idx < stop; ++inner_idx) {                          \
+        PRODUCT(cache_idx+inner_idx, x_idx+inner_idx);                            \
+      }                                                                           \
+    }                                                                             \
+  }
+
+DNM_SIMD_CLONES
+PetscErrorCode do_dia_product(
+  PetscInt mask,
+  PetscInt block_start,
+  PetscInt x_start,
+  PetscInt x_end,
+  const PetscReal* PETSC_RESTRICT d_re,
+  const PetscReal* PETSC_RESTRICT d_im,
+  const PetscScalar* PETSC_RESTRICT x_array,
+  accum_t* PETSC_RESTRICT values
+)
+{
+  PetscInt iterate_max, cache_idx, inner_idx, x_idx, stop;
+
+  accum_real* PETSC_RESTRICT v = (accum_real*)values;
+  const PetscReal* PETSC_RESTRICT xr = (const PetscReal*)x_array;
+
+  /* XOR with the mask permutes within aligned blocks, so checking the block is enough */
+  x_idx = ((block_start ^ mask) & ~((PetscInt)VECSET_CACHE_SIZE-1)) - x_start;
+  if (x_idx < 0 || x_idx + VECSET_CACHE_SIZE > x_end - x_start) {
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_MEMC, "index out of range of x array");
+  }
+
+  iterate_max = mask ? ((PetscInt)1) << builtin_ctz(mask) : VECSET_CACHE_SIZE;
+
+#if defined(PETSC_USE_COMPLEX)
+  if (d_re && d_im) {DIA_LOOP(DIA_PRODUCT_BOTH)}
+  else if (d_re) {DIA_LOOP(DIA_PRODUCT_RE)}
+  else if (d_im) {DIA_LOOP(DIA_PRODUCT_IM)}
+#else
+  (void)d_im;
+  if (d_re) {DIA_LOOP(DIA_PRODUCT_RE)}
+#endif
+
+  return 0;
+}
+
+/*
+ * Add the contribution of one term to the summed coefficients. Real and imaginary
+ * coefficients are accumulated into separate arrays, so each loop streams over
+ * contiguous memory and the per-entry signs come from a contiguous row of the lookup.
+ */
+DNM_SIMD_CLONES
 void sum_term(
   PetscInt block_start,
   PetscInt sign,
   PetscInt is_real,
-  PetscScalar coeff,
+  PetscReal coeff,
   PetscBool check_parity,
-  const PetscInt* lookup,
-  PetscScalar* summed_c
+  const PetscReal* PETSC_RESTRICT lookup,
+  PetscReal* PETSC_RESTRICT summed_re,
+  PetscReal* PETSC_RESTRICT summed_im
 ) {
   PetscInt cache_idx, lkp_idx, flip;
-  PetscScalar tmp_c;
+  PetscReal tmp_c;
+  PetscReal* PETSC_RESTRICT summed_c;
 
-  const PetscInt* l;
+  const PetscReal* PETSC_RESTRICT l;
   l = lookup + (sign&LKP_MASK)*LKP_SIZE;
 
+  summed_c = is_real ? summed_re : summed_im;
+
 /* this is the interior of the for loop. The compiler wasn't
  * doing a good enough job unswitching it so I write a macro
  * to unswitch it manually.
  */
 /* TODO: include sign flips due to parity bit in lookup table */
 /**********/
-#define INNER_LOOP(sign_flip,add_func,parity_check)                     \
-  for (cache_idx=0; cache_idx<VECSET_CACHE_SIZE; ) {                    \
+#define INNER_LOOP(sign_flip,parity_check)                              \
+  for (cache_idx=0; cache_idx<VECSET_CACHE_SIZE; cache_idx+=LKP_SIZE) { \
     flip = builtin_parity((cache_idx+block_start)&(~LKP_MASK)&sign);    \
     if (parity_check)                                                   \
       flip ^= builtin_parity((cache_idx+block_start)&(~LKP_MASK));      \
     tmp_c = -(flip^(flip-1))*coeff;                                     \
-    for (lkp_idx=0; lkp_idx<LKP_SIZE; ++lkp_idx,++cache_idx) {          \
-      add_func(summed_c+cache_idx,(sign_flip)*tmp_c);                   \
+    for (lkp_idx=0; lkp_idx<LKP_SIZE; ++lkp_idx) {                      \
+      summed_c[cache_idx+lkp_idx] += (sign_flip)*tmp_c;                 \
     }                                                                   \
   }
 /**********/
 
-  if (check_parity) {
-    if (is_real) {INNER_LOOP(l[lkp_idx],_radd,1)}
-    else {INNER_LOOP(l[lkp_idx],_cadd,1)}
-  }
-  else {
-    if (sign&LKP_MASK) {
-      if (is_real) {INNER_LOOP(l[lkp_idx],_radd,0)}
-      else {INNER_LOOP(l[lkp_idx],_cadd,0)}
-    }
-    else {
-      if (is_real) {INNER_LOOP(1,_radd,0)}
-      else {INNER_LOOP(1,_cadd,0)}
-    }
-  }
+  if (check_parity) {INNER_LOOP(l[lkp_idx],1)}
+  else if (sign&LKP_MASK) {INNER_LOOP(l[lkp_idx],0)}
+  else {INNER_LOOP(1,0)}
 }
 #endif
 
 void C(compute_mask_starts,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscInt nmasks,
-  PetscInt n_local_spins,
-  PetscInt mpi_size,
+  PetscInt n_block_spins,
+  PetscInt n_prefixes,
   const PetscInt* masks,
   PetscInt* mask_starts
 )
 {
-  PetscInt proc_idx, mask_idx;
+  PetscInt prefix_idx, mask_idx;
 
   mask_idx = 0;
-  for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
-    // search for the first mask that has the same prefix as this process
+  for (prefix_idx = 0; prefix_idx < n_prefixes; ++prefix_idx) {
+    // search for the first mask whose bits above the block have this prefix
     // in parity case, we drop the last bit of the mask (by calling S2I on it)
     while (
         mask_idx < nmasks &&
-        C(S2I_nocheck,LEFT_SUBSPACE)(masks[mask_idx], NULL) < (proc_idx << n_local_spins)
+        C(S2I_nocheck,LEFT_SUBSPACE)(masks[mask_idx], NULL) < (prefix_idx << n_block_spins)
       ) {
       ++mask_idx;
     }
-    mask_starts[proc_idx] = mask_idx;
+    mask_starts[prefix_idx] = mask_idx;
   }
-  mask_starts[mpi_size] = nmasks;
+  mask_starts[n_prefixes] = nmasks;
 }
 
 #undef  __FUNCT__
 #define __FUNCT__ "MatMult_CPU_Fast"
-PetscErrorCode C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b)
+/*
+ * Multiply by n_vecs vectors at once: column j of the local part of x starts at
+ * x_array + j*x_ld, and its product goes into b[j]. The coefficients summed for each block
+ * and mask are applied to all of the vectors, so each matrix element is computed only once.
+ */
+PetscErrorCode C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  Mat A, PetscInt n_vecs, const PetscScalar* x_array, PetscInt x_ld, Vec* b)
 {
-  PetscInt proc_idx, proc_me, proc_mask, n_local_spins;
-  PetscInt proc_start_idx, block_start_idx;
+  PetscInt prefix_idx, n_prefixes, prefix_mask, block_mask, n_block_spins;
+  PetscInt N, max_local_size, x_block_start, block_start_idx;
+  const PetscInt *ranges;
   PetscInt mask_idx, term_idx;
   PetscInt m, s, ms_parity;
   PetscReal c;
-  PetscInt *mask_starts, *lookup;
+  PetscInt *mask_starts;
+  PetscReal *lookup;
   PetscBool assembling, r;
 
   #if (C(LEFT_SUBSPACE,SP) == Parity_SP)
-  PetscInt *parity_lookup;
+  PetscReal *parity_lookup;
   #endif
 
-  PetscInt x_start, x_end;
-  const PetscScalar *x_array;
+  PetscInt x_start, x_end, vec_idx;
 
   shell_context *ctx;
 
   /* cache */
   PetscInt *row_idx;
-  PetscScalar *summed_coeffs, *values;
-  PetscInt cache_idx;
+  PetscReal *summed_re, *summed_im;
+  accum_t *values;
+  PetscInt cache_idx, values_stride;
 
-  int mpi_rank,mpi_size;
-  PetscCallMPI(MPI_Comm_rank(PETSC_COMM_WORLD,&mpi_rank));
-  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD,&mpi_size));
+#if DNM_PETSC_SINGLE
+  /* the accumulated values, rounded to PetscScalar for VecSetValues */
+  PetscScalar *set_values;
+#endif
 
-  /* check if number of processors is a multiple of 2 */
-  if ((mpi_size & (mpi_size-1)) != 0) {
-    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_SUP, "number of MPI procs must be a power of 2");
-  }
+  /* each thread fills the cache for one block at a time */
+  PetscInt n_blocks, n_chunks, chunk_idx, chunk_start, chunk_size, block_idx;
+  PetscReal *block_summed_re, *block_summed_im;
+  accum_t *block_values;
+  int n_failed;
+
+  int mpi_size, proc_idx;
+  PetscCallMPI(MPI_Comm_size(PETSC_COMM_WORLD,&mpi_size));
 
   PetscCall(MatShellGetContext(A,&ctx));
 
-  /* clear out the b vector */
-  PetscCall(VecSet(b,0));
+  if (ctx->fast_block_spins <= 0) {
+    SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_SUP, "vector layout is not compatible with the fast matvec");
+  }
+
+  /* clear out the b vectors */
+  for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+    PetscCall(VecSet(b[vec_idx],0));
+  }
 
-  /* prepare x array */
-  PetscCall(VecGetOwnershipRange(x, &x_start, &x_end));
-  PetscCall(VecGetArrayRead(x, &x_array));
+  PetscCall(MatGetOwnershipRangeColumn(A, &x_start, &x_end));
 
-  /* allocate for cache */
-  PetscCall(PetscMalloc1(VECSET_CACHE_SIZE, &row_idx));
-  PetscCall(PetscMalloc1(VECSET_CACHE_SIZE, &summed_coeffs));
-  PetscCall(PetscMalloc1(VECSET_CACHE_SIZE, &values));
+  /* allocate for cache---one block for each thread, and values for each vector */
+  values_stride = ctx->nthreads*VECSET_CACHE_SIZE;
+  PetscCall(PetscMalloc1(ctx->nthreads*VECSET_CACHE_SIZE, &row_idx));
+  PetscCall(PetscMalloc1(ctx->nthreads*VECSET_CACHE_SIZE, &summed_re));
+  PetscCall(PetscMalloc1(ctx->nthreads*VECSET_CACHE_SIZE, &summed_im));
+  PetscCall(PetscMalloc1(n_vecs*values_stride, &values));
+#if DNM_PETSC_SINGLE
+  PetscCall(PetscMalloc1(ctx->nthreads*VECSET_CACHE_SIZE, &set_values));
+#endif
 
   PetscCall(PetscMalloc1(LKP_SIZE*LKP_SIZE, &lookup));
   compute_sign_lookup(lookup);
@@ -766,108 +1442,211 @@ PetscErrorCode C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x,
     compute_parity_sign_lookup(((data_Parity*)(ctx->left_subspace_data))->space, parity_lookup);
   #endif
 
-  /* this relies on MPI size being a power of 2 */
-  /* this is log base 2 of the local vector size */
-  n_local_spins = __builtin_ctz(x_end - x_start);
+  /*
+   * our range is a union of aligned blocks of 2^n_block_spins entries. all masks with the
+   * same bits above the block map each of these blocks onto the same target block, so we
+   * handle the masks in groups by that prefix
+   */
+  n_block_spins = ctx->fast_block_spins;
+  block_mask = ~((((PetscInt)1) << n_block_spins) - 1);
+
+  PetscCall(MatGetSize(A, NULL, &N));
+  n_prefixes = N >> n_block_spins;
 
-  PetscCall(PetscMalloc1(mpi_size+1,&(mask_starts)));
+  PetscCall(PetscMalloc1(n_prefixes+1,&(mask_starts)));
   C(compute_mask_starts,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
     ctx->nmasks,
-    n_local_spins,
-    mpi_size,
+    n_block_spins,
+    n_prefixes,
     ctx->masks,
     mask_starts
   );
 
-  proc_mask = (-1) << n_local_spins;
-  proc_me = mpi_rank << n_local_spins;
+  /* the block size is a power of two larger than VECSET_CACHE_SIZE, so this divides evenly */
+  n_blocks = (x_end - x_start) / VECSET_CACHE_SIZE;
+
+  /*
+   * ranks may own different numbers of blocks, but all of them must make the same number of
+   * (collective) calls to VecAssemblyBegin and VecAssemblyEnd. so we size the loop for the
+   * largest rank, and the others contribute empty chunks at the end
+   */
+  PetscCall(MatGetOwnershipRangesColumn(A, &ranges));
+  max_local_size = 0;
+  for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+    max_local_size = PetscMax(max_local_size, ranges[proc_idx+1] - ranges[proc_idx]);
+  }
+  n_chunks = (max_local_size/VECSET_CACHE_SIZE + ctx->nthreads - 1) / ctx->nthreads;
 
   /* we are not already sending values to another processor */
   assembling = PETSC_FALSE;
 
-  for (proc_idx = 0; proc_idx < mpi_size; ++proc_idx) {
+  for (prefix_idx = 0; prefix_idx < n_prefixes; ++prefix_idx) {
 
-    /* if there are none for this process, skip it */
-    if (mask_starts[proc_idx] == mask_starts[proc_idx+1]) continue;
+    /* if there are none with this prefix, skip it */
+    if (mask_starts[prefix_idx] == mask_starts[prefix_idx+1]) continue;
 
     /* if we've hit the end of the masks, stop */
-    if (mask_starts[proc_idx] == ctx->nmasks) break;
-
-    /* the first index of the target */
-    m = C(S2I_nocheck,LEFT_SUBSPACE)(ctx->masks[mask_starts[proc_idx]], NULL);
-    proc_start_idx = proc_mask & (proc_me ^ m);
-
-    for (block_start_idx = proc_start_idx;
-         block_start_idx < proc_start_idx + (x_end - x_start);
-         block_start_idx += VECSET_CACHE_SIZE) {
-
-      PetscCall(PetscMemzero(values,   sizeof(PetscScalar)*VECSET_CACHE_SIZE));
-      PetscCall(PetscMemzero(summed_coeffs, sizeof(PetscScalar)*VECSET_CACHE_SIZE));
-
-      for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE; ++cache_idx) {
-        row_idx[cache_idx] = block_start_idx+cache_idx;
-      }
-
-      for (mask_idx = mask_starts[proc_idx]; mask_idx < mask_starts[proc_idx+1]; ++mask_idx) {
-
-        m = C(S2I_nocheck,LEFT_SUBSPACE)(
-          ctx->masks[mask_idx],
-          NULL
-        );
+    if (mask_starts[prefix_idx] == ctx->nmasks) break;
+
+    /* XORing with the bits above the block takes us to the target block */
+    prefix_mask = block_mask & C(S2I_nocheck,LEFT_SUBSPACE)(ctx->masks[mask_starts[prefix_idx]], NULL);
+
+    /*
+     * the blocks are handed out to the threads in chunks of nthreads blocks. nthreads
+     * and n_chunks are the same on every rank, so every rank makes the same number of
+     * (collective) calls to VecAssemblyBegin and VecAssemblyEnd
+     */
+    for (chunk_idx = 0; chunk_idx < n_chunks; ++chunk_idx) {
+
+      chunk_start = chunk_idx*ctx->nthreads;
+      chunk_size = PetscMax(0, PetscMin(ctx->nthreads, n_blocks - chunk_start));
+      n_failed = 0;
+
+#if defined(PETSC_HAVE_OPENMP)
+      #pragma omp parallel for schedule(static,1) num_threads(ctx->nthreads) \
+        private(x_block_start, block_start_idx, block_summed_re, block_summed_im, block_values, \
+                cache_idx, vec_idx, \
+                mask_idx, term_idx, m, s, ms_parity, c, r) \
+        reduction(+:n_failed)
+#endif
+      for (block_idx = 0; block_idx < chunk_size; ++block_idx) {
+
+        /* the rows whose columns fall in this block of x are in the same position of the target block */
+        x_block_start = x_start + (chunk_start+block_idx)*VECSET_CACHE_SIZE;
+        block_start_idx = x_block_start ^ prefix_mask;
+        block_summed_re = summed_re + block_idx*VECSET_CACHE_SIZE;
+        block_summed_im = summed_im + block_idx*VECSET_CACHE_SIZE;
+        block_values = values + block_idx*VECSET_CACHE_SIZE;
+
+        for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE; ++cache_idx) {
+          row_idx[block_idx*VECSET_CACHE_SIZE + cache_idx] = block_start_idx+cache_idx;
+          block_summed_re[cache_idx] = 0;
+          block_summed_im[cache_idx] = 0;
+        }
+        for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+          for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE; ++cache_idx) {
+            block_values[vec_idx*values_stride + cache_idx] = 0;
+          }
+        }
 
-        for (
-            term_idx = ctx->mask_offsets[mask_idx];
-            term_idx < ctx->mask_offsets[mask_idx+1];
-            ++term_idx) {
+        for (mask_idx = mask_starts[prefix_idx]; mask_idx < mask_starts[prefix_idx+1]; ++mask_idx) {
 
-          s = C(S2I_nocheck,LEFT_SUBSPACE)(
-            ctx->signs[term_idx],
+          m = C(S2I_nocheck,LEFT_SUBSPACE)(
+            ctx->masks[mask_idx],
             NULL
           );
 
-          ms_parity = builtin_parity(ctx->masks[mask_idx] & ctx->signs[term_idx]);
-          c = -(ms_parity^(ms_parity-1))*ctx->real_coeffs[term_idx];
-          r = TERM_REAL(ctx->masks[mask_idx], ctx->signs[term_idx]);
-
-          #if (C(LEFT_SUBSPACE,SP) == Parity_SP)
-            if (ctx->signs[term_idx] & 1) {
-              sum_term(block_start_idx, s, r, c, 1, parity_lookup, summed_coeffs);
+          /* with mask-diagonal storage the summed coefficients are already there */
+          if (ctx->dia_values) {
+            for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+              if (do_dia_product(m, block_start_idx, x_start, x_end,
+                                 (ctx->dia_re_offsets[mask_idx] >= 0) ?
+                                   ctx->dia_values + ctx->dia_re_offsets[mask_idx] : NULL,
+                                 (ctx->dia_im_offsets[mask_idx] >= 0) ?
+                                   ctx->dia_values + ctx->dia_im_offsets[mask_idx] : NULL,
+                                 x_array + vec_idx*x_ld,
+                                 block_values + vec_idx*values_stride) != 0) {
+                ++n_failed;
+              }
             }
-            else {
-              sum_term(block_start_idx, s, r, c, 0, lookup, summed_coeffs);
+            continue;
+          }
+
+          for (
+              term_idx = ctx->mask_offsets[mask_idx];
+              term_idx < ctx->mask_offsets[mask_idx+1];
+              ++term_idx) {
+
+            s = C(S2I_nocheck,LEFT_SUBSPACE)(
+              ctx->signs[term_idx],
+              NULL
+            );
+
+            ms_parity = builtin_parity(ctx->masks[mask_idx] & ctx->signs[term_idx]);
+            c = -(ms_parity^(ms_parity-1))*ctx->real_coeffs[term_idx];
+            r = TERM_REAL(ctx->masks[mask_idx], ctx->signs[term_idx]);
+
+            #if (C(LEFT_SUBSPACE,SP) == Parity_SP)
+              if (ctx->signs[term_idx] & 1) {
+                sum_term(block_start_idx, s, r, c, 1, parity_lookup, block_summed_re, block_summed_im);
+              }
+              else {
+                sum_term(block_start_idx, s, r, c, 0, lookup, block_summed_re, block_summed_im);
+              }
+            #else
+              sum_term(block_start_idx, s, r, c, 0, lookup, block_summed_re, block_summed_im);
+            #endif
+
+          }
+
+          /* the summed coefficients are applied to every vector. can't return from inside
+           * a parallel region, so just record the failure */
+          for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+            if (do_cache_product(m, block_start_idx, x_start, x_end,
+                                 block_summed_re, block_summed_im,
+                                 x_array + vec_idx*x_ld,
+                                 block_values + vec_idx*values_stride) != 0) {
+              ++n_failed;
             }
-          #else
-            sum_term(block_start_idx, s, r, c, 0, lookup, summed_coeffs);
-          #endif
+          }
 
+          for (cache_idx=0; cache_idx < VECSET_CACHE_SIZE; ++cache_idx) {
+            block_summed_re[cache_idx] = 0;
+            block_summed_im[cache_idx] = 0;
+          }
         }
+      }
 
-        PetscCall(do_cache_product(m, block_start_idx, x_start, x_end, summed_coeffs, x_array, values));
-        PetscCall(PetscMemzero(summed_coeffs, sizeof(PetscScalar)*VECSET_CACHE_SIZE));
-
+      if (n_failed) {
+        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_MEMC, "index out of range in fast matvec");
       }
 
+      /* the values are sent to their owners while we compute the next chunk; only the time
+       * spent in these calls counts as communication */
+      PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
       if (assembling) {
-        PetscCall(VecAssemblyEnd(b));
+        for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+          PetscCall(VecAssemblyEnd(b[vec_idx]));
+        }
         assembling = PETSC_FALSE;
       }
-      PetscCall(VecSetValues(b, VECSET_CACHE_SIZE, row_idx, values, ADD_VALUES));
-
-      PetscCall(VecAssemblyBegin(b));
+      for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+#if DNM_PETSC_SINGLE
+        for (cache_idx = 0; cache_idx < chunk_size*VECSET_CACHE_SIZE; ++cache_idx) {
+          set_values[cache_idx] = (PetscScalar)values[vec_idx*values_stride + cache_idx];
+        }
+        PetscCall(VecSetValues(b[vec_idx], chunk_size*VECSET_CACHE_SIZE, row_idx, set_values, ADD_VALUES));
+#else
+        PetscCall(VecSetValues(b[vec_idx], chunk_size*VECSET_CACHE_SIZE, row_idx,
+                               values + vec_idx*values_stride, ADD_VALUES));
+#endif
+        PetscCall(VecAssemblyBegin(b[vec_idx]));
+      }
       assembling = PETSC_TRUE;
+      PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
     }
   }
 
   if (assembling) {
-    PetscCall(VecAssemblyEnd(b));
+    PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
+    for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+      PetscCall(VecAssemblyEnd(b[vec_idx]));
+    }
+    PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_COMM], 0, 0, 0, 0));
   }
 
-  PetscCall(VecRestoreArrayRead(x,&x_array));
-
   PetscCall(PetscFree(lookup));
+  #if (C(LEFT_SUBSPACE,SP) == Parity_SP)
+    PetscCall(PetscFree(parity_lookup));
+  #endif
+  PetscCall(PetscFree(mask_starts));
   PetscCall(PetscFree(row_idx));
   PetscCall(PetscFree(values));
-  PetscCall(PetscFree(summed_coeffs));
+#if DNM_PETSC_SINGLE
+  PetscCall(PetscFree(set_values));
+#endif
+  PetscCall(PetscFree(summed_re));
+  PetscCall(PetscFree(summed_im));
 
   return 0;
 }
@@ -876,12 +1655,89 @@ PetscErrorCode C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x,
 
 PetscErrorCode C(MatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b)
 {
+  PetscInt local_rows;
+  shell_context *ctx;
+
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_MULT], A, x, b, 0));
+
   PetscCall(C(MatMult_CPU_General,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A,x,b));
+
+  PetscCall(MatShellGetContext(A, &ctx));
+  PetscCall(VecGetLocalSize(b, &local_rows));
+  PetscCall(LogShellProduct(EVENT_SHELL_MULT, ctx->nmasks, ctx->nterms,
+                            local_rows, 1, PETSC_FALSE));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_MULT], A, x, b, 0));
   return 0;
 }
 
 #endif
 
+#undef  __FUNCT__
+#define __FUNCT__ "MatMatMult_CPU"
+PetscErrorCode C(MatMatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Mat X, Mat B, void *data)
+{
+  PetscInt n_vecs, local_rows, nterms;
+  shell_context *ctx;
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+  PetscInt vec_idx, x_ld, b_ld;
+  const PetscScalar *x_array;
+  PetscScalar *b_array;
+  Vec *b_cols;
+#endif
+
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_MATMAT], A, X, B, 0));
+
+  PetscCall(MatShellGetContext(A, &ctx));
+  PetscCall(MatGetSize(X, NULL, &n_vecs));
+  PetscCall(MatGetLocalSize(A, &local_rows, NULL));
+
+  /* the general kernel evaluates the terms once for all of the columns */
+  nterms = ctx->nterms;
+
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+  if (ctx->fast_block_spins == -1) {
+    PetscCall(C(SetupFast_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, ctx));
+  }
+
+  /* the fast matvec also sums the terms of each block once for all of the columns. it
+   * needs all of the columns of B at once, so it gets vectors wrapping their storage */
+  if (ctx->fast_block_spins > 0) {
+    PetscCall(MatDenseGetLDA(X, &x_ld));
+    PetscCall(MatDenseGetLDA(B, &b_ld));
+    PetscCall(MatDenseGetArrayRead(X, &x_array));
+    PetscCall(MatDenseGetArrayWrite(B, &b_array));
+
+    PetscCall(PetscMalloc1(n_vecs, &b_cols));
+    for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+      PetscCall(VecCreateMPIWithArray(PETSC_COMM_WORLD, 1, local_rows, PETSC_DETERMINE,
+                                      b_array + vec_idx*b_ld, &b_cols[vec_idx]));
+    }
+
+    PetscCall(C(MatMult_CPU_Fast,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, n_vecs, x_array, x_ld, b_cols));
+
+    for (vec_idx = 0; vec_idx < n_vecs; ++vec_idx) {
+      PetscCall(VecDestroy(&b_cols[vec_idx]));
+    }
+    PetscCall(PetscFree(b_cols));
+
+    PetscCall(MatDenseRestoreArrayWrite(B, &b_array));
+    PetscCall(MatDenseRestoreArrayRead(X, &x_array));
+
+    if (ctx->dia_values) nterms = 0;
+  }
+  else
+#endif
+  {
+    PetscCall(C(MatMatMult_CPU_General,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(A, X, B));
+  }
+
+  PetscCall(LogShellProduct(EVENT_SHELL_MATMAT, ctx->nmasks, nterms, local_rows, n_vecs, PETSC_FALSE));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_MATMAT], A, X, B, 0));
+  return 0;
+}
+
 #undef  __FUNCT__
 #define __FUNCT__ "MatNorm_CPU"
 /*
@@ -897,6 +1753,10 @@ PetscErrorCode C(MatNorm_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscReal sum, sum_err, comp, total, local_max, global_max;
   shell_context *ctx;
 
+#if C(RIGHT_SUBSPACE,SP) == Momentum_SP
+  PetscInt col_idx, shift;
+#endif
+
   if (type != NORM_INFINITY) {
     SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE, "Only NORM_INFINITY is implemented for shell matrices.");
   }
@@ -912,6 +1772,8 @@ PetscErrorCode C(MatNorm_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
     return 0;
   }
 
+  PetscCall(PetscLogEventBegin(dnm_events[EVENT_SHELL_NORM], A, 0, 0, 0));
+
   PetscCall(MatGetOwnershipRange(A, &row_start, &row_end));
 
   local_max = 0;
@@ -941,6 +1803,14 @@ PetscErrorCode C(MatNorm_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
         }
       }
 
+#if C(RIGHT_SUBSPACE,SP) == Momentum_SP
+      /* the phase doesn't matter either, but the ratio of the normalizations does */
+      col_idx = C(S2I,RIGHT_SUBSPACE)(bra, &shift, ctx->right_subspace_data);
+      if (col_idx == -1) continue;
+      csum *= ElementFactor_Momentum(row_idx, col_idx, shift,
+                                     (const data_Momentum*)ctx->right_subspace_data);
+#endif
+
       // extra s2i sign of csum doesn't matter because we are
       // immediately taking the absolute value
       // TODO: handle the extreme edge case in which two different terms collide
@@ -961,22 +1831,32 @@ PetscErrorCode C(MatNorm_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   ctx->nrm = global_max;
   (*nrm) = global_max;
 
+  PetscCall(LogShellProduct(EVENT_SHELL_NORM, 0, ctx->nterms,
+                            row_end-row_start, 0, PETSC_FALSE));
+
+  PetscCall(PetscLogEventEnd(dnm_events[EVENT_SHELL_NORM], A, 0, 0, 0));
   return 0;
 }
 
+/* translation invariance can't be checked one row at a time, so for Momentum it's done in Python */
+#if C(LEFT_SUBSPACE,SP) != Momentum_SP
+
 #undef  __FUNCT__
-#define __FUNCT__ "CheckConserves"
-PetscErrorCode C(CheckConserves,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+#define __FUNCT__ "AnalyzeOperator"
+PetscErrorCode C(AnalyzeOperator,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const msc_t *msc,
   const C(data,LEFT_SUBSPACE)* left_subspace_data,
   const C(data,RIGHT_SUBSPACE)* right_subspace_data,
-  PetscInt* result)
+  PetscInt* result,
+  PetscReal* nrm)
 {
   PetscLayout layout;
   PetscInt N, col_start, col_end;
   PetscInt mask_idx, term_idx;
   PetscInt row_idx, ket, col_idx, bra, sign;
+  PetscInt in_left, nthreads;
   PetscScalar value;
+  PetscReal sum, sum_err, comp, total, local_max, global_max;
 
 #if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
   PetscInt bra_complement;
@@ -997,17 +1877,43 @@ PetscErrorCode C(CheckConserves,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   PetscCall(PetscLayoutSetSize(layout, N));
   PetscCall(PetscLayoutSetUp(layout));
   PetscCall(PetscLayoutGetRange(layout, &col_start, &col_end));
+  PetscCall(PetscLayoutDestroy(&layout));
+
+  PetscCall(GetShellThreads(&nthreads));
 
   local_result = 1;
+  local_max = 0;
 
+  /*
+   * Threads can't leave the loop early, so once the operator is known not to conserve the
+   * subspace, each thread skips its remaining columns (unless it is still summing the norm).
+   */
+#if defined(PETSC_HAVE_OPENMP)
+#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
+  #pragma omp parallel for schedule(static) num_threads(nthreads) \
+    private(bra, ket, row_idx, mask_idx, term_idx, sign, in_left, value, sum, sum_err, comp, total, \
+            bra_complement, value_complement) \
+    reduction(&&:local_result) reduction(max:local_max)
+#else
+  #pragma omp parallel for schedule(static) num_threads(nthreads) \
+    private(bra, ket, row_idx, mask_idx, term_idx, sign, in_left, value, sum, sum_err, comp, total) \
+    reduction(&&:local_result) reduction(max:local_max)
+#endif
+#endif
   for (col_idx=col_start; col_idx<col_end; ++col_idx) {
 
+    if (!local_result && !nrm) continue;
+
     /* each term looks like value*|ket><bra| */
     bra = C(I2S,RIGHT_SUBSPACE)(col_idx, right_subspace_data);
 #if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
     bra_complement = bra ^ ((1<<left_subspace_data->L)-1);
 #endif
 
+    /* sum abs of all matrix elements in this column, in the same way as MatNorm_CPU sums rows */
+    sum = 0;
+    sum_err = 0;
+
     for (mask_idx=0; mask_idx<msc->nmasks; mask_idx++) {
       ket = bra ^ msc->masks[mask_idx];
 
@@ -1020,22 +1926,34 @@ PetscErrorCode C(CheckConserves,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
       /* in this case, it mapped onto a row that was in the subspace, so we're good */
       /* (except spinflip, which needs extra sign checks) */
 #if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
-      if (row_idx != -1 && !left_subspace_data->spinflip) {
-        continue;
-      }
+      in_left = row_idx != -1 && !left_subspace_data->spinflip;
 #else
-      if (row_idx != -1) {
+      in_left = row_idx != -1;
+#endif
+
+      if (in_left && !nrm) {
         continue;
       }
-#endif
 
-      /* otherwise, if the sum of all terms for this matrix element is 0, we're OK */
+      /* sum all terms for this matrix element */
       value = 0;
       for (term_idx=msc->mask_offsets[mask_idx]; term_idx<msc->mask_offsets[mask_idx+1]; ++term_idx) {
         sign = 1 - 2*(builtin_parity(bra & msc->signs[term_idx]));
         value += sign * msc->coeffs[term_idx];
       }
 
+      if (nrm) {
+        comp = PetscAbsScalar(value) - sum_err;
+        total = sum + comp;
+        sum_err = (total - sum) - comp;
+        sum = total;
+      }
+
+      /* otherwise, if the sum of all terms for this matrix element is 0, we're OK */
+      if (in_left || !local_result) {
+        continue;
+      }
+
       /* for spinflip, we need to make sure that the value and its complement have the correct sign change */
 #if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
       value_complement = 0;
@@ -1045,41 +1963,42 @@ PetscErrorCode C(CheckConserves,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
 	  value_complement += sign * msc->coeffs[term_idx];
 	}
       }
-#endif
 
-      /* if value == 0, we can just forget about it and continue */
-#if C(LEFT_SUBSPACE,SP) == SpinConserve_SP && C(RIGHT_SUBSPACE,SP) == SpinConserve_SP
       if (value != 0 || value_complement != 0) {
-	if (!left_subspace_data->spinflip) {
-	  /* no spinflip, we're just like all the other subspaces */
-	  local_result = 0;
-	  break;
-	}
-	/* this row isn't included but the values were nonzero */
-	else if (row_idx == -1) {
-	  local_result = 0;
-	  break;
-	}
-	/* in this case we have to make sure the signs are right */
-	else if (value*switch_spinflip != value_complement) {
+	/* no spinflip, we're just like all the other subspaces */
+	/* or this row isn't included but the values were nonzero */
+	/* or the signs are wrong */
+	if (!left_subspace_data->spinflip || row_idx == -1 ||
+	    value*switch_spinflip != value_complement) {
 	  local_result = 0;
-	  break;
 	}
       }
 #else
       if (value != 0) {
 	local_result = 0;
-	break;
       }
 #endif
+
+      if (!local_result && !nrm) break;
+    }
+
+    if (sum > local_max) {
+      local_max = sum;
     }
-    if (!local_result) break;
   }
 
   /* communicate the result among everybody */
   PetscCallMPI(MPI_Allreduce(&local_result, result, 1, MPIU_INT, MPI_LAND, PETSC_COMM_WORLD));
 
-  /* global result is now stored in result, we're done */
+  if (nrm) {
+    PetscCallMPI(MPIU_Allreduce(&local_max, &global_max, 1, MPIU_REAL, MPIU_MAX, PETSC_COMM_WORLD));
+    *nrm = global_max;
+
+    PetscCall(LogShellProduct(EVENT_CHECK_CONSERVES, 0, msc->mask_offsets[msc->nmasks],
+                              col_end-col_start, 0, PETSC_FALSE));
+  }
 
   return 0;
 }
+
+#endif
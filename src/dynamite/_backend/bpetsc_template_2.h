@@ -11,24 +11,49 @@ PetscErrorCode C(BuildMat,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const void* left_subspace_data,
   const void* right_subspace_data,
   shell_impl shell,
+  PetscBool half_storage,
   Mat *A);
 
 /*
- * Build a standard PETSc matrix.
+ * Rewrite the values of a matrix built by BuildMat for new coefficients on the same terms.
+ */
+PetscErrorCode C(UpdateMat,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  const void* left_subspace_data,
+  const void* right_subspace_data,
+  shell_impl shell,
+  Mat A);
+
+/*
+ * Build a standard PETSc matrix. If half_storage is true, the matrix must be Hermitian
+ * with identical left and right subspaces, and only its upper triangle is stored (in
+ * SBAIJ format).
  */
 PetscErrorCode C(BuildPetsc,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const msc_t *msc,
   const void* left_subspace_data,
   const void* right_subspace_data,
+  PetscBool half_storage,
   Mat *A);
 
 /*
- * Build a CPU shell matrix.
+ * Refill the values of a matrix from BuildPetsc, reusing its nonzero pattern.
+ */
+PetscErrorCode C(UpdatePetsc,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  const void* left_subspace_data,
+  const void* right_subspace_data,
+  Mat A);
+
+/*
+ * Build a CPU shell matrix. If mask_diagonal is true and the subspaces allow the fast
+ * matvec, also store the summed coefficients along each mask (see SetupMaskDiagonals).
  */
 PetscErrorCode C(BuildCPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const msc_t *msc,
   const C(data,LEFT_SUBSPACE)* left_subspace_data,
   const C(data,RIGHT_SUBSPACE)* right_subspace_data,
+  PetscBool mask_diagonal,
   Mat *A);
 
 /*
@@ -40,14 +65,49 @@ PetscErrorCode C(BuildContext_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   const C(data,RIGHT_SUBSPACE)* right_subspace_data,
   shell_context **ctx_p);
 
+/*
+ * Replace the coefficients of a CPU shell matrix, keeping its context.
+ */
+PetscErrorCode C(UpdateCPUShell,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  Mat A);
+
 PetscErrorCode C(MatDestroyCtx_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A);
 
+#if C(LEFT_SUBSPACE,SP) == C(RIGHT_SUBSPACE,SP) && (C(LEFT_SUBSPACE,SP) == Full_SP || C(LEFT_SUBSPACE,SP) == Parity_SP)
+/*
+ * Decide whether the fast matvec can be used, and with what block size.
+ */
+PetscErrorCode C(SetupFast_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, shell_context *ctx);
+
+/*
+ * Compute (or recompute, after the coefficients change) the mask-diagonal storage: for each
+ * mask, the matrix element in each local column, which lies in row col^mask. Each mask keeps
+ * a real array, an imaginary array, or both, depending on which kinds of terms it has.
+ */
+PetscErrorCode C(SetupMaskDiagonals,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, shell_context *ctx);
+#endif
+
+/*
+ * Find the off-process columns needed by our rows and build the scatter that fetches them.
+ * Shared with the GPU shell, which passes gpu = PETSC_TRUE to keep the ghost buffer on the device.
+ */
+PetscErrorCode C(SetupGhosts,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  Mat A,
+  const msc_t *msc,
+  const C(data,LEFT_SUBSPACE)* left_subspace_data,
+  const C(data,RIGHT_SUBSPACE)* right_subspace_data,
+  PetscBool gpu,
+  shell_context *ctx);
+
 /*
- * Compute the number of nonzeros per row, for memory allocation purposes.
+ * Insert the elements of our local rows into A row by row or, if A is NULL, count the
+ * nonzeros per row for preallocation. If upper_only is true, only include those on or
+ * above the diagonal.
  */
-PetscErrorCode C(ComputeNonzeros,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
-  PetscInt M, PetscInt N, const msc_t* msc,
-  PetscInt** diag_nonzeros, PetscInt** offdiag_nonzeros,
+PetscErrorCode C(ComputeRows,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  PetscInt local_rows, PetscInt local_cols, const msc_t* msc, PetscBool upper_only, Mat A,
+  PetscInt* diag_nonzeros, PetscInt* offdiag_nonzeros,
   const void *left_subspace_data, const void *right_subspace_data);
 
 /*
@@ -56,10 +116,17 @@ PetscErrorCode C(ComputeNonzeros,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
 PetscErrorCode C(MatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Vec x, Vec b);
 
 /*
- * MatMult kernel for CPU shell matrices.
+ * Numeric phase of the product B = A*X for CPU shell matrices, where X and B are dense.
+ */
+PetscErrorCode C(MatMatMult_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(Mat A, Mat X, Mat B, void *data);
+
+/*
+ * MatMult kernel for CPU shell matrices, applied to n_vecs vectors at once.
  */
 void C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
-  const PetscScalar* x_array, PetscScalar* b_array, shell_context *ctx,
+  const PetscScalar* x_array, PetscInt x_ld, const PetscScalar* ghost_array,
+  PetscScalar* b_array, PetscInt b_ld, PetscInt n_vecs,
+  shell_context *ctx,
   PetscInt row_start, PetscInt row_end, PetscInt col_start, PetscInt col_end);
 
 /*
@@ -67,3 +134,17 @@ void C(MatMult_CPU_kernel,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
  */
 PetscErrorCode C(MatNorm_CPU,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
   Mat A, NormType type, PetscReal *nrm);
+
+#if C(LEFT_SUBSPACE,SP) != Momentum_SP
+/*
+ * Check in one sweep over the right subspace whether the operator maps it into the left
+ * subspace and, if nrm is not NULL, sum each column to bound the infinity norm. For
+ * identical subspaces, the bound is the one MatNorm_CPU and MatNorm_GPU compute by rows.
+ */
+PetscErrorCode C(AnalyzeOperator,C(LEFT_SUBSPACE,RIGHT_SUBSPACE))(
+  const msc_t *msc,
+  const C(data,LEFT_SUBSPACE)* left_subspace_data,
+  const C(data,RIGHT_SUBSPACE)* right_subspace_data,
+  PetscInt* result,
+  PetscReal* nrm);
+#endif
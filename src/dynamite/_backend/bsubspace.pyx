@@ -6,12 +6,22 @@ cimport numpy as np
 
 from libcpp.unordered_set cimport unordered_set
 
+np.import_array()
+
 from .bbuild import dnm_int_t
 
 cdef extern from "bsubspace_impl.h":
 
     ctypedef int PetscInt
 
+    ctypedef struct shared_buffer:
+        void* ptr
+        size_t size
+        int node_ranks
+
+    int SharedBufferCreate(const void* data, size_t size, shared_buffer** buf_p)
+    int SharedBufferRelease(shared_buffer** buf_p)
+
     ctypedef struct data_Full:
         int L
 
@@ -33,12 +43,26 @@ cdef extern from "bsubspace_impl.h":
         int* state_map
         int* rmap_indices
         int* rmap_states
+        int hash_bits
+        int* hash_table
+        shared_buffer* shared
+
+    ctypedef struct data_Momentum:
+        int L
+        int q
+        int k
+        int dim
+        int* state_map
+        int* periods
+        int hash_bits
+        int* hash_table
 
     ctypedef enum subspace_type:
         _FULL "FULL"
         _PARITY "PARITY"
         _EXPLICIT "EXPLICIT"
         _SPIN_CONSERVE "SPIN_CONSERVE"
+        _MOMENTUM "MOMENTUM"
 
     PetscInt Dim_Full(data_Full* data);
     void S2I_Full_array(int n, const data_Full* data, const PetscInt* states, PetscInt* idxs);
@@ -55,6 +79,16 @@ cdef extern from "bsubspace_impl.h":
     PetscInt Dim_Explicit(const data_Explicit* data);
     void S2I_Explicit_array(int n, const data_Explicit* data, const PetscInt* states, PetscInt* idxs);
     void I2S_Explicit_array(int n, const data_Explicit* data, const PetscInt* idxs, PetscInt* states);
+    PetscInt HashBits_Explicit(PetscInt dim);
+    void BuildHashTable_Explicit(PetscInt dim, const PetscInt* state_map,
+                                 PetscInt hash_bits, PetscInt* hash_table);
+
+    PetscInt Dim_Momentum(const data_Momentum* data);
+    void S2I_Momentum_array(int n, const data_Momentum* data, const PetscInt* states, PetscInt* idxs, PetscInt* shifts);
+    void I2S_Momentum_array(int n, const data_Momentum* data, const PetscInt* idxs, PetscInt* states);
+    void SetupTables_Momentum(data_Momentum* data);
+    void ComputeReps_Momentum(PetscInt L, PetscInt q, PetscInt k, PetscInt* dim,
+                              PetscInt* state_map, PetscInt* periods);
 
 #####
 
@@ -63,6 +97,7 @@ class SubspaceType:
     PARITY = _PARITY
     EXPLICIT = _EXPLICIT
     SPIN_CONSERVE = _SPIN_CONSERVE
+    MOMENTUM = _MOMENTUM
 
 #####
 
@@ -97,21 +132,133 @@ cdef class CSpinConserve:
         self.data[0].ld_nchoosek = nchoosek.shape[1]
         self.data[0].nchoosek = &nchoosek[0, 0]
 
+cdef class SharedBuffer:
+    '''
+    Integer arrays stored once per node, in memory shared by all the ranks on it. Must be
+    constructed collectively, with the same arrays on every rank. The attribute ``arrays``
+    holds read-only views of the copies, which keep the buffer alive.
+    '''
+    cdef shared_buffer* buf
+    cdef public object arrays
+
+    def __init__(self, arrays):
+        cdef int ierr
+        cdef np.npy_intp size
+        cdef PetscInt [:] data_view
+        cdef np.ndarray full
+
+        data = np.ascontiguousarray(np.concatenate([np.ravel(a) for a in arrays]),
+                                    dtype=dnm_int_t)
+        size = data.size
+        if size == 0:
+            data = np.zeros(1, dtype=dnm_int_t)
+        data_view = data
+
+        ierr = SharedBufferCreate(&data_view[0], size*sizeof(PetscInt), &self.buf)
+        if ierr != 0:
+            # imported here so that loading this module does not initialize PETSc
+            from petsc4py.PETSc import Error
+            raise Error(ierr)
+
+        full = np.PyArray_SimpleNewFromData(1, &size, np.dtype(dnm_int_t).num, self.buf.ptr)
+        np.set_array_base(full, self)
+        full.flags.writeable = False
+
+        splits = np.cumsum([np.size(a) for a in arrays])[:-1]
+        self.arrays = np.split(full, splits)
+
+    def __dealloc__(self):
+        SharedBufferRelease(&self.buf)
+
+    @property
+    def node_ranks(self):
+        '''
+        The number of ranks on this node sharing the buffer.
+        '''
+        return self.buf.node_ranks
+
 cdef class CExplicit:
     cdef data_Explicit data[1]
+    cdef object shared
+
+    def __init__(
+            self,
+            PetscInt L,
+            const PetscInt [:] state_map,
+            const PetscInt [:] rmap_indices,
+            const PetscInt [:] rmap_states,
+            const PetscInt [:] hash_table = None,
+            SharedBuffer shared = None
+        ):
+        # the arrays must lie in the shared buffer, if one is given
+        self.shared = shared
+        self.data[0].shared = NULL if shared is None else shared.buf
+
+        self.data[0].L = L
+        self.data[0].dim = state_map.size
+        # the backend never writes to these, so the arrays may be read-only
+        self.data[0].state_map = <PetscInt*>&state_map[0]
+        self.data[0].rmap_indices = <PetscInt*>&rmap_indices[0]
+        self.data[0].rmap_states = <PetscInt*>&rmap_states[0]
+        if hash_table is None:
+            self.data[0].hash_bits = 0
+            self.data[0].hash_table = NULL
+        else:
+            self.data[0].hash_bits = HashBits_Explicit(state_map.size)
+            self.data[0].hash_table = <PetscInt*>&hash_table[0]
+
+def compute_hash_table_Explicit(const PetscInt [:] state_map):
+    '''
+    Build the open-addressing hash table used to look up the index of a state
+    in an Explicit subspace.
+    '''
+    cdef PetscInt hash_bits = HashBits_Explicit(state_map.size)
+    hash_table_np = np.ndarray(2*(1 << hash_bits), dtype = dnm_int_t)
+    cdef PetscInt [:] hash_table = hash_table_np
+    BuildHashTable_Explicit(state_map.size, &state_map[0], hash_bits, &hash_table[0])
+    return hash_table_np
+
+cdef class CMomentum:
+    cdef data_Momentum data[1]
 
     def __init__(
             self,
             PetscInt L,
-            PetscInt [:] state_map,
-            PetscInt [:] rmap_indices,
-            PetscInt [:] rmap_states
+            PetscInt q,
+            PetscInt k,
+            const PetscInt [:] state_map,
+            const PetscInt [:] periods,
+            const PetscInt [:] hash_table = None
         ):
         self.data[0].L = L
+        self.data[0].q = q
+        self.data[0].k = k
         self.data[0].dim = state_map.size
-        self.data[0].state_map = &state_map[0]
-        self.data[0].rmap_indices = &rmap_indices[0]
-        self.data[0].rmap_states = &rmap_states[0]
+        self.data[0].state_map = <PetscInt*>&state_map[0]
+        self.data[0].periods = <PetscInt*>&periods[0]
+        if hash_table is None:
+            self.data[0].hash_bits = 0
+            self.data[0].hash_table = NULL
+        else:
+            self.data[0].hash_bits = HashBits_Explicit(state_map.size)
+            self.data[0].hash_table = <PetscInt*>&hash_table[0]
+        SetupTables_Momentum(self.data)
+
+def compute_reps_Momentum(PetscInt L, PetscInt q, PetscInt k):
+    '''
+    Find the representative states of a momentum sector and their periods under translation.
+    Pass k = -1 to include states with any number of set bits.
+    '''
+    cdef PetscInt dim
+    ComputeReps_Momentum(L, q, k, &dim, NULL, NULL)
+
+    state_map_np = np.ndarray(max(dim, 1), dtype = dnm_int_t)
+    periods_np = np.ndarray(max(dim, 1), dtype = dnm_int_t)
+    cdef PetscInt [:] state_map = state_map_np
+    cdef PetscInt [:] periods = periods_np
+    ComputeReps_Momentum(L, q, k, &dim, &state_map[0], &periods[0])
+
+    return state_map_np[:dim], periods_np[:dim]
 
 #####
 
@@ -124,6 +271,8 @@ cdef void set_data_pointer(int sub_type, object data, void** ptr):
         set_data_pointer_SpinConserve(data, ptr)
     elif sub_type == _EXPLICIT:
         set_data_pointer_Explicit(data, ptr)
+    elif sub_type == _MOMENTUM:
+        set_data_pointer_Momentum(data, ptr)
     else:
         raise ValueError('Invalid data type %s' % str(type(data)))
 
@@ -139,6 +288,9 @@ cdef void set_data_pointer_SpinConserve(CSpinConserve data, void** ptr):
 cdef void set_data_pointer_Explicit(CExplicit data, void** ptr):
     ptr[0] = data.data
 
+cdef void set_data_pointer_Momentum(CMomentum data, void** ptr):
+    ptr[0] = data.data
+
 #####
 
 def get_dimension_Full(CFull data):
@@ -153,6 +305,9 @@ def get_dimension_SpinConserve(CSpinConserve data):
 def get_dimension_Explicit(CExplicit data):
     return Dim_Explicit(data.data)
 
+def get_dimension_Momentum(CMomentum data):
+    return Dim_Momentum(data.data)
+
 #####
 
 def idx_to_state_Full(PetscInt [:] idxs, CFull data):
@@ -179,6 +334,12 @@ def idx_to_state_Explicit(PetscInt [:] idxs, CExplicit data):
     I2S_Explicit_array(idxs.size, data.data, &idxs[0], &states[0])
     return states_np
 
+def idx_to_state_Momentum(PetscInt [:] idxs, CMomentum data):
+    states_np = np.ndarray(idxs.size, dtype = dnm_int_t)
+    cdef PetscInt [:] states = states_np
+    I2S_Momentum_array(idxs.size, data.data, &idxs[0], &states[0])
+    return states_np
+
 #####
 
 def state_to_idx_Full(PetscInt [:] states, CFull data):
@@ -214,6 +375,21 @@ def state_to_idx_Explicit(PetscInt [:] states, CExplicit data):
     S2I_Explicit_array(states.size, data.data, &states[0], &idxs[0])
     return idxs_np
 
+def state_to_idx_Momentum(PetscInt [:] states, CMomentum data, bint return_shifts=False):
+    idxs_np = np.ndarray(states.size, dtype=dnm_int_t)
+    cdef PetscInt [:] idxs = idxs_np
+    cdef PetscInt [:] shifts
+
+    if return_shifts:
+        shifts_np = np.ndarray(states.size, dtype=dnm_int_t)
+        shifts = shifts_np
+        S2I_Momentum_array(states.size, data.data, &states[0], &idxs[0], &shifts[0])
+        return idxs_np, shifts_np
+
+    else:
+        S2I_Momentum_array(states.size, data.data, &states[0], &idxs[0], NULL)
+        return idxs_np
+
 #####
 
 cdef extern int __builtin_parityl(unsigned long x)
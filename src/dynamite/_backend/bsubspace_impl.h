@@ -1,6 +1,10 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <petsc.h>
 
 // TODO: include this in a different header?
@@ -21,7 +25,8 @@ typedef enum _subspace_type
   FULL,
   PARITY,
   EXPLICIT,
-  SPIN_CONSERVE
+  SPIN_CONSERVE,
+  MOMENTUM
 } subspace_type;
 
 typedef struct _subspaces_t
@@ -206,6 +211,25 @@ static inline PetscInt S2I_nocheck_SpinConserve(PetscInt state, PetscInt* sign,
   return idx;
 }
 
+/*
+ * The contribution of the set bits of state to the index computed by S2I_nocheck_SpinConserve,
+ * given that rank set bits lie below all of them. Summing this over a partition of a state's
+ * bits into windows recovers its index, so the index of a state that differs from a known one
+ * only within a window can be found by recomputing just that window.
+ */
+static inline PetscInt PartialS2I_SpinConserve(PetscInt state, PetscInt rank, const data_SpinConserve* data) {
+  PetscInt n, idx=0;
+
+  while (state) {
+    n = builtin_ctz(state);
+    rank++;
+    if (rank <= n) idx += data->nchoosek[rank*data->ld_nchoosek + n];
+    state &= state-1;  // pop least significant bit off of state
+  }
+
+  return idx;
+}
+
 static inline PetscInt S2I_SpinConserve(PetscInt state, PetscInt* sign, const data_SpinConserve* data) {
   if (state >> data->L) return (PetscInt)(-1);
   if (builtin_popcount(state) != data->k) return (PetscInt)(-1);
@@ -268,6 +292,124 @@ static inline void I2S_SpinConserve_array(int n, const data_SpinConserve* data,
   }
 }
 
+/***** SHARED MEMORY *****/
+
+/*
+ * A read-only buffer in a POSIX shared memory segment mapped by every rank on a node, so that
+ * large tables are stored once per node rather than once per rank. It is reference counted
+ * within each process, and unmapping it is a local operation. When a rank is alone on its
+ * node, the buffer is ordinary memory.
+ */
+typedef struct _shared_buffer
+{
+  void* ptr;
+  size_t size;
+  PetscBool mapped;        // whether ptr came from mmap rather than PetscMalloc
+  PetscMPIInt node_ranks;  // the number of ranks sharing the buffer
+  PetscInt refs;
+} shared_buffer;
+
+/*
+ * Collectively create a shared buffer holding a copy of data, which must be the same on every
+ * rank. The first rank on each node creates and fills the segment, and the rest map it
+ * read-only. The segment's name is removed once all of them have it mapped, so the memory is
+ * returned to the system when the last rank unmaps it, even if a rank exits abnormally.
+ */
+static inline PetscErrorCode SharedBufferCreate(const void* data, size_t size, shared_buffer** buf_p)
+{
+  MPI_Comm node_comm;
+  PetscMPIInt node_rank, failed;
+  char name[64];
+  int fd;
+  void* ptr = MAP_FAILED;
+  shared_buffer* buf;
+
+  PetscCall(PetscNew(&buf));
+  buf->size = size;
+  buf->refs = 1;
+
+  PetscCallMPI(MPI_Comm_split_type(PETSC_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm));
+  PetscCallMPI(MPI_Comm_rank(node_comm, &node_rank));
+  PetscCallMPI(MPI_Comm_size(node_comm, &(buf->node_ranks)));
+
+  if (buf->node_ranks == 1 || size == 0) {
+    PetscCallMPI(MPI_Comm_free(&node_comm));
+    PetscCall(PetscMalloc(PetscMax(size, 1), &(buf->ptr)));
+    PetscCall(PetscMemcpy(buf->ptr, data, size));
+    buf->mapped = PETSC_FALSE;
+    *buf_p = buf;
+    return 0;
+  }
+
+  /* the writer names the segment after its pid and this buffer; an empty name means it failed */
+  name[0] = '\0';
+  if (node_rank == 0) {
+    PetscCall(PetscSNPrintf(name, sizeof(name), "/dnm-%d-%p", (int)getpid(), (void*)buf));
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd != -1) {
+      if (ftruncate(fd, (off_t)size) == 0) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+      close(fd);
+    }
+    if (ptr == MAP_FAILED) {
+      if (fd != -1) shm_unlink(name);
+      name[0] = '\0';
+    }
+    else {
+      PetscCall(PetscMemcpy(ptr, data, size));
+    }
+  }
+
+  PetscCallMPI(MPI_Bcast(name, sizeof(name), MPI_CHAR, 0, node_comm));
+
+  if (node_rank != 0 && name[0] != '\0') {
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd != -1) {
+      ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+    }
+  }
+
+  /* everyone has the segment mapped (or has given up), so the name can go */
+  failed = (ptr == MAP_FAILED);
+  PetscCallMPI(MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR, node_comm));
+  if (node_rank == 0 && name[0] != '\0') shm_unlink(name);
+  PetscCallMPI(MPI_Comm_free(&node_comm));
+
+  if (failed) {
+    if (ptr != MAP_FAILED) munmap(ptr, size);
+    PetscCall(PetscFree(buf));
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_MEM, "could not create a shared memory segment");
+  }
+
+  buf->ptr = ptr;
+  buf->mapped = PETSC_TRUE;
+  *buf_p = buf;
+  return 0;
+}
+
+/* drop a reference to a shared buffer, freeing it if it was the last; sets *buf_p to NULL */
+static inline PetscErrorCode SharedBufferRelease(shared_buffer** buf_p)
+{
+  shared_buffer* buf = *buf_p;
+  *buf_p = NULL;
+
+  if (!buf || --(buf->refs) > 0) return 0;
+
+  if (buf->mapped) {
+    if (munmap(buf->ptr, buf->size) != 0) {
+      SETERRQ(PETSC_COMM_SELF, PETSC_ERR_SYS, "could not unmap shared memory segment");
+    }
+  }
+  else {
+    PetscCall(PetscFree(buf->ptr));
+  }
+
+  PetscCall(PetscFree(buf));
+  return 0;
+}
+
 /***** EXPLICIT *****/
 
 typedef struct _data_Explicit
@@ -277,12 +419,57 @@ typedef struct _data_Explicit
   PetscInt* state_map;
   PetscInt* rmap_indices;
   PetscInt* rmap_states;
+  PetscInt hash_bits;      // log2 of the number of slots in hash_table
+  PetscInt* hash_table;    // (state, index) pairs, open addressing; NULL to use binary search
+  shared_buffer* shared;   // if not NULL, the arrays above point into it and are not copied
 } data_Explicit;
 
+/* Fibonacci hashing: the top hash_bits bits of the product spread out nearby states */
+#define EXPLICIT_HASH(state, hash_bits) \
+  ((PetscInt)((((uint64_t)(state)) * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - (hash_bits))))
+
+/* the number of slots is at least this factor times the dimension */
+#define EXPLICIT_HASH_LOAD_INV 1.5
+
+static inline PetscInt HashBits_Explicit(PetscInt dim) {
+  PetscInt hash_bits = 1;
+  while ((((PetscInt)1) << hash_bits) < EXPLICIT_HASH_LOAD_INV*dim) ++hash_bits;
+  return hash_bits;
+}
+
+/*
+ * Fill hash_table, which must have room for 2<<hash_bits entries, with the (state, index) pairs
+ * of the subspace. Collisions are resolved by linear probing, and empty slots hold state -1.
+ */
+static inline void BuildHashTable_Explicit(PetscInt dim, const PetscInt* state_map,
+                                           PetscInt hash_bits, PetscInt* hash_table) {
+  PetscInt i, slot;
+  PetscInt slot_mask = (((PetscInt)1) << hash_bits) - 1;
+
+  for (i = 0; i < 2*(slot_mask+1); ++i) {
+    hash_table[i] = -1;
+  }
+
+  for (i = 0; i < dim; ++i) {
+    slot = EXPLICIT_HASH(state_map[i], hash_bits);
+    while (hash_table[2*slot] != -1) {
+      slot = (slot+1) & slot_mask;
+    }
+    hash_table[2*slot] = state_map[i];
+    hash_table[2*slot+1] = i;
+  }
+}
+
 static inline PetscErrorCode CopySubspaceData_Explicit(data_Explicit** out_p, const data_Explicit* in) {
   PetscCall(PetscMalloc1(1, out_p));
   PetscCall(PetscMemcpy(*out_p, in, sizeof(data_Explicit)));
 
+  /* arrays in shared memory are read-only, so the copy can just refer to them */
+  if (in->shared) {
+    ++(in->shared->refs);
+    return 0;
+  }
+
   PetscCall(PetscMalloc1(in->dim, &((*out_p)->state_map)));
   PetscCall(PetscMemcpy((*out_p)->state_map, in->state_map, in->dim*sizeof(PetscInt)));
 
@@ -292,13 +479,25 @@ static inline PetscErrorCode CopySubspaceData_Explicit(data_Explicit** out_p, co
   PetscCall(PetscMalloc1(in->dim, &((*out_p)->rmap_states)));
   PetscCall(PetscMemcpy((*out_p)->rmap_states, in->rmap_states, in->dim*sizeof(PetscInt)));
 
+  if (in->hash_table) {
+    PetscCall(PetscMalloc1(((PetscInt)2) << in->hash_bits, &((*out_p)->hash_table)));
+    PetscCall(PetscMemcpy((*out_p)->hash_table, in->hash_table, (((PetscInt)2) << in->hash_bits)*sizeof(PetscInt)));
+  }
+
   return 0;
 }
 
 static inline PetscErrorCode DestroySubspaceData_Explicit(data_Explicit* data) {
+  if (data->shared) {
+    PetscCall(SharedBufferRelease(&(data->shared)));
+    PetscCall(PetscFree(data));
+    return 0;
+  }
+
   PetscCall(PetscFree(data->state_map));
   PetscCall(PetscFree(data->rmap_indices));
   PetscCall(PetscFree(data->rmap_states));
+  PetscCall(PetscFree(data->hash_table));
   PetscCall(PetscFree(data));
   return 0;
 }
@@ -308,8 +507,23 @@ static inline PetscInt Dim_Explicit(const data_Explicit* data) {
 }
 
 static inline PetscInt S2I_Explicit(PetscInt state, const data_Explicit* data) {
-  /* do a binary search on rmap_states */
   PetscInt left, right, mid;
+  PetscInt slot, slot_mask;
+
+  /* probe the hash table, if we have one */
+  if (data->hash_table) {
+    slot_mask = (((PetscInt)1) << data->hash_bits) - 1;
+    slot = EXPLICIT_HASH(state, data->hash_bits);
+    while (data->hash_table[2*slot] != -1) {
+      if (data->hash_table[2*slot] == state) {
+        return data->hash_table[2*slot+1];
+      }
+      slot = (slot+1) & slot_mask;
+    }
+    return -1;
+  }
+
+  /* otherwise do a binary search on rmap_states */
   left = 0;
   right = data->dim-1;
   while (left <= right) {
@@ -355,3 +569,253 @@ static inline void I2S_Explicit_array(int n, const data_Explicit* data, const Pe
     states[i] = I2S_Explicit(idxs[i], data);
   }
 }
+
+/***** MOMENTUM *****/
+
+/*
+ * The states with momentum 2*pi*q/L under translation T, which moves the spin on site i to
+ * site i+1 (mod L). For each orbit of product states under T, the basis contains (at most)
+ * one state: the normalized sum over the orbit of T^l |r> with amplitude e^{-2 pi i q l/L},
+ * where the representative r is the smallest state in the orbit. That sum vanishes unless
+ * the period R of r (the smallest R > 0 with T^R r = r) satisfies q*R = 0 (mod L), so only
+ * those orbits are included. If k >= 0, only states with k set bits are included.
+ *
+ * An operator that commutes with T has matrix element
+ *   <a|H|b> = sum over terms |ket><bra| with ket = a of  v * e^{2 pi i q l/L} * sqrt(R_a/R_b)
+ * between representatives a and b, where T^l bra = b; see ElementFactor_Momentum.
+ */
+
+#define MOMENTUM_MAX_L 64
+
+typedef struct _data_Momentum
+{
+  PetscInt L;
+  PetscInt q;
+  PetscInt k;              // number of set bits, or -1 for no restriction
+  PetscInt dim;
+  PetscInt* state_map;     // the representatives, in increasing order
+  PetscInt* periods;       // the period of each representative
+  PetscInt hash_bits;
+  PetscInt* hash_table;    // as for Explicit; NULL to use binary search on state_map
+  PetscReal phases[2*MOMENTUM_MAX_L];       // cos and sin of 2 pi q l/L, for each l < L
+  PetscReal sqrt_periods[MOMENTUM_MAX_L+1];
+} data_Momentum;
+
+/* fill in the lookup tables of data, once L and q are set */
+static inline void SetupTables_Momentum(data_Momentum* data) {
+  PetscInt l;
+  PetscReal angle;
+
+  for (l = 0; l < data->L; ++l) {
+    /* reduce first, so that the small angles are exact */
+    angle = 2*PETSC_PI*(PetscReal)((data->q*l) % data->L)/data->L;
+    data->phases[2*l] = PetscCosReal(angle);
+    data->phases[2*l+1] = PetscSinReal(angle);
+  }
+
+  for (l = 0; l <= data->L; ++l) {
+    data->sqrt_periods[l] = PetscSqrtReal((PetscReal)l);
+  }
+}
+
+/* T applied to state: rotate the lowest L bits left by one */
+static inline PetscInt Translate_Momentum(PetscInt state, PetscInt L) {
+  uint64_t s = (uint64_t)state;
+  return (PetscInt)(((s << 1) | (s >> (L-1))) & ((UINT64_C(1) << L) - 1));
+}
+
+/* the representative of state's orbit, with T^shift state = rep, and the orbit's period */
+static inline PetscInt Representative_Momentum(PetscInt state, PetscInt L, PetscInt* shift, PetscInt* period) {
+  PetscInt rep = state, rotated = state, l;
+
+  *shift = 0;
+  *period = L;
+  for (l = 1; l < L; ++l) {
+    rotated = Translate_Momentum(rotated, L);
+    if (rotated == state) {
+      *period = l;
+      break;
+    }
+    if (rotated < rep) {
+      rep = rotated;
+      *shift = l;
+    }
+  }
+
+  return rep;
+}
+
+/* the next state to consider when enumerating the representatives, or -1 if there are none */
+static inline PetscInt NextCandidate_Momentum(PetscInt state, PetscInt k) {
+  PetscInt lowest, ripple;
+
+  if (k < 0) return state+1;
+  if (state == 0) return -1;
+
+  /* the next larger integer with the same number of set bits */
+  lowest = state & -state;
+  ripple = state + lowest;
+  return (((ripple ^ state) >> 2) / lowest) | ripple;
+}
+
+/*
+ * Find the representatives of the subspace in increasing order, with their periods. With
+ * state_map NULL, they are only counted into *dim. A state is skipped as soon as one of its
+ * rotations is found to be smaller, so most states cost only a few rotations.
+ */
+static inline void ComputeReps_Momentum(PetscInt L, PetscInt q, PetscInt k, PetscInt* dim,
+                                        PetscInt* state_map, PetscInt* periods) {
+  PetscInt state, rotated, l, period, end;
+
+  end = ((PetscInt)1) << L;
+  *dim = 0;
+  for (state = (k < 0) ? 0 : (((PetscInt)1) << k) - 1;
+       state >= 0 && state < end;
+       state = NextCandidate_Momentum(state, k)) {
+
+    rotated = state;
+    period = L;
+    for (l = 1; l < L; ++l) {
+      rotated = Translate_Momentum(rotated, L);
+      if (rotated <= state) break;
+    }
+
+    if (l < L) {
+      if (rotated < state) continue;
+      period = l;
+    }
+
+    if ((q*period) % L != 0) continue;
+
+    if (state_map) {
+      state_map[*dim] = state;
+      periods[*dim] = period;
+    }
+    ++(*dim);
+  }
+}
+
+static inline PetscErrorCode CopySubspaceData_Momentum(data_Momentum** out_p, const data_Momentum* in) {
+  PetscCall(PetscMalloc1(1, out_p));
+  PetscCall(PetscMemcpy(*out_p, in, sizeof(data_Momentum)));
+
+  PetscCall(PetscMalloc1(in->dim, &((*out_p)->state_map)));
+  PetscCall(PetscMemcpy((*out_p)->state_map, in->state_map, in->dim*sizeof(PetscInt)));
+
+  PetscCall(PetscMalloc1(in->dim, &((*out_p)->periods)));
+  PetscCall(PetscMemcpy((*out_p)->periods, in->periods, in->dim*sizeof(PetscInt)));
+
+  if (in->hash_table) {
+    PetscCall(PetscMalloc1(((PetscInt)2) << in->hash_bits, &((*out_p)->hash_table)));
+    PetscCall(PetscMemcpy((*out_p)->hash_table, in->hash_table, (((PetscInt)2) << in->hash_bits)*sizeof(PetscInt)));
+  }
+
+  return 0;
+}
+
+static inline PetscErrorCode DestroySubspaceData_Momentum(data_Momentum* data) {
+  PetscCall(PetscFree(data->state_map));
+  PetscCall(PetscFree(data->periods));
+  PetscCall(PetscFree(data->hash_table));
+  PetscCall(PetscFree(data));
+  return 0;
+}
+
+static inline PetscInt Dim_Momentum(const data_Momentum* data) {
+  return data->dim;
+}
+
+/* the index of a representative, or -1 if it is not one of the subspace's */
+static inline PetscInt RepIndex_Momentum(PetscInt rep, const data_Momentum* data) {
+  PetscInt left, right, mid;
+  PetscInt slot, slot_mask;
+
+  if (data->hash_table) {
+    slot_mask = (((PetscInt)1) << data->hash_bits) - 1;
+    slot = EXPLICIT_HASH(rep, data->hash_bits);
+    while (data->hash_table[2*slot] != -1) {
+      if (data->hash_table[2*slot] == rep) {
+        return data->hash_table[2*slot+1];
+      }
+      slot = (slot+1) & slot_mask;
+    }
+    return -1;
+  }
+
+  left = 0;
+  right = data->dim-1;
+  while (left <= right) {
+    mid = left + (right-left)/2;
+    if (data->state_map[mid] == rep) return mid;
+    if (data->state_map[mid] < rep) left = mid + 1;
+    else right = mid - 1;
+  }
+  return -1;
+}
+
+/*
+ * The index of the basis state whose orbit contains state, or -1 if there is none. If shift
+ * is not NULL, it is set to the l with T^l state equal to the representative.
+ */
+static inline PetscInt S2I_Momentum(PetscInt state, PetscInt* shift, const data_Momentum* data) {
+  PetscInt rep, l, period;
+
+  if (state >> data->L) return (PetscInt)(-1);
+  if (data->k >= 0 && builtin_popcount(state) != data->k) return (PetscInt)(-1);
+
+  rep = Representative_Momentum(state, data->L, &l, &period);
+  if (shift != NULL) {
+    *shift = l;
+  }
+
+  return RepIndex_Momentum(rep, data);
+}
+
+static inline PetscInt I2S_Momentum(PetscInt idx, const data_Momentum* data) {
+  return data->state_map[idx];
+}
+
+static inline PetscInt NextState_Momentum(
+  PetscInt prev_state,
+  PetscInt idx,
+  const data_Momentum* data
+)
+{
+  return I2S_Momentum(idx, data);
+};
+
+/*
+ * The factor multiplying <ket|term|bra> in the matrix element between the basis states with
+ * indices row_idx (whose representative is ket) and col_idx, where T^shift bra is col_idx's
+ * representative. Only real for q = 0 or 2q = L, in which case the sine is dropped.
+ */
+static inline PetscScalar ElementFactor_Momentum(PetscInt row_idx, PetscInt col_idx, PetscInt shift,
+                                                 const data_Momentum* data) {
+  PetscReal nrm = data->sqrt_periods[data->periods[row_idx]]/data->sqrt_periods[data->periods[col_idx]];
+#if defined(PETSC_USE_COMPLEX)
+  return nrm*PetscCMPLX(data->phases[2*shift], data->phases[2*shift+1]);
+#else
+  return nrm*data->phases[2*shift];
+#endif
+}
+
+static inline void S2I_Momentum_array(int n, const data_Momentum* data, const PetscInt* states, PetscInt* idxs, PetscInt* shifts) {
+  PetscInt i;
+
+  if (shifts) {
+    for (i = 0; i < n; ++i) {
+      idxs[i] = S2I_Momentum(states[i], &(shifts[i]), data);
+    }
+  } else {
+    for (i = 0; i < n; ++i) {
+      idxs[i] = S2I_Momentum(states[i], NULL, data);
+    }
+  }
+}
+
+static inline void I2S_Momentum_array(int n, const data_Momentum* data, const PetscInt* idxs, PetscInt* states) {
+  PetscInt i;
+  for (i = 0; i < n; ++i) {
+    states[i] = I2S_Momentum(idxs[i], data);
+  }
+}
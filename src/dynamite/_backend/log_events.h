@@ -0,0 +1,81 @@
+#pragma once
+
+#include <petsc.h>
+
+/*
+ * PETSc log events for the backend's kernels, so that they appear by name under -log_view
+ * and in the profile from GetEventProfile. PETSc only counts flops, so each event also
+ * counts the bytes of vector data its kernels read and write, assuming each access goes
+ * to memory (an upper bound on the traffic when some of it is served from cache).
+ */
+
+typedef enum _dnm_event {
+  EVENT_BUILD_MAT,       /* all of BuildMat, for any matrix type */
+  EVENT_COMPUTE_ROWS,    /* computing the matrix elements of non-shell matrices */
+  EVENT_UPDATE_MAT,
+  EVENT_SHELL_MULT,      /* shell matvecs, CPU or GPU */
+  EVENT_SHELL_MATMAT,    /* shell products with dense matrices */
+  EVENT_SHELL_COMM,      /* exchanging vector entries between ranks during shell products */
+  EVENT_SHELL_NORM,
+  EVENT_CHECK_CONSERVES,
+  EVENT_RDM,
+  EVENT_EXPECTATION,
+  EVENT_COMPUTE_AUTO,
+  EVENT_COMPUTE_RCM,     /* logged from the Python side, since compute_rcm lives in bsubspace */
+  DNM_N_EVENTS
+} dnm_event;
+
+typedef struct _event_profile {
+  PetscLogDouble count;          /* max over ranks */
+  PetscLogDouble time;           /* max over ranks, in seconds */
+  PetscLogDouble flops;          /* summed over ranks, as are the rest */
+  PetscLogDouble bytes;
+  PetscLogDouble messages;
+  PetscLogDouble message_bytes;
+  PetscLogDouble reductions;
+} event_profile;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const char* const dnm_event_names[DNM_N_EVENTS];
+extern PetscLogEvent dnm_events[DNM_N_EVENTS];
+extern PetscLogDouble dnm_event_bytes[DNM_N_EVENTS];
+
+/* register the events with PETSc, if that hasn't been done yet */
+PetscErrorCode RegisterEvents(void);
+
+/* the profile of an event, reduced over all ranks; collective */
+PetscErrorCode GetEventProfile(dnm_event event, event_profile *profile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define DNM_LOG_BYTES(event, n) (dnm_event_bytes[event] += (PetscLogDouble)(n))
+
+/*
+ * Log the work of applying a shell matrix with nmasks masks and nterms terms to n_vecs
+ * vectors of local_rows rows each: every term is evaluated once per row, and every mask
+ * adds one product per row and vector, reading one element of x. Pass nterms = 0 when the
+ * matrix elements are precomputed (as with mask-diagonal storage).
+ */
+static inline PetscErrorCode LogShellProduct(dnm_event event, PetscInt nmasks, PetscInt nterms,
+                                             PetscInt local_rows, PetscInt n_vecs, PetscBool gpu)
+{
+  PetscLogDouble flops = 2.0*local_rows*(nterms + (PetscLogDouble)nmasks*n_vecs);
+
+#if defined(PETSC_HAVE_DEVICE)
+  if (gpu) {
+    PetscCall(PetscLogGpuFlops(flops));
+  }
+  else
+#endif
+  {
+    PetscCall(PetscLogFlops(flops));
+  }
+
+  DNM_LOG_BYTES(event, (PetscLogDouble)local_rows*n_vecs*(nmasks+2)*sizeof(PetscScalar));
+  return 0;
+}
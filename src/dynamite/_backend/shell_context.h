@@ -11,6 +11,7 @@ typedef struct _msc_t {
 
 typedef struct _shell_context {
   PetscInt nmasks;
+  PetscInt nterms;            // mask_offsets[nmasks], kept on the host even for the GPU shell
   PetscInt* masks;
   PetscInt* mask_offsets;
   PetscInt* signs;
@@ -18,4 +19,16 @@ typedef struct _shell_context {
   void *left_subspace_data;
   void *right_subspace_data;
   PetscReal nrm;
+  PetscInt nthreads;          // number of OpenMP threads to use in the CPU matvec
+  PetscInt n_ghosts;          // number of off-process columns touched by our rows
+  PetscInt* ghost_cols;       // sorted global indices of those columns
+  Vec ghost_vec;              // local buffer holding their values during a matvec
+  VecScatter ghost_scatter;   // communication plan filling ghost_vec, built once
+  PetscInt fast_block_spins;  // log2 of the aligned block size for the fast matvec; 0 if unusable, -1 if unknown
+  PetscReal* dia_values;      // mask-diagonal storage: each mask's coefficient for every local column, or NULL
+  PetscInt* dia_re_offsets;   // per mask, offset of its real (resp. imaginary) part in dia_values; -1 if zero
+  PetscInt* dia_im_offsets;
+  int gpu_block_num;          // launch geometry for the GPU matvec kernels, chosen in BuildGPUShell
+  int gpu_block_size;
+  size_t gpu_shared_size;     // bytes of shared memory for staging the MSC arrays; 0 to read them from global memory
 } shell_context;
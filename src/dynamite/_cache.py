@@ -0,0 +1,160 @@
+'''
+The on-disk cache of assembled matrices and Auto subspace mappings, enabled by setting
+``config.cache_dir``.
+
+Entries are named by a hash of everything that determines their contents, so they never
+need to be invalidated: an entry is either exactly what we would compute, or not found.
+Files are written under a temporary name and then renamed, so that jobs sharing a cache
+directory never see a partially written entry.
+'''
+
+from hashlib import sha256
+from os import urandom
+import os
+
+import numpy as np
+
+from . import config
+
+# bump when the format of the entries changes, so that old entries are not used
+CACHE_VERSION = 1
+
+
+def key(*parts):
+    '''
+    Hash the parts (bytes, or anything with a stable str) into a key for a cache entry.
+    '''
+    h = sha256(b'dynamite-cache-%d' % CACHE_VERSION)
+    for part in parts:
+        if not isinstance(part, bytes):
+            part = str(part).encode('utf-8')
+        # prefix the length, so that different splits of the same bytes hash differently
+        h.update(b'%d:' % len(part))
+        h.update(part)
+    return h.hexdigest()
+
+
+def path(kind, entry_key, ext):
+    '''
+    The path of a cache entry, or None if the cache is disabled.
+    '''
+    if config.cache_dir is None:
+        return None
+    return os.path.join(config.cache_dir, '%s-%s%s' % (kind, entry_key, ext))
+
+
+def _bcast(value):
+    '''
+    The value from rank 0, on every rank.
+    '''
+    from petsc4py import PETSc
+
+    if PETSc.COMM_WORLD.size == 1:
+        return value
+
+    return PETSc.COMM_WORLD.tompi4py().bcast(value, root=0)
+
+
+def exists(fname):
+    '''
+    Whether the cache entry exists, agreed on by all ranks (entries may be created by other
+    jobs at any time, and the ranks must all take the same branch on the result). Only
+    collective when the cache is enabled, i.e. when fname is not None.
+    '''
+    if fname is None:
+        return False
+
+    from petsc4py import PETSc
+
+    found = None
+    if PETSc.COMM_WORLD.rank == 0:
+        found = os.path.exists(fname)
+    return _bcast(found)
+
+
+def _tmp_name(fname):
+    return '%s.%s.tmp' % (fname, urandom(8).hex())
+
+
+def load_array(fname):
+    '''
+    Memory-map an array from the cache, or return None if it is not there. Collective
+    unless fname is None.
+    '''
+    if fname is None:
+        return None
+
+    if not exists(fname):
+        return None
+    return np.load(fname, mmap_mode='r')
+
+
+def save_array(fname, array):
+    '''
+    Store an array in the cache. Only rank 0 writes, so this need not be called collectively.
+    '''
+    from petsc4py import PETSc
+
+    if fname is None or PETSc.COMM_WORLD.rank != 0:
+        return
+
+    os.makedirs(os.path.dirname(fname), exist_ok=True)
+    tmp = _tmp_name(fname)
+    with open(tmp, 'wb') as f:
+        np.save(f, array)
+    os.replace(tmp, fname)
+
+
+def load_mat(fname, dims, half_storage):
+    '''
+    Load a matrix from the cache, with the given (rows, columns) and the same layout and
+    options as BuildMat gives it. Collective.
+    '''
+    from petsc4py import PETSc
+    from ._backend import bpetsc
+
+    mat = PETSc.Mat().create()
+    mat.setSizes([(bpetsc.split_ownership(d), d) for d in dims])
+    mat.setFromOptions()
+
+    if half_storage:
+        mat.setType(PETSc.Mat.Type.SBAIJ)
+
+    viewer = PETSc.Viewer().createBinary(fname, mode=PETSc.Viewer.Mode.READ)
+    mat.load(viewer)
+    viewer.destroy()
+
+    # SBAIJ assumes the matrix is symmetric unless told otherwise
+    if half_storage:
+        if np.dtype(PETSc.ScalarType).kind == 'c':
+            mat.setOption(PETSc.Mat.Option.HERMITIAN, True)
+        else:
+            mat.setOption(PETSc.Mat.Option.SYMMETRIC, True)
+        mat.setOption(PETSc.Mat.Option.SYMMETRY_ETERNAL, True)
+
+    return mat
+
+
+def save_mat(fname, mat):
+    '''
+    Store an assembled matrix in the cache. Collective.
+    '''
+    from petsc4py import PETSc
+
+    if fname is None:
+        return
+
+    # the ranks must agree on the temporary name, since they all write through one viewer
+    tmp = None
+    if PETSc.COMM_WORLD.rank == 0:
+        os.makedirs(os.path.dirname(fname), exist_ok=True)
+        tmp = _tmp_name(fname)
+    tmp = _bcast(tmp)
+
+    viewer = PETSc.Viewer().createBinary(tmp, mode=PETSc.Viewer.Mode.WRITE)
+    mat.view(viewer)
+    viewer.destroy()
+
+    PETSc.COMM_WORLD.barrier()
+    if PETSc.COMM_WORLD.rank == 0:
+        os.replace(tmp, fname)
@@ -1,5 +1,4 @@
-
-from . import config
+from . import config, msc_tools, subspaces
 from .states import State
 from .tools import complex_enabled
 from .msc_tools import dnm_int_t
@@ -59,7 +58,6 @@ def evolve(H, state, t, result=None, **kwargs):
     state.assert_initialized()
 
     config._initialize()
-    from slepc4py import SLEPc
 
     H.establish_L()
 
@@ -80,12 +78,27 @@ def evolve(H, state, t, result=None, **kwargs):
         raise ValueError('configure PETSc to use complex numbers to '
                          'perform real time evolution')
 
+    mfn = _create_mfn(H, state.subspace, **kwargs)
+    mfn.getFN().setScale(-1j*t)
+
+    mfn.solve(state.vec,result.vec)
+    _check_mfn_converged(mfn)
+
+    result.set_initialized()
+
+    return result
+
+def _create_mfn(H, subspace, **kwargs):
+    """
+    Set up a SLEPc MFN solver for the exponential of H on the given subspace. The scale of
+    its FN is to be set before each solve. See :meth:`evolve` for the keyword arguments.
+    """
+    from slepc4py import SLEPc
+
     mfn = SLEPc.MFN().create()
     f = mfn.getFN()
     f.setType(SLEPc.FN.Type.EXP)
 
-    f.setScale(-1j*t)
-
     if 'algo' in kwargs:
         mfn.setType(kwargs['algo'])
     else:
@@ -98,10 +111,11 @@ def evolve(H, state, t, result=None, **kwargs):
         mfn.setTolerances(kwargs['tol'])
 
     mfn.setFromOptions()
-    mfn.setOperator(H.get_mat(subspaces=(state.subspace, state.subspace)))
+    mfn.setOperator(H.get_mat(subspaces=(subspace, subspace)))
 
-    mfn.solve(state.vec,result.vec)
+    return mfn
 
+def _check_mfn_converged(mfn):
     conv = mfn.getConvergedReason()
     if conv <= 0:
         if conv == -1:
@@ -114,9 +128,188 @@ def evolve(H, state, t, result=None, **kwargs):
         else:
             raise RuntimeError('solver failed to converge.')
 
-    result.set_initialized()
+def evolve_trajectory(H, state, times, observables=None, **kwargs):
+    r"""
+    Evolve a quantum state under the Hamiltonian H through a sequence of times,
+    measuring some observables (or returning the state itself) at each one.
 
-    return result
+    This is a generator: the results for each time are yielded as soon as they are
+    computed, so they can be processed or saved without keeping every intermediate
+    state in memory. The state is evolved incrementally from each time to the next,
+    and the solver and work vectors are set up only once and reused for every step,
+    which is much cheaper than calling :meth:`evolve` separately for each time.
+
+    Parameters
+    ----------
+
+    H : Operator
+        The Hamiltonian
+
+    state : dynamite.states.State
+        The state at time 0. It is not modified.
+
+    times : array-like of float
+        The times at which to measure. Consecutive times need not be evenly spaced,
+        and can decrease to evolve backwards.
+
+    observables : list, optional
+        What to measure after each step. Each entry is either an Operator, whose
+        expectation value in the evolved state is computed (all of them together,
+        with :meth:`expectation_values`), or a function that takes
+        the evolved state and returns any value, for example
+        ``lambda s: reduced_density_matrix(s, keep)``. If omitted, the evolved state
+        itself is yielded.
+
+    **kwargs :
+        The options ``tol``, ``algo``, and ``ncv`` of :meth:`evolve`.
+
+    Yields
+    ------
+    tuple(float, list) or tuple(float, dynamite.states.State)
+        The time and a list of the measured values, in the same order as ``observables``.
+        Without ``observables``, the time and the evolved state; the same State object
+        is reused for later steps, so copy it if it needs to be kept.
+    """
+    state.assert_initialized()
+
+    config._initialize()
+
+    H.establish_L()
+
+    if not H.has_subspace(state.subspace, state.subspace):
+        raise ValueError('Hamiltonian and state are defined on different '
+                         'subspaces.')
+
+    mfn = None
+    f = None
+
+    current = state.copy()
+    work = State(L=H.L, subspace=state.subspace)
+
+    if observables is not None:
+        op_idxs = [i for i, obs in enumerate(observables) if not callable(obs)]
+
+    t_prev = 0.0
+    for t in times:
+        dt = t - t_prev
+        t_prev = t
+
+        if dt != 0.0:
+            if not complex_enabled() and dt.real != 0:
+                raise ValueError('configure PETSc to use complex numbers to '
+                                 'perform real time evolution')
+
+            if mfn is None:
+                mfn = _create_mfn(H, state.subspace, **kwargs)
+                f = mfn.getFN()
+
+            f.setScale(-1j*dt)
+            mfn.solve(current.vec, work.vec)
+            _check_mfn_converged(mfn)
+            work.set_initialized()
+
+            current, work = work, current
+
+        if observables is None:
+            yield t, current
+            continue
+
+        # all of the Operators are measured together in one pass
+        values = [None]*len(observables)
+        if op_idxs:
+            op_values = expectation_values(current, [observables[i] for i in op_idxs])
+            for i, value in zip(op_idxs, op_values):
+                values[i] = value
+
+        for i, obs in enumerate(observables):
+            if callable(obs):
+                values[i] = obs(current)
+
+        yield t, values
+
+def expectation_values(state, operators):
+    r"""
+    Compute the expectation values :math:`\langle \psi | O | \psi \rangle` of a list of
+    operators in a state, without building any of their matrices.
+
+    All of the operators are evaluated together in a single pass over the state vector,
+    so this is much faster than calling ``state.dot(O.dot(state))`` for each operator when
+    there are many of them (for example all of the :math:`\sigma^z_i \sigma^z_j`
+    correlators).
+
+    Parameters
+    ----------
+
+    state : dynamite.states.State
+        A dynamite State object.
+
+    operators : list(dynamite.operators.Operator)
+        The operators to measure. They need not conserve the state's subspace. For a
+        :class:`~dynamite.subspaces.Momentum` subspace each is averaged over translations
+        first, and for a :class:`~dynamite.subspaces.SpinConserve` subspace with spinflip
+        set, over the global spin flip; neither changes its expectation value.
+
+    Returns
+    -------
+    numpy.ndarray
+        The expectation values, in the same order as ``operators``. The array
+        is returned on all processes.
+    """
+    state.assert_initialized()
+
+    config._initialize()
+    from ._backend import bpetsc
+
+    masks = []
+    mask_offsets = []
+    signs = []
+    coeffs = []
+    op_offsets = [0]
+
+    n_terms = 0
+    for op in operators:
+        if op.max_spin_idx >= state.L:
+            raise ValueError('operator has support on spin %d, but the state only has %d spins'
+                             % (op.max_spin_idx, state.L))
+
+        op.reduce_msc()
+        msc = op.msc
+
+        # a state of definite momentum can't tell an operator from its average over
+        # translations, and the backend needs an operator that commutes with them
+        if isinstance(state.subspace, subspaces.Momentum):
+            msc = msc_tools.translation_average(msc, state.L)
+
+        # likewise for the global spin flip, whose symmetric and antisymmetric combinations
+        # of product states are the basis of spinflip subspaces
+        elif isinstance(state.subspace, subspaces.SpinConserve) and state.subspace.spinflip:
+            msc = msc_tools.spinflip_average(msc)
+
+        op_masks, op_mask_offsets = op._get_mask_offsets(msc)
+
+        masks.append(op_masks)
+        mask_offsets.append(op_mask_offsets[:-1] + n_terms)
+        signs.append(msc['signs'])
+        coeffs.append(msc['coeffs'])
+
+        n_terms += msc.shape[0]
+        op_offsets.append(op_offsets[-1] + op_masks.size)
+
+    mask_offsets.append([n_terms])
+
+    if not operators:
+        return np.zeros(0, dtype=np.complex128)
+
+    return bpetsc.expectation_values(
+        masks = np.ascontiguousarray(np.concatenate(masks), dtype=dnm_int_t),
+        mask_offsets = np.ascontiguousarray(np.concatenate(mask_offsets), dtype=dnm_int_t),
+        signs = np.ascontiguousarray(np.concatenate(signs), dtype=dnm_int_t),
+        coeffs = np.ascontiguousarray(np.concatenate(coeffs), dtype=np.complex128),
+        op_offsets = np.array(op_offsets, dtype=dnm_int_t),
+        v = state.vec,
+        sub_type = state.subspace.to_enum(),
+        sub_data = state.subspace.get_cdata()
+    )
 
 def eigsolve(H, getvecs=False, nev=1, which='smallest', target=None, tol=None, subspace=None):
     r"""
@@ -255,8 +448,9 @@ def reduced_density_matrix(state, keep):
     tracing out some set of spins. The spins to be kept (not traced out)
     are specified in the ``keep`` array.
 
-    The density matrix is returned on process 0, the function
-    returns a 1x1 matrix containing the value -1 on all other processes.
+    The computation is distributed across all processes, but the density
+    matrix is returned on process 0 only; the function returns a 1x1 matrix
+    containing the value -1 on all other processes.
 
     Parameters
     ----------
@@ -312,8 +506,9 @@ def entanglement_entropy(state, keep):
     spin chain. To be precise, this is the bipartite entropy of
     entanglement.
 
-    Currently, this quantity is computed entirely on process 0.
-    As a result, the function returns ``-1`` on all other processes.
+    The reduced density matrix is computed in parallel, but this quantity is
+    then computed from it on process 0 only. As a result, the function returns
+    ``-1`` on all other processes.
 
     Parameters
     ----------
@@ -332,7 +527,7 @@ def entanglement_entropy(state, keep):
 
     reduced = reduced_density_matrix(state, keep)
 
-    # currently everything computed on process 0
+    # the reduced density matrix is only returned on process 0
     if reduced[0,0] == -1:
         return -1
 
@@ -369,8 +564,9 @@ def renyi_entropy(state, keep, alpha, method='eigsolve'):
     Arbitrary non-negative values of ``alpha`` are allowed; in the special cases
     of :math:`\alpha \in \{ 0, 1 \}` the function is computed in the limit.
 
-    Currently, this quantity is computed entirely on process 0.
-    As a result, the function returns ``-1`` on all other processes.
+    The reduced density matrix is computed in parallel, but this quantity is
+    then computed from it on process 0 only. As a result, the function returns
+    ``-1`` on all other processes.
 
     Parameters
     ----------
@@ -397,7 +593,7 @@ def renyi_entropy(state, keep, alpha, method='eigsolve'):
 
     reduced = reduced_density_matrix(state, keep)
 
-    # currently everything computed on process 0
+    # the reduced density matrix is only returned on process 0
     if reduced[0,0] == -1:
         return -1
 
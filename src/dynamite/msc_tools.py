@@ -10,6 +10,7 @@ import scipy.sparse
 from .bitwise import parity, intlog2
 
 from ._backend.bbuild import dnm_int_t
+from ._backend import bmsc
 
 msc_dtype = np.dtype([('masks', dnm_int_t),
                       ('signs', dnm_int_t),
@@ -167,23 +168,17 @@ def msc_product(iterable):
     '''
     vals = list(iterable)
 
-    # an efficient way of doing the cartesian product
-    all_terms = np.array(np.meshgrid(*vals)).reshape(len(vals),-1)
+    # the empty product
+    if not vals:
+        return np.array([(0, 0, 1)], dtype=msc_dtype)
 
-    # the following is the product on the MSC representation
-    rtn = all_terms[0]
+    # multiply in one factor at a time, combining like terms as they are generated, so that
+    # memory use follows the number of distinct terms instead of the full cartesian product
+    rtn = bmsc.combine(*_to_arrays(vals[0]))
+    for term in vals[1:]:
+        rtn = bmsc.product(*rtn, *_to_arrays(term))
 
-    # if there was a zero in the terms
-    if all_terms.size == 0:
-        return rtn
-
-    for term in all_terms[1:]:
-        flipped = term['masks'] & rtn['signs']
-        rtn['masks'] ^= term['masks']
-        rtn['signs'] ^= term['signs']
-        rtn['coeffs'] *= (-1)**parity(flipped) * term['coeffs']
-
-    return rtn
+    return _from_arrays(*rtn)
 
 def shift(msc, shift_idx, wrap_idx):
     '''
@@ -236,6 +231,72 @@ def shift(msc, shift_idx, wrap_idx):
 
     return msc
 
+def translation_invariant(msc, L):
+    '''
+    Whether an MSC representation is unchanged by translating it by one site along a periodic
+    spin chain of length ``L`` (and thus by any number of sites).
+
+    Parameters
+    ----------
+    MSC : np.ndarray
+        The input MSC representation.
+
+    L : int
+        The spin chain length.
+
+    Returns
+    -------
+    bool
+        Whether the representation is translation invariant.
+    '''
+    msc = combine_and_sort(msc)
+    coeffs = coeffs_on_terms(msc, shift(msc, 1, L))
+    return coeffs is not None and np.allclose(coeffs, msc['coeffs'])
+
+def translation_average(msc, L):
+    '''
+    Average an MSC representation over all translations along a periodic spin chain of
+    length ``L``. The result is translation invariant, and has the same expectation value as
+    the input in any state of definite momentum.
+
+    Parameters
+    ----------
+    MSC : np.ndarray
+        The input MSC representation.
+
+    L : int
+        The spin chain length.
+
+    Returns
+    -------
+    np.ndarray
+        The reduced representation of the average.
+    '''
+    rtn = combine_and_sort(msc_sum(shift(msc, i, L) for i in range(L)))
+    rtn['coeffs'] /= L
+    return rtn
+
+def spinflip_average(msc):
+    '''
+    Average an MSC representation with its conjugation by the global spin flip
+    :math:`\prod_i \sigma^x_i`. The flip negates the terms with an odd number of
+    :math:`\sigma^z` factors, so those cancel and the others are unchanged. The result has
+    the same expectation value as the input in any state of definite spin flip parity.
+
+    Parameters
+    ----------
+    MSC : np.ndarray
+        The input MSC representation.
+
+    Returns
+    -------
+    np.ndarray
+        The reduced representation of the average.
+    '''
+    if msc.size == 0:
+        return combine_and_sort(msc)
+    return combine_and_sort(msc[parity(msc['signs']) == 0])
+
 def combine_and_sort(msc):
     '''
     Take an MSC representation, sort it, and combine like terms.
@@ -251,19 +312,61 @@ def combine_and_sort(msc):
         The reduced representation (may be of a smaller dimension).
     '''
 
-    unique, inverse = np.unique(msc[['masks','signs']], return_inverse = True)
-    rtn = np.ndarray(unique.size, dtype = msc.dtype)
+    return _from_arrays(*bmsc.combine(*_to_arrays(msc)))
+
+def _to_arrays(msc):
+    '''
+    Split an MSC representation into contiguous arrays of the types used by the compiled
+    kernels in the backend.
+    '''
+    return (np.ascontiguousarray(msc['masks'], dtype=np.int64),
+            np.ascontiguousarray(msc['signs'], dtype=np.int64),
+            np.ascontiguousarray(msc['coeffs'], dtype=np.complex128))
+
+def _from_arrays(masks, signs, coeffs):
+    '''
+    Build an MSC representation from arrays of its fields, sorted by mask and then sign.
+    '''
+    order = np.lexsort((signs, masks))
+    rtn = np.ndarray(order.size, dtype=msc_dtype)
+    rtn['masks'] = masks[order]
+    rtn['signs'] = signs[order]
+    rtn['coeffs'] = coeffs[order]
+    return rtn
 
-    rtn['masks'] = unique['masks']
-    rtn['signs'] = unique['signs']
+def coeffs_on_terms(terms, msc):
+    '''
+    Express the operator ``msc`` as coefficients on a fixed list of terms, combining like
+    terms of ``msc`` along the way.
 
-    rtn['coeffs'] = 0
-    for i,(_,_,c) in enumerate(msc):
-        rtn[inverse[i]]['coeffs'] += c
+    Parameters
+    ----------
+    terms : np.ndarray
+        An MSC representation whose masks and signs are sorted and unique, such as the output
+        of :meth:`combine_and_sort`. Its coefficients are ignored.
 
-    rtn = rtn[rtn['coeffs'] != 0]
+    msc : np.ndarray
+        The operator to express on those terms.
 
-    return rtn
+    Returns
+    -------
+    np.ndarray or None
+        The coefficient of each term in ``terms``, or ``None`` if ``msc`` has a nonzero term
+        that is not among them.
+    '''
+    keys = np.hstack([terms, msc])[['masks', 'signs']]
+    unique, inverse = np.unique(keys, return_inverse=True)
+    inverse = inverse.reshape(-1)
+
+    coeffs = np.zeros(unique.size, dtype=msc.dtype['coeffs'])
+    np.add.at(coeffs, inverse[terms.size:], msc['coeffs'])
+
+    outside = np.ones(unique.size, dtype=bool)
+    outside[inverse[:terms.size]] = False
+    if np.any(coeffs[outside] != 0):
+        return None
+
+    return coeffs[inverse[:terms.size]]
 
 def truncate(msc, tol):
     '''
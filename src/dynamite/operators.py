@@ -6,11 +6,11 @@ defines their built-in behavior and operations.
 from itertools import chain
 import numpy as np
 
-from . import config, validate, msc_tools
-from .computations import evolve, eigsolve
-from .subspaces import Full, Explicit
+from . import config, validate, msc_tools, _cache
+from .computations import evolve, evolve_trajectory, eigsolve
+from .subspaces import Full, Parity, SpinConserve, Explicit, Momentum
 from .states import State
-from .tools import complex_enabled
+from .tools import complex_enabled, single_precision_enabled
 
 class Operator:
     """
@@ -23,9 +23,13 @@ class Operator:
     def __init__(self):
         self._max_spin_idx = None
         self._mats = {}
+        self._mat_terms = {}
+        self._analysis = {}
         self._msc = None
         self._is_reduced = False
         self._shell = config.shell
+        self._half_storage = False
+        self._mask_diagonal = False
         self._allow_projection = False
 
         if config.subspace is not None:
@@ -55,6 +59,8 @@ class Operator:
         rtn.msc = self.msc.copy()
         rtn.is_reduced = self.is_reduced
         rtn.shell = self.shell
+        rtn.half_storage = self.half_storage
+        rtn.mask_diagonal = self.mask_diagonal
 
         if self._subspaces:
             for left, right in self.get_subspace_list():
@@ -95,6 +101,36 @@ class Operator:
         """
         return evolve(self, state, t, **kwargs)
 
+    def evolve_trajectory(self, state, times, observables=None, **kwargs):
+        r"""
+        Time-evolve a state through a sequence of times, using the operator as the
+        Hamiltonian, and measure some observables at each one.
+
+        This method wraps :meth:`dynamite.computations.evolve_trajectory` (see that
+        documentation for a full description of the method's functionality).
+
+        Parameters
+        ----------
+        state : dynamite.states.State
+            The initial state.
+
+        times : array-like of float
+            The times at which to measure.
+
+        observables : list, optional
+            Operators whose expectation values to compute, or functions of the state.
+
+        **kwargs :
+            Any further keyword arguments are passed to the underlying call to
+            :meth:`dynamite.computations.evolve_trajectory`.
+
+        Yields
+        ------
+        tuple
+            The time, and the measured values (or the evolved state).
+        """
+        return evolve_trajectory(self, state, times, observables, **kwargs)
+
     def eigsolve(self, **kwargs):
         """
         Find eigenvalues (and eigenvectors if requested) of the Hamiltonian. This class
@@ -243,6 +279,72 @@ class Operator:
             self.destroy_mat()
         self._shell = value
 
+    @property
+    def half_storage(self):
+        """
+        Whether to store only the upper triangle of non-shell matrices, which nearly halves
+        their memory usage and the memory traffic of each matrix-vector multiplication.
+        Only applies to matrices whose left and right subspaces are identical, and is
+        not supported on GPUs; other matrices are stored in full regardless of this setting.
+
+        .. note::
+            Changing this value after the matrix has been built will invoke a call
+            to :meth:`Operator.destroy_mat`.
+        """
+        return self._half_storage
+
+    @half_storage.setter
+    def half_storage(self, value):
+        if not isinstance(value, bool):
+            raise ValueError('half_storage must be set to True or False.')
+        if value != self._half_storage:
+            self.destroy_mat()
+        self._half_storage = value
+
+    def _use_half_storage(self, subspaces):
+        """
+        Whether the matrix for the given subspace pair will be built with half storage.
+        """
+        return (self.half_storage and not self.shell and not config.gpu
+                and subspaces[0].identical(subspaces[1]))
+
+    @property
+    def mask_diagonal(self):
+        """
+        Whether CPU shell matrices should also store, for each mask, the summed coefficient
+        of the matrix element along its "XOR diagonal" (``col = row ^ mask``) in each
+        column. Matrix-vector multiplications then just stream through these arrays instead
+        of recomputing every term's sign, which is faster for operators with many terms
+        per mask. The memory used is one real (or, for masks with both real and imaginary
+        terms, complex) number per mask per basis state, with no column indices, which is
+        well under what a standard PETSc matrix needs for the same elements.
+
+        Only applies to shell matrices on the CPU whose left and right subspaces are
+        identical and either Full or Parity, and whose vectors are large enough for the
+        optimized shell matvec; other matrices are built as usual regardless of this setting.
+
+        .. note::
+            Changing this value after the matrix has been built will invoke a call
+            to :meth:`Operator.destroy_mat`.
+        """
+        return self._mask_diagonal
+
+    @mask_diagonal.setter
+    def mask_diagonal(self, value):
+        if not isinstance(value, bool):
+            raise ValueError('mask_diagonal must be set to True or False.')
+        if value != self._mask_diagonal:
+            self.destroy_mat()
+        self._mask_diagonal = value
+
+    def _use_mask_diagonal(self, subspaces):
+        """
+        Whether the matrix for the given subspace pair will be built with mask-diagonal storage.
+        """
+        return (self.mask_diagonal and self.shell and not config.gpu
+                and isinstance(subspaces[0], (Full, Parity))
+                and subspaces[0].identical(subspaces[1]))
+
     @property
     def left_subspace(self):
         """
@@ -374,22 +476,125 @@ class Operator:
 
         self.reduce_msc()
 
-        masks, mask_offsets = self._get_mask_offsets()
+        return self._conserves(left, right)
+
+    def _conserves(self, left, right, msc=None):
+        '''
+        Whether the MSC (by default the operator's own, which must already be reduced)
+        conserves the subspaces, as for :meth:`conserves`. The subspaces must already have
+        been checked for compatibility.
+        '''
+        if msc is None:
+            msc = self.msc
+
+        if isinstance(left, Momentum) or isinstance(right, Momentum):
+            if not left.identical(right):
+                raise ValueError('a Momentum subspace can only be mapped to an identical '
+                                 'Momentum subspace')
+
+            # translation invariance involves whole rows of the matrix at once, so rather
+            # than checking the matrix elements we check the operator itself
+            if not msc_tools.translation_invariant(msc, self.L):
+                return False
+
+            if left.k is not None:
+                spin_conserve = SpinConserve(self.L, left.k)
+                return self._analyze(spin_conserve, spin_conserve, norm=False, msc=msc)[0]
+
+            return True
+
+        return self._analyze(left, right, msc=msc)[0]
+
+    def _check_projection(self, subspaces, msc=None):
+        '''
+        Raise a ValueError if building the matrix of the MSC (by default the operator's own)
+        on the subspaces would project it, unless ``allow_projection`` is set.
+        '''
+        if self.allow_projection:
+            return
+
+        if msc is None:
+            conserved = self.conserves(*subspaces)
+        else:
+            conserved = self._conserves(*subspaces, msc=msc)
+
+        if not conserved:
+            raise ValueError("Constructing the operator's matrix on this "
+                             "subspace yields a projection (e.g. subspace is "
+                             "not conserved by the operator). If this "
+                             "behavior is desired, set the "
+                             "Operator.allow_projection parameter to True.")
+
+    def _use_fused_norm(self, subspaces):
+        '''
+        Whether checking conservation on the given subspace pair should also compute the
+        norm of the shell matrix. This is only worth it when the check sweeps through the
+        subspace anyway (so not for Full, which is always conserved), and the norm of a
+        shell matrix is only needed, and only equal to the one the sweep finds, when its
+        subspaces are identical.
+        '''
+        return (self.shell and subspaces[0].identical(subspaces[1])
+                and not isinstance(subspaces[0], (Full, Momentum)))
+
+    def _cached_analysis(self, subspaces, msc=None):
+        '''
+        The result of :meth:`_analyze` on a subspace pair if it was last run on the same
+        terms as ``msc`` (by default the operator's own), or (None, None).
+        '''
+        if msc is None:
+            msc = self.msc
+
+        if subspaces in self._analysis:
+            terms, conserved, nrm = self._analysis[subspaces]
+            if np.array_equal(terms, msc):
+                return conserved, nrm
+        return None, None
+
+    def _analyze(self, left, right, norm=None, msc=None):
+        '''
+        Return whether the MSC (by default the operator's own) conserves the subspaces, as
+        for :meth:`conserves`. If ``norm`` is True (by default, when :meth:`_use_fused_norm`
+        says so), also compute in the same sweep the bound on the infinity norm that shell
+        matrices report, which :meth:`build_mat` then gives to the matrix so that it needn't
+        compute it again; the norm is None otherwise. The MSC must already be reduced.
+
+        The results are kept until the operator's terms change, so that building matrices
+        after checking conservation, or building them again, doesn't repeat the sweep.
+        '''
+        if msc is None:
+            msc = self.msc
+
+        if norm is None:
+            norm = self._use_fused_norm((left, right))
+
+        conserved, nrm = self._cached_analysis((left, right), msc)
+        if conserved is not None and (nrm is not None or not norm):
+            return conserved, nrm
+
+        masks, mask_offsets = self._get_mask_offsets(msc)
 
         config._initialize()
         from ._backend import bpetsc
 
-        return bpetsc.check_conserves(
+        args = dict(
             masks=masks,
             mask_offsets=mask_offsets,
-            signs=np.ascontiguousarray(self.msc['signs']),
-            coeffs=np.ascontiguousarray(self.msc['coeffs']),
+            signs=np.ascontiguousarray(msc['signs']),
+            coeffs=np.ascontiguousarray(msc['coeffs']),
             left_type=left.to_enum(),
             left_data=left.get_cdata(),
             right_type=right.to_enum(),
             right_data=right.get_cdata(),
         )
 
+        if norm:
+            conserved, nrm = bpetsc.analyze_operator(**args)
+        else:
+            conserved, nrm = bpetsc.check_conserves(**args), None
+
+        self._analysis[(left, right)] = (msc.copy(), conserved, nrm)
+        return conserved, nrm
+
     @property
     def allow_projection(self):
         """
@@ -613,16 +818,24 @@ class Operator:
 
         self.reduce_msc()
 
-        if not self.allow_projection and not self.conserves(*subspaces):
-            raise ValueError("Constructing the operator's matrix on this "
-                             "subspace yields a projection (e.g. subspace is "
-                             "not conserved by the operator). If this "
-                             "behavior is desired, set the "
-                             "Operator.allow_projection parameter to True.")
+        self._check_projection(subspaces)
+
+        # the shell matrix's norm, if the conservation check found it
+        nrm = self._cached_analysis(subspaces)[1]
 
         if not msc_tools.is_hermitian(self.msc):
             raise ValueError('Building non-Hermitian matrices currently not supported.')
 
+        cache_path = self._mat_cache_path(subspaces)
+        if cache_path is not None and _cache.exists(cache_path):
+            self._mats[subspaces] = _cache.load_mat(
+                cache_path,
+                (subspaces[0].get_dimension(), subspaces[1].get_dimension()),
+                self._use_half_storage(subspaces)
+            )
+            self._mat_terms[subspaces] = self.msc.copy()
+            return
+
         masks, mask_offsets = self._get_mask_offsets()
 
         mat = bpetsc.build_mat(
@@ -635,25 +848,135 @@ class Operator:
             right_type = subspaces[1].to_enum(),
             right_data = subspaces[1].get_cdata(),
             shell = self.shell,
-            gpu = config.gpu
+            gpu = config.gpu,
+            half_storage = self._use_half_storage(subspaces),
+            mask_diagonal = self._use_mask_diagonal(subspaces)
         )
 
+        if nrm is not None:
+            bpetsc.set_shell_norm(mat, nrm)
+
         self._mats[subspaces] = mat
 
-    def _get_mask_offsets(self):
+        # kept so that update_coeffs knows which terms the matrix holds
+        self._mat_terms[subspaces] = self.msc.copy()
+
+        if cache_path is not None:
+            _cache.save_mat(cache_path, mat)
+
+    def _mat_cache_path(self, subspaces):
+        '''
+        The path of this operator's matrix on the given subspaces in the on-disk cache, or
+        None if the cache is disabled or the matrix is a shell matrix (which has nothing
+        assembled to store). The key covers everything the matrix's contents and layout
+        depend on.
+        '''
+        if config.cache_dir is None or self.shell:
+            return None
+
+        from petsc4py import PETSc
+
+        parts = ['mat', msc_tools.serialize(self.msc)]
+        for sp in subspaces:
+            parts += [type(sp).__name__, sp.L, sp.get_dimension(), sp.get_checksum()]
+        parts += [
+            PETSc.COMM_WORLD.size,
+            np.dtype(PETSc.ScalarType).str,
+            self._use_half_storage(subspaces)
+        ]
+        return _cache.path('mat', _cache.key(*parts), '.dat')
+
+    def update_coeffs(self, op):
+        """
+        Take on the coefficients of ``op``, rewriting any matrices that have already been
+        built in place rather than rebuilding them. When only the coefficients change, as
+        for a Hamiltonian ``H0 + g(t)*H1`` at each step of a driven or annealing protocol,
+        this skips all of the preprocessing and, for shell matrices, all of the memory
+        allocation that :meth:`Operator.build_mat` does.
+
+        The terms of ``op`` should be among those of this operator (they may be missing, or
+        have coefficient zero). Any matrix for which that is not the case is instead rebuilt
+        from scratch. As in :meth:`Operator.build_mat`, a ValueError is raised (and nothing
+        is changed) if the new coefficients no longer conserve a matrix's subspaces, unless
+        ``allow_projection`` is set.
+
+        Parameters
+        ----------
+        op : Operator
+            The operator whose coefficients to use.
         """
-        Return an array of unique mask values, and the indices where each starts
+        updates = []
+        rebuild = []
+        for subspaces, terms in self._mat_terms.items():
+            coeffs = msc_tools.coeffs_on_terms(terms, op.msc)
+            if coeffs is None:
+                rebuild.append(subspaces)
+                continue
+
+            msc = terms.copy()
+            msc['coeffs'] = coeffs
+            if not msc_tools.is_hermitian(msc):
+                raise ValueError('Building non-Hermitian matrices currently not supported.')
+
+            # new coefficients can break a symmetry the old ones had, e.g. XX+YY -> XX+0.5*YY
+            self._check_projection(subspaces, msc)
+
+            updates.append((subspaces, msc))
+
+        if updates:
+            config._initialize()
+            from ._backend import bpetsc
+
+        for subspaces, msc in updates:
+            masks, mask_offsets = self._get_mask_offsets(msc)
+            bpetsc.update_mat(
+                self._mats[subspaces],
+                masks = np.ascontiguousarray(masks),
+                mask_offsets = np.ascontiguousarray(mask_offsets),
+                signs = np.ascontiguousarray(msc['signs']),
+                coeffs = np.ascontiguousarray(msc['coeffs']),
+                left_type = subspaces[0].to_enum(),
+                left_data = subspaces[0].get_cdata(),
+                right_type = subspaces[1].to_enum(),
+                right_data = subspaces[1].get_cdata(),
+                shell = self.shell,
+                gpu = config.gpu,
+                mask_diagonal = self._use_mask_diagonal(subspaces)
+            )
+
+            # the update discards the shell matrix's norm; restore it if the check found it
+            nrm = self._cached_analysis(subspaces, msc)[1]
+            if nrm is not None:
+                bpetsc.set_shell_norm(self._mats[subspaces], nrm)
+
+        self.msc = op.msc.copy()
+        self.is_reduced = op.is_reduced
+
+        self.string = op.string
+        self.tex = op.tex
+        self.brackets = op.brackets
+
+        for subspaces in rebuild:
+            self.destroy_mat(subspaces)
+            self.build_mat(subspaces)
+
+    def _get_mask_offsets(self, msc=None):
+        """
+        Return an array of unique mask values, and the indices where each starts. By default
+        this is for the operator's own MSC, which must already be reduced.
         """
-        if not self.is_reduced:
-            raise RuntimeError('must reduce MSC first')
+        if msc is None:
+            if not self.is_reduced:
+                raise RuntimeError('must reduce MSC first')
+            msc = self.msc
 
-        masks, indices = np.unique(self.msc['masks'], return_index=True)
+        masks, indices = np.unique(msc['masks'], return_index=True)
 
         # need to add the last index
         mask_offsets = np.ndarray((indices.size+1,),
-                                  dtype=self.msc.dtype['masks'])
+                                  dtype=msc.dtype['masks'])
         mask_offsets[:-1] = indices
-        mask_offsets[-1] = self.msc.shape[0]
+        mask_offsets[-1] = msc.shape[0]
 
         return masks, mask_offsets
 
@@ -674,6 +997,7 @@ class Operator:
             to_destroy = list(self._mats.keys())
 
         for k in to_destroy:
+            self._mat_terms.pop(k, None)
             mat = self._mats.pop(k, None)
             if mat is not None:
                 mat.destroy()
@@ -710,27 +1034,50 @@ class Operator:
 
         if self.shell:
             usage_bytes = self.msc.nbytes
+            shared_bytes = 0
 
-            # Explicit is the only subspace that uses an appreciable
-            # amount of memory
+            # Explicit and Momentum are the only subspaces that use an
+            # appreciable amount of memory
             for sp in (self.left_subspace, self.right_subspace):
                 if isinstance(sp, Explicit):
-                    usage_bytes += sp.state_map.nbytes
-                    usage_bytes += sp.rmap_indices.nbytes
-                    usage_bytes += sp.rmap_states.nbytes
+                    sp_bytes = sp.state_map.nbytes
+                    sp_bytes += sp.rmap_indices.nbytes
+                    sp_bytes += sp.rmap_states.nbytes
+
+                    # in shared memory there is one copy per node
+                    if sp.shared_memory:
+                        shared_bytes += sp_bytes*max(1, mpi_size//sp.shared_node_ranks)
+                    else:
+                        usage_bytes += sp_bytes
+
+                elif isinstance(sp, Momentum):
+                    usage_bytes += sp.state_map.nbytes + sp.periods.nbytes
 
             # these values are stored redundantly on every rank
             usage_bytes *= mpi_size
+            usage_bytes += shared_bytes
+
+            if self._use_mask_diagonal((self.left_subspace, self.right_subspace)):
+                # at most a complex number per mask per state, but usually one real
+                real_size = 4 if single_precision_enabled() else 8
+                usage_bytes += self.nnz*self.dim[0]*real_size
 
         else:
             int_size = msc_tools.dnm_int_t().itemsize
-            scalar_size = 16 if complex_enabled() else 8
+            scalar_size = 4 if single_precision_enabled() else 8
+            if complex_enabled():
+                scalar_size *= 2
             elem_size = int_size + scalar_size
 
             # because we have to add a zero diagonal if it doesn't exist
             # to keep PETSc happy
             nnz = self.nnz
-            if np.all(self.msc['masks']):
+            if self._use_half_storage((self.left_subspace, self.right_subspace)):
+                # the diagonal (always stored) plus half of the off-diagonal elements
+                if not np.all(self.msc['masks']):
+                    nnz -= 1
+                nnz = 1 + nnz/2
+            elif np.all(self.msc['masks']):
                 nnz += 1
 
             usage_bytes = nnz*self.dim[0]*elem_size
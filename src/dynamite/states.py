@@ -7,6 +7,12 @@ import numpy as np
 from os import urandom
 from time import time
 import pickle
+import json
+import os
+import zlib
+
+# format version written in checkpoint headers; bump when the layout changes
+CHECKPOINT_VERSION = 1
 
 
 class State:
@@ -107,8 +113,11 @@ class State:
             config._initialize()
             from petsc4py import PETSc
 
+            from ._backend import bpetsc
+
+            dim = self.subspace.get_dimension()
             self._vec = PETSc.Vec().create()
-            self._vec.setSizes(self.subspace.get_dimension())
+            self._vec.setSizes((bpetsc.split_ownership(dim), dim))
             self._vec.setFromOptions()
 
         return self._vec
@@ -395,7 +404,8 @@ class State:
     def save(self, fname):
         '''
         Save the state to disk. Note that this method saves the state
-        as a pair of files, ``<fname>.vec`` and ``<fname>.metadata``.
+        as a pair of files, ``<fname>.vec`` and ``<fname>.metadata``. For large
+        states, :meth:`save_checkpoint` is faster and more compact.
 
         Parameters
         ----------
@@ -436,7 +446,8 @@ class State:
         ----------
 
         fname : str
-            The path from which to load the state
+            The path from which to load the state. If it is a directory, it is
+            loaded as a checkpoint (see :meth:`from_checkpoint`).
 
         Returns
         -------
@@ -444,17 +455,25 @@ class State:
         State
             The state from the file
         '''
+        if os.path.isdir(fname):
+            return cls.from_checkpoint(fname)
+
         with open(fname+'.metadata', 'rb') as f:
             subspace = pickle.load(f)
 
         config._initialize()
         from petsc4py import PETSc
+        from ._backend import bpetsc
 
         viewer = PETSc.Viewer().createBinary(
             fname+'.vec',
             mode=PETSc.Viewer.Mode.READ
         )
+
+        # use the same layout as the matrices, rather than PETSc's default
+        dim = subspace.get_dimension()
         vec = PETSc.Vec().create()
+        vec.setSizes((bpetsc.split_ownership(dim), dim))
         vec.load(viewer)
 
         if subspace.get_dimension() != vec.getSize():
@@ -468,6 +487,191 @@ class State:
 
         return rtn
 
+    def save_checkpoint(self, path, compress=False, chunk_size=2**16):
+        '''
+        Save the state to the directory ``path``. Unlike :meth:`save`, each process
+        writes its own part of the vector to a separate file, all at once, and nothing is
+        pickled: the subspace is described by its parameters in ``header.json``, along
+        with (for :class:`~dynamite.subspaces.Explicit` and
+        :class:`~dynamite.subspaces.Auto` subspaces) its state map as a raw array.
+
+        Uncompressed checkpoints are plain ``.npy`` files, which :meth:`from_checkpoint`
+        can memory-map to reload the state without reading or copying it.
+
+        Parameters
+        ----------
+
+        path : str
+            The directory to save the state to. It is created if needed, and any
+            checkpoint already in it is replaced.
+
+        compress : bool
+            Whether to compress the vector and state map with zlib, in chunks of
+            ``chunk_size`` elements that can be decompressed independently. State maps are
+            delta-encoded first, so sorted ones compress well.
+
+        chunk_size : int
+            The number of elements per compressed chunk.
+        '''
+        self.assert_initialized()
+
+        config._initialize()
+        from petsc4py import PETSc
+        comm = PETSc.COMM_WORLD
+
+        header_path = os.path.join(path, 'header.json')
+        compression = 'zlib' if compress else None
+
+        # the header is written last, so an interrupted save does not leave
+        # something that looks like a complete checkpoint
+        if comm.rank == 0:
+            os.makedirs(path, exist_ok=True)
+            if os.path.exists(header_path):
+                os.remove(header_path)
+        comm.barrier()
+
+        local = self.vec.getArray(readonly=True)
+        vec_name = 'vec.%d' % comm.rank
+        _write_array(os.path.join(path, vec_name), local, compression, chunk_size)
+
+        if comm.rank == 0:
+            desc, arrays = self.subspace._get_descriptor()
+
+            array_entries = {}
+            for name, array in arrays.items():
+                array = np.ascontiguousarray(array)
+                entry = {'dtype': array.dtype.str, 'size': array.size, 'delta': compress}
+                if compress:
+                    array = np.diff(array, prepend=array.dtype.type(0))
+                entry['file'] = _write_array(os.path.join(path, name), array,
+                                             compression, chunk_size)
+                array_entries[name] = entry
+
+            header = {
+                'format': 'dynamite-checkpoint',
+                'version': CHECKPOINT_VERSION,
+                'dim': self.vec.getSize(),
+                'dtype': local.dtype.str,
+                'compression': compression,
+                'chunk_size': chunk_size,
+                'ranges': [list(map(int, r)) for r in _ownership_ranges(self.vec)],
+                'vec_files': [_array_fname('vec.%d' % r, compression)
+                              for r in range(comm.size)],
+                'subspace': desc,
+                'subspace_arrays': array_entries,
+            }
+
+        # everyone must be done writing before the header marks the checkpoint complete
+        comm.barrier()
+
+        if comm.rank == 0:
+            with open(header_path, 'w') as f:
+                json.dump(header, f, indent=1)
+        comm.barrier()
+
+    @classmethod
+    def from_checkpoint(cls, path, mmap=True):
+        '''
+        Load a state saved by :meth:`save_checkpoint`. It can be loaded with any number of
+        processes, each of which reads only the parts of the files it needs.
+
+        Parameters
+        ----------
+
+        path : str
+            The checkpoint directory
+
+        mmap : bool
+            If the checkpoint is uncompressed, and every process's part of the vector is
+            exactly one of the saved files (as when loading with the same number of
+            processes it was saved with), back the vector with a copy-on-write memory map of
+            that file, instead of reading it in. Pages are then only read from disk once they
+            are used, and changes to the state are not written back to the file. Ignored
+            for GPU vectors. Uncompressed state maps are memory-mapped in either case, so
+            that the processes on a node share them through the page cache.
+
+        Returns
+        -------
+
+        State
+            The state from the checkpoint
+        '''
+        with open(os.path.join(path, 'header.json')) as f:
+            header = json.load(f)
+
+        if header.get('format') != 'dynamite-checkpoint':
+            raise ValueError("'%s' is not a dynamite checkpoint" % path)
+        if header['version'] > CHECKPOINT_VERSION:
+            raise ValueError('checkpoint format version %d is newer than this version '
+                             'of dynamite supports' % header['version'])
+
+        config._initialize()
+        from petsc4py import PETSc
+        from ._backend import bpetsc
+
+        compression = header['compression']
+        chunk_size = header['chunk_size']
+
+        arrays = {}
+        for name, entry in header['subspace_arrays'].items():
+            array = _read_array(os.path.join(path, entry['file']), np.dtype(entry['dtype']),
+                                0, entry['size'], chunk_size, mmap_mode='r')
+            if entry['delta']:
+                np.cumsum(array, out=array)
+            arrays[name] = array
+
+        subspace = subspaces._from_descriptor(header['subspace'], arrays)
+
+        dim = subspace.get_dimension()
+        if dim != header['dim']:
+            raise RuntimeError('corrupt data encountered when loading checkpoint')
+
+        stored = np.dtype(header['dtype'])
+        scalar = np.dtype(PETSc.ScalarType)
+        if not np.can_cast(stored, scalar, casting='same_kind'):
+            raise ValueError('cannot load a checkpoint of dtype %s into PETSc vectors of '
+                             'dtype %s' % (stored, scalar))
+
+        vec = PETSc.Vec().create()
+        vec.setSizes((bpetsc.split_ownership(dim), dim))
+        vec.setFromOptions()
+        start, end = vec.getOwnershipRange()
+
+        ranges = [tuple(r) for r in header['ranges']]
+        files = [os.path.join(path, f) for f in header['vec_files']]
+
+        # replacing the vector is collective, so every process must agree to memory-map
+        use_mmap = (mmap and compression is None and stored == scalar and not config.gpu
+                    and (end == start or (start, end) in ranges))
+        if PETSc.COMM_WORLD.size > 1:
+            from mpi4py import MPI
+            use_mmap = PETSc.COMM_WORLD.tompi4py().allreduce(use_mmap, op=MPI.LAND)
+
+        if use_mmap:
+            if end == start:
+                # empty files can't be memory-mapped, and there is nothing to read anyway
+                local = np.empty(0, dtype=scalar)
+            else:
+                fname = files[ranges.index((start, end))]
+                local = _read_array(fname, stored, 0, end-start, chunk_size, mmap_mode='c')
+            vec.destroy()
+            vec = PETSc.Vec().createWithArray(local, size=(end-start, dim))
+        else:
+            local = np.empty(end-start, dtype=scalar)
+            for (r_start, r_end), fname in zip(ranges, files):
+                lo, hi = max(start, r_start), min(end, r_end)
+                if lo < hi:
+                    local[lo-start:hi-start] = _read_array(fname, stored, lo-r_start,
+                                                           hi-r_start, chunk_size)
+            vec.setArray(local)
+
+        rtn = cls(subspace=subspace)
+        rtn._vec = vec
+
+        rtn.set_initialized()
+
+        return rtn
+
     def dot(self, x):
         '''
         Compute the inner product of two states.
@@ -522,5 +726,75 @@ class State:
         return self.subspace.get_dimension()
 
 
+def _ownership_ranges(vec):
+    '''
+    The (start, end) of the part of vec owned by each process.
+    '''
+    bounds = vec.getOwnershipRanges()
+    return list(zip(bounds[:-1], bounds[1:]))
+
+
+def _array_fname(name, compression):
+    return name + ('.npy' if compression is None else '.zc')
+
+
+def _write_array(base, array, compression, chunk_size):
+    '''
+    Write a 1D array to a checkpoint file, either as a .npy file or (for zlib compression)
+    as independently compressed chunks of chunk_size elements, followed by the lengths of
+    the chunks as a .npy array and the offset of that array as an int64. Returns the name
+    of the file, without the directory.
+    '''
+    fname = _array_fname(base, compression)
+
+    if compression is None:
+        np.save(fname, array)
+    else:
+        lengths = []
+        with open(fname, 'wb') as f:
+            for i in range(0, array.size, chunk_size):
+                # checkpoints are written often, so favor speed over compression ratio
+                chunk = zlib.compress(array[i:i+chunk_size].tobytes(), 1)
+                f.write(chunk)
+                lengths.append(len(chunk))
+            index_offset = f.tell()
+            np.save(f, np.array(lengths, dtype=np.int64))
+            f.write(np.int64(index_offset).tobytes())
+
+    return os.path.basename(fname)
+
+
+def _read_array(fname, dtype, start, end, chunk_size, mmap_mode=None):
+    '''
+    Read elements start to end of an array written by _write_array. For uncompressed files,
+    mmap_mode is passed to numpy.load and (if not None) a memory-mapped slice is returned.
+    '''
+    if fname.endswith('.npy'):
+        array = np.load(fname, mmap_mode='r' if mmap_mode is None else mmap_mode)
+        if array.dtype != dtype or array.ndim != 1:
+            raise RuntimeError("unexpected array in checkpoint file '%s'" % fname)
+        array = array[start:end]
+        return np.array(array) if mmap_mode is None else array
+
+    rtn = np.empty(end-start, dtype=dtype)
+    if end <= start:
+        return rtn
+
+    with open(fname, 'rb') as f:
+        f.seek(-8, os.SEEK_END)
+        f.seek(int(np.frombuffer(f.read(8), dtype=np.int64)[0]))
+        lengths = np.load(f)
+        offsets = np.concatenate(([0], np.cumsum(lengths)))
+
+        for c in range(start//chunk_size, (end-1)//chunk_size + 1):
+            f.seek(offsets[c])
+            chunk = np.frombuffer(zlib.decompress(f.read(lengths[c])), dtype=dtype)
+            c_start = c*chunk_size
+            lo, hi = max(start, c_start), min(end, c_start+chunk.size)
+            rtn[lo-start:hi-start] = chunk[lo-c_start:hi-c_start]
+
+    return rtn
+
+
 class UninitializedError(RuntimeError):
     pass
@@ -10,7 +10,7 @@ from copy import deepcopy
 from zlib import crc32
 import math
 
-from . import validate, states, config
+from . import validate, states, config, msc_tools, _cache
 from ._backend import bsubspace
 from .msc_tools import dnm_int_t
 
@@ -145,6 +145,20 @@ class Subspace:
         '''
         raise NotImplementedError()
 
+    def _get_descriptor(self):
+        '''
+        Describe the subspace for a checkpoint, as a JSON-serializable dict of its parameters
+        and a dict of the arrays (if any) that are needed to rebuild it.
+        '''
+        raise NotImplementedError()
+
+    @classmethod
+    def _from_descriptor(cls, desc, arrays):
+        '''
+        Rebuild a subspace from the output of :meth:`_get_descriptor`.
+        '''
+        raise NotImplementedError()
+
 class Full(Subspace):
 
     def __init__(self):
@@ -214,6 +228,15 @@ class Full(Subspace):
     def _get_cdata(cls, L):
         return bsubspace.CFull(L)
 
+    def _get_descriptor(self):
+        return {'type': 'Full', 'L': self.L}, {}
+
+    @classmethod
+    def _from_descriptor(cls, desc, arrays):
+        rtn = cls()
+        rtn.L = desc['L']
+        return rtn
+
     def to_enum(self):
         '''
         Convert the class types used in the Python frontend to the enum values
@@ -313,6 +336,15 @@ class Parity(Subspace):
     def _get_cdata(cls, L, space):
         return bsubspace.CParity(L, space)
 
+    def _get_descriptor(self):
+        return {'type': 'Parity', 'L': self.L, 'space': self.space}, {}
+
+    @classmethod
+    def _from_descriptor(cls, desc, arrays):
+        rtn = cls(desc['space'])
+        rtn.L = desc['L']
+        return rtn
+
     def to_enum(self):
         '''
         Convert the class types used in the Python frontend to the enum values
@@ -554,6 +586,14 @@ class SpinConserve(Subspace):
             spinflip
         )
 
+    def _get_descriptor(self):
+        desc = {'type': 'SpinConserve', 'L': self.L, 'k': self.k, 'spinflip': self.spinflip}
+        return desc, {}
+
+    @classmethod
+    def _from_descriptor(cls, desc, arrays):
+        return cls(desc['L'], desc['k'], spinflip=desc['spinflip'])
+
     def to_enum(self):
         '''
         Convert the class types used in the Python frontend to the enum values
@@ -570,11 +610,26 @@ class Explicit(Subspace):
     ----------
     state_list : array-like
         An array of integers representing the states (in binary).
+
+    hash_lookup : bool
+        Whether to build a hash table for finding the index of a state. This makes
+        lookups (and thus building and multiplying by matrices) much faster for large
+        subspaces, at the cost of 3-6 more integers of memory per state. If False, a
+        binary search is used instead.
+
+    shared_memory : bool
+        Whether to store the subspace's tables once per node, in memory shared by all of
+        the MPI ranks on it, rather than once per rank. Shell matrices then refer to these
+        tables instead of keeping their own copies. Must be the same on every rank, since
+        the tables are created collectively. Requires enough space in ``/dev/shm``.
     '''
 
-    def __init__(self, state_list):
+    def __init__(self, state_list, hash_lookup=True, shared_memory=False):
         Subspace.__init__(self)
         self.state_map = np.asarray(state_list, dtype=bsubspace.dnm_int_t)
+        self.hash_lookup = hash_lookup
+        self._hash_table = None
+        self._shared = None
 
         map_sorted = np.all(self.state_map[:-1] <= self.state_map[1:])
 
@@ -585,6 +640,62 @@ class Explicit(Subspace):
             self.rmap_indices = np.argsort(self.state_map).astype(bsubspace.dnm_int_t, copy=False)
             self.rmap_states = self.state_map[self.rmap_indices]
 
+        if shared_memory:
+            self._share()
+
+    def _share(self):
+        '''
+        Move the tables into a buffer shared by the ranks on each node.
+        '''
+        config._initialize()
+
+        if self.hash_lookup and self._hash_table is None:
+            self._hash_table = bsubspace.compute_hash_table_Explicit(
+                np.ascontiguousarray(self.state_map)
+            )
+
+        # rmap_states is the state map itself if the latter was sorted
+        same_rmap = self.rmap_states is self.state_map
+
+        arrays = [self.state_map, self.rmap_indices]
+        if not same_rmap:
+            arrays.append(self.rmap_states)
+        if self.hash_lookup:
+            arrays.append(self._hash_table)
+
+        self._shared = bsubspace.SharedBuffer(arrays)
+        views = list(self._shared.arrays)
+
+        self.state_map = views.pop(0)
+        self.rmap_indices = views.pop(0)
+        self.rmap_states = self.state_map if same_rmap else views.pop(0)
+        if self.hash_lookup:
+            self._hash_table = views.pop(0)
+
+    def copy(self):
+        if self._shared is None:
+            return Subspace.copy(self)
+
+        # the tables are read-only, so the copy can refer to the same shared buffer
+        rtn = type(self).__new__(type(self))
+        rtn.__dict__.update(self.__dict__)
+        return rtn
+
+    @property
+    def shared_memory(self):
+        '''
+        Whether the subspace's tables are in memory shared by the ranks on each node.
+        '''
+        return self._shared is not None
+
+    @property
+    def shared_node_ranks(self):
+        '''
+        The number of ranks sharing each copy of the subspace's tables (1 if they are not
+        in shared memory).
+        '''
+        return 1 if self._shared is None else self._shared.node_ranks
+
     def check_L(self, value):
         # last value of rmap_states is the lexicographically largest one
         if self.rmap_states[-1] >> value != 0:
@@ -618,17 +729,50 @@ class Explicit(Subspace):
         state = self._numeric_to_array(state)
         return bsubspace.state_to_idx_Explicit(state, self.get_cdata())
 
+    def __getstate__(self):
+        # the hash table can be rebuilt quickly, so don't bother saving it. shared memory is
+        # specific to this run, so the arrays are saved as ordinary copies
+        state = self.__dict__.copy()
+        state['_hash_table'] = None
+        state['_shared'] = None
+        return state
+
+    def __setstate__(self, state):
+        # subspaces pickled before hash tables existed don't have these attributes
+        state.setdefault('hash_lookup', True)
+        state.setdefault('_hash_table', None)
+        state.setdefault('_shared', None)
+        self.__dict__.update(state)
+
     def get_cdata(self):
         '''
         Returns an object containing the subspace data accessible by the C backend.
         '''
+        # the hash table is built the first time it is needed, and kept afterwards
+        if self.hash_lookup and self._hash_table is None:
+            self._hash_table = bsubspace.compute_hash_table_Explicit(
+                np.ascontiguousarray(self.state_map)
+            )
+
         return bsubspace.CExplicit(
             self.L,
             np.ascontiguousarray(self.state_map),
             np.ascontiguousarray(self.rmap_indices),
-            np.ascontiguousarray(self.rmap_states)
+            np.ascontiguousarray(self.rmap_states),
+            self._hash_table if self.hash_lookup else None,
+            self._shared
         )
 
+    def _get_descriptor(self):
+        desc = {'type': 'Explicit', 'L': self.L, 'hash_lookup': self.hash_lookup}
+        return desc, {'state_map': self.state_map}
+
+    @classmethod
+    def _from_descriptor(cls, desc, arrays):
+        rtn = cls(arrays['state_map'], hash_lookup=desc['hash_lookup'])
+        rtn.L = desc['L']
+        return rtn
+
     def to_enum(self):
         '''
         Convert the class types used in the Python frontend to the enum values
@@ -644,8 +788,11 @@ class Auto(Explicit):
     as an adjacency matrix. The subspace is defined by providing a "start" state; the returned
     subspace will be whatever subspace contains that state.
 
-    Currently the actual computation of the ordering only can occur on process 0, limiting
-    the scalability of this subspace.
+    The search is distributed across all processes (and across threads, according to the
+    same options as the CPU shell matrix), so that the memory needed for the search scales
+    as the subspace dimension divided by the number of processes. The resulting mapping is still stored in full on every process,
+    or once per node with ``shared_memory=True``, as every ``Explicit`` subspace is; it is
+    gathered there once, after the search.
 
     Parameters
     ----------
@@ -658,35 +805,351 @@ class Auto(Explicit):
         :meth:`dynamite.states.State.str_to_state` for more information.
 
     size_guess : int
-        A guess for the dimension of the subspace. By default, memory is allocated for the full
-        space, and then trimmed off if not used.
+        Ignored; kept for compatibility. The search no longer needs to preallocate the
+        mapping.
 
     sort : bool
         Whether to reorder the mapping after computing it. In some cases this may
-        cause a speedup.
+        cause a speedup. If False, the states are ordered by the number of applications of
+        H needed to reach them from the start state, and then by value.
+
+    hash_lookup : bool
+        Whether to build a hash table for finding the index of a state. See
+        :class:`Explicit`.
+
+    shared_memory : bool
+        Whether to store the mapping once per node, in memory shared by the MPI ranks on
+        it. See :class:`Explicit`.
     '''
 
-    def __init__(self, H, state, size_guess=None, sort=True):
+    def __init__(self, H, state, size_guess=None, sort=True, hash_lookup=True,
+                 shared_memory=False):
 
         H.establish_L()
 
         self.state = states.State.str_to_state(state, H.L)
 
-        if size_guess is None:
-            size_guess = 2**H.L
+        H.reduce_msc()
+
+        config._initialize()
 
-        state_map = np.ndarray((size_guess,), dtype=bsubspace.dnm_int_t)
+        if config.cache_dir is None:
+            state_map = self._compute_state_map(H, sort)
+        else:
+            cache_path = _cache.path('auto', _cache.key(
+                'auto', msc_tools.serialize(H.msc), H.L, self.state, sort
+            ), '.npy')
 
-        H.reduce_msc()
+            state_map = _cache.load_array(cache_path)
+            if state_map is None:
+                state_map = self._compute_state_map(H, sort)
+                _cache.save_array(cache_path, state_map)
 
-        dim = bsubspace.compute_rcm(H.msc['masks'], H.msc['signs'], H.msc['coeffs'],
-                                    state_map, self.state, H.L)
+        Explicit.__init__(self, state_map, hash_lookup=hash_lookup, shared_memory=shared_memory)
 
-        state_map = state_map[:dim]
+        self._L = H.L
+
+    def _compute_state_map(self, H, sort):
+        '''
+        Find the states connected to self.state by H.
+        '''
+        from ._backend import bpetsc
+
+        # the search is threaded, so it is worth using even on a single process
+        masks, mask_offsets = H._get_mask_offsets()
+        state_map = bpetsc.compute_auto(
+            masks = np.ascontiguousarray(masks),
+            mask_offsets = np.ascontiguousarray(mask_offsets),
+            signs = np.ascontiguousarray(H.msc['signs']),
+            coeffs = np.ascontiguousarray(H.msc['coeffs']),
+            start = self.state
+        )
 
         if sort:
             state_map.sort()
 
-        Explicit.__init__(self, state_map)
+        return state_map
 
-        self._L = H.L
+    def _get_descriptor(self):
+        desc, arrays = Explicit._get_descriptor(self)
+        desc.update(type='Auto', state=int(self.state))
+        return desc, arrays
+
+    @classmethod
+    def _from_descriptor(cls, desc, arrays):
+        # skip the search, since we already have its result
+        rtn = cls.__new__(cls)
+        Explicit.__init__(rtn, arrays['state_map'], hash_lookup=desc['hash_lookup'])
+        rtn.state = desc['state']
+        rtn._L = desc['L']
+        return rtn
+
+
+class Momentum(Subspace):
+    '''
+    The subspaces of states with definite momentum on a periodic spin chain, for operators
+    that are invariant under translation by one site. Each basis state is the equal
+    superposition (with momentum phases) of the translations of a product state, represented
+    by whichever of those translations is smallest as an integer.
+
+    The basis states are not product states, so computing reduced density matrices requires
+    converting to a product state subspace with :meth:`convert_momentum`. Operators may
+    only map a momentum subspace to an identical one. Setting a :class:`~dynamite.states.State`
+    on this subspace to a product state gives the basis state of that product state's
+    translations. Unless dynamite was built with
+    complex numbers, only the momenta 0 and pi (``q=0`` and ``q=L/2``) are supported, since
+    the others require complex amplitudes.
+
+    Parameters
+    ----------
+    L : int
+        Length of spin chain (constant for this class)
+
+    q : int
+        The momentum, in units of 2 pi / L. Taken modulo L.
+
+    k : int, optional
+        If given, also restrict to states with this number of down spins (1's in the integer
+        representation of the state), as with :class:`SpinConserve`.
+
+    hash_lookup : bool
+        Whether to build a hash table for finding the index of a representative state. See
+        :class:`Explicit`.
+    '''
+
+    _product_state_basis = False
+
+    def __init__(self, L, q, k=None, hash_lookup=True):
+        Subspace.__init__(self)
+        self._L = validate.L(L)
+        self._q = self._check_q(q)
+        self._k = self._check_k(k)
+        self.hash_lookup = hash_lookup
+        self._hash_table = None
+
+        # the representatives of different momenta overlap, so their checksums must not
+        self._checksum_start = crc32(b'Momentum%d' % self._q)
+
+        self.state_map, self.periods = bsubspace.compute_reps_Momentum(
+            self.L, self.q, -1 if self.k is None else self.k
+        )
+
+        if self.state_map.size == 0:
+            raise ValueError('no states have momentum q=%d for L=%d%s' % (
+                self.q, self.L, '' if self.k is None else ' and k=%d' % self.k
+            ))
+
+    def _check_q(self, q):
+        q = int(q) % self.L
+
+        from .tools import complex_enabled
+        if not complex_enabled() and q != 0 and 2*q != self.L:
+            raise ValueError('momentum other than 0 or pi requires dynamite to be built '
+                             'with complex numbers')
+
+        return q
+
+    def _check_k(self, k):
+        if k is not None and not (0 <= k <= self.L):
+            raise ValueError('k must be between 0 and L')
+        return k
+
+    def identical(self, s):
+        if type(self) != type(s):
+            return False
+
+        return self.L == s.L and self.q == s.q and self.k == s.k
+
+    @Subspace.L.setter
+    def L(self, value):
+        if value != self.L:
+            raise AttributeError('cannot change L for Momentum class')
+
+    @property
+    def q(self):
+        """
+        The momentum, in units of 2 pi / L.
+        """
+        return self._q
+
+    @property
+    def k(self):
+        """
+        The number of down spins, or None if it is not fixed.
+        """
+        return self._k
+
+    @classmethod
+    def _translate(cls, states, L, n=1):
+        '''
+        Translate an array of states by n sites (rotating their bits to the left).
+        '''
+        states = np.asarray(states).astype(np.uint64)
+        n = n % L
+        full = np.uint64((1 << L) - 1)
+        return ((states << np.uint64(n)) | (states >> np.uint64(L - n))) & full
+
+    @classmethod
+    def convert_momentum(cls, state, q=None, k=None):
+        """
+        Convert a state on a Momentum subspace to a state on a product state subspace
+        (:class:`SpinConserve` if the number of down spins is fixed, and :class:`Full`
+        otherwise), and vice versa. Converting to a Momentum subspace projects the state
+        onto that momentum.
+
+        Parameters
+        ----------
+
+        state : State
+            The input state
+
+        q : int, optional
+            The momentum to project onto. Required when converting to a Momentum subspace.
+
+        k : int, optional
+            The number of down spins of the Momentum subspace. Defaults to that of the input
+            state's subspace if it is a :class:`SpinConserve` subspace.
+
+        Returns
+        -------
+
+        State
+            The converted state
+        """
+        state.assert_initialized()
+
+        from .tools import complex_enabled
+        in_space = state.subspace
+        L = in_space.L
+
+        if isinstance(in_space, Momentum):
+            if q is not None or k is not None:
+                raise ValueError('do not provide q or k when converting from a Momentum '
+                                 'subspace')
+
+            if in_space.k is None:
+                new_space = Full()
+                new_space.L = L
+            else:
+                new_space = SpinConserve(L, in_space.k)
+
+        else:
+            if q is None:
+                raise ValueError('must provide q when converting to a Momentum subspace')
+
+            if not in_space.product_state_basis:
+                raise ValueError('can only convert to a Momentum subspace from a product '
+                                 'state subspace')
+
+            if k is None and isinstance(in_space, SpinConserve):
+                k = in_space.k
+
+            new_space = Momentum(L, q, k=k)
+
+        rtn_state = states.State(subspace=new_space)
+        istart, iend = state.vec.getOwnershipRange()
+        values = state.vec[istart:iend]
+
+        if isinstance(in_space, Momentum):
+            # spread each local amplitude over the orbit of its representative
+            reps = in_space.state_map[istart:iend]
+            periods = in_space.periods[istart:iend]
+            norms = 1/np.sqrt(periods)
+            for shift in range(L):
+                keep = shift < periods
+                if not np.any(keep):
+                    break
+                translated = cls._translate(reps[keep], L, shift).astype(dnm_int_t)
+                phases = np.exp(-2j*np.pi*in_space.q*shift/L)*norms[keep]
+                idxs = new_space.state_to_idx(translated)
+                new_values = values[keep]*(phases if complex_enabled() else phases.real)
+                rtn_state.vec.setValues(idxs, new_values)
+
+        else:
+            # sum each local amplitude into the momentum state of its orbit
+            local_states = in_space.idx_to_state(np.arange(istart, iend, dtype=dnm_int_t))
+            idxs, shifts = bsubspace.state_to_idx_Momentum(
+                cls._numeric_to_array(local_states), new_space.get_cdata(), True
+            )
+            keep = idxs != -1
+            idxs = idxs[keep]
+            phases = np.exp(-2j*np.pi*new_space.q*shifts[keep]/L)
+            phases /= np.sqrt(new_space.periods[idxs])
+            new_values = values[keep]*(phases if complex_enabled() else phases.real)
+            rtn_state.vec.setValues(idxs, new_values, addv=True)
+
+        rtn_state.vec.assemble()
+        rtn_state.set_initialized()
+
+        return rtn_state
+
+    def get_dimension(self):
+        """
+        Get the dimension of the subspace.
+        """
+        return self.state_map.size
+
+    def idx_to_state(self, idx):
+        """
+        Maps an index to the representative product state of that basis state.
+        Vectorized implementation allows passing a numpy array of indices as idx.
+        """
+        idx = self._numeric_to_array(idx)
+        return bsubspace.idx_to_state_Momentum(idx, self.get_cdata())
+
+    def state_to_idx(self, state):
+        """
+        The index of the basis state whose orbit contains a product state, or -1 if there
+        is none.
+        """
+        state = self._numeric_to_array(state)
+        return bsubspace.state_to_idx_Momentum(state, self.get_cdata())
+
+    def __getstate__(self):
+        # as for Explicit, the hash table is quick to rebuild
+        state = self.__dict__.copy()
+        state['_hash_table'] = None
+        return state
+
+    def get_cdata(self):
+        '''
+        Returns an object containing the subspace data accessible by the C backend.
+        '''
+        if self.hash_lookup and self._hash_table is None:
+            self._hash_table = bsubspace.compute_hash_table_Explicit(
+                np.ascontiguousarray(self.state_map)
+            )
+
+        return bsubspace.CMomentum(
+            self.L, self.q, -1 if self.k is None else self.k,
+            np.ascontiguousarray(self.state_map),
+            np.ascontiguousarray(self.periods),
+            self._hash_table if self.hash_lookup else None
+        )
+
+    def _get_descriptor(self):
+        # the representatives are quick to recompute, so they aren't saved
+        desc = {'type': 'Momentum', 'L': self.L, 'q': self.q, 'k': self.k,
+                'hash_lookup': self.hash_lookup}
+        return desc, {}
+
+    @classmethod
+    def _from_descriptor(cls, desc, arrays):
+        return cls(desc['L'], desc['q'], k=desc['k'], hash_lookup=desc['hash_lookup'])
+
+    def to_enum(self):
+        '''
+        Convert the class types used in the Python frontend to the enum values
+        used in the C backend.
+        '''
+        return bsubspace.SubspaceType.MOMENTUM
+
+
+def _from_descriptor(desc, arrays):
+    '''
+    Rebuild a subspace of any type from the output of its ``_get_descriptor`` method.
+    '''
+    types = {c.__name__: c for c in (Full, Parity, SpinConserve, Explicit, Auto, Momentum)}
+    if desc['type'] not in types:
+        raise ValueError('Unknown subspace type "%s"' % desc['type'])
+    return types[desc['type']]._from_descriptor(desc, arrays)
@@ -126,6 +126,51 @@ def get_cur_memory_usage(which='all'):
     from ._backend import bpetsc
     return bpetsc.get_cur_memory_usage(which=which)/1E9
 
+def track_profile():
+    '''
+    Begin recording the PETSc log events of dynamite's backend (matrix building, shell
+    matrix-vector products, expectation values, and so on), for a later call to
+    :meth:`get_profile`. Not needed if the option ``'-log_view'`` was supplied to PETSc,
+    which also prints the events by name (prefixed with ``DNM``) when the program exits.
+    '''
+    from . import config
+    config._initialize()
+    from ._backend import bpetsc
+    return bpetsc.track_profile()
+
+def get_profile():
+    '''
+    Get the profile of each of the backend's events up to this point. Must be called on all
+    MPI ranks.
+
+    .. note::
+        :meth:`track_profile` must be called first, or ``'-log_view'`` supplied to PETSc.
+        Otherwise the counts are all zero.
+
+    Returns
+    -------
+    dict
+        For each event name, a dict with the number of times the event was logged
+        (``'count'``) and its time in seconds (``'time'``), both the maximum over ranks; and
+        the floating point operations (``'flops'``), estimated bytes of vector and matrix
+        data read and written (``'bytes'``), MPI messages (``'messages'``) and their total
+        size (``'message_bytes'``), and reductions (``'reductions'``), all summed over ranks.
+        Communication during shell matrix products is logged separately as ``'ShellComm'``,
+        and is also included in the time of the product itself.
+    '''
+    from . import config
+    config._initialize()
+    from ._backend import bpetsc
+    return bpetsc.get_profile()
+
 def complex_enabled():
     from ._backend import bbuild
     return bbuild.complex_enabled()
+
+def single_precision_enabled():
+    '''
+    Whether PETSc was configured with ``--with-precision=single``, in which case vectors and
+    matrices are stored in single precision.
+    '''
+    from ._backend import bbuild
+    return bbuild.single_precision_enabled()
@@ -7,10 +7,11 @@ import dynamite_test_runner as dtr
 import unittest as ut
 
 from dynamite import config
-from dynamite.operators import sigmax, index_product, identity
+from dynamite.operators import sigmax, sigmaz, index_product, identity
 from dynamite.states import State
 from dynamite.subspaces import Parity
 from dynamite.tools import complex_enabled
+from dynamite.computations import evolve_trajectory, reduced_density_matrix
 
 @ut.skipIf(not complex_enabled(), 'complex numbers not enabled')
 class Analytic(dtr.DynamiteTestCase):
@@ -92,6 +93,40 @@ class ParityTests(EvolveChecker):
 
     # TODO: actually check output
 
+@ut.skipIf(not complex_enabled(), 'complex numbers not enabled')
+class Trajectory(dtr.DynamiteTestCase):
+
+    def setUp(self):
+        self.H = hamiltonians.localized()
+        self.state = State(state='random', seed=0)
+        self.times = [0.0, 0.3, 0.5, 1.2, 1.0]
+
+    def test_states(self):
+        initial = self.state.copy()
+        for t, evolved in evolve_trajectory(self.H, self.state, self.times):
+            check = self.H.evolve(self.state, t=t)
+            self.assertLess(np.abs(1 - np.abs(check.dot(evolved))), 1E-9)
+
+        # the input state should not have changed
+        self.assertLess(np.abs(1 - initial.dot(self.state)), 1E-12)
+
+    def test_observables(self):
+        Sz = sigmaz(0)
+        keep = [0, 1]
+        observables = [Sz, lambda s: reduced_density_matrix(s, keep)]
+
+        results = list(self.H.evolve_trajectory(self.state, self.times, observables))
+        self.assertEqual([t for t, _ in results], self.times)
+
+        for t, (Sz_val, dm) in results:
+            with self.subTest(t=t):
+                check = self.H.evolve(self.state, t=t)
+                self.assertAlmostEqual(Sz_val, check.dot(Sz.dot(check)), places=10)
+
+                dm_check = reduced_density_matrix(check, keep)
+                if dm_check[0, 0] != -1:
+                    self.assertTrue(np.allclose(dm, dm_check, atol=1E-10))
+
 @ut.skipIf(complex_enabled(), 'complex numbers enabled')
 class FailTest(dtr.DynamiteTestCase):
     def test_fail(self):
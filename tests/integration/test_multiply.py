@@ -94,6 +94,47 @@ class FullHamiltonians(dtr.DynamiteTestCase):
 
         self.assertLess(np.abs(1 - inner_prod), 1E-9, msg=msg)
 
+@generate_hamiltonian_tests
+class HalfStorage(dtr.DynamiteTestCase):
+    def check_hamiltonian(self, H_name):
+        H = getattr(hamiltonians, H_name)()
+        bra, ket = H.create_states()
+        ket.set_random(seed = 0)
+        H.dot(ket, bra)
+
+        H_half = H.copy()
+        H_half.half_storage = True
+        bra_half = H_half.dot(ket)
+
+        bra_half.vec.axpy(-1, bra.vec)
+        self.assertLess(bra_half.vec.norm(), 1E-12*bra.vec.norm())
+
+@generate_hamiltonian_tests
+class MaskDiagonal(dtr.DynamiteTestCase):
+    def compare(self, H, subspace):
+        H = H.copy()
+        H.shell = True
+        H.add_subspace(subspace)
+        bra, ket = H.create_states()
+        ket.set_random(seed = 0)
+        H.dot(ket, bra)
+
+        H_dia = H.copy()
+        H_dia.mask_diagonal = True
+        bra_dia = H_dia.dot(ket)
+
+        bra_dia.vec.axpy(-1, bra.vec)
+        self.assertLess(bra_dia.vec.norm(), 1E-12*bra.vec.norm())
+
+    def check_hamiltonian(self, H_name):
+        self.compare(getattr(hamiltonians, H_name)(), Full())
+
+    def test_parity(self):
+        H = index_sum(sigmax(0)*sigmax(1) + sigmay(0)*sigmay(1))
+        for space in ('even', 'odd'):
+            with self.subTest(space=space):
+                self.compare(H, Parity(space))
+
 @generate_hamiltonian_tests
 class Subspaces(dtr.DynamiteTestCase):
 
@@ -257,6 +298,51 @@ class Subspaces(dtr.DynamiteTestCase):
 
                         self.compare_to_full(H, *xs, sp)
 
+class ShellMatMatMult(dtr.DynamiteTestCase):
+    '''
+    Check that multiplying a shell matrix by a block of vectors at once matches
+    multiplying by each vector individually.
+    '''
+
+    def check_matmatmult(self, H, n_vecs=3):
+        from petsc4py import PETSc
+
+        H.shell = True
+        A = H.get_mat()
+
+        X = PETSc.Mat().create()
+        X.setSizes([A.getSizes()[1], (PETSc.DECIDE, n_vecs)])
+        X.setType('densecuda' if config.gpu else 'dense')
+        X.setUp()
+        X.setRandom()
+        X.assemble()
+
+        B = A.matMult(X)
+
+        x, b = A.createVecs()
+        b_block = b.duplicate()
+        for vec_idx in range(n_vecs):
+            with self.subTest(vec_idx=vec_idx):
+                X.getColumnVector(vec_idx, x)
+                A.mult(x, b)
+                B.getColumnVector(vec_idx, b_block)
+                b_block.axpy(-1, b)
+                self.assertLess(b_block.norm(), 1E-12*b.norm())
+
+    def test_full(self):
+        self.check_matmatmult(hamiltonians.localized())
+
+    def test_spinconserve(self):
+        H = hamiltonians.localized()
+        H.add_subspace(SpinConserve(H.get_length(), H.get_length()//2))
+        self.check_matmatmult(H)
+
+    def test_auto(self):
+        H = hamiltonians.localized()
+        half = H.get_length()//2
+        H.add_subspace(Auto(H, 'U'*half + 'D'*(H.get_length()-half)))
+        self.check_matmatmult(H)
+
 # TODO: write tests where this is not just the identity
 class Projection(dtr.DynamiteTestCase):
 
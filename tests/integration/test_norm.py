@@ -8,9 +8,10 @@ import hamiltonians
 
 import dynamite_test_runner as dtr
 
-from dynamite import config
+from dynamite import config, tools
 from dynamite._backend.bbuild import have_gpu_shell
 from dynamite.tools import complex_enabled
+from dynamite.subspaces import Parity, SpinConserve, Auto
 
 class Hamiltonians(dtr.DynamiteTestCase):
 
@@ -34,5 +35,67 @@ class Hamiltonians(dtr.DynamiteTestCase):
                 self.assertLess(np.abs(petsc_norm-shell_norm), eps,
                                 msg = '\npetsc: %e\nshell: %e' % (petsc_norm, shell_norm))
 
+class FusedNorm(dtr.DynamiteTestCase):
+    """
+    The norm found while checking conservation should be the one the shell matrix would
+    compute.
+    """
+
+    def subspaces(self):
+        half = 'U'*(config.L//2) + 'D'*(config.L - config.L//2)
+        return [
+            ('parity', Parity('even')),
+            ('spinconserve', SpinConserve(config.L, config.L//2)),
+            ('auto', Auto(hamiltonians.localized(), half)),
+        ]
+
+    def test_matches(self):
+        config._initialize()
+        from petsc4py import PETSc
+
+        for name, subspace in self.subspaces():
+            with self.subTest(subspace=name):
+                norms = []
+                for fused in (True, False):
+                    H = hamiltonians.localized()
+                    H.shell = True
+                    # skipping the conservation check leaves the norm to MatNorm
+                    H.allow_projection = not fused
+                    H.add_subspace(subspace)
+                    norms.append(H.get_mat().norm(PETSc.NormType.INFINITY))
+
+                eps = H.nnz * np.finfo(np.complex128).eps * 1E2
+                self.assertLess(np.abs(norms[0]-norms[1]), eps,
+                                msg = '\nfused: %e\nshell: %e' % tuple(norms))
+
+    def test_cached(self):
+        config._initialize()
+        from petsc4py import PETSc
+
+        H = hamiltonians.localized()
+        H.shell = True
+        subspace = SpinConserve(config.L, config.L//2)
+        H.add_subspace(subspace)
+
+        tools.track_profile()
+        self.assertTrue(H.conserves(subspace))
+        nrm = H.get_mat().norm(PETSc.NormType.INFINITY)
+        before = tools.get_profile()
+
+        # rebuilding the matrix reuses both the conservation check and the norm
+        H.destroy_mat()
+        self.assertEqual(H.get_mat().norm(PETSc.NormType.INFINITY), nrm)
+
+        after = tools.get_profile()
+        for event in ('CheckConsrv', 'ShellNorm'):
+            with self.subTest(event=event):
+                self.assertEqual(after[event]['count'], before[event]['count'])
+
+        # but new coefficients need a new sweep
+        H.update_coeffs(2*hamiltonians.localized())
+        self.assertTrue(H.conserves(subspace))
+        self.assertGreater(tools.get_profile()['CheckConsrv']['count'], after['CheckConsrv']['count'])
+
+
 if __name__ == '__main__':
     dtr.main()
@@ -2,12 +2,20 @@
 Integration tests for operators.
 '''
 
+import os
+import shutil
+from glob import glob
+
+import numpy as np
+
 import dynamite_test_runner as dtr
 
 from dynamite import config
 from dynamite.tools import complex_enabled
-from dynamite.subspaces import Full, Parity, SpinConserve, Auto
+from dynamite.subspaces import Full, Parity, SpinConserve, Auto, Momentum
 from dynamite.operators import index_sum, sigmax, sigmay, sigmaz
+from dynamite.states import State
+from dynamite.computations import expectation_values
 
 import hamiltonians
 
@@ -101,6 +109,22 @@ class SubspaceConservation(dtr.DynamiteTestCase):
                 Full()
             )
 
+    def test_momentum(self):
+        H = index_sum(sigmax(0)*sigmax(1) + sigmay(0)*sigmay(1) + sigmaz(0)*sigmaz(1),
+                      boundary='closed')
+        for k in (None, config.L//2):
+            with self.subTest(k=k):
+                subspace = Momentum(config.L, 0, k=k)
+                self.assertTrue(H.conserves(subspace))
+                self.assertTrue((H + index_sum(sigmaz())).conserves(subspace))
+                self.assertEqual((H + index_sum(sigmax())).conserves(subspace), k is None)
+                self.assertFalse(index_sum(sigmaz(0)*sigmaz(1)).conserves(subspace))
+
+    def test_momentum_error(self):
+        op = sigmaz()
+        with self.assertRaises(ValueError):
+            op.conserves(Momentum(config.L, 0), Full())
+
     def test_auto(self):
         for k in (config.L//2, config.L//4):
             for H_name in hamiltonians.get_names(complex_enabled()):
@@ -172,5 +196,240 @@ class SubspaceConservation(dtr.DynamiteTestCase):
                         ))
 
 
+class ExpectationValues(dtr.DynamiteTestCase):
+    """
+    Tests for computing many expectation values at once without building matrices.
+    """
+
+    def get_operators(self):
+        L = config.L
+        ops = [sigmaz(i) for i in range(L)]
+        ops += [sigmaz(i)*sigmaz(j) for i in range(L) for j in range(i+1, L)]
+        ops += [sigmax(0)*sigmax(L-1), sigmax(1), hamiltonians.localized()]
+        return ops
+
+    def check_subspace(self, subspace):
+        state = State(subspace=subspace, state='random', seed=0)
+        ops = self.get_operators()
+
+        values = expectation_values(state, ops)
+        self.assertEqual(len(values), len(ops))
+
+        for i, op in enumerate(ops):
+            with self.subTest(op=i):
+                op.add_subspace(subspace)
+                op.allow_projection = True
+                check = op.dot(state).dot(state)
+                self.assertAlmostEqual(values[i], check, places=10)
+
+    def test_full(self):
+        self.check_subspace(Full())
+
+    def test_parity(self):
+        for parity in ('even', 'odd'):
+            with self.subTest(parity=parity):
+                self.check_subspace(Parity(parity))
+
+    def test_spinconserve(self):
+        self.check_subspace(SpinConserve(config.L, config.L//2))
+
+    def test_spinconserve_spinflip(self):
+        if config.L % 2 != 0:
+            self.skipTest('spinflip requires even L')
+        # the operators needn't commute with the spin flip, so compare to the product
+        # state basis (projecting them would fold them the same way the backend does)
+        for sign in '+-':
+            with self.subTest(sign=sign):
+                subspace = SpinConserve(config.L, config.L//2, spinflip=sign)
+                state = State(subspace=subspace, state='random', seed=0)
+                ops = self.get_operators()
+
+                values = expectation_values(state, ops)
+                check = expectation_values(SpinConserve.convert_spinflip(state), ops)
+                self.assertTrue(np.allclose(values, check, atol=1E-10))
+
+                # a single sigma^z anticommutes with the flip
+                self.assertAlmostEqual(values[0], 0, places=10)
+
+    def test_auto(self):
+        H = hamiltonians.localized()
+        self.check_subspace(Auto(H, 'U'*(config.L//2) + 'D'*(config.L - config.L//2)))
+
+    def test_momentum(self):
+        # the operators needn't be translation invariant, so compare to the full space
+        for k in (None, config.L//2):
+            with self.subTest(k=k):
+                state = State(subspace=Momentum(config.L, 0, k=k), state='random', seed=0)
+                ops = self.get_operators()
+
+                values = expectation_values(state, ops)
+                check = expectation_values(Momentum.convert_momentum(state), ops)
+                self.assertTrue(np.allclose(values, check, atol=1E-10))
+
+    def test_empty(self):
+        state = State(state='random', seed=0)
+        self.assertEqual(list(expectation_values(state, [])), [])
+
+
+class UpdateCoeffs(dtr.DynamiteTestCase):
+    """
+    Tests for rewriting the coefficients of a built matrix in place.
+    """
+
+    def setUp(self):
+        self.H0 = index_sum(sigmaz(0)*sigmaz(1))
+        self.H1 = index_sum(sigmax(0)*sigmax(1) + sigmay(0)*sigmay(1))
+
+    def check_update(self, subspace):
+        H = self.H0 + 0.3*self.H1
+        H.add_subspace(subspace)
+        mat = H.get_mat(subspaces=(subspace, subspace))
+        state = State(subspace=subspace, state='random', seed=0)
+
+        for g in (0.7, -1.2, 0):
+            with self.subTest(g=g):
+                target = self.H0 + g*self.H1
+                H.update_coeffs(target)
+                self.assertIs(H.get_mat(subspaces=(subspace, subspace)), mat)
+
+                target.add_subspace(subspace)
+                self.check_vec_equal(H.dot(state), target.dot(state))
+
+    def test_full(self):
+        self.check_update(Full())
+
+    def test_parity(self):
+        self.check_update(Parity('even'))
+
+    def test_spinconserve(self):
+        self.check_update(SpinConserve(config.L, config.L//2))
+
+    def test_half_storage(self):
+        if config.shell:
+            self.skipTest('half storage is only for non-shell matrices')
+        self.H0.half_storage = True
+        self.H1.half_storage = True
+        self.check_update(Full())
+
+    def test_mask_diagonal(self):
+        for op in (self.H0, self.H1):
+            op.shell = True
+            op.mask_diagonal = True
+        self.check_update(Full())
+
+    def test_new_terms(self):
+        H = self.H0 + 0.3*self.H1
+        mat = H.get_mat()
+        state = State(state='random', seed=0)
+
+        target = self.H0 + 0.3*self.H1 + index_sum(sigmax())
+        H.update_coeffs(target)
+        self.assertIsNot(H.get_mat(), mat)
+        self.check_vec_equal(H.dot(state), target.dot(state))
+
+    def test_breaks_conservation(self):
+        # same terms, but XX+0.5*YY no longer conserves total magnetization
+        subspace = SpinConserve(config.L, config.L//2)
+        target = index_sum(sigmax(0)*sigmax(1) + 0.5*sigmay(0)*sigmay(1))
+
+        H = index_sum(sigmax(0)*sigmax(1) + sigmay(0)*sigmay(1))
+        H.add_subspace(subspace)
+        H.build_mat(subspaces=(subspace, subspace))
+        with self.assertRaises(ValueError):
+            H.update_coeffs(target)
+
+        H.allow_projection = True
+        H.update_coeffs(target)
+
+
+class Cache(dtr.DynamiteTestCase):
+    """
+    Tests for the on-disk cache of matrices and Auto subspaces.
+    """
+
+    cache_dir = '/tmp/dnm_test_cache'
+
+    def setUp(self):
+        from petsc4py import PETSc
+        if PETSc.COMM_WORLD.rank == 0:
+            shutil.rmtree(self.cache_dir, ignore_errors=True)
+        PETSc.COMM_WORLD.barrier()
+        config.cache_dir = self.cache_dir
+
+    def tearDown(self):
+        config.cache_dir = None
+
+    def entries(self, kind):
+        return glob(os.path.join(self.cache_dir, kind+'-*'))
+
+    def check_cached_mat(self, make_op, subspace):
+        state = State(subspace=subspace, state='random', seed=0)
+        results = []
+        for count in (1, 2):
+            with self.subTest(build=count):
+                H = make_op()
+                H.add_subspace(subspace)
+                results.append(H.dot(state))
+                self.assertEqual(len(self.entries('mat')), 1)
+        self.check_vec_equal(*results)
+
+    def test_mat(self):
+        if config.shell:
+            self.skipTest('shell matrices are not cached')
+
+        for H_name in hamiltonians.get_names(complex_enabled()):
+            with self.subTest(H=H_name):
+                self.setUp()
+                self.check_cached_mat(getattr(hamiltonians, H_name), Full())
+
+    def test_mat_subspace(self):
+        if config.shell:
+            self.skipTest('shell matrices are not cached')
+
+        self.check_cached_mat(hamiltonians.localized,
+                              SpinConserve(config.L, config.L//2))
+
+    def test_half_storage(self):
+        if config.shell:
+            self.skipTest('half storage is only for non-shell matrices')
+
+        def make_op():
+            H = hamiltonians.localized()
+            H.half_storage = True
+            return H
+
+        self.check_cached_mat(make_op, Full())
+
+    def test_mat_coeffs(self):
+        if config.shell:
+            self.skipTest('shell matrices are not cached')
+
+        for g in (0.5, 0.25):
+            H = index_sum(sigmax(0)*sigmax(1)) + g*index_sum(sigmaz())
+            H.build_mat()
+        self.assertEqual(len(self.entries('mat')), 2)
+
+    def test_shell(self):
+        H = hamiltonians.localized()
+        H.shell = True
+        H.build_mat()
+        self.assertEqual(self.entries('mat'), [])
+
+    def test_auto(self):
+        H = hamiltonians.localized()
+        start = 'U'*(config.L//2) + 'D'*(config.L - config.L//2)
+
+        for sort in (True, False):
+            with self.subTest(sort=sort):
+                self.setUp()
+                computed = Auto(H, start, sort=sort)
+                self.assertEqual(len(self.entries('auto')), 1)
+
+                loaded = Auto(H, start, sort=sort)
+                self.assertEqual(len(self.entries('auto')), 1)
+                self.assertTrue(computed.identical(loaded))
+                self.assertTrue(np.array_equal(computed.state_map, loaded.state_map))
+
+
 if __name__ == '__main__':
     dtr.main()
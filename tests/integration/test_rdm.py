@@ -258,6 +258,43 @@ class FullSpace(Checker):
 
                 self.compare_rdm(keep, correct)
 
+    def test_scattered_keep(self):
+        # with several processes, each computes a full-size part of the matrix and the parts
+        # are summed onto process 0, so keep more sites than are traced out
+        from dynamite import config
+        config._initialize()
+        from petsc4py import PETSc
+        from dynamite.operators import identity
+        from dynamite.subspaces import Full
+
+        self.state.set_random(seed=0)
+
+        to_full = identity()
+        to_full.add_subspace(Full(), self.state.subspace)
+        full_np = (to_full*self.state).to_numpy()
+
+        keep = [i for i in range(self.state.L) if i % 3 != 1]
+        if len(keep) > self.state.L//2 and 'slow' in self.skip_flags:
+            self.skipTest('slow')
+
+        if full_np is not None: # process 0
+            # axis k of the reshaped vector is spin L-1-k
+            tensor = full_np.reshape((2,)*self.state.L)
+            keep_axes = [self.state.L-1-i for i in reversed(keep)]
+            tr_axes = [a for a in range(self.state.L) if a not in keep_axes]
+            matrix = np.transpose(tensor, keep_axes+tr_axes).reshape((2**len(keep), -1))
+            correct = np.dot(matrix, np.conj(matrix.T))
+        else:
+            correct = None
+
+        self.compare_rdm(keep, correct)
+
+        # the other processes should get back their placeholder untouched
+        check = reduced_density_matrix(self.state, keep)
+        if PETSc.COMM_WORLD.rank != 0:
+            self.assertEqual(check.shape, (1, 1))
+            self.assertEqual(check[0, 0], -1)
+
 class EvenParitySpace(FullSpace):
     def setUp(self):
         self.state = State(subspace=Parity('even'))
@@ -2,13 +2,18 @@
 Integration tests for states.
 '''
 
+import os
+import json
+import shutil
+import tempfile
+
 import numpy as np
 
 import dynamite_test_runner as dtr
 
 from dynamite import config
 from dynamite.states import State, UninitializedError
-from dynamite.subspaces import Parity, SpinConserve, Auto
+from dynamite.subspaces import Full, Parity, SpinConserve, Auto
 from dynamite.operators import sigmaz, sigmax, sigmay, index_sum
 from dynamite.computations import reduced_density_matrix
 
@@ -255,6 +260,131 @@ class Saving(dtr.DynamiteTestCase):
         self.check_states_equal(state, loaded)
 
 
+class Checkpoint(dtr.DynamiteTestCase):
+
+    def setUp(self):
+        from petsc4py import PETSc
+
+        # a fresh directory for each test, so that concurrent runs don't collide
+        path = None
+        if PETSc.COMM_WORLD.rank == 0:
+            path = tempfile.mkdtemp(prefix='dnm_test_checkpoint_')
+
+        if PETSc.COMM_WORLD.size > 1:
+            path = PETSc.COMM_WORLD.tompi4py().bcast(path, root=0)
+
+        self.path = path
+
+    def tearDown(self):
+        from petsc4py import PETSc
+        PETSc.COMM_WORLD.barrier()
+        if PETSc.COMM_WORLD.rank == 0:
+            shutil.rmtree(self.path, ignore_errors=True)
+
+    def get_subspaces(self):
+        half_L = config.L//2
+        H = index_sum(sigmax(0)*sigmax(1) + sigmay(0)*sigmay(1))
+        rtn = [
+            ('full', Full()),
+            ('parity', Parity('odd')),
+            ('spinconserve', SpinConserve(config.L, half_L)),
+            ('auto', Auto(H, 'U'*half_L + 'D'*(config.L - half_L))),
+            ('auto_unsorted', Auto(H, 'U'*half_L + 'D'*(config.L - half_L), sort=False)),
+        ]
+        if config.L % 2 == 0:
+            rtn.append(('spinflip', SpinConserve(config.L, half_L, spinflip='-')))
+        return rtn
+
+    def check_states_equal(self, a, b):
+        self.assertTrue(a.subspace.identical(b.subspace))
+        self.assertEqual(type(a.subspace), type(b.subspace))
+        self.assertTrue(a.vec.equal(b.vec))
+
+    def test_roundtrip(self):
+        for compress in (False, True):
+            for mmap in (False, True):
+                for name, subspace in self.get_subspaces():
+                    with self.subTest(subspace=name, compress=compress, mmap=mmap):
+                        state = State(state='random', subspace=subspace, seed=0)
+                        state.save_checkpoint(self.path, compress=compress, chunk_size=100)
+                        loaded = State.from_checkpoint(self.path, mmap=mmap)
+                        self.check_states_equal(state, loaded)
+
+    def test_from_file(self):
+        state = State(state='random', seed=0)
+        state.save_checkpoint(self.path)
+        self.check_states_equal(state, State.from_file(self.path))
+
+    def test_mmap_copy_on_write(self):
+        state = State(state='random', seed=0)
+        state.save_checkpoint(self.path)
+
+        loaded = State.from_checkpoint(self.path)
+        loaded.vec.scale(2)
+        self.assertFalse(loaded.vec.equal(state.vec))
+
+        # the file should not have changed
+        self.check_states_equal(state, State.from_checkpoint(self.path))
+
+    def resplit(self, n_pieces):
+        '''
+        Rewrite the saved vector of an uncompressed checkpoint as if it had been saved with
+        a different number of processes: the first file is kept, and the rest of the
+        vector is split into n_pieces files.
+        '''
+        from petsc4py import PETSc
+        comm = PETSc.COMM_WORLD.tompi4py()
+
+        comm.barrier()
+        if comm.rank == 0:
+            header_path = os.path.join(self.path, 'header.json')
+            with open(header_path) as f:
+                header = json.load(f)
+
+            vec = np.concatenate([np.load(os.path.join(self.path, fname))
+                                  for fname in header['vec_files']])
+            first = header['ranges'][0][1]
+            bounds = [0] + [first + (vec.size-first)*i//n_pieces
+                            for i in range(n_pieces+1)]
+
+            header['ranges'] = list(zip(bounds[:-1], bounds[1:]))
+            header['vec_files'] = ['resplit.%d.npy' % i for i in range(n_pieces+1)]
+            for (start, end), fname in zip(header['ranges'], header['vec_files']):
+                np.save(os.path.join(self.path, fname), vec[start:end])
+
+            with open(header_path, 'w') as f:
+                json.dump(header, f)
+        comm.barrier()
+
+    def test_different_nprocs(self):
+        for mmap in (False, True):
+            for n_pieces in (1, 2, 5):
+                for name, subspace in self.get_subspaces():
+                    with self.subTest(subspace=name, mmap=mmap, n_pieces=n_pieces):
+                        state = State(state='random', subspace=subspace, seed=0)
+                        state.save_checkpoint(self.path)
+                        self.resplit(n_pieces)
+                        loaded = State.from_checkpoint(self.path, mmap=mmap)
+                        self.check_states_equal(state, loaded)
+
+    def test_small_dim(self):
+        # fewer states than processes leaves some processes with nothing
+        H = index_sum(sigmaz(0))
+        for compress in (False, True):
+            for mmap in (False, True):
+                with self.subTest(compress=compress, mmap=mmap):
+                    state = State(state='random', subspace=Auto(H, 'U'*config.L), seed=0)
+                    state.save_checkpoint(self.path, compress=compress)
+                    loaded = State.from_checkpoint(self.path, mmap=mmap)
+                    self.check_states_equal(state, loaded)
+
+    def test_overwrite(self):
+        for seed in (0, 1):
+            state = State(state='random', subspace=Parity('even'), seed=seed)
+            state.save_checkpoint(self.path, compress=bool(seed))
+        self.check_states_equal(state, State.from_checkpoint(self.path))
+
+
 class Uninitialized(dtr.DynamiteTestCase):
 
     def test_copy_neither(self):
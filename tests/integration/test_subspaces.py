@@ -8,7 +8,9 @@ import dynamite_test_runner as dtr
 
 from dynamite import config
 from dynamite.states import State, UninitializedError
-from dynamite.subspaces import SpinConserve, Auto, Full, Parity
+from dynamite.subspaces import SpinConserve, Auto, Full, Parity, Explicit, Momentum
+from dynamite.operators import index_sum, sigmax, sigmay, sigmaz
+from dynamite.tools import complex_enabled
 
 from hamiltonians import localized
 
@@ -36,6 +38,100 @@ class AutoBuild(dtr.DynamiteTestCase):
                                     H.allow_projection = True
                                     H.build_mat(subspaces=subspaces)
 
+    def test_matches_spinconserve(self):
+        H = localized()
+        for k in [H.L//2, H.L//2 - 1]:
+            with self.subTest(k=k):
+                auto = Auto(H, 'U'*k + 'D'*(H.L-k))
+                sc = SpinConserve(H.L, k)
+                self.assertEqual(auto.get_dimension(), sc.get_dimension())
+                self.assertTrue(np.array_equal(
+                    auto.idx_to_state(np.arange(auto.get_dimension())),
+                    np.sort(sc.idx_to_state(np.arange(sc.get_dimension())))
+                ))
+
+
+    def test_unsorted_order(self):
+        # ordered by distance from the start state and then by value, for any number of
+        # processes, so that the basis doesn't depend on how the job was run
+        H = localized()
+        start = State.str_to_state('U'*(H.L//2) + 'D'*(H.L - H.L//2), H.L)
+        auto = Auto(H, start, sort=False)
+        check = auto.idx_to_state(np.arange(auto.get_dimension()))
+
+        H.reduce_msc()
+        seen = {start}
+        level = [start]
+        correct = []
+        while level:
+            correct += sorted(level)
+            next_level = set()
+            for state in level:
+                for mask in np.unique(H.msc['masks']):
+                    terms = H.msc[H.msc['masks'] == mask]
+                    signs = [1 - 2*(bin(state & int(s)).count('1') % 2) for s in terms['signs']]
+                    if np.sum(signs*terms['coeffs']) != 0:
+                        next_level.add(state ^ int(mask))
+            level = list(next_level - seen)
+            seen |= next_level
+
+        self.assertTrue(np.array_equal(check, correct))
+
+class SharedMemory(dtr.DynamiteTestCase):
+    """
+    Explicit subspaces whose tables are stored once per node.
+    """
+
+    def check_shared(self, shared, private):
+        self.assertTrue(shared.shared_memory)
+        self.assertFalse(private.shared_memory)
+        self.assertEqual(shared, private)
+
+        # the tables are read-only in shared memory, so copies can share them
+        self.assertTrue(shared.copy().shared_memory)
+
+        idxs = np.arange(private.get_dimension())
+        states = private.idx_to_state(idxs)
+        self.assertTrue(np.array_equal(shared.idx_to_state(idxs), states))
+        self.assertTrue(np.array_equal(shared.state_to_idx(states), idxs))
+
+        for shell in (False, True):
+            with self.subTest(shell=shell):
+                H = localized()
+                H.shell = shell
+                H.add_subspace(shared)
+                H.add_subspace(private)
+
+                ket = State(subspace=private, state='random', seed=0)
+                shared_ket = State(subspace=shared)
+                ket.vec.copy(shared_ket.vec)
+                shared_ket.set_initialized()
+
+                self.assertTrue(np.allclose(
+                    H.dot(shared_ket).to_numpy(to_all=True),
+                    H.dot(ket).to_numpy(to_all=True)
+                ))
+
+    def test_auto(self):
+        H = localized()
+        state = 'U'*(H.L//2) + 'D'*(H.L - H.L//2)
+        for hash_lookup in (True, False):
+            with self.subTest(hash_lookup=hash_lookup):
+                self.check_shared(
+                    Auto(H, state, hash_lookup=hash_lookup, shared_memory=True),
+                    Auto(H, state, hash_lookup=hash_lookup)
+                )
+
+    def test_unsorted(self):
+        H = localized()
+        auto = Auto(H, 'U'*(H.L//2) + 'D'*(H.L - H.L//2), sort=False)
+        states = auto.idx_to_state(np.arange(auto.get_dimension()))
+
+        private = Explicit(states)
+        shared = Explicit(states, shared_memory=True)
+        private.L = shared.L = H.L
+        self.check_shared(shared, private)
+
 
 class ConfigLSetting(dtr.DynamiteTestCase):
 
@@ -153,5 +249,98 @@ class SpinFlipConversion(dtr.DynamiteTestCase):
                 self.assertTrue(len(bad_idxs) == 0, msg=msg)
 
 
+class MomentumSubspace(dtr.DynamiteTestCase):
+
+    def setUp(self):
+        # a translation invariant Hamiltonian with no other symmetries to speak of
+        self.H = index_sum(sigmax(0)*sigmax(1) + 0.5*sigmay(0)*sigmay(1) + 0.3*sigmaz(0)*sigmaz(1),
+                           boundary='closed')
+        self.H += 0.2*index_sum(sigmaz(0)*sigmax(1)*sigmaz(2), boundary='closed')
+        self.H += 0.4*index_sum(sigmax())
+
+    def momenta(self):
+        L = config.L
+        if complex_enabled():
+            return range(L)
+        return [0, L//2] if L % 2 == 0 else [0]
+
+    def test_conversion(self):
+        for q in self.momenta():
+            for k in (None, config.L//2):
+                with self.subTest(q=q, k=k):
+                    state = State(state='random', subspace=Momentum(config.L, q, k=k), seed=0)
+                    full_state = Momentum.convert_momentum(state)
+                    self.assertAlmostEqual(full_state.norm(), 1)
+
+                    check = Momentum.convert_momentum(full_state, q=q)
+                    self.check_vec_equal(state, check)
+
+    def test_projection(self):
+        # the momentum states are orthogonal, and together span the space
+        full_state = State(state='random', seed=0)
+        total = 0
+        for q in self.momenta():
+            total += Momentum.convert_momentum(full_state, q=q).norm()**2
+
+        if complex_enabled():
+            self.assertAlmostEqual(total, 1)
+        else:
+            self.assertLess(total, 1 + 1E-12)
+
+    def test_product_state(self):
+        state = State(state='U'*(config.L-1) + 'D', subspace=Momentum(config.L, 0))
+        full_state = Momentum.convert_momentum(state)
+        correct = State(state='U'*(config.L-1) + 'D')
+        for i in range(1, config.L):
+            correct.vec.axpy(1, State(state='U'*(config.L-1-i) + 'D' + 'U'*i).vec)
+        correct.vec.scale(1/np.sqrt(config.L))
+        self.check_vec_equal(full_state, correct)
+
+    def test_matvec(self):
+        for q in self.momenta():
+            with self.subTest(q=q):
+                subspace = Momentum(config.L, q)
+                self.assertTrue(self.H.conserves(subspace))
+
+                H = self.H.copy()
+                H.add_subspace(subspace)
+                state = State(state='random', subspace=subspace, seed=0)
+                result = Momentum.convert_momentum(H.dot(state))
+
+                check = self.H.dot(Momentum.convert_momentum(state))
+                self.check_vec_equal(result, check)
+
+    def test_spinconserve(self):
+        H = index_sum(sigmax(0)*sigmax(1) + sigmay(0)*sigmay(1) + 0.5*sigmaz(0)*sigmaz(1),
+                      boundary='closed')
+        k = config.L//2
+        for q in self.momenta():
+            with self.subTest(q=q):
+                subspace = Momentum(config.L, q, k=k)
+                self.assertTrue(H.conserves(subspace))
+
+                Hm = H.copy()
+                Hm.add_subspace(subspace)
+                state = State(state='random', subspace=subspace, seed=0)
+                result = Momentum.convert_momentum(Hm.dot(state))
+
+                Hs = H.copy()
+                Hs.add_subspace(SpinConserve(config.L, k))
+                check = Hs.dot(Momentum.convert_momentum(state))
+                self.check_vec_equal(result, check)
+
+    def test_not_conserved(self):
+        subspace = Momentum(config.L, 0)
+        self.assertFalse(index_sum(sigmax(0)*sigmax(1)).conserves(subspace))
+        self.assertFalse(sigmaz(0).conserves(subspace))
+        self.assertFalse(self.H.conserves(Momentum(config.L, 0, k=config.L//2)))
+
+    def test_rdm_error(self):
+        from dynamite.computations import reduced_density_matrix
+        state = State(state='random', subspace=Momentum(config.L, 0), seed=0)
+        with self.assertRaises(ValueError):
+            reduced_density_matrix(state, [0])
+
+
 if __name__ == '__main__':
     dtr.main()
@@ -1,5 +1,6 @@
 
 import unittest as ut
+import numpy as np
 from dynamite import tools
 import dynamite_test_runner as dtr
 
@@ -26,5 +27,35 @@ class Tools(dtr.DynamiteTestCase):
         tools.track_memory()
         self.assertTrue(isinstance(tools.get_max_memory_usage(), float))
 
+    def test_profile(self):
+        from dynamite.operators import sigmax, sigmaz, index_sum
+        from dynamite.states import State
+
+        tools.track_profile()
+        before = tools.get_profile()
+
+        H = index_sum(sigmax(0)*sigmax(1)) + index_sum(sigmaz())
+        state = State(state='random', seed=0)
+        H.dot(state)
+
+        profile = tools.get_profile()
+        self.assertEqual(set(profile), set(before))
+        for fields in profile.values():
+            for key in ('count', 'time', 'flops', 'bytes', 'messages',
+                        'message_bytes', 'reductions'):
+                self.assertTrue(key in fields)
+
+        self.assertGreater(profile['BuildMat']['count'], before['BuildMat']['count'])
+        product = 'ShellMult' if H.shell else 'ComputeRows'
+        self.assertGreater(profile[product]['count'], before[product]['count'])
+        self.assertGreater(profile[product]['flops'], before[product]['flops'])
+
+    def test_scalar_type(self):
+        from petsc4py import PETSc
+        from dynamite._backend import bpetsc
+        self.assertEqual(np.dtype(bpetsc.scalar_dtype()), np.dtype(PETSc.ScalarType))
+        self.assertEqual(tools.single_precision_enabled(),
+                         np.dtype(PETSc.RealType) == np.dtype(np.float32))
+
 if __name__ == '__main__':
     dtr.main()
@@ -7,7 +7,9 @@ config.mock_backend = True
 
 modules['petsc4py.PETSc'] = Mock()
 modules['slepc4py.SLEPc'] = Mock()
+modules['dynamite._backend.bpetsc'] = Mock()
 
 from petsc4py import PETSc
 
 PETSc.COMM_WORLD.rank = 0
+PETSc.COMM_WORLD.size = 1
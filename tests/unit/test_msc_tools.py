@@ -391,6 +391,28 @@ class MSCProduct(ut.TestCase):
         target = []
         self.check_same(check, target)
 
+    def test_no_factors(self):
+        check = msc_tools.msc_product([])
+        target = [(0, 0, 1)]
+        self.check_same(check, target)
+
+    def test_combine(self):
+        lst = [
+            [(1, 0, 1), (1, 0, 2), (0, 1, 1)],
+            [(1, 0, 1), (0, 1, 1)]
+        ]
+        lst = [np.array(x, dtype=self.dtype) for x in lst]
+        check = msc_tools.msc_product(lst)
+        target = [(0, 0, 4), (1, 1, 2)]
+        self.check_same(check, target)
+
+    def test_many_factors(self):
+        # (X_0 + X_1)^8 on many factors, whose cartesian product would have 256 terms
+        factor = np.array([(1, 0, 1), (2, 0, 1)], dtype=self.dtype)
+        check = msc_tools.msc_product([factor]*8)
+        target = [(0, 0, 128), (3, 0, 128)]
+        self.check_same(check, target)
+
 class ShiftMSC(ut.TestCase):
     '''
     Tests the shift method.
@@ -464,6 +486,70 @@ class ShiftMSC(ut.TestCase):
         self.assertTrue(np.all(shifted['coeffs'] == msc['coeffs']))
         self.assertTrue(np.all(msc == orig))
 
+class Translation(ut.TestCase):
+    '''
+    Tests the translation_invariant and translation_average methods.
+    '''
+
+    def setUp(self):
+        self.dtype = msc_tools.msc_dtype
+
+    def test_invariant(self):
+        # sigma^z on each of 4 sites
+        msc = np.array([(0, 2**i, 1) for i in range(4)], dtype=self.dtype)
+        self.assertTrue(msc_tools.translation_invariant(msc, 4))
+        self.assertFalse(msc_tools.translation_invariant(msc, 5))
+
+    def test_invariant_wrap(self):
+        # a nearest neighbor XX coupling, with and without the term across the boundary
+        msc = np.array([(3 << i, 0, 1) for i in range(3)], dtype=self.dtype)
+        self.assertFalse(msc_tools.translation_invariant(msc, 4))
+
+        msc = np.hstack([msc, np.array([(0b1001, 0, 1)], dtype=self.dtype)])
+        self.assertTrue(msc_tools.translation_invariant(msc, 4))
+
+    def test_invariant_coeffs(self):
+        msc = np.array([(0, 2**i, 1+(i == 2)) for i in range(4)], dtype=self.dtype)
+        self.assertFalse(msc_tools.translation_invariant(msc, 4))
+
+    def test_average(self):
+        msc = np.array([(1, 0, 2), (0, 2, 1j)], dtype=self.dtype)
+        avg = msc_tools.translation_average(msc, 4)
+        self.assertTrue(msc_tools.translation_invariant(avg, 4))
+
+        check = msc_tools.combine_and_sort(np.array(
+            [(2**i, 0, 0.5) for i in range(4)] + [(0, 2**i, 0.25j) for i in range(4)],
+            dtype=self.dtype
+        ))
+        self.assertTrue(np.array_equal(avg, check))
+
+    def test_average_invariant(self):
+        msc = msc_tools.combine_and_sort(
+            np.array([(0, 2**i, 0.5) for i in range(5)], dtype=self.dtype)
+        )
+        self.assertTrue(np.array_equal(msc_tools.translation_average(msc, 5), msc))
+
+class SpinFlip(ut.TestCase):
+    '''
+    Tests the spinflip_average method.
+    '''
+
+    def setUp(self):
+        self.dtype = msc_tools.msc_dtype
+
+    def test_average(self):
+        # X, Z, Y, ZZ and XZ on the first two sites
+        msc = np.array([(1, 0, 2), (0, 1, 3), (1, 1, 1j), (0, 3, 4), (1, 2, 5)],
+                       dtype=self.dtype)
+        check = msc_tools.combine_and_sort(
+            np.array([(1, 0, 2), (0, 3, 4)], dtype=self.dtype)
+        )
+        self.assertTrue(np.array_equal(msc_tools.spinflip_average(msc), check))
+
+    def test_empty(self):
+        msc = np.array([], dtype=self.dtype)
+        self.assertEqual(msc_tools.spinflip_average(msc).size, 0)
+
 class ReduceMSC(ut.TestCase):
     '''
     Test the _combine_and_sort method.
@@ -521,6 +607,56 @@ class ReduceMSC(ut.TestCase):
 
         self.check_same(check, target)
 
+    def test_random(self):
+        # enough terms to make the hash table grow several times
+        rng = np.random.default_rng(0)
+        check = np.ndarray(5000, dtype=self.dtype)
+        check['masks'] = rng.integers(0, 64, size=check.size)
+        check['signs'] = rng.integers(0, 64, size=check.size)
+        check['coeffs'] = rng.integers(-3, 4, size=check.size)
+
+        reference = {}
+        for m, s, c in check:
+            reference[(m, s)] = reference.get((m, s), 0) + c
+        target = np.array(sorted((m, s, c) for (m, s), c in reference.items() if c != 0),
+                          dtype=self.dtype)
+
+        self.check_same(check, target)
+
+class CoeffsOnTerms(ut.TestCase):
+    '''
+    Test the coeffs_on_terms method.
+    '''
+
+    def setUp(self):
+        self.dtype = msc_tools.msc_dtype
+        self.terms = np.array([(0, 3, 1), (1, 0, 1), (1, 1, 1j), (6, 0, 1)],
+                              dtype=self.dtype)
+
+    def test_same(self):
+        msc = np.array([(6, 0, 2), (1, 1, -1j), (0, 3, 0.5), (1, 0, 3)], dtype=self.dtype)
+        check = msc_tools.coeffs_on_terms(self.terms, msc)
+        self.assertTrue(np.array_equal(check, [0.5, 3, -1j, 2]))
+
+    def test_combine(self):
+        msc = np.array([(1, 0, 2), (6, 0, 1), (1, 0, -0.5)], dtype=self.dtype)
+        check = msc_tools.coeffs_on_terms(self.terms, msc)
+        self.assertTrue(np.array_equal(check, [0, 1.5, 0, 1]))
+
+    def test_empty(self):
+        msc = np.array([], dtype=self.dtype)
+        check = msc_tools.coeffs_on_terms(self.terms, msc)
+        self.assertTrue(np.array_equal(check, [0, 0, 0, 0]))
+
+    def test_new_term(self):
+        msc = np.array([(1, 0, 2), (3, 0, 1)], dtype=self.dtype)
+        self.assertIsNone(msc_tools.coeffs_on_terms(self.terms, msc))
+
+    def test_new_term_zero(self):
+        msc = np.array([(1, 0, 2), (3, 0, 1), (3, 0, -1), (7, 0, 0)], dtype=self.dtype)
+        check = msc_tools.coeffs_on_terms(self.terms, msc)
+        self.assertTrue(np.array_equal(check, [0, 2, 0, 0]))
+
 class Truncate(ut.TestCase):
     '''
     Test truncation method
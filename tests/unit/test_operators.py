@@ -626,6 +626,17 @@ class Properties(ut.TestCase):
         with self.assertRaises(ValueError):
             o.shell = 'crab'
 
+    def test_half_storage(self):
+        o = Operator()
+        self.assertEqual(o.half_storage, False)
+
+        o.half_storage = True
+        self.assertTrue(o.half_storage)
+        self.assertTrue(o.copy().half_storage)
+
+        with self.assertRaises(ValueError):
+            o.half_storage = 'yes'
+
     def test_right_subspace(self):
 
         from dynamite.subspaces import Subspace, Full
@@ -6,8 +6,10 @@ These tests should NOT require MPI.
 '''
 
 import unittest as ut
+import math
 import numpy as np
-from dynamite.subspaces import Full, Parity, Explicit, Auto, SpinConserve
+from dynamite.subspaces import Full, Parity, Explicit, Auto, SpinConserve, Momentum
+from dynamite.tools import complex_enabled
 from dynamite._backend.bsubspace import compute_rcm
 from dynamite._backend.bbuild import dnm_int_t
 
@@ -500,6 +502,21 @@ class TestExplicit(ut.TestCase):
 
                 # TODO: test index out of range
 
+    def test_hash_lookup(self):
+        rng = np.random.default_rng(0xD1)
+        states = rng.choice(2**16, size=5000, replace=False)
+
+        hashed = Explicit(states)
+        unhashed = Explicit(states, hash_lookup=False)
+        hashed.L = 16
+        unhashed.L = 16
+
+        # every state, plus plenty that aren't in the subspace
+        test_states = np.arange(2**16)
+        self.assertTrue(np.all(
+            hashed.state_to_idx(test_states) == unhashed.state_to_idx(test_states)
+        ))
+
     def test_compare_parity(self):
         p = Parity('even')
         p.L = 5
@@ -573,6 +590,99 @@ class TestAuto(ut.TestCase):
             msg=msg
         )
 
+class TestMomentum(ut.TestCase):
+
+    @classmethod
+    def rotations(cls, state, L):
+        return [((state << n) | (state >> (L-n))) & (2**L-1) for n in range(L)]
+
+    @classmethod
+    def momenta(cls, L):
+        # the others need complex numbers
+        return range(L) if complex_enabled() else sorted({0, L//2} if L % 2 == 0 else {0})
+
+    def brute_force(self, L, q, k=None):
+        states = []
+        for state in range(2**L):
+            if k is not None and bin(state).count('1') != k:
+                continue
+            rotations = self.rotations(state, L)
+            period = rotations[1:].index(state)+1 if state in rotations[1:] else L
+            if state == min(rotations) and (q*period) % L == 0:
+                states.append(state)
+        return states
+
+    def test_reps(self):
+        for L in range(1, 9):
+            for q in self.momenta(L):
+                for k in [None] + list(range(L+1)):
+                    with self.subTest(L=L, q=q, k=k):
+                        correct = self.brute_force(L, q, k)
+                        if not correct:
+                            with self.assertRaises(ValueError):
+                                Momentum(L, q, k=k)
+                            continue
+
+                        sp = Momentum(L, q, k=k)
+                        self.assertEqual(sp.get_dimension(), len(correct))
+                        self.assertTrue(np.array_equal(
+                            sp.idx_to_state(np.arange(sp.get_dimension())), correct
+                        ))
+
+    def test_dimension_sum(self):
+        if not complex_enabled():
+            self.skipTest('all momenta are needed')
+
+        L = 8
+        for k in [None, 3, 4]:
+            with self.subTest(k=k):
+                total = sum(Momentum(L, q, k=k).get_dimension() for q in range(L))
+                self.assertEqual(total, 2**L if k is None else math.comb(L, k))
+
+    def test_s2i(self):
+        L = 10
+        for hash_lookup in (True, False):
+            for q in self.momenta(L):
+                with self.subTest(hash_lookup=hash_lookup, q=q):
+                    sp = Momentum(L, q, hash_lookup=hash_lookup)
+                    reps = list(sp.idx_to_state(np.arange(sp.get_dimension())))
+
+                    states = np.arange(2**L)
+                    idxs = sp.state_to_idx(states)
+                    for state, idx in zip(states, idxs):
+                        rep = min(self.rotations(int(state), L))
+                        self.assertEqual(idx, reps.index(rep) if rep in reps else -1)
+
+    def test_q_mod_L(self):
+        self.assertTrue(Momentum(6, 6).identical(Momentum(6, 0)))
+
+    def test_real_momentum(self):
+        if complex_enabled():
+            self.skipTest('all momenta are allowed with complex numbers')
+
+        with self.assertRaises(ValueError):
+            Momentum(6, 1)
+
+    def test_L_error(self):
+        sp = Momentum(6, 0)
+        with self.assertRaises(AttributeError):
+            sp.L = 7
+
+    def test_compare_explicit(self):
+        # same representatives, different basis
+        sp = Momentum(6, 0)
+        s = Explicit(sp.idx_to_state(np.arange(sp.get_dimension())))
+        s.L = 6
+        self.assertNotEqual(sp, s)
+
+    def test_descriptor(self):
+        for k in (None, 3):
+            with self.subTest(k=k):
+                sp = Momentum(6, 0, k=k)
+                desc, arrays = sp._get_descriptor()
+                self.assertTrue(Momentum._from_descriptor(desc, arrays).identical(sp))
+
+
 class Checksum(ut.TestCase):
 
     def test_same_full(self):